@@ -37,6 +37,19 @@ int luaopen_luaflac(lua_State *L) {
     copydown(L,"luaflac.stream_encoder");
     copydown(L,"luaflac.format");
     copydown(L,"luaflac.export");
+    copydown(L,"luaflac.cut");
+    copydown(L,"luaflac.loudness");
+    copydown(L,"luaflac.metadata");
+    copydown(L,"luaflac.metadata_chain");
+    copydown(L,"luaflac.pcm_buffer");
+    copydown(L,"luaflac.playlist");
+    copydown(L,"luaflac.scan");
+    copydown(L,"luaflac.scan_frames");
+    copydown(L,"luaflac.seektable");
+    copydown(L,"luaflac.verify");
+    copydown(L,"luaflac.vorbis_comment");
+    copydown(L,"luaflac.wav");
+    copydown(L,"luaflac.waveform");
 
     return 1;
 }
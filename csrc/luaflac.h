@@ -1,5 +1,7 @@
 #include <lua.h>
 #include <lauxlib.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #if defined(_WIN32) || defined(_WIN64) || defined(WIN32) || defined(_MSC_VER)
 #define LUAFLAC_PUBLIC __declspec(dllexport)
@@ -16,6 +18,9 @@ extern "C" {
 LUAFLAC_PUBLIC
 int luaopen_luaflac(lua_State *L);
 
+LUAFLAC_PUBLIC
+int luaopen_luaflac_cut(lua_State *L);
+
 LUAFLAC_PUBLIC
 int luaopen_luaflac_format(lua_State *L);
 
@@ -25,12 +30,76 @@ int luaopen_luaflac_int64(lua_State *L);
 LUAFLAC_PUBLIC
 int luaopen_luaflac_uint64(lua_State *L);
 
+LUAFLAC_PUBLIC
+int luaopen_luaflac_loudness(lua_State *L);
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_metadata(lua_State *L);
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_metadata_chain(lua_State *L);
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_pcm_buffer(lua_State *L);
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_playlist(lua_State *L);
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_scan(lua_State *L);
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_scan_frames(lua_State *L);
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_seektable(lua_State *L);
+
 LUAFLAC_PUBLIC
 int luaopen_luaflac_stream_decoder(lua_State *L);
 
 LUAFLAC_PUBLIC
 int luaopen_luaflac_stream_encoder(lua_State *L);
 
+LUAFLAC_PUBLIC
+int luaopen_luaflac_verify(lua_State *L);
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_vorbis_comment(lua_State *L);
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_wav(lua_State *L);
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_waveform(lua_State *L);
+
+/* C ABI for LuaJIT's FFI, see src/luaflac/ffi.lua. Bump the version
+ * whenever these change, the shim refuses a library it doesn't match */
+#define LUAFLAC_FFI_ABI_VERSION 1
+
+LUAFLAC_PUBLIC
+unsigned int luaflac_ffi_abi_version(void);
+
+LUAFLAC_PUBLIC
+unsigned int luaflac_ffi_pcm_channels(const void *buffer);
+
+LUAFLAC_PUBLIC
+size_t luaflac_ffi_pcm_frames(const void *buffer);
+
+LUAFLAC_PUBLIC
+int luaflac_ffi_pcm_format(const void *buffer);
+
+LUAFLAC_PUBLIC
+unsigned int luaflac_ffi_pcm_bits_per_sample(const void *buffer);
+
+LUAFLAC_PUBLIC
+void **luaflac_ffi_pcm_planar(void *buffer);
+
+LUAFLAC_PUBLIC
+int luaflac_ffi_encoder_process(void *encoder, int32_t *const buffer[], unsigned int samples);
+
+LUAFLAC_PUBLIC
+int luaflac_ffi_encoder_process_interleaved(void *encoder, const int32_t buffer[], unsigned int samples);
+
 #ifdef __cplusplus
 }
 #endif
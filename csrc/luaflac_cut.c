@@ -0,0 +1,1278 @@
+#if !defined(_WIN32) && !defined(_WIN64)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "luaflac_internal.h"
+#include "luaflac_thread.h"
+#include <FLAC/metadata.h>
+#include <FLAC/stream_encoder.h>
+
+#include <stdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* flac.cut - lossless smart cut. Frames that lie completely inside the
+ * range are copied as they are, with their frame or sample number
+ * rewritten and both CRCs recomputed. Only the frames the cut points fall
+ * in are decoded, trimmed and encoded again, so a cut costs about two
+ * frames of encoding however long it is.
+ *
+ * flac.concat - joins streams with the same audio format the same way,
+ * every frame is copied.
+ *
+ * flac.split_tracks - smart cuts every track in a CUESHEET block out to a
+ * file of its own, on a pool of threads with no Lua callbacks while they
+ * run. */
+
+#define LUAFLAC_CUT_COPY_SIZE 65536
+
+struct luaflac_cut_s {
+    luaflac_frame_reader r;
+    FILE *out;
+    FLAC__uint64 streaminfo_offset; /* of the STREAMINFO block header in out */
+    int variable; /* the output is numbered by samples instead of frames */
+    unsigned int level;
+    const char *error;
+
+    /* a VORBIS_COMMENT block body written instead of the source's */
+    FLAC__byte *comment;
+    FLAC__uint32 comment_len;
+
+    /* samples waiting to be encoded again */
+    FLAC__int32 *piece[FLAC__MAX_CHANNELS];
+    unsigned int piece_len;
+    unsigned int piece_size;
+
+    FLAC__byte *buf; /* a rewritten frame */
+    size_t buf_size;
+
+    luaflac_frame_decoder source; /* decodes the frames at the cut points */
+    luaflac_frame_decoder check; /* decodes the output for the MD5 */
+    int do_md5;
+    luaflac_md5 md5;
+    FLAC__byte md5sum[16];
+
+    FLAC__uint64 samples;
+    FLAC__uint64 frames;
+    FLAC__uint64 copied;
+    FLAC__uint64 encoded;
+    FLAC__uint64 bytes;
+    FLAC__uint32 min_blocksize;
+    FLAC__uint32 max_blocksize;
+    FLAC__uint32 last_blocksize;
+    FLAC__uint32 min_framesize;
+    FLAC__uint32 max_framesize;
+};
+
+typedef struct luaflac_cut_s luaflac_cut_state;
+
+/* writes a frame with the next number in the output, the header is
+ * rebuilt around the new number and both CRCs are recomputed */
+static int
+luaflac_cut_write_frame(luaflac_cut_state *c, const FLAC__byte *data, size_t size) {
+    luaflac_frame_header h;
+    FLAC__byte *p = NULL;
+    size_t n = 0;
+
+    if(!luaflac_frame_header_parse(data,size,&c->r.streaminfo,&h) || size < h.length + 2) {
+        c->error = "invalid frame";
+        return 0;
+    }
+
+    /* with frame numbers, only the last frame can be short */
+    if(!c->variable && c->frames > 0 &&
+       (c->last_blocksize != c->max_blocksize || h.blocksize > c->last_blocksize)) {
+        c->error = "blocksizes don't allow frame numbering";
+        return 0;
+    }
+
+    if(size + LUAFLAC_FRAME_RENUMBER_GROWTH > c->buf_size) {
+        p = realloc(c->buf,size + LUAFLAC_FRAME_RENUMBER_GROWTH);
+        if(p == NULL) {
+            c->error = "out of memory";
+            return 0;
+        }
+        c->buf = p;
+        c->buf_size = size + LUAFLAC_FRAME_RENUMBER_GROWTH;
+    }
+    p = c->buf;
+
+    n = luaflac_frame_renumber(data,size,&h,c->variable,c->variable ? c->samples : c->frames,p);
+    if(fwrite(p,1,n,c->out) != n) {
+        c->error = "error writing file";
+        return 0;
+    }
+
+    if(c->do_md5) {
+        if(!luaflac_frame_decoder_run(&c->check,p,n)) {
+            c->error = c->check.error;
+            return 0;
+        }
+        if(c->check.samples != h.blocksize) {
+            c->error = "error decoding frame";
+            return 0;
+        }
+    }
+
+    /* the last frame doesn't count towards the minimum blocksize */
+    if(c->frames > 0 && (c->frames == 1 || c->last_blocksize < c->min_blocksize)) {
+        c->min_blocksize = c->last_blocksize;
+    }
+    if(h.blocksize > c->max_blocksize) c->max_blocksize = h.blocksize;
+    if(c->frames == 0 || n < c->min_framesize) c->min_framesize = (FLAC__uint32)n;
+    if(n > c->max_framesize) c->max_framesize = (FLAC__uint32)n;
+    c->last_blocksize = h.blocksize;
+    c->samples += h.blocksize;
+    c->frames++;
+    c->bytes += n;
+    return 1;
+}
+
+static FLAC__StreamEncoderWriteStatus
+luaflac_cut_encoder_write(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[], size_t bytes, unsigned samples, unsigned current_frame, void *client_data) {
+    luaflac_cut_state *c = (luaflac_cut_state *)client_data;
+    (void)encoder;
+    (void)current_frame;
+
+    /* the stream marker and STREAMINFO come through without samples */
+    if(samples == 0) return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+    if(!luaflac_cut_write_frame(c,buffer,bytes)) return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+    c->encoded++;
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+static int
+luaflac_cut_piece_add(luaflac_cut_state *c, unsigned int offset, unsigned int count) {
+    const FLAC__StreamMetadata_StreamInfo *s = &c->r.streaminfo;
+    FLAC__int32 *tmp = NULL;
+    unsigned int size = 0;
+    unsigned int i = 0;
+
+    if(c->piece_len + count > c->piece_size) {
+        size = c->piece_len + count;
+        for(i=0;i<s->channels;i++) {
+            tmp = realloc(c->piece[i],sizeof(FLAC__int32) * size);
+            if(tmp == NULL) {
+                c->error = "out of memory";
+                return 0;
+            }
+            c->piece[i] = tmp;
+        }
+        c->piece_size = size;
+    }
+    for(i=0;i<s->channels;i++) {
+        memcpy(&c->piece[i][c->piece_len],&c->source.pcm[i][offset],sizeof(FLAC__int32) * count);
+    }
+    c->piece_len += count;
+    return 1;
+}
+
+static int
+luaflac_cut_piece_encode(luaflac_cut_state *c) {
+    const FLAC__StreamMetadata_StreamInfo *s = &c->r.streaminfo;
+    FLAC__StreamEncoder *encoder = NULL;
+    unsigned int blocksize = c->piece_len;
+    int ok = 0;
+
+    if(blocksize < 16) blocksize = 16;
+    if(blocksize > 65535) blocksize = 65535;
+
+    encoder = FLAC__stream_encoder_new();
+    if(encoder == NULL) {
+        c->error = "out of memory";
+        return 0;
+    }
+    FLAC__stream_encoder_set_channels(encoder,s->channels);
+    FLAC__stream_encoder_set_bits_per_sample(encoder,s->bits_per_sample);
+    FLAC__stream_encoder_set_sample_rate(encoder,s->sample_rate);
+    FLAC__stream_encoder_set_streamable_subset(encoder,0);
+    FLAC__stream_encoder_set_compression_level(encoder,c->level);
+    FLAC__stream_encoder_set_blocksize(encoder,blocksize);
+
+    if(FLAC__stream_encoder_init_stream(encoder,luaflac_cut_encoder_write,
+      NULL,NULL,NULL,c) != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+        c->error = FLAC__stream_encoder_get_resolved_state_string(encoder);
+        FLAC__stream_encoder_delete(encoder);
+        return 0;
+    }
+
+    ok = FLAC__stream_encoder_process(encoder,(const FLAC__int32 * const *)c->piece,c->piece_len);
+    ok = FLAC__stream_encoder_finish(encoder) && ok;
+    if(!ok && c->error == NULL) {
+        c->error = FLAC__stream_encoder_get_resolved_state_string(encoder);
+    }
+    FLAC__stream_encoder_delete(encoder);
+    c->piece_len = 0;
+    return ok;
+}
+
+/* writes a blank STREAMINFO, c->comment if it's set and, with metadata,
+ * the blocks from the file c->r is reading that stay valid */
+static int
+luaflac_cut_write_metadata(luaflac_cut_state *c, int metadata, FLAC__byte *copy) {
+    luaflac_block_header *blocks = NULL;
+    luaflac_block_header *tmp = NULL;
+    luaflac_block_header h;
+    FLAC__uint64 offset = 0;
+    FLAC__uint32 left = 0;
+    size_t num_blocks = 0;
+    size_t i = 0;
+    size_t n = 0;
+    FLAC__byte b[4];
+    int ok = 0;
+
+    if(metadata) {
+        if(!luaflac_parse_stream_start(c->r.f,&offset)) return 0;
+        offset += 4;
+        do {
+            if(!luaflac_parse_block_header(c->r.f,offset,&h)) goto luaflac_cut_write_metadata_done;
+            /* seek points and cue points would point at the wrong audio */
+            if(h.type != FLAC__METADATA_TYPE_STREAMINFO &&
+               h.type != FLAC__METADATA_TYPE_SEEKTABLE &&
+               h.type != FLAC__METADATA_TYPE_CUESHEET &&
+               (c->comment == NULL || h.type != FLAC__METADATA_TYPE_VORBIS_COMMENT)) {
+                if((num_blocks & 7) == 0) {
+                    tmp = realloc(blocks,sizeof(luaflac_block_header) * (num_blocks + 8));
+                    if(tmp == NULL) goto luaflac_cut_write_metadata_done;
+                    blocks = tmp;
+                }
+                blocks[num_blocks++] = h;
+            }
+            offset += 4 + (FLAC__uint64)h.length;
+        } while(!h.is_last);
+    }
+
+    b[0] = (FLAC__byte)(FLAC__METADATA_TYPE_STREAMINFO | (num_blocks == 0 && c->comment == NULL ? 0x80 : 0));
+    b[1] = 0;
+    b[2] = 0;
+    b[3] = FLAC__STREAM_METADATA_STREAMINFO_LENGTH;
+    if(fwrite(b,1,4,c->out) != 4) goto luaflac_cut_write_metadata_done;
+    memset(copy,0,FLAC__STREAM_METADATA_STREAMINFO_LENGTH);
+    if(fwrite(copy,1,FLAC__STREAM_METADATA_STREAMINFO_LENGTH,c->out) != FLAC__STREAM_METADATA_STREAMINFO_LENGTH) {
+        goto luaflac_cut_write_metadata_done;
+    }
+
+    if(c->comment != NULL) {
+        b[0] = (FLAC__byte)(FLAC__METADATA_TYPE_VORBIS_COMMENT | (num_blocks == 0 ? 0x80 : 0));
+        b[1] = (FLAC__byte)(c->comment_len >> 16);
+        b[2] = (FLAC__byte)(c->comment_len >> 8);
+        b[3] = (FLAC__byte)(c->comment_len);
+        if(fwrite(b,1,4,c->out) != 4) goto luaflac_cut_write_metadata_done;
+        if(fwrite(c->comment,1,c->comment_len,c->out) != c->comment_len) goto luaflac_cut_write_metadata_done;
+    }
+
+    for(i=0;i<num_blocks;i++) {
+        b[0] = (FLAC__byte)(blocks[i].type | (i + 1 == num_blocks ? 0x80 : 0));
+        b[1] = (FLAC__byte)(blocks[i].length >> 16);
+        b[2] = (FLAC__byte)(blocks[i].length >> 8);
+        b[3] = (FLAC__byte)(blocks[i].length);
+        if(fwrite(b,1,4,c->out) != 4) goto luaflac_cut_write_metadata_done;
+
+        if(luaflac_fseek(c->r.f,blocks[i].offset + 4) != 0) goto luaflac_cut_write_metadata_done;
+        left = blocks[i].length;
+        while(left > 0) {
+            n = left < LUAFLAC_CUT_COPY_SIZE ? left : LUAFLAC_CUT_COPY_SIZE;
+            if(fread(copy,1,n,c->r.f) != n) goto luaflac_cut_write_metadata_done;
+            if(fwrite(copy,1,n,c->out) != n) goto luaflac_cut_write_metadata_done;
+            left -= (FLAC__uint32)n;
+        }
+    }
+    ok = 1;
+
+    luaflac_cut_write_metadata_done:
+    free(blocks);
+    return ok;
+}
+
+/* writes the stream marker and the metadata, see luaflac_cut_write_metadata */
+static int
+luaflac_cut_begin(luaflac_cut_state *c, int metadata, FLAC__byte *copy) {
+    if(fwrite("fLaC",1,4,c->out) != 4 || luaflac_ftell(c->out,&c->streaminfo_offset) != 0) {
+        c->error = "error writing file";
+        return 0;
+    }
+    if(!luaflac_cut_write_metadata(c,metadata,copy)) {
+        c->error = metadata ? "error copying metadata" : "error writing file";
+        return 0;
+    }
+    return 1;
+}
+
+/* fills in STREAMINFO from what was written, format has the audio format */
+static int
+luaflac_cut_end(luaflac_cut_state *c, const FLAC__StreamMetadata_StreamInfo *format, FLAC__byte *copy) {
+    FLAC__StreamMetadata_StreamInfo s = *format;
+    FLAC__uint64 out_end = 0;
+
+    if(c->frames == 0) {
+        c->error = "no audio to write";
+        return 0;
+    }
+
+    s.min_blocksize = c->frames == 1 ? c->last_blocksize : c->min_blocksize;
+    s.max_blocksize = c->max_blocksize;
+    s.min_framesize = c->min_framesize;
+    s.max_framesize = c->max_framesize;
+    s.total_samples = c->samples;
+    memset(c->md5sum,0,16);
+    if(c->do_md5) luaflac_md5_final(&c->md5,c->md5sum);
+    memcpy(s.md5sum,c->md5sum,16);
+
+    /* the STREAMINFO data follows its 4-byte header */
+    luaflac_pack_streaminfo(copy,&s);
+    if(luaflac_ftell(c->out,&out_end) != 0 ||
+       luaflac_fseek(c->out,c->streaminfo_offset + 4) != 0 ||
+       fwrite(copy,1,FLAC__STREAM_METADATA_STREAMINFO_LENGTH,c->out) != FLAC__STREAM_METADATA_STREAMINFO_LENGTH ||
+       luaflac_fseek(c->out,out_end) != 0 ||
+       fflush(c->out) != 0) {
+        c->error = "error writing file";
+        return 0;
+    }
+    return 1;
+}
+
+static int
+luaflac_cut_run(luaflac_cut_state *c, FLAC__uint64 first, FLAC__uint64 end,
+  const luaflac_frame_index *index, int metadata) {
+    luaflac_frame frame;
+    FLAC__uint64 frame_end = 0;
+    FLAC__uint64 start = c->r.audio_offset;
+    FLAC__byte *copy = NULL;
+    size_t i = 0;
+    unsigned int from = 0;
+    unsigned int to = 0;
+    int started = 0;
+    int res = 0;
+
+    copy = malloc(LUAFLAC_CUT_COPY_SIZE);
+    if(copy == NULL) {
+        c->error = "out of memory";
+        return 0;
+    }
+
+    if(!luaflac_cut_begin(c,metadata,copy)) goto luaflac_cut_run_done;
+
+    if(index != NULL && luaflac_frame_index_find(index,first,&i)) {
+        start = index->offsets[i];
+    }
+    if(!luaflac_frame_reader_seek(&c->r,start)) {
+        c->error = "error reading frames";
+        goto luaflac_cut_run_done;
+    }
+
+    while( (res = luaflac_frame_reader_next(&c->r,&frame)) == 1) {
+        frame_end = frame.sample + frame.header.blocksize;
+        if(frame_end <= first) continue;
+        if(frame.sample >= end) break;
+
+        if(!started) {
+            if(index != NULL && start != c->r.audio_offset && frame.sample != index->samples[i]) {
+                c->error = "index doesn't match the file";
+                goto luaflac_cut_run_done;
+            }
+            /* a shortened first frame only fits a variable blocksize stream */
+            c->variable = frame.header.variable_blocksize || frame.sample < first;
+            started = 1;
+        }
+
+        if(!luaflac_frame_check_crc(&frame)) {
+            c->error = "CRC error in the source";
+            goto luaflac_cut_run_done;
+        }
+
+        if(frame.sample >= first && frame_end <= end && c->piece_len == 0) {
+            if(!luaflac_cut_write_frame(c,frame.data,frame.size)) goto luaflac_cut_run_done;
+            c->copied++;
+        } else {
+            if(c->source.decoder == NULL) {
+                c->source.keep = 1;
+                if(!luaflac_frame_decoder_init(&c->source,&c->r.streaminfo)) {
+                    c->error = "error setting up the decoder";
+                    goto luaflac_cut_run_done;
+                }
+            }
+            /* frames are decoded on their own, so nothing carries over */
+            FLAC__stream_decoder_flush(c->source.decoder);
+            if(!luaflac_frame_decoder_run(&c->source,frame.data,frame.size)) {
+                c->error = c->source.error;
+                goto luaflac_cut_run_done;
+            }
+            if(c->source.samples != frame.header.blocksize) {
+                c->error = "error decoding frame";
+                goto luaflac_cut_run_done;
+            }
+
+            from = frame.sample < first ? (unsigned int)(first - frame.sample) : 0;
+            to = frame_end > end ? (unsigned int)(end - frame.sample) : frame.header.blocksize;
+            if(!luaflac_cut_piece_add(c,from,to - from)) goto luaflac_cut_run_done;
+
+            /* a piece too short for a frame of its own takes the next frame along */
+            if(c->piece_len >= 16 || frame_end >= end) {
+                if(!luaflac_cut_piece_encode(c)) goto luaflac_cut_run_done;
+            }
+        }
+
+        if(frame_end >= end) break;
+    }
+    if(res < 0) {
+        c->error = "error reading frames";
+        goto luaflac_cut_run_done;
+    }
+    if(c->piece_len > 0 && !luaflac_cut_piece_encode(c)) goto luaflac_cut_run_done;
+
+    luaflac_cut_end(c,&c->r.streaminfo,copy);
+
+    luaflac_cut_run_done:
+    free(copy);
+    return c->error == NULL;
+}
+
+static void
+luaflac_cut_free(luaflac_cut_state *c) {
+    unsigned int i = 0;
+    luaflac_frame_decoder_free(&c->source);
+    luaflac_frame_decoder_free(&c->check);
+    for(i=0;i<FLAC__MAX_CHANNELS;i++) {
+        free(c->piece[i]);
+    }
+    free(c->buf);
+    free(c->comment);
+}
+
+static void
+luaflac_cut_push_result(lua_State *L, const luaflac_cut_state *c) {
+    lua_createtable(L,0,6);
+    luaflac_pushuint64(L,c->samples);
+    lua_setfield(L,-2,"samples");
+    lua_pushinteger(L,(lua_Integer)c->frames);
+    lua_setfield(L,-2,"frames");
+    lua_pushinteger(L,(lua_Integer)c->copied);
+    lua_setfield(L,-2,"copied");
+    lua_pushinteger(L,(lua_Integer)c->encoded);
+    lua_setfield(L,-2,"encoded");
+    luaflac_pushuint64(L,c->bytes);
+    lua_setfield(L,-2,"bytes");
+    if(c->do_md5) {
+        lua_pushlstring(L,(const char *)c->md5sum,16);
+        lua_setfield(L,-2,"md5sum");
+    }
+}
+
+/* the value at idx has to be a filename or an open file, checked before
+ * anything is opened so luaflac_checkfile can't raise an error later */
+static void
+luaflac_cut_check_file(lua_State *L, int idx) {
+    FILE **fh = NULL;
+
+    if(lua_type(L,idx) == LUA_TSTRING) return;
+    fh = (FILE **)luaL_testudata(L,idx,LUA_FILEHANDLE);
+    if(fh == NULL || *fh == NULL) {
+        luaL_argerror(L,idx,"filename or open file expected");
+    }
+}
+
+static int
+luaflac_cut(lua_State *L) {
+    luaflac_cut_state c;
+    const luaflac_frame_index *index = NULL;
+    FLAC__uint64 first = luaflac_touint64(L,3);
+    FLAC__uint64 last = luaflac_touint64(L,4);
+    FLAC__uint64 end = 0;
+    FILE *f = NULL;
+    int owned = 0;
+    int out_owned = 0;
+    int metadata = 1;
+
+    memset(&c,0,sizeof(c));
+    c.level = 5;
+    c.do_md5 = 1;
+
+    if(last < first) {
+        return luaL_error(L,"last sample is before the first");
+    }
+
+    if(!lua_isnoneornil(L,5)) {
+        luaL_checktype(L,5,LUA_TTABLE);
+        lua_getfield(L,5,"level");
+        if(!lua_isnil(L,-1)) c.level = (unsigned int)luaL_checkinteger(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,5,"md5");
+        if(!lua_isnil(L,-1)) c.do_md5 = lua_toboolean(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,5,"metadata");
+        if(!lua_isnil(L,-1)) metadata = lua_toboolean(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,5,"index");
+        if(!lua_isnil(L,-1)) index = luaflac_frame_index_check(L,-1);
+        lua_pop(L,1);
+    }
+
+    luaflac_cut_check_file(L,1);
+    luaflac_cut_check_file(L,2);
+
+    f = luaflac_checkfile(L,1,"rb",&owned);
+    if(f == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,1));
+        return 2;
+    }
+    c.out = luaflac_checkfile(L,2,"wb",&out_owned);
+    if(c.out == NULL) {
+        if(owned) fclose(f);
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,2));
+        return 2;
+    }
+
+    if(!luaflac_frame_reader_init(&c.r,f)) {
+        c.error = "error reading metadata";
+    } else if(c.r.streaminfo_offset == 0) {
+        c.error = "no STREAMINFO block";
+    } else {
+        end = last + 1;
+        if(c.r.streaminfo.total_samples > 0 && end > c.r.streaminfo.total_samples) {
+            end = c.r.streaminfo.total_samples;
+        }
+        if(c.do_md5) {
+            luaflac_md5_init(&c.md5);
+            c.check.md5 = &c.md5;
+            if(!luaflac_frame_decoder_init(&c.check,&c.r.streaminfo)) {
+                c.error = "error setting up the decoder";
+            }
+        }
+        if(c.error == NULL) {
+            luaflac_cut_run(&c,first,end,index,metadata);
+        }
+    }
+
+    luaflac_frame_reader_free(&c.r);
+    luaflac_cut_free(&c);
+    if(owned) fclose(f);
+    if(out_owned && fclose(c.out) != 0 && c.error == NULL) {
+        c.error = "error writing file";
+    }
+
+    if(c.error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,c.error);
+        return 2;
+    }
+
+    luaflac_cut_push_result(L,&c);
+    return 1;
+}
+
+/* every input has to be a filename or an open file, checked before
+ * anything is opened so luaflac_checkfile can't raise an error later */
+static void
+luaflac_concat_check_inputs(lua_State *L, size_t num_inputs) {
+    FILE **fh = NULL;
+    size_t i = 0;
+
+    for(i=1;i<=num_inputs;i++) {
+        lua_rawgeti(L,1,(lua_Integer)i);
+        if(lua_type(L,-1) != LUA_TSTRING) {
+            fh = (FILE **)luaL_testudata(L,-1,LUA_FILEHANDLE);
+            if(fh == NULL || *fh == NULL) {
+                luaL_error(L,"input %d isn't a filename or an open file",(int)i);
+                return;
+            }
+        }
+        lua_pop(L,1);
+    }
+}
+
+static FILE *
+luaflac_concat_open(lua_State *L, size_t i, int *owned) {
+    FILE *f = NULL;
+    lua_rawgeti(L,1,(lua_Integer)i);
+    f = luaflac_checkfile(L,-1,"rb",owned);
+    lua_pop(L,1);
+    return f;
+}
+
+/* the first pass over the inputs, they all need the first one's audio
+ * format. Frame numbers can only be kept when every input but the last
+ * is made of whole blocks of the same size */
+static void
+luaflac_concat_scan(lua_State *L, luaflac_cut_state *c, size_t num_inputs,
+  FLAC__StreamMetadata_StreamInfo *format, size_t *failed) {
+    const FLAC__StreamMetadata_StreamInfo *s = NULL;
+    luaflac_frame frame;
+    FILE *f = NULL;
+    size_t i = 0;
+    int owned = 0;
+    int fixed = 1;
+
+    for(i=1;i<=num_inputs && c->error == NULL;i++) {
+        f = luaflac_concat_open(L,i,&owned);
+        if(f == NULL) {
+            c->error = "error opening file";
+            *failed = i;
+            break;
+        }
+
+        if(!luaflac_frame_reader_init(&c->r,f) || c->r.streaminfo_offset == 0) {
+            c->error = "error reading metadata";
+        } else {
+            s = &c->r.streaminfo;
+            if(i == 1) {
+                *format = *s;
+            } else if(s->sample_rate != format->sample_rate ||
+                      s->channels != format->channels ||
+                      s->bits_per_sample != format->bits_per_sample) {
+                c->error = "audio format doesn't match the first input";
+            }
+            if(s->min_blocksize != s->max_blocksize ||
+               s->min_blocksize != format->min_blocksize ||
+               (i < num_inputs && (s->total_samples == 0 || s->total_samples % s->min_blocksize != 0))) {
+                fixed = 0;
+            }
+            if(fixed && luaflac_frame_reader_next(&c->r,&frame) == 1 && frame.header.variable_blocksize) {
+                fixed = 0;
+            }
+        }
+
+        luaflac_frame_reader_free(&c->r);
+        if(owned) fclose(f);
+        if(c->error != NULL) *failed = i;
+    }
+    c->variable = !fixed;
+}
+
+static int
+luaflac_concat(lua_State *L) {
+    luaflac_cut_state c;
+    FLAC__StreamMetadata_StreamInfo format;
+    luaflac_frame frame;
+    FLAC__byte *copy = NULL;
+    FILE *f = NULL;
+    size_t num_inputs = 0;
+    size_t failed = 0;
+    size_t i = 0;
+    int owned = 0;
+    int out_owned = 0;
+    int metadata = 1;
+    int res = 0;
+
+    luaL_checktype(L,1,LUA_TTABLE);
+    num_inputs = lua_rawlen(L,1);
+    if(num_inputs == 0) {
+        return luaL_error(L,"no inputs");
+    }
+    luaflac_concat_check_inputs(L,num_inputs);
+
+    memset(&c,0,sizeof(c));
+    memset(&format,0,sizeof(format));
+    c.do_md5 = 1;
+
+    if(!lua_isnoneornil(L,3)) {
+        luaL_checktype(L,3,LUA_TTABLE);
+        lua_getfield(L,3,"md5");
+        if(!lua_isnil(L,-1)) c.do_md5 = lua_toboolean(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,3,"metadata");
+        if(!lua_isnil(L,-1)) metadata = lua_toboolean(L,-1);
+        lua_pop(L,1);
+    }
+
+    c.out = luaflac_checkfile(L,2,"wb",&out_owned);
+    if(c.out == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,2));
+        return 2;
+    }
+
+    copy = malloc(LUAFLAC_CUT_COPY_SIZE);
+    if(copy == NULL) {
+        c.error = "out of memory";
+    } else {
+        luaflac_concat_scan(L,&c,num_inputs,&format,&failed);
+    }
+
+    if(c.error == NULL && c.do_md5) {
+        luaflac_md5_init(&c.md5);
+        c.check.md5 = &c.md5;
+        if(!luaflac_frame_decoder_init(&c.check,&format)) {
+            c.error = "error setting up the decoder";
+        }
+    }
+
+    /* the second pass copies every frame, the metadata comes from the first input */
+    for(i=1;i<=num_inputs && c.error == NULL;i++) {
+        f = luaflac_concat_open(L,i,&owned);
+        if(f == NULL) {
+            c.error = "error opening file";
+            failed = i;
+            break;
+        }
+
+        if(!luaflac_frame_reader_init(&c.r,f)) {
+            c.error = "error reading metadata";
+        } else if(i == 1 && !luaflac_cut_begin(&c,metadata,copy)) {
+            /* c.error is set */
+        } else if(!luaflac_frame_reader_seek(&c.r,c.r.audio_offset)) {
+            c.error = "error reading frames";
+        } else {
+            while( (res = luaflac_frame_reader_next(&c.r,&frame)) == 1) {
+                if(!luaflac_frame_check_crc(&frame)) {
+                    c.error = "CRC error in the source";
+                    break;
+                }
+                if(!luaflac_cut_write_frame(&c,frame.data,frame.size)) break;
+                c.copied++;
+            }
+            if(res < 0 && c.error == NULL) c.error = "error reading frames";
+        }
+
+        luaflac_frame_reader_free(&c.r);
+        if(owned) fclose(f);
+        if(c.error != NULL) failed = i;
+    }
+
+    if(c.error == NULL) {
+        luaflac_cut_end(&c,&format,copy);
+    }
+
+    free(copy);
+    luaflac_cut_free(&c);
+    if(out_owned && fclose(c.out) != 0 && c.error == NULL) {
+        c.error = "error writing file";
+    }
+
+    if(c.error != NULL) {
+        lua_pushnil(L);
+        if(failed > 0) {
+            lua_pushfstring(L,"input %d: %s",(int)failed,c.error);
+        } else {
+            lua_pushstring(L,c.error);
+        }
+        return 2;
+    }
+
+    luaflac_cut_push_result(L,&c);
+    return 1;
+}
+
+struct luaflac_split_track_s {
+    const char *path; /* NULL if the track isn't wanted */
+    unsigned int number; /* from the CUESHEET */
+    FLAC__uint64 first;
+    FLAC__uint64 end;
+    luaflac_cut_state c;
+    double seconds;
+};
+
+typedef struct luaflac_split_track_s luaflac_split_track;
+
+struct luaflac_split_batch_s {
+    luaflac_mutex lock;
+    const char *source;
+    luaflac_split_track *tracks;
+    size_t num_tracks;
+    size_t next;
+    const luaflac_frame_index *index;
+    int metadata;
+};
+
+typedef struct luaflac_split_batch_s luaflac_split_batch;
+
+/* a track starts at INDEX 01, its pregap goes with the track before.
+ * With pregap it starts at its first index instead */
+static FLAC__uint64
+luaflac_split_track_start(const FLAC__StreamMetadata_CueSheet_Track *t, int pregap) {
+    unsigned int i = 0;
+
+    if(t->num_indices == 0) return t->offset;
+    if(!pregap) {
+        for(i=0;i<t->num_indices;i++) {
+            if(t->indices[i].number == 1) return t->offset + t->indices[i].offset;
+        }
+    }
+    return t->offset + t->indices[0].offset;
+}
+
+static void
+luaflac_split_pack32(FLAC__byte *b, FLAC__uint32 v) {
+    b[0] = (FLAC__byte)(v);
+    b[1] = (FLAC__byte)(v >> 8);
+    b[2] = (FLAC__byte)(v >> 16);
+    b[3] = (FLAC__byte)(v >> 24);
+}
+
+/* the body of a VORBIS_COMMENT block, NULL if it's too big for one */
+static FLAC__byte *
+luaflac_split_pack_comment(const FLAC__StreamMetadata *m, FLAC__uint32 *len) {
+    const FLAC__StreamMetadata_VorbisComment *vc = &m->data.vorbis_comment;
+    FLAC__uint64 size = 8 + (FLAC__uint64)vc->vendor_string.length;
+    FLAC__byte *b = NULL;
+    FLAC__byte *p = NULL;
+    FLAC__uint32 i = 0;
+
+    for(i=0;i<vc->num_comments;i++) {
+        size += 4 + (FLAC__uint64)vc->comments[i].length;
+    }
+    if(size >= ((FLAC__uint64)1 << FLAC__STREAM_METADATA_LENGTH_LEN)) return NULL;
+
+    b = malloc((size_t)size);
+    if(b == NULL) return NULL;
+    p = b;
+    luaflac_split_pack32(p,vc->vendor_string.length);
+    if(vc->vendor_string.length) memcpy(p + 4,vc->vendor_string.entry,vc->vendor_string.length);
+    p += 4 + vc->vendor_string.length;
+    luaflac_split_pack32(p,vc->num_comments);
+    p += 4;
+    for(i=0;i<vc->num_comments;i++) {
+        luaflac_split_pack32(p,vc->comments[i].length);
+        if(vc->comments[i].length) memcpy(p + 4,vc->comments[i].entry,vc->comments[i].length);
+        p += 4 + vc->comments[i].length;
+    }
+    *len = (FLAC__uint32)size;
+    return b;
+}
+
+static int
+luaflac_split_set_tag(FLAC__StreamMetadata *m, const char *name, const char *value) {
+    FLAC__StreamMetadata_VorbisComment_Entry entry;
+
+    if(!FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair(&entry,name,value)) return 0;
+    if(!FLAC__metadata_object_vorbiscomment_replace_comment(m,entry,1,0)) {
+        free(entry.entry);
+        return 0;
+    }
+    return 1;
+}
+
+/* the source's tags, with the ones about the whole file replaced by the
+ * track's and then the tags table at index tags (0 for none) applied.
+ * Returns an error message or NULL */
+static const char *
+luaflac_split_comment(lua_State *L, int tags, const FLAC__StreamMetadata *source,
+  const FLAC__StreamMetadata_CueSheet_Track *track, unsigned int total, luaflac_split_track *t) {
+    static const char * const whole_file[] = {
+        "CUESHEET", "REPLAYGAIN_TRACK_GAIN", "REPLAYGAIN_TRACK_PEAK", "ISRC", NULL
+    };
+    FLAC__StreamMetadata *m = NULL;
+    const char *error = "out of memory";
+    char num[16];
+    unsigned int i = 0;
+
+    if(source != NULL) m = FLAC__metadata_object_clone(source);
+    else m = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT);
+    if(m == NULL) return error;
+
+    for(i=0;whole_file[i]!=NULL;i++) {
+        if(FLAC__metadata_object_vorbiscomment_remove_entries_matching(m,whole_file[i]) < 0) {
+            goto luaflac_split_comment_done;
+        }
+    }
+    sprintf(num,"%u",track->number);
+    if(!luaflac_split_set_tag(m,"TRACKNUMBER",num)) goto luaflac_split_comment_done;
+    sprintf(num,"%u",total);
+    if(!luaflac_split_set_tag(m,"TRACKTOTAL",num)) goto luaflac_split_comment_done;
+    if(track->isrc[0] != '\0' && !luaflac_split_set_tag(m,"ISRC",track->isrc)) {
+        goto luaflac_split_comment_done;
+    }
+
+    if(tags != 0) {
+        lua_pushnil(L);
+        while(lua_next(L,tags) != 0) {
+            if(lua_type(L,-2) != LUA_TSTRING) {
+                error = "tag names must be strings";
+            } else if(lua_type(L,-1) == LUA_TBOOLEAN && !lua_toboolean(L,-1)) {
+                if(FLAC__metadata_object_vorbiscomment_remove_entries_matching(m,lua_tostring(L,-2)) < 0) {
+                    error = "out of memory";
+                } else {
+                    error = NULL;
+                }
+            } else if(lua_type(L,-1) != LUA_TSTRING && lua_type(L,-1) != LUA_TNUMBER) {
+                error = "tag values must be strings";
+            } else if(!luaflac_split_set_tag(m,lua_tostring(L,-2),lua_tostring(L,-1))) {
+                error = "invalid tag";
+            } else {
+                error = NULL;
+            }
+            lua_pop(L,1);
+            if(error != NULL) {
+                lua_pop(L,1);
+                goto luaflac_split_comment_done;
+            }
+        }
+    }
+
+    t->c.comment = luaflac_split_pack_comment(m,&t->c.comment_len);
+    error = t->c.comment == NULL ? "tags don't fit in a metadata block" : NULL;
+
+    luaflac_split_comment_done:
+    FLAC__metadata_object_delete(m);
+    return error;
+}
+
+/* one pass over the frames to find the one each track starts in, so the
+ * threads can seek straight there. Returns 0 if the threads have to find
+ * their own way */
+static int
+luaflac_split_index(luaflac_frame_reader *r, const luaflac_split_track *tracks, size_t num_tracks,
+  luaflac_frame_index *index) {
+    luaflac_frame frame;
+    size_t k = 0;
+    int res = 0;
+
+    index->offsets = malloc(sizeof(FLAC__uint64) * num_tracks);
+    index->samples = malloc(sizeof(FLAC__uint64) * num_tracks);
+    index->sizes = malloc(sizeof(FLAC__uint32) * num_tracks);
+    index->blocksizes = malloc(sizeof(FLAC__uint32) * num_tracks);
+    if(index->offsets == NULL || index->samples == NULL ||
+       index->sizes == NULL || index->blocksizes == NULL) return 0;
+    index->max_frames = num_tracks;
+    if(!luaflac_frame_reader_seek(r,r->audio_offset)) return 0;
+
+    while(k < num_tracks && (res = luaflac_frame_reader_next(r,&frame)) == 1) {
+        for(;k < num_tracks && tracks[k].first < frame.sample + frame.header.blocksize;k++) {
+            if(tracks[k].first < frame.sample) continue;
+            if(index->num_frames > 0 && index->samples[index->num_frames-1] == frame.sample) continue;
+            index->offsets[index->num_frames] = frame.offset;
+            index->samples[index->num_frames] = frame.sample;
+            index->sizes[index->num_frames] = frame.size;
+            index->blocksizes[index->num_frames] = frame.header.blocksize;
+            index->num_frames++;
+        }
+    }
+    return res >= 0;
+}
+
+static void
+luaflac_split_index_free(luaflac_frame_index *index) {
+    free(index->offsets);
+    free(index->samples);
+    free(index->sizes);
+    free(index->blocksizes);
+}
+
+static void
+luaflac_split_run(const luaflac_split_batch *b, luaflac_split_track *t) {
+    luaflac_cut_state *c = &t->c;
+    double start = luaflac_time_now();
+    FILE *f = NULL;
+
+    f = fopen(b->source,"rb");
+    if(f == NULL) {
+        c->error = "error opening file";
+        return;
+    }
+    c->out = fopen(t->path,"wb");
+    if(c->out == NULL) {
+        fclose(f);
+        c->error = "error opening output";
+        return;
+    }
+
+    if(!luaflac_frame_reader_init(&c->r,f)) {
+        c->error = "error reading metadata";
+    } else {
+        if(c->do_md5) {
+            luaflac_md5_init(&c->md5);
+            c->check.md5 = &c->md5;
+            if(!luaflac_frame_decoder_init(&c->check,&c->r.streaminfo)) {
+                c->error = "error setting up the decoder";
+            }
+        }
+        if(c->error == NULL) {
+            luaflac_cut_run(c,t->first,t->end,b->index,b->metadata);
+        }
+    }
+
+    luaflac_frame_reader_free(&c->r);
+    fclose(f);
+    if(fclose(c->out) != 0 && c->error == NULL) {
+        c->error = "error writing file";
+    }
+    t->seconds = luaflac_time_now() - start;
+}
+
+static void
+luaflac_split_worker(void *arg) {
+    luaflac_split_batch *b = (luaflac_split_batch *)arg;
+    luaflac_split_track *t = NULL;
+
+    luaflac_mutex_lock(&b->lock);
+    while(b->next < b->num_tracks) {
+        t = &b->tracks[b->next++];
+        luaflac_mutex_unlock(&b->lock);
+
+        if(t->path != NULL) luaflac_split_run(b,t);
+        luaflac_cut_free(&t->c);
+
+        luaflac_mutex_lock(&b->lock);
+    }
+    luaflac_mutex_unlock(&b->lock);
+}
+
+/* asks the outputs argument where track t goes, leaves the path and the
+ * tags table (or nil) on the stack. Returns an error message or NULL */
+static const char *
+luaflac_split_output(lua_State *L, const luaflac_split_track *t, const char *isrc) {
+    if(lua_type(L,2) == LUA_TTABLE) {
+        lua_rawgeti(L,2,(lua_Integer)t->number);
+        lua_pushnil(L);
+    } else {
+        lua_pushvalue(L,2);
+        lua_createtable(L,0,4);
+        lua_pushinteger(L,(lua_Integer)t->number);
+        lua_setfield(L,-2,"number");
+        luaflac_pushuint64(L,t->first);
+        lua_setfield(L,-2,"first");
+        luaflac_pushuint64(L,t->end - 1);
+        lua_setfield(L,-2,"last");
+        if(isrc[0] != '\0') {
+            lua_pushstring(L,isrc);
+            lua_setfield(L,-2,"isrc");
+        }
+        if(lua_pcall(L,1,2,0) != 0) return lua_tostring(L,-1);
+    }
+
+    if(!lua_isnoneornil(L,-2) && lua_type(L,-2) != LUA_TSTRING &&
+       !(lua_type(L,-2) == LUA_TBOOLEAN && !lua_toboolean(L,-2))) {
+        return "output isn't a filename";
+    }
+    if(!lua_isnil(L,-1) && lua_type(L,-1) != LUA_TTABLE) {
+        return "tags aren't a table";
+    }
+    return NULL;
+}
+
+static int
+luaflac_split_tracks(lua_State *L) {
+    luaflac_split_batch b;
+    luaflac_split_track *t = NULL;
+    luaflac_frame_reader r;
+    luaflac_frame_index sparse;
+    luaflac_parsed_block *blocks = NULL;
+    unsigned int num_blocks = 0;
+    const FLAC__StreamMetadata_CueSheet *cue = NULL;
+    const FLAC__StreamMetadata *source_comment = NULL;
+    unsigned char want[FLAC__MAX_METADATA_TYPE_CODE + 1];
+    luaflac_thread *threads = NULL;
+    lua_Integer num_threads = luaflac_thread_cpus();
+    const char *error = NULL;
+    const char *raise = NULL;
+    unsigned int level = 5;
+    unsigned int started = 0;
+    unsigned int total = 0;
+    unsigned int i = 0;
+    size_t j = 0;
+    FILE *f = NULL;
+    int do_md5 = 1;
+    int tags = 1;
+    int pregap = 0;
+
+    memset(&b,0,sizeof(b));
+    memset(&r,0,sizeof(r));
+    memset(&sparse,0,sizeof(sparse));
+    b.source = luaL_checkstring(L,1);
+    b.metadata = 1;
+    luaL_argcheck(L,lua_type(L,2) == LUA_TTABLE || lua_type(L,2) == LUA_TFUNCTION,2,
+      "table or function expected");
+
+    if(!lua_isnoneornil(L,3)) {
+        luaL_checktype(L,3,LUA_TTABLE);
+        lua_getfield(L,3,"threads");
+        num_threads = luaL_optinteger(L,-1,num_threads);
+        lua_pop(L,1);
+        lua_getfield(L,3,"level");
+        if(!lua_isnil(L,-1)) level = (unsigned int)luaL_checkinteger(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,3,"md5");
+        if(!lua_isnil(L,-1)) do_md5 = lua_toboolean(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,3,"metadata");
+        if(!lua_isnil(L,-1)) b.metadata = lua_toboolean(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,3,"tags");
+        if(!lua_isnil(L,-1)) tags = lua_toboolean(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,3,"pregap");
+        if(!lua_isnil(L,-1)) pregap = lua_toboolean(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,3,"index");
+        if(!lua_isnil(L,-1)) b.index = luaflac_frame_index_check(L,-1);
+        lua_pop(L,1);
+    }
+    if(num_threads < 1) num_threads = 1;
+
+    /* keeps the output paths alive until we return */
+    lua_settop(L,3);
+    lua_newtable(L);
+
+    f = fopen(b.source,"rb");
+    if(f == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",b.source);
+        return 2;
+    }
+
+    memset(want,0,sizeof(want));
+    want[FLAC__METADATA_TYPE_CUESHEET] = 1;
+    want[FLAC__METADATA_TYPE_VORBIS_COMMENT] = 1;
+    if(!luaflac_parse_metadata(f,want,0,&blocks,&num_blocks) || !luaflac_frame_reader_init(&r,f)) {
+        error = "error reading metadata";
+        goto luaflac_split_tracks_done;
+    }
+    for(i=0;i<num_blocks;i++) {
+        if(blocks[i].header.type == FLAC__METADATA_TYPE_CUESHEET && cue == NULL) {
+            cue = &blocks[i].metadata->data.cue_sheet;
+        } else if(blocks[i].header.type == FLAC__METADATA_TYPE_VORBIS_COMMENT) {
+            source_comment = blocks[i].metadata;
+        }
+    }
+    if(r.streaminfo_offset == 0) {
+        error = "no STREAMINFO block";
+        goto luaflac_split_tracks_done;
+    }
+    if(cue == NULL || cue->num_tracks < 2) {
+        error = "no tracks in a CUESHEET block";
+        goto luaflac_split_tracks_done;
+    }
+
+    /* the last track is the lead-out, it only marks where the audio ends */
+    b.tracks = calloc(cue->num_tracks - 1,sizeof(luaflac_split_track));
+    if(b.tracks == NULL) {
+        error = "out of memory";
+        goto luaflac_split_tracks_done;
+    }
+    for(i=0;i + 1<cue->num_tracks;i++) {
+        if(cue->tracks[i].type == 0) total++;
+    }
+
+    for(i=0;i + 1<cue->num_tracks;i++) {
+        /* data tracks only mark where the audio track before them ends */
+        if(cue->tracks[i].type != 0) continue;
+        t = &b.tracks[b.num_tracks];
+        t->number = cue->tracks[i].number;
+        t->first = luaflac_split_track_start(&cue->tracks[i],pregap);
+        t->end = luaflac_split_track_start(&cue->tracks[i+1],pregap);
+        if(r.streaminfo.total_samples > 0 && t->end > r.streaminfo.total_samples) {
+            t->end = r.streaminfo.total_samples;
+        }
+        if(t->end <= t->first) continue;
+        b.num_tracks++;
+        t->c.level = level;
+        t->c.do_md5 = do_md5;
+
+        raise = luaflac_split_output(L,t,cue->tracks[i].isrc);
+        if(raise != NULL) goto luaflac_split_tracks_done;
+        if(lua_type(L,-2) == LUA_TSTRING) {
+            t->path = lua_tostring(L,-2);
+            lua_pushvalue(L,-2);
+            lua_rawseti(L,4,(lua_Integer)b.num_tracks);
+            if(tags) {
+                raise = luaflac_split_comment(L,lua_istable(L,-1) ? lua_gettop(L) : 0,
+                  source_comment,&cue->tracks[i],total,t);
+                if(raise != NULL) goto luaflac_split_tracks_done;
+            }
+        }
+        lua_pop(L,2);
+    }
+
+    if(b.index == NULL && luaflac_split_index(&r,b.tracks,b.num_tracks,&sparse)) {
+        b.index = &sparse;
+    }
+    luaflac_frame_reader_free(&r);
+    fclose(f);
+    f = NULL;
+
+    if((size_t)num_threads > b.num_tracks) num_threads = (lua_Integer)b.num_tracks;
+    if(num_threads < 1) num_threads = 1;
+    if(luaflac_mutex_init(&b.lock) != 0) {
+        raise = "error creating mutex";
+        goto luaflac_split_tracks_done;
+    }
+
+    /* this thread works through the list too */
+    if(num_threads > 1) {
+        threads = malloc(sizeof(luaflac_thread) * (num_threads - 1));
+    }
+    if(threads != NULL) {
+        for(i=0;i<(unsigned int)num_threads-1;i++) {
+            if(luaflac_thread_create(&threads[started],luaflac_split_worker,&b) != 0) break;
+            started++;
+        }
+    }
+    luaflac_split_worker(&b);
+    for(i=0;i<started;i++) {
+        luaflac_thread_join(&threads[i]);
+    }
+    free(threads);
+    luaflac_mutex_destroy(&b.lock);
+
+    lua_newtable(L);
+    i = 0;
+    for(j=0;j<b.num_tracks;j++) {
+        t = &b.tracks[j];
+        if(t->path == NULL) continue;
+        luaflac_cut_push_result(L,&t->c);
+        lua_pushinteger(L,(lua_Integer)t->number);
+        lua_setfield(L,-2,"number");
+        lua_pushstring(L,t->path);
+        lua_setfield(L,-2,"path");
+        lua_pushboolean(L,t->c.error == NULL);
+        lua_setfield(L,-2,"ok");
+        lua_pushnumber(L,t->seconds);
+        lua_setfield(L,-2,"seconds");
+        if(t->seconds > 0.0 && r.streaminfo.sample_rate > 0) {
+            /* times faster than realtime */
+            lua_pushnumber(L,(double)t->c.samples / (double)r.streaminfo.sample_rate / t->seconds);
+            lua_setfield(L,-2,"speed");
+        }
+        if(t->c.error != NULL) {
+            lua_pushstring(L,t->c.error);
+            lua_setfield(L,-2,"error");
+        }
+        lua_rawseti(L,-2,++i);
+    }
+
+    luaflac_split_tracks_done:
+    /* tracks the workers never got to still own their comments */
+    for(j=b.next;j<b.num_tracks;j++) {
+        luaflac_cut_free(&b.tracks[j].c);
+    }
+    free(b.tracks);
+    luaflac_split_index_free(&sparse);
+    luaflac_parsed_free(blocks,num_blocks);
+    if(f != NULL) {
+        luaflac_frame_reader_free(&r);
+        fclose(f);
+    }
+
+    if(raise != NULL) {
+        return luaL_error(L,"%s",raise);
+    }
+    if(error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,error);
+        return 2;
+    }
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_cut_functions[] = {
+    { "cut", luaflac_cut },
+    { "concat", luaflac_concat },
+    { "split_tracks", luaflac_split_tracks },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_cut(lua_State *L) {
+    lua_getglobal(L,"require");
+    lua_pushstring(L,"luaflac.uint64");
+    lua_call(L,1,1);
+    lua_pop(L,1);
+
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_cut_functions,0);
+
+    return 1;
+}
@@ -0,0 +1,59 @@
+#include "luaflac_internal.h"
+#include <FLAC/stream_encoder.h>
+
+/* a C ABI for LuaJIT's FFI, used by src/luaflac/ffi.lua. LuaJIT passes
+ * a userdata given for a void * parameter as a pointer to its payload,
+ * so these take the payload of a pcm_buffer or encoder userdata. They
+ * don't check what they're given, the shim does that before calling */
+
+LUAFLAC_PUBLIC
+unsigned int
+luaflac_ffi_abi_version(void) {
+    return LUAFLAC_FFI_ABI_VERSION;
+}
+
+LUAFLAC_PUBLIC
+unsigned int
+luaflac_ffi_pcm_channels(const void *buffer) {
+    return ((const luaflac_pcm_buffer *)buffer)->channels;
+}
+
+LUAFLAC_PUBLIC
+size_t
+luaflac_ffi_pcm_frames(const void *buffer) {
+    return ((const luaflac_pcm_buffer *)buffer)->frames;
+}
+
+LUAFLAC_PUBLIC
+int
+luaflac_ffi_pcm_format(const void *buffer) {
+    return ((const luaflac_pcm_buffer *)buffer)->format;
+}
+
+LUAFLAC_PUBLIC
+unsigned int
+luaflac_ffi_pcm_bits_per_sample(const void *buffer) {
+    return ((const luaflac_pcm_buffer *)buffer)->bits_per_sample;
+}
+
+/* int32_t * or float * for each channel, valid until the buffer is
+ * resized or collected */
+LUAFLAC_PUBLIC
+void **
+luaflac_ffi_pcm_planar(void *buffer) {
+    return ((luaflac_pcm_buffer *)buffer)->planar;
+}
+
+LUAFLAC_PUBLIC
+int
+luaflac_ffi_encoder_process(void *encoder, int32_t *const buffer[], unsigned int samples) {
+    return FLAC__stream_encoder_process(luaflac_stream_encoder_get(encoder),
+      (const FLAC__int32 *const *)buffer,samples);
+}
+
+LUAFLAC_PUBLIC
+int
+luaflac_ffi_encoder_process_interleaved(void *encoder, const int32_t buffer[], unsigned int samples) {
+    return FLAC__stream_encoder_process_interleaved(luaflac_stream_encoder_get(encoder),
+      (const FLAC__int32 *)buffer,samples);
+}
@@ -0,0 +1,695 @@
+#include "luaflac_internal.h"
+#include <FLAC/format.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* native parsing of FLAC frame headers, for walking the audio part of a
+ * stream without a FLAC__StreamDecoder (and without decoding anything) */
+
+#define LUAFLAC_FRAME_BUFFER_SIZE 262144
+
+/* max_framesize in STREAMINFO is a 24-bit field, a "frame" bigger than
+ * this means the header we synced on was bogus */
+#define LUAFLAC_FRAME_SIZE_MAX 16777216
+
+/* allowance on top of the size a frame should be at most */
+#define LUAFLAC_FRAME_SIZE_SLACK 256
+
+/* don't bother splitting up less than this between threads */
+#define LUAFLAC_FRAME_REGION_MIN 4194304
+
+/* CRC-8, polynomial x^8 + x^2 + x^1 + x^0 */
+static const FLAC__uint8 luaflac_crc8_table[256] = {
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31,
+    0x24, 0x23, 0x2A, 0x2D, 0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65,
+    0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D, 0xE0, 0xE7, 0xEE, 0xE9,
+    0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+    0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1,
+    0xB4, 0xB3, 0xBA, 0xBD, 0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2,
+    0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA, 0xB7, 0xB0, 0xB9, 0xBE,
+    0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+    0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16,
+    0x03, 0x04, 0x0D, 0x0A, 0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42,
+    0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A, 0x89, 0x8E, 0x87, 0x80,
+    0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+    0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8,
+    0xDD, 0xDA, 0xD3, 0xD4, 0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C,
+    0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44, 0x19, 0x1E, 0x17, 0x10,
+    0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+    0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F,
+    0x6A, 0x6D, 0x64, 0x63, 0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B,
+    0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13, 0xAE, 0xA9, 0xA0, 0xA7,
+    0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+    0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF,
+    0xFA, 0xFD, 0xF4, 0xF3
+};
+
+/* CRC-16, polynomial x^16 + x^15 + x^2 + x^0 */
+static const FLAC__uint16 luaflac_crc16_table[256] = {
+    0x0000, 0x8005, 0x800F, 0x000A, 0x801B, 0x001E, 0x0014, 0x8011,
+    0x8033, 0x0036, 0x003C, 0x8039, 0x0028, 0x802D, 0x8027, 0x0022,
+    0x8063, 0x0066, 0x006C, 0x8069, 0x0078, 0x807D, 0x8077, 0x0072,
+    0x0050, 0x8055, 0x805F, 0x005A, 0x804B, 0x004E, 0x0044, 0x8041,
+    0x80C3, 0x00C6, 0x00CC, 0x80C9, 0x00D8, 0x80DD, 0x80D7, 0x00D2,
+    0x00F0, 0x80F5, 0x80FF, 0x00FA, 0x80EB, 0x00EE, 0x00E4, 0x80E1,
+    0x00A0, 0x80A5, 0x80AF, 0x00AA, 0x80BB, 0x00BE, 0x00B4, 0x80B1,
+    0x8093, 0x0096, 0x009C, 0x8099, 0x0088, 0x808D, 0x8087, 0x0082,
+    0x8183, 0x0186, 0x018C, 0x8189, 0x0198, 0x819D, 0x8197, 0x0192,
+    0x01B0, 0x81B5, 0x81BF, 0x01BA, 0x81AB, 0x01AE, 0x01A4, 0x81A1,
+    0x01E0, 0x81E5, 0x81EF, 0x01EA, 0x81FB, 0x01FE, 0x01F4, 0x81F1,
+    0x81D3, 0x01D6, 0x01DC, 0x81D9, 0x01C8, 0x81CD, 0x81C7, 0x01C2,
+    0x0140, 0x8145, 0x814F, 0x014A, 0x815B, 0x015E, 0x0154, 0x8151,
+    0x8173, 0x0176, 0x017C, 0x8179, 0x0168, 0x816D, 0x8167, 0x0162,
+    0x8123, 0x0126, 0x012C, 0x8129, 0x0138, 0x813D, 0x8137, 0x0132,
+    0x0110, 0x8115, 0x811F, 0x011A, 0x810B, 0x010E, 0x0104, 0x8101,
+    0x8303, 0x0306, 0x030C, 0x8309, 0x0318, 0x831D, 0x8317, 0x0312,
+    0x0330, 0x8335, 0x833F, 0x033A, 0x832B, 0x032E, 0x0324, 0x8321,
+    0x0360, 0x8365, 0x836F, 0x036A, 0x837B, 0x037E, 0x0374, 0x8371,
+    0x8353, 0x0356, 0x035C, 0x8359, 0x0348, 0x834D, 0x8347, 0x0342,
+    0x03C0, 0x83C5, 0x83CF, 0x03CA, 0x83DB, 0x03DE, 0x03D4, 0x83D1,
+    0x83F3, 0x03F6, 0x03FC, 0x83F9, 0x03E8, 0x83ED, 0x83E7, 0x03E2,
+    0x83A3, 0x03A6, 0x03AC, 0x83A9, 0x03B8, 0x83BD, 0x83B7, 0x03B2,
+    0x0390, 0x8395, 0x839F, 0x039A, 0x838B, 0x038E, 0x0384, 0x8381,
+    0x0280, 0x8285, 0x828F, 0x028A, 0x829B, 0x029E, 0x0294, 0x8291,
+    0x82B3, 0x02B6, 0x02BC, 0x82B9, 0x02A8, 0x82AD, 0x82A7, 0x02A2,
+    0x82E3, 0x02E6, 0x02EC, 0x82E9, 0x02F8, 0x82FD, 0x82F7, 0x02F2,
+    0x02D0, 0x82D5, 0x82DF, 0x02DA, 0x82CB, 0x02CE, 0x02C4, 0x82C1,
+    0x8243, 0x0246, 0x024C, 0x8249, 0x0258, 0x825D, 0x8257, 0x0252,
+    0x0270, 0x8275, 0x827F, 0x027A, 0x826B, 0x026E, 0x0264, 0x8261,
+    0x0220, 0x8225, 0x822F, 0x022A, 0x823B, 0x023E, 0x0234, 0x8231,
+    0x8213, 0x0216, 0x021C, 0x8219, 0x0208, 0x820D, 0x8207, 0x0202
+};
+
+static const FLAC__uint32 luaflac_frame_sample_rates[12] = {
+    0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000
+};
+
+static const FLAC__uint32 luaflac_frame_sample_sizes[8] = {
+    0, 8, 12, 0, 16, 20, 24, 32
+};
+
+LUAFLAC_PRIVATE
+FLAC__uint8
+luaflac_crc8(const FLAC__byte *data, size_t len) {
+    FLAC__uint8 crc = 0;
+    while(len--) {
+        crc = luaflac_crc8_table[crc ^ *data++];
+    }
+    return crc;
+}
+
+LUAFLAC_PRIVATE
+FLAC__uint16
+luaflac_crc16_update(FLAC__uint16 crc, const FLAC__byte *data, size_t len) {
+    while(len--) {
+        crc = (FLAC__uint16)((crc << 8) ^ luaflac_crc16_table[(crc >> 8) ^ *data++]);
+    }
+    return crc;
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_header_parse(const FLAC__byte *b, size_t len,
+  const FLAC__StreamMetadata_StreamInfo *streaminfo, luaflac_frame_header *h) {
+    unsigned int bs_code = 0;
+    unsigned int sr_code = 0;
+    unsigned int ch_code = 0;
+    unsigned int ss_code = 0;
+    unsigned int extra = 0;
+    FLAC__uint64 number = 0;
+    size_t n = 5;
+
+    if(len < 6) return 0;
+    if(b[0] != 0xFF || (b[1] & 0xFE) != 0xF8) return 0;
+
+    bs_code = b[2] >> 4;
+    sr_code = b[2] & 0x0F;
+    ch_code = b[3] >> 4;
+    ss_code = (b[3] >> 1) & 0x07;
+    if(bs_code == 0 || sr_code == 15 || ch_code > 10 || ss_code == 3 || (b[3] & 0x01)) return 0;
+
+    h->variable_blocksize = b[1] & 0x01;
+
+    /* frame or sample number, "UTF-8" coded */
+    if(!(b[4] & 0x80))             { number = b[4];        extra = 0; }
+    else if((b[4] & 0xE0) == 0xC0) { number = b[4] & 0x1F; extra = 1; }
+    else if((b[4] & 0xF0) == 0xE0) { number = b[4] & 0x0F; extra = 2; }
+    else if((b[4] & 0xF8) == 0xF0) { number = b[4] & 0x07; extra = 3; }
+    else if((b[4] & 0xFC) == 0xF8) { number = b[4] & 0x03; extra = 4; }
+    else if((b[4] & 0xFE) == 0xFC) { number = b[4] & 0x01; extra = 5; }
+    else if(b[4] == 0xFE)          { number = 0;           extra = 6; }
+    else return 0;
+
+    /* frame numbers are 31 bits */
+    if(!h->variable_blocksize && extra > 5) return 0;
+    if(len < n + extra) return 0;
+    while(extra--) {
+        if((b[n] & 0xC0) != 0x80) return 0;
+        number = (number << 6) | (b[n++] & 0x3F);
+    }
+    h->number = number;
+
+    if(bs_code == 1) {
+        h->blocksize = 192;
+    } else if(bs_code <= 5) {
+        h->blocksize = 576 << (bs_code - 2);
+    } else if(bs_code == 6) {
+        if(len < n + 1) return 0;
+        h->blocksize = (FLAC__uint32)b[n] + 1;
+        n += 1;
+    } else if(bs_code == 7) {
+        if(len < n + 2) return 0;
+        h->blocksize = (((FLAC__uint32)b[n] << 8) | b[n+1]) + 1;
+        n += 2;
+    } else {
+        h->blocksize = 256 << (bs_code - 8);
+    }
+
+    if(sr_code == 0) {
+        h->sample_rate = streaminfo == NULL ? 0 : streaminfo->sample_rate;
+    } else if(sr_code < 12) {
+        h->sample_rate = luaflac_frame_sample_rates[sr_code];
+    } else if(sr_code == 12) {
+        if(len < n + 1) return 0;
+        h->sample_rate = (FLAC__uint32)b[n] * 1000;
+        n += 1;
+    } else {
+        if(len < n + 2) return 0;
+        h->sample_rate = ((FLAC__uint32)b[n] << 8) | b[n+1];
+        if(sr_code == 14) h->sample_rate *= 10;
+        n += 2;
+    }
+
+    if(ss_code == 0) {
+        h->bits_per_sample = streaminfo == NULL ? 0 : streaminfo->bits_per_sample;
+    } else {
+        h->bits_per_sample = luaflac_frame_sample_sizes[ss_code];
+    }
+
+    if(ch_code < 8) {
+        h->channels = ch_code + 1;
+        h->channel_assignment = FLAC__CHANNEL_ASSIGNMENT_INDEPENDENT;
+    } else {
+        h->channels = 2;
+        h->channel_assignment = (FLAC__ChannelAssignment)(ch_code - 7);
+    }
+
+    /* a stream doesn't change format, so a header that contradicts
+     * STREAMINFO is a false sync inside a frame */
+    if(streaminfo != NULL) {
+        if(streaminfo->sample_rate != 0 && h->sample_rate != streaminfo->sample_rate) return 0;
+        if(streaminfo->channels != 0 && h->channels != streaminfo->channels) return 0;
+        if(streaminfo->bits_per_sample != 0 && h->bits_per_sample != streaminfo->bits_per_sample) return 0;
+        if(streaminfo->max_blocksize != 0 && h->blocksize > streaminfo->max_blocksize) return 0;
+    }
+
+    if(len < n + 1) return 0;
+    if(luaflac_crc8(b,n) != b[n]) return 0;
+    h->length = (FLAC__uint32)(n + 1);
+    return 1;
+}
+
+static int
+luaflac_frame_header_follows(const luaflac_frame_header *prev, const luaflac_frame_header *h) {
+    if(prev->variable_blocksize != h->variable_blocksize) return 0;
+    if(h->variable_blocksize) return h->number == prev->number + prev->blocksize;
+    return h->number == prev->number + 1;
+}
+
+/* drops everything before pos and reads more data, returns how many
+ * bytes were dropped from the front of the buffer */
+static size_t
+luaflac_frame_reader_fill(luaflac_frame_reader *r) {
+    size_t drop = r->pos;
+    size_t got = 0;
+    FLAC__byte *tmp = NULL;
+
+    if(drop > 0) {
+        memmove(r->buf,r->buf + drop,r->len - drop);
+        r->len -= drop;
+        r->buf_offset += drop;
+        r->pos = 0;
+    }
+
+    if(r->len == r->buf_size) {
+        tmp = realloc(r->buf,r->buf_size * 2);
+        if(tmp == NULL) {
+            r->error = 1;
+            r->eof = 1;
+            return drop;
+        }
+        r->buf = tmp;
+        r->buf_size *= 2;
+    }
+
+    got = fread(r->buf + r->len,1,r->buf_size - r->len,r->f);
+    if(got == 0) {
+        if(ferror(r->f)) r->error = 1;
+        r->eof = 1;
+    }
+    r->len += got;
+    return drop;
+}
+
+/* finds the first frame header at or after pos */
+static int
+luaflac_frame_reader_sync(luaflac_frame_reader *r) {
+    const FLAC__byte *p = NULL;
+
+    for(;;) {
+        if(r->len - r->pos < LUAFLAC_FRAME_HEADER_MAX && !r->eof) {
+            luaflac_frame_reader_fill(r);
+            continue;
+        }
+        if(r->pos >= r->len) return 0;
+
+        p = memchr(r->buf + r->pos,0xFF,r->len - r->pos);
+        if(p == NULL) {
+            r->skipped += r->len - r->pos;
+            r->pos = r->len;
+            continue;
+        }
+        r->skipped += (size_t)(p - (r->buf + r->pos));
+        r->pos = (size_t)(p - r->buf);
+        if(r->len - r->pos < LUAFLAC_FRAME_HEADER_MAX && !r->eof) continue;
+
+        if(luaflac_frame_header_parse(&r->buf[r->pos],r->len - r->pos,&r->streaminfo,&r->header)) {
+            if(r->fixed_blocksize == 0) {
+                r->fixed_blocksize = r->header.blocksize;
+            }
+            r->have_header = 1;
+            return 1;
+        }
+        r->pos++;
+        r->skipped++;
+    }
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_reader_init(luaflac_frame_reader *r, FILE *f) {
+    luaflac_block_header h;
+    FLAC__StreamMetadata *m = NULL;
+    FLAC__uint64 offset = 0;
+
+    memset(r,0,sizeof(luaflac_frame_reader));
+    r->f = f;
+
+    if(!luaflac_parse_stream_start(f,&offset)) return 0;
+    offset += 4;
+
+    do {
+        if(!luaflac_parse_block_header(f,offset,&h)) return 0;
+        if(h.type == FLAC__METADATA_TYPE_STREAMINFO) {
+            m = luaflac_parse_block(f,&h,0);
+            if(m == NULL) return 0;
+            r->streaminfo = m->data.stream_info;
+            r->streaminfo_offset = offset;
+            FLAC__metadata_object_delete(m);
+        }
+        offset += 4 + (FLAC__uint64)h.length;
+    } while(!h.is_last);
+
+    if(r->streaminfo.min_blocksize == r->streaminfo.max_blocksize) {
+        r->fixed_blocksize = r->streaminfo.min_blocksize;
+    }
+
+    r->buf_size = LUAFLAC_FRAME_BUFFER_SIZE;
+    r->buf = malloc(r->buf_size);
+    if(r->buf == NULL) return 0;
+
+    r->audio_offset = offset;
+    return luaflac_frame_reader_seek(r,offset);
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_reader_seek(luaflac_frame_reader *r, FLAC__uint64 offset) {
+    r->len = 0;
+    r->pos = 0;
+    r->buf_offset = offset;
+    r->eof = 0;
+    r->have_header = 0;
+    r->have_last = 0;
+    return luaflac_fseek(r->f,offset) == 0;
+}
+
+/* the most the frame at pos can take up: max_framesize from STREAMINFO if
+ * it's known, otherwise what the frame would take stored verbatim (side
+ * channels get an extra bit) */
+static size_t
+luaflac_frame_reader_limit(const luaflac_frame_reader *r) {
+    const luaflac_frame_header *h = &r->header;
+    FLAC__uint64 limit = 0;
+
+    if(r->streaminfo.max_framesize > 0) {
+        limit = r->streaminfo.max_framesize;
+    } else if(h->bits_per_sample > 0) {
+        limit = (FLAC__uint64)h->blocksize * h->channels * (h->bits_per_sample + 1) / 8;
+        limit += h->length + 2 * h->channels + 2;
+    } else {
+        return LUAFLAC_FRAME_SIZE_MAX;
+    }
+    limit += LUAFLAC_FRAME_SIZE_SLACK;
+    return limit < LUAFLAC_FRAME_SIZE_MAX ? (size_t)limit : LUAFLAC_FRAME_SIZE_MAX;
+}
+
+/* for when the header after the frame at pos is damaged: the first sync
+ * code before stop the frame's CRC-16 checks out at, relative to pos. 0 if
+ * there's none */
+static size_t
+luaflac_frame_reader_crc_end(const luaflac_frame_reader *r, size_t stop) {
+    const FLAC__byte *p = NULL;
+    FLAC__uint16 crc = 0;
+    size_t done = r->pos;
+    size_t i = r->pos + r->header.length;
+
+    if(stop > r->len - 1) stop = r->len - 1;
+    while(i < stop && (p = memchr(&r->buf[i],0xFF,stop - i)) != NULL) {
+        i = (size_t)(p - r->buf);
+        if((r->buf[i+1] & 0xFE) == 0xF8) {
+            crc = luaflac_crc16_update(crc,&r->buf[done],i - done);
+            done = i;
+            if(crc == 0) return i - r->pos;
+        }
+        i++;
+    }
+    return 0;
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_reader_next(luaflac_frame_reader *r, luaflac_frame *frame) {
+    luaflac_frame_header next;
+    const FLAC__byte *p = NULL;
+    size_t limit = 0;
+    size_t brk = 0; /* header that doesn't continue the numbering, relative to pos */
+    size_t end = 0; /* where the CRC-16 says the frame ends, relative to pos */
+    size_t i = 0;
+    int found = 0;
+
+    luaflac_frame_reader_next_restart:
+    if(!r->have_header && !luaflac_frame_reader_sync(r)) {
+        return r->error ? -1 : 0;
+    }
+
+    /* the frame runs up to the next header that continues the numbering */
+    limit = luaflac_frame_reader_limit(r);
+    brk = 0;
+    end = 0;
+    i = r->pos + r->header.length;
+    for(;;) {
+        if(r->len - i < LUAFLAC_FRAME_HEADER_MAX && !r->eof) {
+            i -= luaflac_frame_reader_fill(r);
+            continue;
+        }
+        if(i >= r->len) break;
+
+        if(i - r->pos > limit) {
+            /* longer than a frame can be, the next header is missing */
+            if(brk > 0) break;
+            if(limit < LUAFLAC_FRAME_SIZE_MAX) {
+                end = luaflac_frame_reader_crc_end(r,i);
+                if(end > 0) break;
+                limit = LUAFLAC_FRAME_SIZE_MAX;
+                continue;
+            }
+            /* lost sync, the header at pos was most likely bogus */
+            r->have_header = 0;
+            r->pos++;
+            r->skipped++;
+            goto luaflac_frame_reader_next_restart;
+        }
+
+        p = memchr(r->buf + i,0xFF,r->len - i);
+        if(p == NULL) {
+            i = r->len;
+            continue;
+        }
+        i = (size_t)(p - r->buf);
+        if(r->len - i < LUAFLAC_FRAME_HEADER_MAX && !r->eof) continue;
+
+        if(luaflac_frame_header_parse(&r->buf[i],r->len - i,&r->streaminfo,&next)) {
+            if(luaflac_frame_header_follows(&r->header,&next)) {
+                found = 1;
+                break;
+            }
+            /* either frames are missing (or damaged) from here on, or
+             * this is a stray header inside the frame. Only the first
+             * one counts, the frames after it follow on from it */
+            if(brk == 0) {
+                brk = i - r->pos;
+                end = luaflac_frame_reader_crc_end(r,i + 1);
+                if(end > 0) break;
+            }
+        }
+        i++;
+    }
+
+    if(!found && i >= r->len) {
+        if(i - r->pos > r->header.length + 128 &&
+           memcmp(&r->buf[i - 128],"TAG",3) == 0) {
+            /* leave a trailing ID3v1 tag out of the last frame */
+            i -= 128;
+        }
+        if(luaflac_crc16_update(0,&r->buf[r->pos],i - r->pos) == 0) {
+            /* a last frame that checks out runs to the end, whatever
+             * stray headers are inside it */
+            brk = 0;
+        }
+    }
+
+    if(!found && end == 0 && brk == 0) {
+        end = luaflac_frame_reader_crc_end(r,i);
+    }
+
+    if(!found && (end > 0 || brk > 0)) {
+        /* leave resyncing on whatever comes next to the next call */
+        i = r->pos + (end > 0 ? end : brk);
+    }
+
+    if(!r->have_last && !found &&
+       luaflac_crc16_update(0,&r->buf[r->pos],i - r->pos) != 0) {
+        /* the first frame after a seek could be a false sync inside the
+         * frame before it, without the next header following on it has to
+         * pass its CRC-16 */
+        r->have_header = 0;
+        r->pos++;
+        r->skipped++;
+        goto luaflac_frame_reader_next_restart;
+    }
+
+    frame->offset = r->buf_offset + r->pos;
+    frame->size = (FLAC__uint32)(i - r->pos);
+    frame->data = &r->buf[r->pos];
+    frame->header = r->header;
+    frame->sample = r->header.variable_blocksize ?
+      r->header.number :
+      r->header.number * r->fixed_blocksize;
+    frame->numbering_break = r->have_last &&
+      !luaflac_frame_header_follows(&r->last,&r->header);
+
+    if(frame->numbering_break) r->breaks++;
+    r->last = r->header;
+    r->have_last = 1;
+
+    /* at the end of the stream pos skips past any tag */
+    r->pos = found || end > 0 || brk > 0 ? i : r->len;
+    r->have_header = found;
+    if(found) r->header = next;
+    return r->error ? -1 : 1;
+}
+
+/* the "UTF-8" coding frame headers use for frame and sample numbers */
+static size_t
+luaflac_frame_number(FLAC__byte *b, FLAC__uint64 v) {
+    static const FLAC__byte lead[8] = { 0, 0, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE };
+    size_t n = 0;
+    size_t i = 0;
+
+    if(v < 0x80) {
+        b[0] = (FLAC__byte)v;
+        return 1;
+    }
+    if(v < 0x800) n = 2;
+    else if(v < 0x10000) n = 3;
+    else if(v < 0x200000) n = 4;
+    else if(v < 0x4000000) n = 5;
+    else if(v < 0x80000000) n = 6;
+    else n = 7;
+
+    for(i=n-1;i>0;i--) {
+        b[i] = (FLAC__byte)(0x80 | (v & 0x3F));
+        v >>= 6;
+    }
+    b[0] = (FLAC__byte)(lead[n] | v);
+    return n;
+}
+
+static size_t
+luaflac_frame_number_length(FLAC__byte b) {
+    if(!(b & 0x80)) return 1;
+    if((b & 0xE0) == 0xC0) return 2;
+    if((b & 0xF0) == 0xE0) return 3;
+    if((b & 0xF8) == 0xF0) return 4;
+    if((b & 0xFC) == 0xF8) return 5;
+    if((b & 0xFE) == 0xFC) return 6;
+    return 7;
+}
+
+LUAFLAC_PRIVATE
+size_t
+luaflac_frame_renumber(const FLAC__byte *data, size_t size, const luaflac_frame_header *h,
+  int variable, FLAC__uint64 number, FLAC__byte *out) {
+    FLAC__uint16 crc = 0;
+    size_t extra = 0;
+    size_t body = 0;
+    size_t n = 0;
+
+    /* blocksize and sample rate bytes that follow the number */
+    extra = h->length - 1 - 4 - luaflac_frame_number_length(data[4]);
+    body = size - h->length - 2;
+
+    out[0] = 0xFF;
+    out[1] = (FLAC__byte)(0xF8 | (variable ? 1 : 0));
+    out[2] = data[2];
+    out[3] = data[3];
+    n = 4 + luaflac_frame_number(&out[4],number);
+    memcpy(&out[n],&data[h->length - 1 - extra],extra);
+    n += extra;
+    out[n] = luaflac_crc8(out,n);
+    n++;
+    memcpy(&out[n],&data[h->length],body);
+    n += body;
+    crc = luaflac_crc16_update(0,out,n);
+    out[n++] = (FLAC__byte)(crc >> 8);
+    out[n++] = (FLAC__byte)(crc);
+    return n;
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_regions(FLAC__uint64 audio, FLAC__uint64 size, lua_Integer threads) {
+    if(threads < 1) threads = 1;
+    if(size > audio && (size - audio) / LUAFLAC_FRAME_REGION_MIN < (FLAC__uint64)threads) {
+        threads = (lua_Integer)((size - audio) / LUAFLAC_FRAME_REGION_MIN);
+        if(threads < 1) threads = 1;
+    }
+    return (int)threads;
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_frame_region(FLAC__uint64 audio, FLAC__uint64 size, int n, int i,
+  FLAC__uint64 *start, FLAC__uint64 *end) {
+    *start = audio + (size - audio) / n * i;
+    *end = i + 1 == n ? size : audio + (size - audio) / n * (i + 1);
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_check_crc(const luaflac_frame *frame) {
+    /* the CRC-16 of a frame including its own CRC comes out as 0 */
+    return frame->size > frame->header.length + 2 &&
+      luaflac_crc16_update(0,frame->data,frame->size) == 0;
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_reader_last(luaflac_frame_reader *r, luaflac_frame *frame) {
+    luaflac_frame_header h;
+    luaflac_frame_header prev;
+    luaflac_frame_header last;
+    FLAC__uint64 size = 0;
+    FLAC__uint64 start = 0;
+    FLAC__byte *tmp = NULL;
+    const FLAC__byte *p = NULL;
+    size_t window = 65536;
+    size_t end = 0;
+    size_t i = 0;
+    size_t found = 0;
+    int have_prev = 0;
+    int crc_ok = 0;
+
+    memset(&prev,0,sizeof(luaflac_frame_header));
+    memset(&last,0,sizeof(luaflac_frame_header));
+
+    /* fixed blocksize streams count frames, so the blocksize has to come
+     * from STREAMINFO or failing that the first frame */
+    if(r->fixed_blocksize == 0) {
+        if(!luaflac_frame_reader_seek(r,r->audio_offset)) return -1;
+        if(!luaflac_frame_reader_sync(r)) return r->error ? -1 : 0;
+    }
+
+    if(luaflac_fsize(r->f,&size) != 0) return -1;
+    if(r->streaminfo.max_framesize > 0) {
+        window = r->streaminfo.max_framesize + LUAFLAC_FRAME_HEADER_MAX + 128;
+    }
+
+    for(;;) {
+        start = size > r->audio_offset + window ? size - window : r->audio_offset;
+        if(!luaflac_frame_reader_seek(r,start)) return -1;
+        if(r->buf_size < window) {
+            tmp = realloc(r->buf,window);
+            if(tmp == NULL) return -1;
+            r->buf = tmp;
+            r->buf_size = window;
+        }
+        r->len = fread(r->buf,1,(size_t)(size - start),r->f);
+        if(r->len != size - start) return -1;
+
+        end = r->len;
+        if(end > 128 && memcmp(&r->buf[end - 128],"TAG",3) == 0) end -= 128;
+
+        /* the last frame is the last header whose CRC-16 runs out exactly
+         * at the end of the file. If it's damaged, settle for the last
+         * header that continues from the one before it */
+        found = 0;
+        have_prev = 0;
+        crc_ok = 0;
+        i = 0;
+        while(i < end && (p = memchr(&r->buf[i],0xFF,end - i)) != NULL) {
+            i = (size_t)(p - r->buf);
+            if(luaflac_frame_header_parse(&r->buf[i],end - i,&r->streaminfo,&h)) {
+                if(luaflac_crc16_update(0,&r->buf[i],end - i) == 0) {
+                    found = i + 1;
+                    last = h;
+                    crc_ok = 1;
+                } else if(!crc_ok && have_prev && luaflac_frame_header_follows(&prev,&h)) {
+                    found = i + 1;
+                    last = h;
+                }
+                prev = h;
+                have_prev = 1;
+            }
+            i++;
+        }
+
+        if(found) break;
+        if(start == r->audio_offset || window >= LUAFLAC_FRAME_SIZE_MAX) return 0;
+        window *= 4;
+    }
+
+    i = found - 1;
+    frame->offset = start + i;
+    frame->size = (FLAC__uint32)(end - i);
+    frame->data = &r->buf[i];
+    frame->header = last;
+    frame->numbering_break = 0;
+    frame->sample = last.variable_blocksize ?
+      last.number :
+      last.number * r->fixed_blocksize;
+
+    r->pos = r->len;
+    r->eof = 1;
+    r->have_header = 0;
+    return 1;
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_frame_reader_free(luaflac_frame_reader *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
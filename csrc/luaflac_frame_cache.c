@@ -0,0 +1,162 @@
+#include "luaflac_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* decoded frames kept in C, bounded by bytes and evicted least recently
+ * used first. Entries are kept in an array sorted by first sample, so the
+ * frame holding any sample can be found with a binary search */
+
+static size_t
+luaflac_frame_cache_entry_size(const luaflac_frame_cache_entry *e) {
+    return sizeof(luaflac_frame_cache_entry) +
+      sizeof(FLAC__int32) * e->frame.header.channels * e->frame.header.blocksize;
+}
+
+/* index of the first entry starting after sample */
+static size_t
+luaflac_frame_cache_upper(const luaflac_frame_cache *c, FLAC__uint64 sample) {
+    size_t lo = 0;
+    size_t hi = c->num_entries;
+    size_t mid = 0;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(c->entries[mid]->sample <= sample) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void
+luaflac_frame_cache_unlink(luaflac_frame_cache *c, luaflac_frame_cache_entry *e) {
+    if(e->prev != NULL) e->prev->next = e->next;
+    else c->newest = e->next;
+    if(e->next != NULL) e->next->prev = e->prev;
+    else c->oldest = e->prev;
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void
+luaflac_frame_cache_link(luaflac_frame_cache *c, luaflac_frame_cache_entry *e) {
+    e->prev = NULL;
+    e->next = c->newest;
+    if(c->newest != NULL) c->newest->prev = e;
+    c->newest = e;
+    if(c->oldest == NULL) c->oldest = e;
+}
+
+static void
+luaflac_frame_cache_remove(luaflac_frame_cache *c, luaflac_frame_cache_entry *e) {
+    size_t i = luaflac_frame_cache_upper(c,e->sample) - 1;
+
+    luaflac_frame_cache_unlink(c,e);
+    memmove(&c->entries[i],&c->entries[i+1],sizeof(luaflac_frame_cache_entry *) * (c->num_entries - i - 1));
+    c->num_entries--;
+    c->bytes -= luaflac_frame_cache_entry_size(e);
+    free(e);
+}
+
+LUAFLAC_PRIVATE
+luaflac_frame_cache *
+luaflac_frame_cache_new(size_t limit) {
+    luaflac_frame_cache *c = calloc(1,sizeof(luaflac_frame_cache));
+    if(c == NULL) return NULL;
+    c->limit = limit;
+    return c;
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_frame_cache_clear(luaflac_frame_cache *c) {
+    while(c->oldest != NULL) {
+        luaflac_frame_cache_remove(c,c->oldest);
+    }
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_frame_cache_free(luaflac_frame_cache *c) {
+    if(c == NULL) return;
+    luaflac_frame_cache_clear(c);
+    free(c->entries);
+    free(c);
+}
+
+LUAFLAC_PRIVATE
+luaflac_frame_cache_entry *
+luaflac_frame_cache_find(luaflac_frame_cache *c, FLAC__uint64 sample) {
+    size_t i = luaflac_frame_cache_upper(c,sample);
+    luaflac_frame_cache_entry *e = NULL;
+
+    if(i > 0) {
+        e = c->entries[i-1];
+        if(sample < e->sample + e->frame.header.blocksize) {
+            luaflac_frame_cache_unlink(c,e);
+            luaflac_frame_cache_link(c,e);
+            c->hits++;
+            return e;
+        }
+    }
+    c->misses++;
+    return NULL;
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_cache_insert(luaflac_frame_cache *c, const FLAC__Frame *frame,
+  const FLAC__int32 * const buffer[], FLAC__uint64 sample) {
+    luaflac_frame_cache_entry *e = NULL;
+    luaflac_frame_cache_entry **tmp = NULL;
+    size_t size = 0;
+    size_t max = 0;
+    size_t i = 0;
+    unsigned int channel = 0;
+
+    e = malloc(sizeof(luaflac_frame_cache_entry) +
+      sizeof(FLAC__int32) * frame->header.channels * frame->header.blocksize);
+    if(e == NULL) return 0;
+    e->frame = *frame;
+    e->sample = sample;
+    e->pcm = (FLAC__int32 *)(e + 1);
+    for(channel=0;channel<frame->header.channels;channel++) {
+        memcpy(&e->pcm[channel * frame->header.blocksize],buffer[channel],
+          sizeof(FLAC__int32) * frame->header.blocksize);
+    }
+
+    size = luaflac_frame_cache_entry_size(e);
+    if(size > c->limit) {
+        free(e);
+        return 1;
+    }
+
+    i = luaflac_frame_cache_upper(c,sample);
+    if(i > 0 && c->entries[i-1]->sample == sample) {
+        /* already there, the new copy replaces it */
+        luaflac_frame_cache_remove(c,c->entries[i-1]);
+    }
+
+    while(c->bytes + size > c->limit && c->oldest != NULL) {
+        luaflac_frame_cache_remove(c,c->oldest);
+    }
+
+    if(c->num_entries == c->max_entries) {
+        max = c->max_entries ? c->max_entries * 2 : 64;
+        tmp = realloc(c->entries,sizeof(luaflac_frame_cache_entry *) * max);
+        if(tmp == NULL) {
+            free(e);
+            return 0;
+        }
+        c->entries = tmp;
+        c->max_entries = max;
+    }
+
+    i = luaflac_frame_cache_upper(c,sample);
+    memmove(&c->entries[i+1],&c->entries[i],sizeof(luaflac_frame_cache_entry *) * (c->num_entries - i));
+    c->entries[i] = e;
+    c->num_entries++;
+    c->bytes += size;
+    luaflac_frame_cache_link(c,e);
+    return 1;
+}
@@ -0,0 +1,124 @@
+#include "luaflac_internal.h"
+#include <FLAC/stream_decoder.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* a FLAC__StreamDecoder fed from memory one frame at a time, for decoding
+ * frames found by the native frame reader. It's started with a made-up
+ * STREAMINFO carrying just the audio format */
+
+static FLAC__StreamDecoderReadStatus
+luaflac_frame_decoder_read(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes, void *client_data) {
+    luaflac_frame_decoder *d = (luaflac_frame_decoder *)client_data;
+    (void)decoder;
+
+    if(d->len == 0) {
+        *bytes = 0;
+        return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+    }
+    if(*bytes > d->len) *bytes = d->len;
+    memcpy(buffer,d->data,*bytes);
+    d->data += *bytes;
+    d->len -= *bytes;
+    return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__StreamDecoderWriteStatus
+luaflac_frame_decoder_write(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data) {
+    luaflac_frame_decoder *d = (luaflac_frame_decoder *)client_data;
+    FLAC__int32 *tmp = NULL;
+    unsigned int i = 0;
+    (void)decoder;
+
+    if(d->md5 != NULL) {
+        luaflac_md5_update_samples(d->md5,buffer,frame->header.channels,
+          frame->header.blocksize,frame->header.bits_per_sample);
+    }
+
+    if(d->keep) {
+        if(frame->header.blocksize > d->pcm_size) {
+            for(i=0;i<frame->header.channels;i++) {
+                tmp = realloc(d->pcm[i],sizeof(FLAC__int32) * frame->header.blocksize);
+                if(tmp == NULL) {
+                    d->error = "out of memory";
+                    return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+                }
+                d->pcm[i] = tmp;
+            }
+            d->pcm_size = frame->header.blocksize;
+        }
+        for(i=0;i<frame->header.channels;i++) {
+            memcpy(d->pcm[i],buffer[i],sizeof(FLAC__int32) * frame->header.blocksize);
+        }
+    }
+
+    d->samples = frame->header.blocksize;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void
+luaflac_frame_decoder_error(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data) {
+    luaflac_frame_decoder *d = (luaflac_frame_decoder *)client_data;
+    (void)decoder;
+    if(d->error == NULL) d->error = FLAC__StreamDecoderErrorStatusString[status];
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_decoder_init(luaflac_frame_decoder *d, const FLAC__StreamMetadata_StreamInfo *streaminfo) {
+    FLAC__StreamMetadata_StreamInfo s = *streaminfo;
+
+    /* only the audio format matters, and frames of any size have to pass */
+    s.min_blocksize = 16;
+    s.max_blocksize = 65535;
+    s.min_framesize = 0;
+    s.max_framesize = 0;
+    s.total_samples = 0;
+    memset(s.md5sum,0,16);
+
+    memcpy(d->head,"fLaC",4);
+    d->head[4] = 0x80 | FLAC__METADATA_TYPE_STREAMINFO;
+    d->head[5] = 0;
+    d->head[6] = 0;
+    d->head[7] = FLAC__STREAM_METADATA_STREAMINFO_LENGTH;
+    luaflac_pack_streaminfo(&d->head[8],&s);
+
+    d->decoder = FLAC__stream_decoder_new();
+    if(d->decoder == NULL) return 0;
+    if(FLAC__stream_decoder_init_stream(d->decoder,luaflac_frame_decoder_read,
+      NULL,NULL,NULL,NULL,
+      luaflac_frame_decoder_write,NULL,luaflac_frame_decoder_error,d) != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+        return 0;
+    }
+
+    d->data = d->head;
+    d->len = sizeof(d->head);
+    return FLAC__stream_decoder_process_until_end_of_metadata(d->decoder);
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_decoder_run(luaflac_frame_decoder *d, const FLAC__byte *data, size_t len) {
+    d->data = data;
+    d->len = len;
+    d->samples = 0;
+    d->error = NULL;
+
+    if(!FLAC__stream_decoder_process_single(d->decoder) || d->error != NULL || d->samples == 0) {
+        if(d->error == NULL) d->error = "error decoding frame";
+        FLAC__stream_decoder_flush(d->decoder);
+        return 0;
+    }
+    return 1;
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_frame_decoder_free(luaflac_frame_decoder *d) {
+    unsigned int i = 0;
+    if(d->decoder != NULL) FLAC__stream_decoder_delete(d->decoder);
+    for(i=0;i<FLAC__MAX_CHANNELS;i++) {
+        free(d->pcm[i]);
+    }
+}
@@ -1,4 +1,14 @@
+#if !defined(_WIN32) && !defined(_WIN64)
+#define _FILE_OFFSET_BITS 64
+#endif
 #include "luaflac_internal.h"
+#include <stdio.h>
+#include <string.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 #if !defined(luaL_newlibtable) \
   && (!defined LUA_VERSION_NUM || LUA_VERSION_NUM==501)
@@ -43,3 +53,227 @@ void *luaL_testudata (lua_State *L, int i, const char *tname) {
     return p;
 }
 #endif
+
+LUAFLAC_PRIVATE
+int luaflac_fseek(FILE *f, FLAC__uint64 offset) {
+#if defined(_WIN32) || defined(_WIN64)
+    return _fseeki64(f,(__int64)offset,SEEK_SET);
+#else
+    return fseeko(f,(off_t)offset,SEEK_SET);
+#endif
+}
+
+LUAFLAC_PRIVATE
+int luaflac_ftell(FILE *f, FLAC__uint64 *offset) {
+#if defined(_WIN32) || defined(_WIN64)
+    __int64 r = _ftelli64(f);
+#else
+    off_t r = ftello(f);
+#endif
+    if(r < 0) return -1;
+    *offset = (FLAC__uint64)r;
+    return 0;
+}
+
+LUAFLAC_PRIVATE
+int luaflac_fsize(FILE *f, FLAC__uint64 *size) {
+#if defined(_WIN32) || defined(_WIN64)
+    __int64 r;
+    if(_fseeki64(f,0,SEEK_END) != 0) return -1;
+    r = _ftelli64(f);
+#else
+    off_t r;
+    if(fseeko(f,0,SEEK_END) != 0) return -1;
+    r = ftello(f);
+#endif
+    if(r < 0) return -1;
+    *size = (FLAC__uint64)r;
+    return 0;
+}
+
+LUAFLAC_PRIVATE
+int luaflac_ftruncate(FILE *f, FLAC__uint64 size) {
+    if(fflush(f) != 0) return -1;
+#if defined(_WIN32) || defined(_WIN64)
+    return _chsize_s(_fileno(f),(__int64)size) == 0 ? 0 : -1;
+#else
+    return ftruncate(fileno(f),(off_t)size);
+#endif
+}
+
+LUAFLAC_PRIVATE
+void luaflac_pcm_unpack(const unsigned char *b, unsigned int width, FLAC__int32 *out, size_t n) {
+    unsigned int shift = 32 - 8 * width;
+    unsigned int i = 0;
+    FLAC__uint32 v = 0;
+
+    while(n--) {
+        v = 0;
+        for(i=0;i<width;i++) {
+            v |= (FLAC__uint32)b[i] << (8 * i);
+        }
+        /* sign-extend from the top byte */
+        *out++ = (FLAC__int32)(v << shift) >> shift;
+        b += width;
+    }
+}
+
+LUAFLAC_PRIVATE
+void luaflac_pcm_pack(unsigned char *b, unsigned int width, const FLAC__int32 *in, size_t n) {
+    unsigned int i = 0;
+    FLAC__uint32 v = 0;
+
+    while(n--) {
+        v = (FLAC__uint32)*in++;
+        for(i=0;i<width;i++) {
+            *b++ = (unsigned char)(v >> (8 * i));
+        }
+    }
+}
+
+LUAFLAC_PRIVATE
+void luaflac_pcm_float(unsigned char *b, unsigned int bits, const FLAC__int32 *const buffer[], unsigned int channels, size_t count) {
+    /* a power of two, so the multiply is exact and only
+     * samples over 24 bits are rounded */
+    const float scale = 1.0f / (float)((FLAC__uint32)1 << (bits - 1));
+    const FLAC__int32 *in = NULL;
+    unsigned char *p = NULL;
+    unsigned int c = 0;
+    size_t i = 0;
+    size_t stride = (size_t)channels * 4;
+    FLAC__uint32 v = 0;
+    float f = 0.0f;
+
+    for(c=0;c<channels;c++) {
+        in = buffer[c];
+        p = b + (size_t)c * 4;
+        for(i=0;i<count;i++) {
+            f = (float)in[i] * scale;
+            memcpy(&v,&f,sizeof(v));
+            p[0] = (unsigned char)v;
+            p[1] = (unsigned char)(v >> 8);
+            p[2] = (unsigned char)(v >> 16);
+            p[3] = (unsigned char)(v >> 24);
+            p += stride;
+        }
+    }
+}
+
+/* xorshift32, only used for dither so it just needs to be fast */
+static FLAC__uint32
+luaflac_pcm_random(FLAC__uint32 *state) {
+    FLAC__uint32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* TPDF dither of +/-1 LSB, two uniform values make a triangular distribution */
+static double
+luaflac_pcm_tpdf(FLAC__uint32 *state) {
+    return ((double)luaflac_pcm_random(state) + (double)luaflac_pcm_random(state)) *
+      (1.0 / 4294967296.0) - 1.0;
+}
+
+/* rounds d, in units of 1 LSB, and clips it to +/-scale */
+static FLAC__int32
+luaflac_pcm_clip(double d, double scale, size_t *clipped) {
+    /* offset so the range starts at 0, then truncating rounds */
+    d += scale + 0.5;
+    if(d >= 2.0 * scale) {
+        (*clipped)++;
+        return (FLAC__int32)(scale - 1.0);
+    }
+    if(d < 0.0) {
+        (*clipped)++;
+        return (FLAC__int32)-scale;
+    }
+    if(d != d) {
+        /* NaN */
+        return 0;
+    }
+    return (FLAC__int32)((FLAC__int64)d - (FLAC__int64)scale);
+}
+
+LUAFLAC_PRIVATE
+size_t luaflac_pcm_quantize(const unsigned char *b, unsigned int bits, FLAC__int32 *out, size_t n, FLAC__uint32 *dither) {
+    /* doubles hold every 32-bit sample exactly */
+    const double scale = (double)((FLAC__uint64)1 << (bits - 1));
+    size_t clipped = 0;
+    FLAC__uint32 v = 0;
+    float f = 0.0f;
+    double d = 0.0;
+
+    while(n--) {
+        v = (FLAC__uint32)b[0] | (FLAC__uint32)b[1] << 8 |
+          (FLAC__uint32)b[2] << 16 | (FLAC__uint32)b[3] << 24;
+        memcpy(&f,&v,sizeof(f));
+        d = (double)f * scale;
+        if(dither != NULL) d += luaflac_pcm_tpdf(dither);
+        *out++ = luaflac_pcm_clip(d,scale,&clipped);
+        b += 4;
+    }
+    return clipped;
+}
+
+LUAFLAC_PRIVATE
+size_t luaflac_pcm_round(const double *in, unsigned int bits, FLAC__int32 *out, size_t n, FLAC__uint32 *dither) {
+    const double scale = (double)((FLAC__uint64)1 << (bits - 1));
+    size_t clipped = 0;
+    size_t i = 0;
+
+    if(dither != NULL) {
+        for(i=0;i<n;i++) {
+            out[i] = luaflac_pcm_clip(in[i] + luaflac_pcm_tpdf(dither),scale,&clipped);
+        }
+    } else {
+        for(i=0;i<n;i++) {
+            out[i] = luaflac_pcm_clip(in[i],scale,&clipped);
+        }
+    }
+    return clipped;
+}
+
+LUAFLAC_PRIVATE
+FLAC__uint32 *luaflac_pcm_dither_options(lua_State *L, int idx, FLAC__uint32 *state) {
+    int dither = 0;
+
+    if(!lua_istable(L,idx)) return NULL;
+    lua_getfield(L,idx,"dither");
+    dither = lua_toboolean(L,-1);
+    lua_pop(L,1);
+    lua_getfield(L,idx,"seed");
+    if(!lua_isnil(L,-1)) {
+        /* xorshift gets stuck on 0, which any multiple of 2^32 becomes */
+        *state = (FLAC__uint32)luaL_checkinteger(L,-1);
+        if(*state == 0) *state = LUAFLAC_PCM_SEED;
+    }
+    lua_pop(L,1);
+    return dither ? state : NULL;
+}
+
+LUAFLAC_PRIVATE
+FILE *luaflac_checkfile(lua_State *L, int idx, const char *mode, int *owned) {
+    FILE **f = NULL;
+
+    if(lua_type(L,idx) == LUA_TSTRING) {
+        *owned = 1;
+        return fopen(lua_tostring(L,idx),mode);
+    }
+
+    /* in every Lua version the FILE * is the first
+     * member of the io library's userdata */
+    f = (FILE **)luaL_testudata(L,idx,LUA_FILEHANDLE);
+    if(f == NULL) {
+        luaL_error(L,"expected a filename or file handle");
+        return NULL;
+    }
+    if(*f == NULL) {
+        luaL_error(L,"attempt to use a closed file");
+        return NULL;
+    }
+    *owned = 0;
+    return *f;
+}
@@ -1,6 +1,9 @@
 #include "luaflac.h"
+#include <stdio.h>
 #include <FLAC/ordinals.h>
 #include <FLAC/metadata.h>
+#include <FLAC/stream_decoder.h>
+#include <FLAC/stream_encoder.h>
 
 #if __GNUC__ > 4
 #define LUAFLAC_PRIVATE __attribute__ ((visibility ("hidden")))
@@ -22,6 +25,148 @@ typedef struct luaflac_metamethods_s {
 
 #define luaflac_push_const(x) lua_pushinteger(L,x) ; lua_setfield(L,-2, #x)
 
+#define LUAFLAC_COPY_BUFFER_SIZE 65536
+
+typedef struct luaflac_block_header_s {
+    FLAC__uint64 offset; /* absolute offset of the 4-byte block header */
+    FLAC__MetadataType type;
+    FLAC__bool is_last;
+    FLAC__uint32 length; /* length of the block, not including the header */
+} luaflac_block_header;
+
+typedef struct luaflac_parsed_block_s {
+    luaflac_block_header header;
+    FLAC__StreamMetadata *metadata;
+} luaflac_parsed_block;
+
+/* longest possible frame header, including the CRC-8 */
+#define LUAFLAC_FRAME_HEADER_MAX 16
+
+/* how much longer luaflac_frame_renumber can make a frame */
+#define LUAFLAC_FRAME_RENUMBER_GROWTH 8
+
+typedef struct luaflac_frame_header_s {
+    FLAC__uint32 blocksize;
+    FLAC__uint32 sample_rate; /* 0 if taken from a missing STREAMINFO */
+    FLAC__uint32 channels;
+    FLAC__ChannelAssignment channel_assignment;
+    FLAC__uint32 bits_per_sample; /* 0 if taken from a missing STREAMINFO */
+    FLAC__bool variable_blocksize;
+    FLAC__uint64 number; /* frame number, or sample number with variable_blocksize */
+    FLAC__uint32 length; /* length of the header, including the CRC-8 */
+} luaflac_frame_header;
+
+typedef struct luaflac_frame_s {
+    FLAC__uint64 offset; /* absolute offset of the frame */
+    FLAC__uint64 sample; /* first sample in the frame */
+    FLAC__uint32 size;
+    const FLAC__byte *data; /* the whole frame, valid until the next read */
+    luaflac_frame_header header;
+    int numbering_break; /* doesn't continue from the frame read before it */
+} luaflac_frame;
+
+typedef struct luaflac_frame_reader_s {
+    FILE *f;
+    FLAC__byte *buf;
+    size_t buf_size;
+    size_t len;
+    size_t pos; /* start of the current frame in buf */
+    FLAC__uint64 buf_offset; /* absolute offset of buf[0] */
+    int eof;
+    int error;
+    int have_header; /* header is the frame header at pos */
+    luaflac_frame_header header;
+    FLAC__uint32 fixed_blocksize;
+    FLAC__StreamMetadata_StreamInfo streaminfo;
+    FLAC__uint64 streaminfo_offset; /* offset of the STREAMINFO block header, 0 if missing */
+    FLAC__uint64 audio_offset; /* offset of the first frame */
+    FLAC__uint64 skipped; /* bytes skipped looking for frame headers */
+    int have_last; /* last is the header of the frame read before, unset by seeks */
+    luaflac_frame_header last;
+    FLAC__uint64 breaks; /* frames that didn't continue the numbering */
+} luaflac_frame_reader;
+
+/* frame positions from flac.scan_frames, parallel arrays */
+typedef struct luaflac_frame_index_s {
+    size_t num_frames;
+    size_t max_frames;
+    FLAC__uint64 *offsets;
+    FLAC__uint64 *samples;
+    FLAC__uint32 *sizes;
+    FLAC__uint32 *blocksizes;
+} luaflac_frame_index;
+
+/* a decoded frame, frame.header is the header of the whole frame */
+typedef struct luaflac_frame_cache_entry_s {
+    FLAC__uint64 sample; /* first sample */
+    FLAC__Frame frame;
+    FLAC__int32 *pcm; /* blocksize samples per channel, one channel after another */
+    struct luaflac_frame_cache_entry_s *prev; /* more recently used */
+    struct luaflac_frame_cache_entry_s *next; /* less recently used */
+} luaflac_frame_cache_entry;
+
+typedef struct luaflac_frame_cache_s {
+    size_t limit; /* in bytes */
+    size_t bytes;
+    FLAC__uint64 hits;
+    FLAC__uint64 misses;
+    luaflac_frame_cache_entry **entries; /* sorted by sample */
+    size_t num_entries;
+    size_t max_entries;
+    luaflac_frame_cache_entry *newest;
+    luaflac_frame_cache_entry *oldest;
+} luaflac_frame_cache;
+
+typedef struct luaflac_md5_s {
+    FLAC__uint32 state[4];
+    FLAC__uint64 length; /* bytes so far */
+    FLAC__byte block[64];
+} luaflac_md5;
+
+/* a libFLAC decoder fed from memory, one frame at a time */
+typedef struct luaflac_frame_decoder_s {
+    FLAC__StreamDecoder *decoder;
+    FLAC__byte head[8 + FLAC__STREAM_METADATA_STREAMINFO_LENGTH]; /* fLaC and a STREAMINFO */
+    const FLAC__byte *data;
+    size_t len;
+    int keep; /* copy the samples into pcm */
+    FLAC__int32 *pcm[FLAC__MAX_CHANNELS];
+    unsigned int pcm_size;
+    unsigned int samples;
+    luaflac_md5 *md5; /* if set, gets the decoded samples */
+    const char *error;
+} luaflac_frame_decoder;
+
+typedef struct luaflac_wav_writer_s luaflac_wav_writer;
+
+typedef struct luaflac_loudness_s luaflac_loudness;
+
+typedef struct luaflac_waveform_s luaflac_waveform;
+
+/* a flac.pcm_buffer, planar samples with channel c starting at c * frames */
+#define LUAFLAC_PCM_INT32 0
+#define LUAFLAC_PCM_FLOAT32 1
+
+typedef struct luaflac_pcm_buffer_s {
+    int format;
+    unsigned int bits_per_sample; /* of LUAFLAC_PCM_INT32 samples */
+    unsigned int channels;
+    size_t frames;
+    size_t size; /* bytes allocated */
+    void *data;
+    void *planar[FLAC__MAX_CHANNELS]; /* the start of each channel, for the FFI */
+} luaflac_pcm_buffer;
+
+#define luaflac_pcm_buffer_int(b,c) ((FLAC__int32 *)(b)->data + (size_t)(c) * (b)->frames)
+#define luaflac_pcm_buffer_float(b,c) ((float *)(b)->data + (size_t)(c) * (b)->frames)
+
+/* flags for luaflac_parse_block */
+#define LUAFLAC_PARSE_PICTURE_NODATA 0x01
+
+/* flags for luaflac_pushstreammetadata_flags */
+#define LUAFLAC_PUSH_LAZY_PICTURE 0x01
+#define LUAFLAC_PUSH_PACKED_SEEKTABLE 0x02
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -38,6 +183,13 @@ LUAFLAC_PRIVATE
 int
 luaflac_pushstreammetadata(lua_State *L, const FLAC__StreamMetadata *m);
 
+/* same as above with LUAFLAC_PUSH_* flags. With LUAFLAC_PUSH_LAZY_PICTURE,
+ * picture data is left out and data_offset is the position of the picture
+ * data in the stream (or 0 if unknown) */
+LUAFLAC_PRIVATE
+int
+luaflac_pushstreammetadata_flags(lua_State *L, const FLAC__StreamMetadata *m, int flags, FLAC__uint64 data_offset);
+
 LUAFLAC_PRIVATE
 void
 luaflac_pushint64(lua_State *L, FLAC__int64 v);
@@ -46,15 +198,84 @@ LUAFLAC_PRIVATE
 FLAC__int64
 luaflac_toint64(lua_State *L, int idx);
 
-/* this will copy data in, need to call FLAC__metadata_object_delete when done with metadata */
+/* this will copy data in, need to call luaflac_streammetadata_delete when done with metadata.
+ * if anchor is non-zero, picture data is referenced instead of copied and the
+ * Lua string is appended to the table at anchor, which must outlive the metadata */
 LUAFLAC_PRIVATE
 FLAC__StreamMetadata *
-luaflac_toflac_streammetadata(lua_State *L, int idx);
+luaflac_toflac_streammetadata(lua_State *L, int idx, int anchor);
+
+/* borrowed should match whether luaflac_toflac_streammetadata used an anchor */
+LUAFLAC_PRIVATE
+void
+luaflac_streammetadata_delete(FLAC__StreamMetadata *m, int borrowed);
 
 LUAFLAC_PRIVATE
 int
 luaflac_no_ogg(lua_State *L);
 
+/* 64-bit safe fseek to an absolute offset, returns 0 on success */
+LUAFLAC_PRIVATE
+int
+luaflac_fseek(FILE *f, FLAC__uint64 offset);
+
+/* 64-bit safe ftell, returns 0 on success */
+LUAFLAC_PRIVATE
+int
+luaflac_ftell(FILE *f, FLAC__uint64 *offset);
+
+/* size of the file in bytes, returns 0 on success. Leaves the position at the end */
+LUAFLAC_PRIVATE
+int
+luaflac_fsize(FILE *f, FLAC__uint64 *size);
+
+/* flushes the file and cuts it off at size, returns 0 on success */
+LUAFLAC_PRIVATE
+int
+luaflac_ftruncate(FILE *f, FLAC__uint64 size);
+
+/* packed PCM: interleaved, little-endian signed samples of width bytes
+ * each, the layout decode_range and process_packed use */
+LUAFLAC_PRIVATE
+void
+luaflac_pcm_unpack(const unsigned char *b, unsigned int width, FLAC__int32 *out, size_t n);
+
+LUAFLAC_PRIVATE
+void
+luaflac_pcm_pack(unsigned char *b, unsigned int width, const FLAC__int32 *in, size_t n);
+
+/* converts count samples per channel of bits-bit audio to interleaved,
+ * little-endian float32 with full scale at +/-1.0 */
+LUAFLAC_PRIVATE
+void
+luaflac_pcm_float(unsigned char *b, unsigned int bits, const FLAC__int32 *const buffer[], unsigned int channels, size_t count);
+
+/* converts n little-endian float32 samples, full scale at +/-1.0, to
+ * bits-bit integers. With a dither state, TPDF dither of +/-1 LSB is
+ * added first. Returns the number of samples that were clipped */
+LUAFLAC_PRIVATE
+size_t
+luaflac_pcm_quantize(const unsigned char *b, unsigned int bits, FLAC__int32 *out, size_t n, FLAC__uint32 *dither);
+
+/* the same, from n doubles already scaled to units of 1 LSB */
+LUAFLAC_PRIVATE
+size_t
+luaflac_pcm_round(const double *in, unsigned int bits, FLAC__int32 *out, size_t n, FLAC__uint32 *dither);
+
+/* any non-zero starting point for a dither state */
+#define LUAFLAC_PCM_SEED 0x2545f491
+
+/* reads the dither and seed keys of an options table at idx, if there is
+ * one. seed restarts *state, returns state when dithering or NULL */
+LUAFLAC_PRIVATE
+FLAC__uint32 *
+luaflac_pcm_dither_options(lua_State *L, int idx, FLAC__uint32 *state);
+
+/* accepts a filename or Lua file handle, owned is set when the caller needs to fclose */
+LUAFLAC_PRIVATE
+FILE *
+luaflac_checkfile(lua_State *L, int idx, const char *mode, int *owned);
+
 LUAFLAC_PRIVATE
 extern const char * const luaflac_uint64_mt;
 
@@ -64,6 +285,317 @@ extern const char * const luaflac_int64_mt;
 LUAFLAC_PRIVATE
 extern const char * const luaflac_metadata_mt;
 
+LUAFLAC_PRIVATE
+extern const char * const luaflac_vorbis_comment_mt;
+
+LUAFLAC_PRIVATE
+extern const char * const luaflac_seektable_mt;
+
+LUAFLAC_PRIVATE
+extern const char * const luaflac_frame_index_mt;
+
+/* pushes an empty frame index userdata */
+LUAFLAC_PRIVATE
+luaflac_frame_index *
+luaflac_frame_index_push_new(lua_State *L);
+
+LUAFLAC_PRIVATE
+luaflac_frame_index *
+luaflac_frame_index_check(lua_State *L, int idx);
+
+/* returns 0 when out of memory */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_index_append(luaflac_frame_index *index, const luaflac_frame *frame);
+
+/* sets i to the (0-based) frame holding sample, returns 0 if there's none */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_index_find(const luaflac_frame_index *index, FLAC__uint64 sample, size_t *i);
+
+/* pushes a packed seektable userdata with a copy of m's points */
+LUAFLAC_PRIVATE
+void
+luaflac_pushseektable(lua_State *L, const FLAC__StreamMetadata *m);
+
+/* copies the points of the seektable userdata at idx into dest, returns 0 on error */
+LUAFLAC_PRIVATE
+int
+luaflac_seektable_copy(lua_State *L, int idx, FLAC__StreamMetadata *dest);
+
+/* builds a VORBIS_COMMENT block from a flac.vorbis_comment userdata */
+LUAFLAC_PRIVATE
+FLAC__StreamMetadata *
+luaflac_vorbis_comment_toflac(lua_State *L, int idx);
+
+/* native stream parsing, see luaflac_parse.c */
+
+/* finds the fLaC marker (skipping any ID3v2 tags), returns 0 if this isn't a FLAC file */
+LUAFLAC_PRIVATE
+int
+luaflac_parse_stream_start(FILE *f, FLAC__uint64 *marker_offset);
+
+LUAFLAC_PRIVATE
+int
+luaflac_parse_block_header(FILE *f, FLAC__uint64 offset, luaflac_block_header *h);
+
+/* replaces a Vorbis comment entry (or vendor string) with a NUL-terminated
+ * copy of data, without libFLAC's UTF-8 and '=' checks. The caller updates
+ * the block's length. Returns 0 when out of memory */
+LUAFLAC_PRIVATE
+int
+luaflac_vorbiscomment_entry_set(FLAC__StreamMetadata_VorbisComment_Entry *entry,
+  const FLAC__byte *data, FLAC__uint32 length);
+
+/* returns a new metadata object, or NULL on error. With LUAFLAC_PARSE_PICTURE_NODATA
+ * a picture's data is not read: data is NULL and only data_length is set */
+LUAFLAC_PRIVATE
+FLAC__StreamMetadata *
+luaflac_parse_block(FILE *f, const luaflac_block_header *h, int flags);
+
+/* reads every block whose type is set in want (an array indexed by type),
+ * stopping early once the blocks that can only appear once have been found.
+ * want is modified. Returns 0 on error, free the list with luaflac_parsed_free */
+LUAFLAC_PRIVATE
+int
+luaflac_parse_metadata(FILE *f, unsigned char *want, int flags,
+  luaflac_parsed_block **blocks, unsigned int *num_blocks);
+
+LUAFLAC_PRIVATE
+void
+luaflac_parsed_free(luaflac_parsed_block *blocks, unsigned int num_blocks);
+
+/* writes the FLAC__STREAM_METADATA_STREAMINFO_LENGTH bytes of a STREAMINFO block */
+LUAFLAC_PRIVATE
+void
+luaflac_pack_streaminfo(FLAC__byte *b, const FLAC__StreamMetadata_StreamInfo *s);
+
+/* pushes a block from luaflac_parse_metadata, pictures without data get a data_offset.
+ * flags are LUAFLAC_PUSH_* flags */
+LUAFLAC_PRIVATE
+void
+luaflac_push_parsed_block(lua_State *L, const luaflac_parsed_block *b, int flags);
+
+/* native frame parsing, see luaflac_frame.c */
+
+LUAFLAC_PRIVATE
+FLAC__uint8
+luaflac_crc8(const FLAC__byte *data, size_t len);
+
+LUAFLAC_PRIVATE
+FLAC__uint16
+luaflac_crc16_update(FLAC__uint16 crc, const FLAC__byte *data, size_t len);
+
+/* parses and CRC-checks the frame header at b, streaminfo may be NULL.
+ * returns 0 if there's no valid header there */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_header_parse(const FLAC__byte *b, size_t len,
+  const FLAC__StreamMetadata_StreamInfo *streaminfo, luaflac_frame_header *h);
+
+/* reads the metadata and positions the reader at the first frame,
+ * returns 0 on error. Always call luaflac_frame_reader_free */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_reader_init(luaflac_frame_reader *r, FILE *f);
+
+/* continues reading at an absolute offset, returns 0 on error */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_reader_seek(luaflac_frame_reader *r, FLAC__uint64 offset);
+
+/* finds the next frame without decoding it. Returns 1 with a frame,
+ * 0 at the end of the stream and -1 on a read error */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_reader_next(luaflac_frame_reader *r, luaflac_frame *frame);
+
+/* finds the last frame in the stream by reading backwards from the end of
+ * the file, without walking the frames before it. Returns like
+ * luaflac_frame_reader_next, afterwards the reader is at the end */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_reader_last(luaflac_frame_reader *r, luaflac_frame *frame);
+
+/* how many byte ranges to split the audio between audio and size into for
+ * up to threads threads, without any being smaller than 4MiB */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_regions(FLAC__uint64 audio, FLAC__uint64 size, lua_Integer threads);
+
+/* range i of n. A reader seeked to start confirms the first frame it finds,
+ * so walking from start up to the first frame at or past end covers every
+ * frame once with the neighbouring ranges */
+LUAFLAC_PRIVATE
+void
+luaflac_frame_region(FLAC__uint64 audio, FLAC__uint64 size, int n, int i,
+  FLAC__uint64 *start, FLAC__uint64 *end);
+
+/* checks the CRC-16 at the end of a frame from luaflac_frame_reader_next */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_check_crc(const luaflac_frame *frame);
+
+/* copies the frame at data (with header h) into out under a new frame or
+ * sample number, rebuilding the header and recomputing both CRCs. out needs
+ * size + LUAFLAC_FRAME_RENUMBER_GROWTH bytes, returns the new size */
+LUAFLAC_PRIVATE
+size_t
+luaflac_frame_renumber(const FLAC__byte *data, size_t size, const luaflac_frame_header *h,
+  int variable, FLAC__uint64 number, FLAC__byte *out);
+
+/* memory-fed frame decoder, see luaflac_frame_decoder.c. Set keep and md5
+ * before init, always call luaflac_frame_decoder_free */
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_decoder_init(luaflac_frame_decoder *d, const FLAC__StreamMetadata_StreamInfo *streaminfo);
+
+/* decodes exactly one frame, returns 0 on error */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_decoder_run(luaflac_frame_decoder *d, const FLAC__byte *data, size_t len);
+
+LUAFLAC_PRIVATE
+void
+luaflac_frame_decoder_free(luaflac_frame_decoder *d);
+
+LUAFLAC_PRIVATE
+void
+luaflac_frame_reader_free(luaflac_frame_reader *r);
+
+/* decoded frame cache, see luaflac_frame_cache.c */
+
+LUAFLAC_PRIVATE
+luaflac_frame_cache *
+luaflac_frame_cache_new(size_t limit);
+
+LUAFLAC_PRIVATE
+void
+luaflac_frame_cache_clear(luaflac_frame_cache *c);
+
+LUAFLAC_PRIVATE
+void
+luaflac_frame_cache_free(luaflac_frame_cache *c);
+
+/* the cached frame holding sample, or NULL. Counts a hit or a miss */
+LUAFLAC_PRIVATE
+luaflac_frame_cache_entry *
+luaflac_frame_cache_find(luaflac_frame_cache *c, FLAC__uint64 sample);
+
+/* copies a whole decoded frame starting at sample into the cache, evicting
+ * older frames to stay under the limit. Returns 0 when out of memory */
+LUAFLAC_PRIVATE
+int
+luaflac_frame_cache_insert(luaflac_frame_cache *c, const FLAC__Frame *frame,
+  const FLAC__int32 * const buffer[], FLAC__uint64 sample);
+
+/* MD5, see luaflac_md5.c */
+
+LUAFLAC_PRIVATE
+void
+luaflac_md5_init(luaflac_md5 *m);
+
+LUAFLAC_PRIVATE
+void
+luaflac_md5_update(luaflac_md5 *m, const FLAC__byte *data, size_t len);
+
+/* adds samples the way STREAMINFO's MD5 signature covers them */
+LUAFLAC_PRIVATE
+void
+luaflac_md5_update_samples(luaflac_md5 *m, const FLAC__int32 *const buffer[],
+  unsigned int channels, unsigned int samples, unsigned int bits_per_sample);
+
+LUAFLAC_PRIVATE
+void
+luaflac_md5_final(luaflac_md5 *m, FLAC__byte digest[16]);
+
+/* the libFLAC encoder inside a FLAC__StreamEncoder userdata,
+ * or NULL if the value at idx isn't one */
+LUAFLAC_PRIVATE
+FLAC__StreamEncoder *
+luaflac_stream_encoder_test(lua_State *L, int idx);
+
+/* a flac.wav_writer userdata, or NULL if the value at idx isn't one */
+LUAFLAC_PRIVATE
+luaflac_wav_writer *
+luaflac_wav_writer_test(lua_State *L, int idx);
+
+/* writes count samples of planar audio, returns an error message or NULL */
+LUAFLAC_PRIVATE
+const char *
+luaflac_wav_writer_write(luaflac_wav_writer *w, const FLAC__int32 *const buffer[],
+  unsigned int channels, unsigned int bits_per_sample, unsigned int count);
+
+LUAFLAC_PRIVATE
+FLAC__StreamEncoder *
+luaflac_stream_encoder_get(void *userdata);
+
+LUAFLAC_PRIVATE
+extern const char * const luaflac_pcm_buffer_mt;
+
+/* pushes a new buffer, raises an error when out of memory */
+LUAFLAC_PRIVATE
+luaflac_pcm_buffer *
+luaflac_pcm_buffer_push(lua_State *L, int format, unsigned int bits_per_sample,
+  unsigned int channels, size_t frames);
+
+/* changes the shape of a buffer, leaving its samples undefined. Returns 0
+ * when out of memory */
+LUAFLAC_PRIVATE
+int
+luaflac_pcm_buffer_resize(luaflac_pcm_buffer *b, unsigned int channels, size_t frames);
+
+/* a flac.pcm_buffer userdata, or NULL if the value at idx isn't one */
+LUAFLAC_PRIVATE
+luaflac_pcm_buffer *
+luaflac_pcm_buffer_test(lua_State *L, int idx);
+
+/* converts a buffer to bits-bit integers in out[channel], returns the
+ * number of samples clipped */
+LUAFLAC_PRIVATE
+size_t
+luaflac_pcm_buffer_to_int(const luaflac_pcm_buffer *b, unsigned int bits,
+  FLAC__int32 *const out[], FLAC__uint32 *dither);
+
+LUAFLAC_PRIVATE
+extern const char * const luaflac_loudness_mt;
+
+/* a flac.loudness userdata, or NULL if the value at idx isn't one */
+LUAFLAC_PRIVATE
+luaflac_loudness *
+luaflac_loudness_test(lua_State *L, int idx);
+
+/* analyzes count samples per channel, returns an error message or NULL */
+LUAFLAC_PRIVATE
+const char *
+luaflac_loudness_add(luaflac_loudness *l, const FLAC__int32 *const buffer[],
+  unsigned int channels, unsigned int bits_per_sample, unsigned int sample_rate, size_t count);
+
+LUAFLAC_PRIVATE
+extern const char * const luaflac_waveform_mt;
+
+/* a flac.waveform userdata, or NULL if the value at idx isn't one */
+LUAFLAC_PRIVATE
+luaflac_waveform *
+luaflac_waveform_test(lua_State *L, int idx);
+
+/* starts over on length samples per channel, returns an error message or NULL */
+LUAFLAC_PRIVATE
+const char *
+luaflac_waveform_start(luaflac_waveform *w, FLAC__uint64 length);
+
+/* summarizes the next count samples per channel, returns an error message or NULL */
+LUAFLAC_PRIVATE
+const char *
+luaflac_waveform_add(luaflac_waveform *w, const FLAC__int32 *const buffer[],
+  unsigned int channels, unsigned int bits_per_sample, size_t count);
+
+/* writes out the last bucket of each level, returns an error message or NULL */
+LUAFLAC_PRIVATE
+const char *
+luaflac_waveform_finish(luaflac_waveform *w);
+
 #if !defined(luaL_newlibtable) \
   && (!defined LUA_VERSION_NUM || LUA_VERSION_NUM==501)
 LUAFLAC_PRIVATE
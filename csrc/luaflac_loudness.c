@@ -0,0 +1,885 @@
+#include "luaflac_internal.h"
+#include "luaflac_thread.h"
+#include <FLAC/stream_decoder.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* flac.loudness - ITU-R BS.1770-4 / EBU R128 integrated loudness,
+ * loudness range (EBU Tech 3342), sample peak and true peak, the
+ * measurements ReplayGain 2.0 is built on.
+ *
+ * Samples are K-weighted by two biquads and their weighted mean square is
+ * summed per 100ms. The energy of every 400ms gating block (overlapping by
+ * 300ms) and every 3s short-term block is kept, so the gates are applied
+ * exactly when a result is asked for, and an album is every track's
+ * blocks put together. True peak is the largest sample after 4x
+ * oversampling (2x at 96kHz and up) with a polyphase windowed-sinc
+ * interpolator. Each stage is a loop over one channel's samples at a time.
+ *
+ * flac.loudness_files - decodes and analyzes a list of files on a pool of
+ * threads, the same way flac.verify_md5 does. */
+
+LUAFLAC_PRIVATE
+const char * const luaflac_loudness_mt = "luaflac_loudness";
+
+#define LUAFLAC_LOUDNESS_PI 3.14159265358979323846
+
+/* samples converted to doubles at a time */
+#define LUAFLAC_LOUDNESS_CHUNK 1024
+
+/* 100ms sub-blocks in a gating block and in a short-term block */
+#define LUAFLAC_LOUDNESS_GATING 4
+#define LUAFLAC_LOUDNESS_SHORT_TERM 30
+
+/* taps in each phase of the true peak interpolator, and its largest factor */
+#define LUAFLAC_LOUDNESS_TAPS 13
+#define LUAFLAC_LOUDNESS_FACTOR 4
+
+/* in LUFS and LU */
+#define LUAFLAC_LOUDNESS_ABSOLUTE_GATE (-70.0)
+#define LUAFLAC_LOUDNESS_RELATIVE_GATE (-10.0)
+#define LUAFLAC_LOUDNESS_RANGE_GATE (-20.0)
+#define LUAFLAC_LOUDNESS_REFERENCE (-18.0)
+
+struct luaflac_loudness_s {
+    int true_peak; /* measure true peak */
+    double reference; /* ReplayGain reference loudness, LUFS */
+    double weight_options[FLAC__MAX_CHANNELS]; /* negative for the default */
+
+    /* set up on the first samples, and again when the stream changes */
+    unsigned int channels;
+    unsigned int sample_rate;
+    double weights[FLAC__MAX_CHANNELS];
+    double b[2][3]; /* K-weighting, a pre-filter and a high pass */
+    double a[2][2];
+    double z[FLAC__MAX_CHANNELS][2][2]; /* transposed direct form II state */
+    unsigned int factor;
+    double interp[LUAFLAC_LOUDNESS_FACTOR][LUAFLAC_LOUDNESS_TAPS];
+    double history[FLAC__MAX_CHANNELS][LUAFLAC_LOUDNESS_TAPS - 1];
+    size_t sub_size; /* samples in 100ms */
+    size_t sub_fill;
+    double sub_sum;
+    double subs[LUAFLAC_LOUDNESS_SHORT_TERM]; /* ring of the latest sub-block sums */
+    size_t num_subs;
+
+    double sample_peak;
+    double true_peak_max;
+    double *blocks; /* mean square of each gating block */
+    size_t num_blocks;
+    size_t max_blocks;
+    double *short_terms; /* mean square of each short-term block */
+    size_t num_short_terms;
+    size_t max_short_terms;
+};
+
+static void
+luaflac_loudness_init(luaflac_loudness *l) {
+    unsigned int c = 0;
+
+    memset(l,0,sizeof(luaflac_loudness));
+    l->true_peak = 1;
+    l->reference = LUAFLAC_LOUDNESS_REFERENCE;
+    for(c=0;c<FLAC__MAX_CHANNELS;c++) {
+        l->weight_options[c] = -1.0;
+    }
+}
+
+static void
+luaflac_loudness_free(luaflac_loudness *l) {
+    free(l->blocks);
+    free(l->short_terms);
+    l->blocks = NULL;
+    l->short_terms = NULL;
+}
+
+/* BS.1770 weights for FLAC's channel orders: surround channels count
+ * +1.5dB and the LFE channel is left out */
+static double
+luaflac_loudness_weight(unsigned int channels, unsigned int c) {
+    if(channels >= 6 && c == 3) return 0.0;
+    if(channels == 4 && c >= 2) return 1.41;
+    if(channels == 5 && c >= 3) return 1.41;
+    if(channels >= 6 && c >= 4) return 1.41;
+    return 1.0;
+}
+
+static void
+luaflac_loudness_setup(luaflac_loudness *l, unsigned int channels, unsigned int sample_rate) {
+    double rate = (double)sample_rate;
+    double f0 = 0.0;
+    double q = 0.0;
+    double k = 0.0;
+    double vh = 0.0;
+    double vb = 0.0;
+    double a0 = 0.0;
+    double m = 0.0;
+    double v = 0.0;
+    unsigned int taps = 0;
+    unsigned int c = 0;
+    unsigned int j = 0;
+
+    l->channels = channels;
+    l->sample_rate = sample_rate;
+    for(c=0;c<channels;c++) {
+        l->weights[c] = l->weight_options[c] >= 0.0 ?
+          l->weight_options[c] : luaflac_loudness_weight(channels,c);
+    }
+
+    /* the BS.1770 filters are given at 48kHz, these are the analog
+     * prototypes they come from, re-done for the stream's rate */
+    f0 = 1681.974450955533;
+    q = 0.7071752369554196;
+    k = tan(LUAFLAC_LOUDNESS_PI * f0 / rate);
+    vh = pow(10.0,3.999843853973347 / 20.0);
+    vb = pow(vh,0.4996667741545416);
+    a0 = 1.0 + k / q + k * k;
+    l->b[0][0] = (vh + vb * k / q + k * k) / a0;
+    l->b[0][1] = 2.0 * (k * k - vh) / a0;
+    l->b[0][2] = (vh - vb * k / q + k * k) / a0;
+    l->a[0][0] = 2.0 * (k * k - 1.0) / a0;
+    l->a[0][1] = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(LUAFLAC_LOUDNESS_PI * f0 / rate);
+    a0 = 1.0 + k / q + k * k;
+    l->b[1][0] = 1.0;
+    l->b[1][1] = -2.0;
+    l->b[1][2] = 1.0;
+    l->a[1][0] = 2.0 * (k * k - 1.0) / a0;
+    l->a[1][1] = (1.0 - k / q + k * k) / a0;
+
+    /* phase p of the interpolator holds taps p, p + factor, p + 2 * factor... */
+    l->factor = sample_rate < 96000 ? 4 : sample_rate < 192000 ? 2 : 1;
+    taps = (LUAFLAC_LOUDNESS_TAPS - 1) * l->factor + 1;
+    memset(l->interp,0,sizeof(l->interp));
+    for(j=0;j<taps;j++) {
+        m = (double)j - (double)(taps - 1) / 2.0;
+        v = 1.0;
+        if(fabs(m) > 1e-9) {
+            v = sin(m * LUAFLAC_LOUDNESS_PI / l->factor) / (m * LUAFLAC_LOUDNESS_PI / l->factor);
+        }
+        v *= 0.5 * (1.0 - cos(2.0 * LUAFLAC_LOUDNESS_PI * j / (taps - 1)));
+        l->interp[j % l->factor][j / l->factor] = v;
+    }
+
+    memset(l->z,0,sizeof(l->z));
+    memset(l->history,0,sizeof(l->history));
+    l->sub_size = (sample_rate + 5) / 10;
+    l->sub_fill = 0;
+    l->sub_sum = 0.0;
+    l->num_subs = 0;
+}
+
+static int
+luaflac_loudness_append(double **list, size_t *num, size_t *max, double v) {
+    double *tmp = NULL;
+    size_t size = 0;
+
+    if(*num == *max) {
+        size = *max ? *max * 2 : 256;
+        tmp = realloc(*list,sizeof(double) * size);
+        if(tmp == NULL) return 0;
+        *list = tmp;
+        *max = size;
+    }
+    (*list)[(*num)++] = v;
+    return 1;
+}
+
+/* the latest n sub-blocks as a mean square */
+static double
+luaflac_loudness_recent(const luaflac_loudness *l, size_t n) {
+    double sum = 0.0;
+    size_t i = 0;
+
+    for(i=0;i<n;i++) {
+        sum += l->subs[(l->num_subs - 1 - i) % LUAFLAC_LOUDNESS_SHORT_TERM];
+    }
+    return sum / (double)(n * l->sub_size);
+}
+
+static int
+luaflac_loudness_sub_block(luaflac_loudness *l) {
+    l->subs[l->num_subs % LUAFLAC_LOUDNESS_SHORT_TERM] = l->sub_sum;
+    l->num_subs++;
+    l->sub_sum = 0.0;
+    l->sub_fill = 0;
+
+    if(l->num_subs >= LUAFLAC_LOUDNESS_GATING &&
+       !luaflac_loudness_append(&l->blocks,&l->num_blocks,&l->max_blocks,
+         luaflac_loudness_recent(l,LUAFLAC_LOUDNESS_GATING))) {
+        return 0;
+    }
+    if(l->num_subs >= LUAFLAC_LOUDNESS_SHORT_TERM &&
+       !luaflac_loudness_append(&l->short_terms,&l->num_short_terms,&l->max_short_terms,
+         luaflac_loudness_recent(l,LUAFLAC_LOUDNESS_SHORT_TERM))) {
+        return 0;
+    }
+    return 1;
+}
+
+/* x holds the channel's last LUAFLAC_LOUDNESS_TAPS - 1 samples followed
+ * by n new ones */
+static void
+luaflac_loudness_channel(luaflac_loudness *l, unsigned int c, const double *x, size_t n) {
+    const double *in = x + LUAFLAC_LOUDNESS_TAPS - 1;
+    double peak = l->sample_peak;
+    double sum = 0.0;
+    double y = 0.0;
+    double v = 0.0;
+    double z00 = l->z[c][0][0];
+    double z01 = l->z[c][0][1];
+    double z10 = l->z[c][1][0];
+    double z11 = l->z[c][1][1];
+    unsigned int p = 0;
+    unsigned int j = 0;
+    size_t i = 0;
+
+    for(i=0;i<n;i++) {
+        v = fabs(in[i]);
+        if(v > peak) peak = v;
+    }
+    l->sample_peak = peak;
+
+    if(l->true_peak && l->factor > 1) {
+        peak = l->true_peak_max;
+        for(p=0;p<l->factor;p++) {
+            for(i=0;i<n;i++) {
+                y = 0.0;
+                for(j=0;j<LUAFLAC_LOUDNESS_TAPS;j++) {
+                    y += l->interp[p][j] * x[i + LUAFLAC_LOUDNESS_TAPS - 1 - j];
+                }
+                v = fabs(y);
+                if(v > peak) peak = v;
+            }
+        }
+        l->true_peak_max = peak;
+        memcpy(l->history[c],in + n - (LUAFLAC_LOUDNESS_TAPS - 1),
+          sizeof(double) * (LUAFLAC_LOUDNESS_TAPS - 1));
+    }
+
+    if(l->weights[c] == 0.0) return;
+    for(i=0;i<n;i++) {
+        v = in[i];
+        y = l->b[0][0] * v + z00;
+        z00 = l->b[0][1] * v - l->a[0][0] * y + z01;
+        z01 = l->b[0][2] * v - l->a[0][1] * y;
+        v = y;
+        y = l->b[1][0] * v + z10;
+        z10 = l->b[1][1] * v - l->a[1][0] * y + z11;
+        z11 = l->b[1][2] * v - l->a[1][1] * y;
+        sum += y * y;
+    }
+    /* flush denormals left by a fade to silence */
+    l->z[c][0][0] = fabs(z00) < 1e-30 ? 0.0 : z00;
+    l->z[c][0][1] = fabs(z01) < 1e-30 ? 0.0 : z01;
+    l->z[c][1][0] = fabs(z10) < 1e-30 ? 0.0 : z10;
+    l->z[c][1][1] = fabs(z11) < 1e-30 ? 0.0 : z11;
+    l->sub_sum += l->weights[c] * sum;
+}
+
+static const char *
+luaflac_loudness_run(luaflac_loudness *l, const void *const buffer[], int format,
+  unsigned int channels, unsigned int bits_per_sample, unsigned int sample_rate, size_t count) {
+    double x[LUAFLAC_LOUDNESS_TAPS - 1 + LUAFLAC_LOUDNESS_CHUNK];
+    double *to = x + LUAFLAC_LOUDNESS_TAPS - 1;
+    const FLAC__int32 *in = NULL;
+    const float *f = NULL;
+    double scale = 1.0;
+    unsigned int c = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+
+    if(sample_rate == 0) return "unknown sample rate";
+    if(channels == 0 || channels > FLAC__MAX_CHANNELS) return "invalid number of channels";
+    if(channels != l->channels || sample_rate != l->sample_rate) {
+        luaflac_loudness_setup(l,channels,sample_rate);
+    }
+    if(format == LUAFLAC_PCM_INT32) {
+        scale = 1.0 / (double)((FLAC__uint64)1 << (bits_per_sample - 1));
+    }
+
+    while(i < count) {
+        n = count - i;
+        if(n > LUAFLAC_LOUDNESS_CHUNK) n = LUAFLAC_LOUDNESS_CHUNK;
+        if(n > l->sub_size - l->sub_fill) n = l->sub_size - l->sub_fill;
+        for(c=0;c<channels;c++) {
+            memcpy(x,l->history[c],sizeof(l->history[c]));
+            if(format == LUAFLAC_PCM_FLOAT32) {
+                f = (const float *)buffer[c] + i;
+                for(j=0;j<n;j++) to[j] = f[j];
+            } else {
+                in = (const FLAC__int32 *)buffer[c] + i;
+                for(j=0;j<n;j++) to[j] = in[j] * scale;
+            }
+            luaflac_loudness_channel(l,c,x,n);
+        }
+        i += n;
+        l->sub_fill += n;
+        if(l->sub_fill == l->sub_size && !luaflac_loudness_sub_block(l)) {
+            return "out of memory";
+        }
+    }
+    return NULL;
+}
+
+LUAFLAC_PRIVATE
+const char *
+luaflac_loudness_add(luaflac_loudness *l, const FLAC__int32 *const buffer[],
+  unsigned int channels, unsigned int bits_per_sample, unsigned int sample_rate, size_t count) {
+    return luaflac_loudness_run(l,(const void *const *)buffer,LUAFLAC_PCM_INT32,
+      channels,bits_per_sample,sample_rate,count);
+}
+
+static int
+luaflac_loudness_merge(luaflac_loudness *l, const luaflac_loudness *from) {
+    /* from can be l */
+    size_t num_blocks = from->num_blocks;
+    size_t num_short_terms = from->num_short_terms;
+    size_t i = 0;
+
+    for(i=0;i<num_blocks;i++) {
+        if(!luaflac_loudness_append(&l->blocks,&l->num_blocks,&l->max_blocks,from->blocks[i])) return 0;
+    }
+    for(i=0;i<num_short_terms;i++) {
+        if(!luaflac_loudness_append(&l->short_terms,&l->num_short_terms,&l->max_short_terms,
+          from->short_terms[i])) return 0;
+    }
+    if(from->sample_peak > l->sample_peak) l->sample_peak = from->sample_peak;
+    if(from->true_peak_max > l->true_peak_max) l->true_peak_max = from->true_peak_max;
+    return 1;
+}
+
+static double
+luaflac_loudness_energy(double lufs) {
+    return pow(10.0,(lufs + 0.691) / 10.0);
+}
+
+static double
+luaflac_loudness_lufs(double energy) {
+    return -0.691 + 10.0 * log10(energy);
+}
+
+/* the blocks passing the absolute gate and a second gate relative LU
+ * below their mean, moved to the front of e. Returns how many there are */
+static size_t
+luaflac_loudness_gate(double *e, size_t n, double relative) {
+    double gate = luaflac_loudness_energy(LUAFLAC_LOUDNESS_ABSOLUTE_GATE);
+    double sum = 0.0;
+    size_t count = 0;
+    size_t i = 0;
+
+    for(i=0;i<n;i++) {
+        if(e[i] >= gate) {
+            sum += e[i];
+            e[count++] = e[i];
+        }
+    }
+    if(count == 0) return 0;
+
+    gate = sum / (double)count * pow(10.0,relative / 10.0);
+    n = count;
+    count = 0;
+    for(i=0;i<n;i++) {
+        if(e[i] >= gate) e[count++] = e[i];
+    }
+    return count;
+}
+
+static int
+luaflac_loudness_compare(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* integrated loudness (-HUGE_VAL for silence) and loudness range,
+ * returns 0 when out of memory */
+static int
+luaflac_loudness_measure(const luaflac_loudness *l, double *integrated, double *range) {
+    size_t n = l->num_blocks > l->num_short_terms ? l->num_blocks : l->num_short_terms;
+    double *e = malloc(sizeof(double) * (n ? n : 1));
+    double sum = 0.0;
+    size_t count = 0;
+    size_t i = 0;
+
+    if(e == NULL) return 0;
+
+    memcpy(e,l->blocks,sizeof(double) * l->num_blocks);
+    count = luaflac_loudness_gate(e,l->num_blocks,LUAFLAC_LOUDNESS_RELATIVE_GATE);
+    for(i=0;i<count;i++) {
+        sum += e[i];
+    }
+    *integrated = count ? luaflac_loudness_lufs(sum / (double)count) : -HUGE_VAL;
+
+    memcpy(e,l->short_terms,sizeof(double) * l->num_short_terms);
+    count = luaflac_loudness_gate(e,l->num_short_terms,LUAFLAC_LOUDNESS_RANGE_GATE);
+    *range = 0.0;
+    if(count > 0) {
+        qsort(e,count,sizeof(double),luaflac_loudness_compare);
+        *range = luaflac_loudness_lufs(e[(size_t)((double)(count - 1) * 0.95 + 0.5)]) -
+          luaflac_loudness_lufs(e[(size_t)((double)(count - 1) * 0.10 + 0.5)]);
+    }
+
+    free(e);
+    return 1;
+}
+
+/* returns 0 when out of memory, with nothing pushed */
+static int
+luaflac_loudness_push_result(lua_State *L, const luaflac_loudness *l) {
+    double integrated = 0.0;
+    double range = 0.0;
+
+    if(!luaflac_loudness_measure(l,&integrated,&range)) return 0;
+
+    lua_createtable(L,0,6);
+    lua_pushnumber(L,integrated);
+    lua_setfield(L,-2,"integrated");
+    lua_pushnumber(L,range);
+    lua_setfield(L,-2,"range");
+    lua_pushnumber(L,l->sample_peak);
+    lua_setfield(L,-2,"sample_peak");
+    if(l->true_peak) {
+        /* below 96kHz, the oversampled peak can't be lower than the samples' */
+        lua_pushnumber(L,l->true_peak_max > l->sample_peak ? l->true_peak_max : l->sample_peak);
+        lua_setfield(L,-2,"true_peak");
+    }
+    if(integrated > -HUGE_VAL) {
+        lua_pushnumber(L,l->reference - integrated);
+        lua_setfield(L,-2,"gain");
+    }
+    lua_pushnumber(L,l->reference);
+    lua_setfield(L,-2,"reference");
+    return 1;
+}
+
+/* reads true_peak, reference and weights from the options table at idx */
+static void
+luaflac_loudness_options(lua_State *L, int idx, luaflac_loudness *l) {
+    unsigned int c = 0;
+
+    lua_getfield(L,idx,"true_peak");
+    if(!lua_isnil(L,-1)) l->true_peak = lua_toboolean(L,-1);
+    lua_pop(L,1);
+
+    lua_getfield(L,idx,"reference");
+    l->reference = luaL_optnumber(L,-1,l->reference);
+    lua_pop(L,1);
+
+    lua_getfield(L,idx,"weights");
+    if(lua_istable(L,-1)) {
+        for(c=0;c<FLAC__MAX_CHANNELS;c++) {
+            lua_rawgeti(L,-1,c+1);
+            if(!lua_isnil(L,-1)) {
+                l->weight_options[c] = luaL_checknumber(L,-1);
+                if(l->weight_options[c] < 0.0) {
+                    luaL_error(L,"channel weights can't be negative");
+                }
+            }
+            lua_pop(L,1);
+        }
+    }
+    lua_pop(L,1);
+}
+
+typedef struct luaflac_loudness_userdata_s {
+    luaflac_loudness l;
+    unsigned int sample_rate; /* for buffers, 0 if not given */
+} luaflac_loudness_userdata;
+
+LUAFLAC_PRIVATE
+luaflac_loudness *
+luaflac_loudness_test(lua_State *L, int idx) {
+    luaflac_loudness_userdata *u = luaL_testudata(L,idx,luaflac_loudness_mt);
+    return u == NULL ? NULL : &u->l;
+}
+
+static int
+luaflac_loudness_new(lua_State *L) {
+    luaflac_loudness_userdata *u = NULL;
+    luaflac_loudness l;
+    unsigned int sample_rate = 0;
+
+    luaflac_loudness_init(&l);
+    if(!lua_isnoneornil(L,1)) {
+        luaL_checktype(L,1,LUA_TTABLE);
+        luaflac_loudness_options(L,1,&l);
+        lua_getfield(L,1,"sample_rate");
+        sample_rate = (unsigned int)luaL_optinteger(L,-1,0);
+        lua_pop(L,1);
+    }
+
+    u = (luaflac_loudness_userdata *)lua_newuserdata(L,sizeof(luaflac_loudness_userdata));
+    u->l = l;
+    u->sample_rate = sample_rate;
+    luaL_setmetatable(L,luaflac_loudness_mt);
+    return 1;
+}
+
+static int
+luaflac_loudness_gc(lua_State *L) {
+    luaflac_loudness_userdata *u = (luaflac_loudness_userdata *)luaL_checkudata(L,1,luaflac_loudness_mt);
+    luaflac_loudness_free(&u->l);
+    return 0;
+}
+
+static int
+luaflac_loudness_add_buffer(lua_State *L) {
+    luaflac_loudness_userdata *u = (luaflac_loudness_userdata *)luaL_checkudata(L,1,luaflac_loudness_mt);
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_test(L,2);
+    unsigned int sample_rate = (unsigned int)luaL_optinteger(L,3,u->sample_rate);
+    const char *error = NULL;
+
+    if(b == NULL) {
+        return luaL_argerror(L,2,"pcm_buffer expected");
+    }
+    u->sample_rate = sample_rate;
+    error = luaflac_loudness_run(&u->l,(const void *const *)b->planar,b->format,
+      b->channels,b->bits_per_sample,sample_rate,b->frames);
+    if(error != NULL) {
+        return luaL_error(L,"%s",error);
+    }
+    lua_settop(L,1);
+    return 1;
+}
+
+static int
+luaflac_loudness_merge_method(lua_State *L) {
+    luaflac_loudness_userdata *u = (luaflac_loudness_userdata *)luaL_checkudata(L,1,luaflac_loudness_mt);
+    luaflac_loudness_userdata *from = (luaflac_loudness_userdata *)luaL_checkudata(L,2,luaflac_loudness_mt);
+
+    if(!luaflac_loudness_merge(&u->l,&from->l)) {
+        return luaL_error(L,"out of memory");
+    }
+    lua_settop(L,1);
+    return 1;
+}
+
+static int
+luaflac_loudness_result(lua_State *L) {
+    luaflac_loudness_userdata *u = (luaflac_loudness_userdata *)luaL_checkudata(L,1,luaflac_loudness_mt);
+
+    if(!luaflac_loudness_push_result(L,&u->l)) {
+        return luaL_error(L,"out of memory");
+    }
+    return 1;
+}
+
+struct luaflac_loudness_file_s {
+    const char *path;
+    luaflac_loudness l;
+    unsigned int sample_rate; /* from STREAMINFO */
+    FLAC__uint64 samples; /* decoded */
+    double seconds;
+    const char *error;
+};
+
+typedef struct luaflac_loudness_file_s luaflac_loudness_file;
+
+struct luaflac_loudness_batch_s {
+    luaflac_mutex lock;
+    luaflac_loudness_file *files;
+    size_t num_files;
+    size_t next;
+};
+
+typedef struct luaflac_loudness_batch_s luaflac_loudness_batch;
+
+static FLAC__StreamDecoderWriteStatus
+luaflac_loudness_write(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data) {
+    luaflac_loudness_file *v = (luaflac_loudness_file *)client_data;
+    (void)decoder;
+
+    v->samples += frame->header.blocksize;
+    v->error = luaflac_loudness_add(&v->l,buffer,frame->header.channels,
+      frame->header.bits_per_sample,frame->header.sample_rate,frame->header.blocksize);
+    return v->error == NULL ? FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE :
+      FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+}
+
+static void
+luaflac_loudness_metadata(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data) {
+    luaflac_loudness_file *v = (luaflac_loudness_file *)client_data;
+    (void)decoder;
+
+    if(metadata->type != FLAC__METADATA_TYPE_STREAMINFO) return;
+    v->sample_rate = metadata->data.stream_info.sample_rate;
+}
+
+static void
+luaflac_loudness_error(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data) {
+    luaflac_loudness_file *v = (luaflac_loudness_file *)client_data;
+    (void)decoder;
+    if(v->error == NULL) v->error = FLAC__StreamDecoderErrorStatusString[status];
+}
+
+static void
+luaflac_loudness_decode(FLAC__StreamDecoder *decoder, luaflac_loudness_file *v) {
+    FLAC__StreamDecoderInitStatus status;
+    int decoded = 0;
+    double start = luaflac_time_now();
+
+    status = FLAC__stream_decoder_init_file(decoder,v->path,
+      luaflac_loudness_write,luaflac_loudness_metadata,luaflac_loudness_error,v);
+    if(status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+        v->error = FLAC__StreamDecoderInitStatusString[status];
+        return;
+    }
+
+    decoded = FLAC__stream_decoder_process_until_end_of_stream(decoder);
+    if(!decoded && v->error == NULL) {
+        v->error = FLAC__StreamDecoderStateString[FLAC__stream_decoder_get_state(decoder)];
+    }
+    FLAC__stream_decoder_finish(decoder);
+    v->seconds = luaflac_time_now() - start;
+}
+
+static void
+luaflac_loudness_worker(void *arg) {
+    luaflac_loudness_batch *b = (luaflac_loudness_batch *)arg;
+    FLAC__StreamDecoder *decoder = FLAC__stream_decoder_new();
+    size_t index = 0;
+
+    luaflac_mutex_lock(&b->lock);
+    while(b->next < b->num_files) {
+        index = b->next++;
+        luaflac_mutex_unlock(&b->lock);
+
+        if(decoder == NULL) {
+            b->files[index].error = "out of memory";
+        } else {
+            luaflac_loudness_decode(decoder,&b->files[index]);
+        }
+
+        luaflac_mutex_lock(&b->lock);
+    }
+    luaflac_mutex_unlock(&b->lock);
+
+    if(decoder != NULL) FLAC__stream_decoder_delete(decoder);
+}
+
+static void
+luaflac_loudness_batch_free(luaflac_loudness_batch *b) {
+    size_t j = 0;
+
+    for(j=0;j<b->num_files;j++) {
+        luaflac_loudness_free(&b->files[j].l);
+    }
+    free(b->files);
+}
+
+static int
+luaflac_loudness_files(lua_State *L) {
+    luaflac_loudness_batch b;
+    luaflac_loudness options;
+    luaflac_loudness album;
+    luaflac_loudness_file *v = NULL;
+    luaflac_thread *threads = NULL;
+    lua_Integer num_threads = luaflac_thread_cpus();
+    unsigned int started = 0;
+    unsigned int i = 0;
+    size_t j = 0;
+    int ok = 1;
+
+    luaflac_loudness_init(&options);
+    luaL_checktype(L,1,LUA_TTABLE);
+    if(!lua_isnoneornil(L,2)) {
+        luaL_checktype(L,2,LUA_TTABLE);
+        lua_getfield(L,2,"threads");
+        num_threads = luaL_optinteger(L,-1,num_threads);
+        lua_pop(L,1);
+        luaflac_loudness_options(L,2,&options);
+    }
+
+    memset(&b,0,sizeof(b));
+    b.num_files = lua_rawlen(L,1);
+    if(num_threads < 1) num_threads = 1;
+    if((size_t)num_threads > b.num_files) num_threads = (lua_Integer)b.num_files;
+
+    /* paths point into the strings in the table, which is left alone until we return */
+    b.files = calloc(b.num_files ? b.num_files : 1,sizeof(luaflac_loudness_file));
+    if(b.files == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    for(j=0;j<b.num_files;j++) {
+        lua_rawgeti(L,1,j+1);
+        b.files[j].path = lua_type(L,-1) == LUA_TSTRING ? lua_tostring(L,-1) : NULL;
+        lua_pop(L,1);
+        if(b.files[j].path == NULL) {
+            free(b.files);
+            return luaL_error(L,"path %d is not a string",(int)(j+1));
+        }
+        b.files[j].l = options;
+    }
+
+    if(luaflac_mutex_init(&b.lock) != 0) {
+        free(b.files);
+        return luaL_error(L,"error creating mutex");
+    }
+
+    /* this thread works through the list too */
+    if(num_threads > 1) {
+        threads = malloc(sizeof(luaflac_thread) * (num_threads - 1));
+    }
+    if(threads != NULL) {
+        for(i=0;i<(unsigned int)num_threads-1;i++) {
+            if(luaflac_thread_create(&threads[started],luaflac_loudness_worker,&b) != 0) break;
+            started++;
+        }
+    }
+    luaflac_loudness_worker(&b);
+    for(i=0;i<started;i++) {
+        luaflac_thread_join(&threads[i]);
+    }
+    free(threads);
+    luaflac_mutex_destroy(&b.lock);
+
+    /* the album is merged in list order, so it doesn't depend on the threads */
+    album = options;
+    for(j=0;j<b.num_files && ok;j++) {
+        if(b.files[j].error == NULL) ok = luaflac_loudness_merge(&album,&b.files[j].l);
+    }
+
+    lua_createtable(L,b.num_files,0);
+    for(j=0;j<b.num_files && ok;j++) {
+        v = &b.files[j];
+        if(v->error != NULL || !(ok = luaflac_loudness_push_result(L,&v->l))) {
+            lua_createtable(L,0,4);
+        }
+        lua_pushstring(L,v->path);
+        lua_setfield(L,-2,"path");
+        lua_pushboolean(L,v->error == NULL);
+        lua_setfield(L,-2,"ok");
+        lua_pushnumber(L,v->seconds);
+        lua_setfield(L,-2,"seconds");
+        if(v->seconds > 0.0 && v->sample_rate > 0) {
+            /* times faster than realtime */
+            lua_pushnumber(L,(double)v->samples / (double)v->sample_rate / v->seconds);
+            lua_setfield(L,-2,"speed");
+        }
+        if(v->error != NULL) {
+            lua_pushstring(L,v->error);
+            lua_setfield(L,-2,"error");
+        }
+        lua_rawseti(L,-2,j+1);
+    }
+    ok = ok && luaflac_loudness_push_result(L,&album);
+    luaflac_loudness_free(&album);
+    luaflac_loudness_batch_free(&b);
+
+    if(!ok) {
+        return luaL_error(L,"out of memory");
+    }
+    return 2;
+}
+
+/* formats v with a '.' whatever LC_NUMERIC says, since tags are read back
+ * by other programs. %.0f never prints a decimal point, so the rounded value
+ * goes out as whole and fractional parts */
+static void
+luaflac_loudness_format(char *value, size_t len, double v, int decimals, const char *suffix) {
+    double scale = pow(10.0,decimals);
+    double r = 0.0;
+    double whole = 0.0;
+
+    if(!isfinite(v)) {
+        snprintf(value,len,"%f%s",v,suffix);
+        return;
+    }
+    r = floor(fabs(v) * scale + 0.5);
+    whole = floor(r / scale);
+    snprintf(value,len,"%s%.0f.%0*.0f%s",v < 0.0 && r > 0.0 ? "-" : "",
+      whole,decimals,r - whole * scale,suffix);
+}
+
+/* sets field to the value formatted from the number in table t's key,
+ * or removes it when there's no such number */
+static void
+luaflac_loudness_set_tag(lua_State *L, int tags, int t, const char *key,
+  const char *field, int decimals, const char *suffix) {
+    char value[64];
+
+    lua_getfield(L,tags,"set");
+    lua_pushvalue(L,tags);
+    lua_pushstring(L,field);
+    lua_getfield(L,t,key);
+    if(lua_type(L,-1) == LUA_TNUMBER) {
+        luaflac_loudness_format(value,sizeof(value),(double)lua_tonumber(L,-1),decimals,suffix);
+        lua_pop(L,1);
+        lua_pushstring(L,value);
+    } else {
+        lua_pop(L,1);
+        lua_pushnil(L);
+    }
+    lua_call(L,3,0);
+}
+
+static void
+luaflac_loudness_set_tags(lua_State *L, int tags, int t, const char *gain, const char *peak) {
+    luaflac_loudness_set_tag(L,tags,t,"gain",gain,2," dB");
+    lua_getfield(L,t,"true_peak");
+    luaflac_loudness_set_tag(L,tags,t,lua_isnil(L,-1) ? "sample_peak" : "true_peak",peak,6,"");
+    lua_pop(L,1);
+}
+
+static int
+luaflac_loudness_replaygain_tags(lua_State *L) {
+    luaL_checktype(L,1,LUA_TTABLE);
+    if(!lua_isnoneornil(L,2)) luaL_checktype(L,2,LUA_TTABLE);
+    lua_settop(L,3);
+
+    if(lua_isnil(L,3)) {
+        lua_getglobal(L,"require");
+        lua_pushstring(L,"luaflac.vorbis_comment");
+        lua_call(L,1,1);
+        lua_getfield(L,-1,"vorbis_comment");
+        lua_call(L,0,1);
+        lua_replace(L,3);
+        lua_settop(L,3);
+    } else if(luaL_testudata(L,3,luaflac_vorbis_comment_mt) == NULL) {
+        return luaL_argerror(L,3,"vorbis_comment expected");
+    }
+
+    luaflac_loudness_set_tags(L,3,1,"REPLAYGAIN_TRACK_GAIN","REPLAYGAIN_TRACK_PEAK");
+    if(!lua_isnil(L,2)) {
+        luaflac_loudness_set_tags(L,3,2,"REPLAYGAIN_ALBUM_GAIN","REPLAYGAIN_ALBUM_PEAK");
+    }
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_loudness_functions[] = {
+    { "loudness", luaflac_loudness_new },
+    { "loudness_files", luaflac_loudness_files },
+    { "replaygain_tags", luaflac_loudness_replaygain_tags },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaflac_loudness_methods[] = {
+    { "add", luaflac_loudness_add_buffer },
+    { "merge", luaflac_loudness_merge_method },
+    { "result", luaflac_loudness_result },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_loudness(lua_State *L) {
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_loudness_functions,0);
+
+    luaL_newmetatable(L,luaflac_loudness_mt);
+    lua_pushcclosure(L,luaflac_loudness_gc,0);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L); /* __index */
+    luaL_setfuncs(L,luaflac_loudness_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    return 1;
+}
@@ -0,0 +1,188 @@
+#include "luaflac_internal.h"
+
+#include <string.h>
+
+/* MD5 (RFC 1321), libFLAC keeps its own implementation private so
+ * STREAMINFO signatures for streams built natively are computed here */
+
+#define LUAFLAC_MD5_F(x,y,z) ((z) ^ ((x) & ((y) ^ (z))))
+#define LUAFLAC_MD5_G(x,y,z) ((y) ^ ((z) & ((x) ^ (y))))
+#define LUAFLAC_MD5_H(x,y,z) ((x) ^ (y) ^ (z))
+#define LUAFLAC_MD5_I(x,y,z) ((y) ^ ((x) | ~(z)))
+
+#define LUAFLAC_MD5_STEP(f,a,b,c,d,x,t,s) \
+    (a) += f((b),(c),(d)) + (x) + (t); \
+    (a) = ((a) << (s)) | (((a) & 0xFFFFFFFF) >> (32 - (s))); \
+    (a) += (b);
+
+static void
+luaflac_md5_transform(FLAC__uint32 state[4], const FLAC__byte *block) {
+    FLAC__uint32 x[16];
+    FLAC__uint32 a = state[0];
+    FLAC__uint32 b = state[1];
+    FLAC__uint32 c = state[2];
+    FLAC__uint32 d = state[3];
+    unsigned int i = 0;
+
+    for(i=0;i<16;i++) {
+        x[i] = (FLAC__uint32)block[i*4] |
+          ((FLAC__uint32)block[i*4+1] << 8) |
+          ((FLAC__uint32)block[i*4+2] << 16) |
+          ((FLAC__uint32)block[i*4+3] << 24);
+    }
+
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,a,b,c,d,x[ 0],0xd76aa478, 7)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,d,a,b,c,x[ 1],0xe8c7b756,12)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,c,d,a,b,x[ 2],0x242070db,17)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,b,c,d,a,x[ 3],0xc1bdceee,22)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,a,b,c,d,x[ 4],0xf57c0faf, 7)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,d,a,b,c,x[ 5],0x4787c62a,12)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,c,d,a,b,x[ 6],0xa8304613,17)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,b,c,d,a,x[ 7],0xfd469501,22)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,a,b,c,d,x[ 8],0x698098d8, 7)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,d,a,b,c,x[ 9],0x8b44f7af,12)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,c,d,a,b,x[10],0xffff5bb1,17)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,b,c,d,a,x[11],0x895cd7be,22)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,a,b,c,d,x[12],0x6b901122, 7)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,d,a,b,c,x[13],0xfd987193,12)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,c,d,a,b,x[14],0xa679438e,17)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_F,b,c,d,a,x[15],0x49b40821,22)
+
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,a,b,c,d,x[ 1],0xf61e2562, 5)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,d,a,b,c,x[ 6],0xc040b340, 9)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,c,d,a,b,x[11],0x265e5a51,14)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,b,c,d,a,x[ 0],0xe9b6c7aa,20)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,a,b,c,d,x[ 5],0xd62f105d, 5)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,d,a,b,c,x[10],0x02441453, 9)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,c,d,a,b,x[15],0xd8a1e681,14)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,b,c,d,a,x[ 4],0xe7d3fbc8,20)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,a,b,c,d,x[ 9],0x21e1cde6, 5)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,d,a,b,c,x[14],0xc33707d6, 9)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,c,d,a,b,x[ 3],0xf4d50d87,14)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,b,c,d,a,x[ 8],0x455a14ed,20)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,a,b,c,d,x[13],0xa9e3e905, 5)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,d,a,b,c,x[ 2],0xfcefa3f8, 9)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,c,d,a,b,x[ 7],0x676f02d9,14)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_G,b,c,d,a,x[12],0x8d2a4c8a,20)
+
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,a,b,c,d,x[ 5],0xfffa3942, 4)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,d,a,b,c,x[ 8],0x8771f681,11)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,c,d,a,b,x[11],0x6d9d6122,16)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,b,c,d,a,x[14],0xfde5380c,23)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,a,b,c,d,x[ 1],0xa4beea44, 4)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,d,a,b,c,x[ 4],0x4bdecfa9,11)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,c,d,a,b,x[ 7],0xf6bb4b60,16)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,b,c,d,a,x[10],0xbebfbc70,23)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,a,b,c,d,x[13],0x289b7ec6, 4)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,d,a,b,c,x[ 0],0xeaa127fa,11)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,c,d,a,b,x[ 3],0xd4ef3085,16)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,b,c,d,a,x[ 6],0x04881d05,23)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,a,b,c,d,x[ 9],0xd9d4d039, 4)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,d,a,b,c,x[12],0xe6db99e5,11)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,c,d,a,b,x[15],0x1fa27cf8,16)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_H,b,c,d,a,x[ 2],0xc4ac5665,23)
+
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,a,b,c,d,x[ 0],0xf4292244, 6)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,d,a,b,c,x[ 7],0x432aff97,10)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,c,d,a,b,x[14],0xab9423a7,15)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,b,c,d,a,x[ 5],0xfc93a039,21)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,a,b,c,d,x[12],0x655b59c3, 6)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,d,a,b,c,x[ 3],0x8f0ccc92,10)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,c,d,a,b,x[10],0xffeff47d,15)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,b,c,d,a,x[ 1],0x85845dd1,21)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,a,b,c,d,x[ 8],0x6fa87e4f, 6)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,d,a,b,c,x[15],0xfe2ce6e0,10)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,c,d,a,b,x[ 6],0xa3014314,15)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,b,c,d,a,x[13],0x4e0811a1,21)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,a,b,c,d,x[ 4],0xf7537e82, 6)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,d,a,b,c,x[11],0xbd3af235,10)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,c,d,a,b,x[ 2],0x2ad7d2bb,15)
+    LUAFLAC_MD5_STEP(LUAFLAC_MD5_I,b,c,d,a,x[ 9],0xeb86d391,21)
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_md5_init(luaflac_md5 *m) {
+    m->state[0] = 0x67452301;
+    m->state[1] = 0xefcdab89;
+    m->state[2] = 0x98badcfe;
+    m->state[3] = 0x10325476;
+    m->length = 0;
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_md5_update(luaflac_md5 *m, const FLAC__byte *data, size_t len) {
+    size_t used = (size_t)(m->length & 63);
+    size_t n = 0;
+
+    m->length += len;
+    if(used > 0) {
+        n = 64 - used;
+        if(n > len) n = len;
+        memcpy(&m->block[used],data,n);
+        data += n;
+        len -= n;
+        if(used + n < 64) return;
+        luaflac_md5_transform(m->state,m->block);
+    }
+    while(len >= 64) {
+        luaflac_md5_transform(m->state,data);
+        data += 64;
+        len -= 64;
+    }
+    memcpy(m->block,data,len);
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_md5_update_samples(luaflac_md5 *m, const FLAC__int32 *const buffer[],
+  unsigned int channels, unsigned int samples, unsigned int bits_per_sample) {
+    FLAC__byte b[1024];
+    unsigned int width = (bits_per_sample + 7) / 8;
+    size_t n = 0;
+    unsigned int i = 0;
+    unsigned int c = 0;
+    unsigned int k = 0;
+    FLAC__uint32 v = 0;
+
+    /* the same layout as libFLAC: interleaved, little-endian, signed */
+    for(i=0;i<samples;i++) {
+        if(n + channels * width > sizeof(b)) {
+            luaflac_md5_update(m,b,n);
+            n = 0;
+        }
+        for(c=0;c<channels;c++) {
+            v = (FLAC__uint32)buffer[c][i];
+            for(k=0;k<width;k++) {
+                b[n++] = (FLAC__byte)(v >> (8 * k));
+            }
+        }
+    }
+    luaflac_md5_update(m,b,n);
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_md5_final(luaflac_md5 *m, FLAC__byte digest[16]) {
+    static const FLAC__byte pad[64] = { 0x80 };
+    FLAC__byte bits[8];
+    FLAC__uint64 length = m->length * 8;
+    size_t used = (size_t)(m->length & 63);
+    unsigned int i = 0;
+
+    for(i=0;i<8;i++) {
+        bits[i] = (FLAC__byte)(length >> (8 * i));
+    }
+    luaflac_md5_update(m,pad,used < 56 ? 56 - used : 120 - used);
+    luaflac_md5_update(m,bits,8);
+
+    for(i=0;i<16;i++) {
+        digest[i] = (FLAC__byte)(m->state[i/4] >> (8 * (i%4)));
+    }
+}
@@ -165,6 +165,16 @@ luaflac_toflac_streammetadata_seek_table(lua_State *L, int idx, FLAC__StreamMeta
     }
 
     lua_getfield(L,-1,"points");
+    if(luaL_testudata(L,-1,luaflac_seektable_mt) != NULL) {
+        if(!luaflac_seektable_copy(L,-1,m)) {
+            lua_pop(L,2);
+            lua_pushliteral(L,"error resizing points");
+            return 1;
+        }
+        lua_pop(L,2);
+        assert(top == lua_gettop(L));
+        return 0;
+    }
     if(!lua_istable(L,-1)) {
         lua_pop(L,2);
         lua_pushliteral(L,"missing key: points");
@@ -410,8 +420,11 @@ luaflac_toflac_streammetadata_cue_sheet(lua_State *L, int idx, FLAC__StreamMetad
     return 0;
 }
 
+/* when anchor is non-zero the picture data is not copied, the
+ * FLAC__StreamMetadata object points directly at the Lua string,
+ * and the string is stored in the table at anchor to keep it alive */
 static int
-luaflac_toflac_streammetadata_picture(lua_State *L, int idx, FLAC__StreamMetadata *m) {
+luaflac_toflac_streammetadata_picture(lua_State *L, int idx, int anchor, FLAC__StreamMetadata *m) {
     int top = lua_gettop(L);
     const char *str = NULL;
     size_t str_len = 0;
@@ -478,11 +491,20 @@ luaflac_toflac_streammetadata_picture(lua_State *L, int idx, FLAC__StreamMetadat
     lua_getfield(L,-1,"data");
     if(!lua_isnil(L,-1)) {
         str = lua_tolstring(L,-1,&str_len);
-        if(!FLAC__metadata_object_picture_set_data(m,(FLAC__byte *)str,str_len,1)) {
+        if(str == NULL) {
+            lua_pop(L,2);
+            lua_pushliteral(L,"data not a string");
+            return 1;
+        }
+        if(!FLAC__metadata_object_picture_set_data(m,(FLAC__byte *)str,str_len,anchor == 0)) {
             lua_pop(L,2);
             lua_pushliteral(L,"error setting data");
             return 1;
         }
+        if(anchor != 0) {
+            lua_pushvalue(L,-1);
+            lua_rawseti(L,anchor,lua_rawlen(L,anchor) + 1);
+        }
     }
     lua_pop(L,1);
 
@@ -491,10 +513,40 @@ luaflac_toflac_streammetadata_picture(lua_State *L, int idx, FLAC__StreamMetadat
     return 0;
 }
 
+LUAFLAC_PRIVATE
+void
+luaflac_streammetadata_delete(FLAC__StreamMetadata *m, int borrowed) {
+    if(m == NULL) return;
+    if(borrowed && m->type == FLAC__METADATA_TYPE_PICTURE) {
+        /* data belongs to a Lua string, don't let libFLAC free it */
+        m->data.picture.data = NULL;
+        m->data.picture.data_length = 0;
+    }
+    FLAC__metadata_object_delete(m);
+}
+
 LUAFLAC_PRIVATE
 FLAC__StreamMetadata *
-luaflac_toflac_streammetadata(lua_State *L, int idx) {
+luaflac_toflac_streammetadata(lua_State *L, int idx, int anchor) {
     FLAC__StreamMetadata *m = NULL;
+    if(idx < 0) {
+        idx = lua_gettop(L) + idx + 1;
+    }
+    if(anchor < 0) {
+        anchor = lua_gettop(L) + anchor + 1;
+    }
+    if(luaL_testudata(L,idx,luaflac_vorbis_comment_mt) != NULL) {
+        return luaflac_vorbis_comment_toflac(L,idx);
+    }
+    if(luaL_testudata(L,idx,luaflac_seektable_mt) != NULL) {
+        m = FLAC__metadata_object_new(FLAC__METADATA_TYPE_SEEKTABLE);
+        if(m == NULL || !luaflac_seektable_copy(L,idx,m)) {
+            if(m != NULL) FLAC__metadata_object_delete(m);
+            luaL_error(L,"memory error");
+            return NULL;
+        }
+        return m;
+    }
     if(!lua_istable(L,idx)) {
         luaL_error(L,"invalid table");
         return NULL;
@@ -552,7 +604,7 @@ luaflac_toflac_streammetadata(lua_State *L, int idx) {
             break;
         }
         case FLAC__METADATA_TYPE_PICTURE: {
-            if(luaflac_toflac_streammetadata_picture(L,idx,m)) {
+            if(luaflac_toflac_streammetadata_picture(L,idx,anchor,m)) {
                 goto luaflac_toflac_streammetadata_error;
             }
             break;
@@ -566,7 +618,7 @@ luaflac_toflac_streammetadata(lua_State *L, int idx) {
     goto luaflac_toflac_streammetadata_complete;
 
     luaflac_toflac_streammetadata_error:
-    FLAC__metadata_object_delete(m);
+    luaflac_streammetadata_delete(m,anchor != 0);
     m = NULL;
     lua_error(L);
 
@@ -631,13 +683,20 @@ luaflac_pushstreammetadata_application(lua_State *L, const FLAC__StreamMetadata
 }
 
 static void
-luaflac_pushstreammetadata_seek_table(lua_State *L, const FLAC__StreamMetadata *m) {
+luaflac_pushstreammetadata_seek_table(lua_State *L, const FLAC__StreamMetadata *m, int packed) {
     unsigned int i = 0;
     lua_newtable(L);
 
     lua_pushinteger(L,m->data.seek_table.num_points);
     lua_setfield(L,-2,"num_points");
 
+    if(packed) {
+        luaflac_pushseektable(L,m);
+        lua_setfield(L,-2,"points");
+        lua_setfield(L,-2,"seek_table");
+        return;
+    }
+
     i = 0;
     lua_newtable(L);
     while(i<m->data.seek_table.num_points) {
@@ -736,8 +795,10 @@ luaflac_pushstreammetadata_cue_sheet(lua_State *L, const FLAC__StreamMetadata *m
     lua_setfield(L,-2,"cue_sheet");
 }
 
+/* with lazy set the picture data is left out, data_offset is
+ * the absolute position of the data in the stream (0 if unknown) */
 static void
-luaflac_pushstreammetadata_picture(lua_State *L, const FLAC__StreamMetadata *m) {
+luaflac_pushstreammetadata_picture(lua_State *L, const FLAC__StreamMetadata *m, int lazy, FLAC__uint64 data_offset) {
     lua_newtable(L);
 
     lua_pushinteger(L,m->data.picture.type);
@@ -754,21 +815,27 @@ luaflac_pushstreammetadata_picture(lua_State *L, const FLAC__StreamMetadata *m)
     lua_setfield(L,-2,"colors");
     lua_pushinteger(L,m->data.picture.data_length);
     lua_setfield(L,-2,"data_length");
-    lua_pushlstring(L,(const char *)m->data.picture.data,m->data.picture.data_length);
-    lua_setfield(L,-2,"data");
+    if(lazy) {
+        if(data_offset != 0) {
+            luaflac_pushuint64(L,data_offset);
+            lua_setfield(L,-2,"data_offset");
+        }
+    } else {
+        lua_pushlstring(L,(const char *)m->data.picture.data,m->data.picture.data_length);
+        lua_setfield(L,-2,"data");
+    }
 
     lua_setfield(L,-2,"picture");
 }
 
 static void
 luaflac_pushstreammetadata_undefined(lua_State *L, const FLAC__StreamMetadata *m) {
-    lua_pushlstring(L,(const char *)&m->data,m->length);
+    lua_pushlstring(L,(const char *)m->data.unknown.data,m->length);
     lua_setfield(L,-2,"data");
 }
 
-LUAFLAC_PRIVATE
-int
-luaflac_pushstreammetadata(lua_State *L, const FLAC__StreamMetadata *m) {
+static int
+luaflac_pushstreammetadata_internal(lua_State *L, const FLAC__StreamMetadata *m, int flags, FLAC__uint64 data_offset) {
     int top;
     lua_newtable(L);
     top = lua_gettop(L);
@@ -793,7 +860,7 @@ luaflac_pushstreammetadata(lua_State *L, const FLAC__StreamMetadata *m) {
             break;
         }
         case FLAC__METADATA_TYPE_SEEKTABLE: {
-            luaflac_pushstreammetadata_seek_table(L,m);
+            luaflac_pushstreammetadata_seek_table(L,m,flags & LUAFLAC_PUSH_PACKED_SEEKTABLE);
             break;
         }
         case FLAC__METADATA_TYPE_VORBIS_COMMENT: {
@@ -805,7 +872,7 @@ luaflac_pushstreammetadata(lua_State *L, const FLAC__StreamMetadata *m) {
             break;
         }
         case FLAC__METADATA_TYPE_PICTURE: {
-            luaflac_pushstreammetadata_picture(L,m);
+            luaflac_pushstreammetadata_picture(L,m,flags & LUAFLAC_PUSH_LAZY_PICTURE,data_offset);
             break;
         }
         default: {
@@ -817,3 +884,203 @@ luaflac_pushstreammetadata(lua_State *L, const FLAC__StreamMetadata *m) {
     return 1;
 }
 
+
+LUAFLAC_PRIVATE
+int
+luaflac_pushstreammetadata(lua_State *L, const FLAC__StreamMetadata *m) {
+    return luaflac_pushstreammetadata_internal(L,m,0,0);
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_pushstreammetadata_flags(lua_State *L, const FLAC__StreamMetadata *m, int flags, FLAC__uint64 data_offset) {
+    return luaflac_pushstreammetadata_internal(L,m,flags,data_offset);
+}
+
+/* copies length bytes at offset from one FILE to another,
+ * or into a Lua string if out is NULL */
+static int
+luaflac_copy_range(lua_State *L, FILE *in, FLAC__uint64 offset, FLAC__uint64 length, FILE *out) {
+    char buffer[LUAFLAC_COPY_BUFFER_SIZE];
+    luaL_Buffer b;
+    char *p = NULL;
+    size_t want = 0;
+
+    if(luaflac_fseek(in,offset)) {
+        return 0;
+    }
+
+    if(out == NULL) {
+        luaL_buffinit(L,&b);
+        while(length > 0) {
+            want = length > LUAL_BUFFERSIZE ? LUAL_BUFFERSIZE : (size_t)length;
+            p = luaL_prepbuffer(&b);
+            if(fread(p,1,want,in) != want) {
+                luaL_pushresult(&b);
+                lua_pop(L,1);
+                return 0;
+            }
+            luaL_addsize(&b,want);
+            length -= want;
+        }
+        luaL_pushresult(&b);
+        return 1;
+    }
+
+    while(length > 0) {
+        want = length > sizeof(buffer) ? sizeof(buffer) : (size_t)length;
+        if(fread(buffer,1,want,in) != want) {
+            return 0;
+        }
+        if(fwrite(buffer,1,want,out) != want) {
+            return 0;
+        }
+        length -= want;
+    }
+    return 1;
+}
+
+static int
+luaflac_read_picture_data(lua_State *L) {
+    FLAC__uint64 data_offset = 0;
+    FLAC__uint64 data_length = 0;
+    FILE *in = NULL;
+    FILE *out = NULL;
+    int in_owned = 0;
+    int out_owned = 0;
+    int ok = 0;
+
+    luaL_checktype(L,2,LUA_TTABLE);
+
+    /* accept either the full metadata block or just the picture table */
+    lua_getfield(L,2,"picture");
+    if(!lua_istable(L,-1)) {
+        lua_pop(L,1);
+        lua_pushvalue(L,2);
+    }
+    lua_getfield(L,-1,"data_offset");
+    if(lua_isnil(L,-1)) {
+        return luaL_error(L,"picture has no data_offset");
+    }
+    data_offset = luaflac_touint64(L,-1);
+    lua_getfield(L,-2,"data_length");
+    data_length = luaflac_touint64(L,-1);
+    lua_pop(L,3);
+
+    in = luaflac_checkfile(L,1,"rb",&in_owned);
+    if(in == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,1));
+        return 2;
+    }
+
+    if(!lua_isnoneornil(L,3)) {
+        out = luaflac_checkfile(L,3,"wb",&out_owned);
+        if(out == NULL) {
+            if(in_owned) fclose(in);
+            lua_pushnil(L);
+            lua_pushfstring(L,"error opening %s",lua_tostring(L,3));
+            return 2;
+        }
+    }
+
+    ok = luaflac_copy_range(L,in,data_offset,data_length,out);
+
+    if(in_owned) fclose(in);
+    if(out_owned) {
+        if(fclose(out) != 0) ok = 0;
+    }
+
+    if(!ok) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"error reading picture data");
+        return 2;
+    }
+
+    if(out != NULL) {
+        lua_pushboolean(L,1);
+    }
+    return 1;
+}
+
+static int
+luaflac_probe(lua_State *L) {
+    unsigned char want[FLAC__MAX_METADATA_TYPE_CODE + 1];
+    luaflac_parsed_block *blocks = NULL;
+    unsigned int num_blocks = 0;
+    unsigned int i = 0;
+    FILE *f = NULL;
+    int owned = 0;
+    int flags = 0;
+    int push_flags = 0;
+    int ok = 0;
+    lua_Integer type = 0;
+    size_t j = 0;
+
+    memset(want,0,sizeof(want));
+    if(lua_isnoneornil(L,2)) {
+        want[FLAC__METADATA_TYPE_STREAMINFO] = 1;
+    }
+    else {
+        luaL_checktype(L,2,LUA_TTABLE);
+        for(j=1;j<=lua_rawlen(L,2);j++) {
+            lua_rawgeti(L,2,j);
+            type = luaL_checkinteger(L,-1);
+            lua_pop(L,1);
+            if(type < 0 || type > FLAC__MAX_METADATA_TYPE_CODE) {
+                return luaL_error(L,"invalid metadata type %d",(int)type);
+            }
+            want[type] = 1;
+        }
+        lua_getfield(L,2,"lazy_pictures");
+        if(lua_toboolean(L,-1)) flags |= LUAFLAC_PARSE_PICTURE_NODATA;
+        lua_pop(L,1);
+        lua_getfield(L,2,"packed_seektable");
+        if(lua_toboolean(L,-1)) push_flags |= LUAFLAC_PUSH_PACKED_SEEKTABLE;
+        lua_pop(L,1);
+    }
+
+    f = luaflac_checkfile(L,1,"rb",&owned);
+    if(f == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,1));
+        return 2;
+    }
+
+    ok = luaflac_parse_metadata(f,want,flags,&blocks,&num_blocks);
+    if(owned) fclose(f);
+
+    if(!ok) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"error reading metadata");
+        return 2;
+    }
+
+    lua_createtable(L,num_blocks,0);
+    for(i=0;i<num_blocks;i++) {
+        luaflac_push_parsed_block(L,&blocks[i],push_flags);
+        lua_rawseti(L,-2,i+1);
+    }
+    luaflac_parsed_free(blocks,num_blocks);
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_metadata_functions[] = {
+    { "read_picture_data", luaflac_read_picture_data },
+    { "probe", luaflac_probe },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_metadata(lua_State *L) {
+    lua_getglobal(L,"require");
+    lua_pushstring(L,"luaflac.uint64");
+    lua_call(L,1,1);
+    lua_pop(L,1);
+
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_metadata_functions,0);
+
+    return 1;
+}
@@ -0,0 +1,339 @@
+#include "luaflac_internal.h"
+#include <FLAC/export.h>
+#include <FLAC/metadata.h>
+
+/* bindings for the level 2 metadata interface (FLAC__Metadata_Chain and
+ * FLAC__Metadata_Iterator), for editing metadata without re-encoding */
+
+LUAFLAC_PRIVATE
+const char * const luaflac_metadata_chain_mt = "FLAC__Metadata_Chain";
+
+LUAFLAC_PRIVATE
+const char * const luaflac_metadata_iterator_mt = "FLAC__Metadata_Iterator";
+
+struct luaflac_chain_userdata_s {
+    FLAC__Metadata_Chain *chain;
+    /* bumped whenever the chain is (re)read, which frees every node */
+    unsigned int generation;
+};
+
+typedef struct luaflac_chain_userdata_s luaflac_chain_userdata;
+
+struct luaflac_iterator_userdata_s {
+    FLAC__Metadata_Iterator *iterator;
+    luaflac_chain_userdata *chain;
+    unsigned int generation;
+};
+
+typedef struct luaflac_iterator_userdata_s luaflac_iterator_userdata;
+
+static luaflac_iterator_userdata *
+luaflac_metadata_iterator_check(lua_State *L, int idx) {
+    luaflac_iterator_userdata *u = luaL_checkudata(L,idx,luaflac_metadata_iterator_mt);
+    if(u->chain == NULL) {
+        luaL_error(L,"iterator has not been initialized");
+        return NULL;
+    }
+    if(u->chain->generation != u->generation) {
+        luaL_error(L,"chain was re-read, iterator must be initialized again");
+        return NULL;
+    }
+    return u;
+}
+
+static int
+luaflac_metadata_chain_delete(lua_State *L) {
+    luaflac_chain_userdata *u = luaL_checkudata(L,1,luaflac_metadata_chain_mt);
+    if(u->chain != NULL) {
+        FLAC__metadata_chain_delete(u->chain);
+        u->chain = NULL;
+    }
+    return 0;
+}
+
+static int
+luaflac_metadata_chain_new(lua_State *L) {
+    luaflac_chain_userdata *u = lua_newuserdata(L,sizeof(luaflac_chain_userdata));
+    if(u == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    u->generation = 0;
+    u->chain = FLAC__metadata_chain_new();
+    if(u->chain == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    luaL_setmetatable(L,luaflac_metadata_chain_mt);
+    return 1;
+}
+
+static int
+luaflac_metadata_chain_status(lua_State *L) {
+    luaflac_chain_userdata *u = luaL_checkudata(L,1,luaflac_metadata_chain_mt);
+    lua_pushinteger(L,FLAC__metadata_chain_status(u->chain));
+    return 1;
+}
+
+static int
+luaflac_metadata_chain_read(lua_State *L) {
+    FLAC__bool (*read)(FLAC__Metadata_Chain *, const char *) = NULL;
+    luaflac_chain_userdata *u = luaL_checkudata(L,1,luaflac_metadata_chain_mt);
+    const char *filename = luaL_checkstring(L,2);
+
+    read = lua_touserdata(L,lua_upvalueindex(1));
+    u->generation++;
+    lua_pushboolean(L,read(u->chain,filename));
+    return 1;
+}
+
+static int
+luaflac_metadata_chain_check_if_tempfile_needed(lua_State *L) {
+    luaflac_chain_userdata *u = luaL_checkudata(L,1,luaflac_metadata_chain_mt);
+    lua_pushboolean(L,FLAC__metadata_chain_check_if_tempfile_needed(u->chain,lua_toboolean(L,2)));
+    return 1;
+}
+
+static int
+luaflac_metadata_chain_write(lua_State *L) {
+    luaflac_chain_userdata *u = luaL_checkudata(L,1,luaflac_metadata_chain_mt);
+    lua_pushboolean(L,FLAC__metadata_chain_write(u->chain,lua_toboolean(L,2),lua_toboolean(L,3)));
+    return 1;
+}
+
+static int
+luaflac_metadata_chain_merge_padding(lua_State *L) {
+    luaflac_chain_userdata *u = luaL_checkudata(L,1,luaflac_metadata_chain_mt);
+    FLAC__metadata_chain_merge_padding(u->chain);
+    return 0;
+}
+
+static int
+luaflac_metadata_chain_sort_padding(lua_State *L) {
+    luaflac_chain_userdata *u = luaL_checkudata(L,1,luaflac_metadata_chain_mt);
+    FLAC__metadata_chain_sort_padding(u->chain);
+    return 0;
+}
+
+static int
+luaflac_metadata_iterator_delete(lua_State *L) {
+    luaflac_iterator_userdata *u = luaL_checkudata(L,1,luaflac_metadata_iterator_mt);
+    if(u->iterator != NULL) {
+        FLAC__metadata_iterator_delete(u->iterator);
+        u->iterator = NULL;
+    }
+    return 0;
+}
+
+static int
+luaflac_metadata_iterator_new(lua_State *L) {
+    luaflac_iterator_userdata *u = lua_newuserdata(L,sizeof(luaflac_iterator_userdata));
+    if(u == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    u->chain = NULL;
+    u->generation = 0;
+    u->iterator = FLAC__metadata_iterator_new();
+    if(u->iterator == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    luaL_setmetatable(L,luaflac_metadata_iterator_mt);
+    return 1;
+}
+
+static int
+luaflac_metadata_iterator_init(lua_State *L) {
+    luaflac_iterator_userdata *u = luaL_checkudata(L,1,luaflac_metadata_iterator_mt);
+    luaflac_chain_userdata *c = luaL_checkudata(L,2,luaflac_metadata_chain_mt);
+
+    FLAC__metadata_iterator_init(u->iterator,c->chain);
+    u->chain = c;
+    u->generation = c->generation;
+
+    /* keep the chain alive for as long as the iterator is, in a table
+     * since before 5.3 a uservalue has to be one */
+    lua_createtable(L,1,0);
+    lua_pushvalue(L,2);
+    lua_rawseti(L,-2,1);
+    lua_setuservalue(L,1);
+    return 0;
+}
+
+static int
+luaflac_metadata_iterator_next(lua_State *L) {
+    luaflac_iterator_userdata *u = luaflac_metadata_iterator_check(L,1);
+    lua_pushboolean(L,FLAC__metadata_iterator_next(u->iterator));
+    return 1;
+}
+
+static int
+luaflac_metadata_iterator_prev(lua_State *L) {
+    luaflac_iterator_userdata *u = luaflac_metadata_iterator_check(L,1);
+    lua_pushboolean(L,FLAC__metadata_iterator_prev(u->iterator));
+    return 1;
+}
+
+static int
+luaflac_metadata_iterator_get_block_type(lua_State *L) {
+    luaflac_iterator_userdata *u = luaflac_metadata_iterator_check(L,1);
+    lua_pushinteger(L,FLAC__metadata_iterator_get_block_type(u->iterator));
+    return 1;
+}
+
+static int
+luaflac_metadata_iterator_get_block(lua_State *L) {
+    luaflac_iterator_userdata *u = luaflac_metadata_iterator_check(L,1);
+    luaflac_pushstreammetadata(L,FLAC__metadata_iterator_get_block(u->iterator));
+    return 1;
+}
+
+/* the chain takes ownership of the block, so it has to be a full copy */
+static int
+luaflac_metadata_iterator_block_op(lua_State *L, FLAC__bool (*op)(FLAC__Metadata_Iterator *, FLAC__StreamMetadata *)) {
+    luaflac_iterator_userdata *u = luaflac_metadata_iterator_check(L,1);
+    FLAC__StreamMetadata *m = luaflac_toflac_streammetadata(L,2,0);
+    FLAC__bool r = 0;
+
+    if(m == NULL) {
+        return luaL_error(L,"invalid metadata block");
+    }
+
+    r = op(u->iterator,m);
+    if(!r) {
+        FLAC__metadata_object_delete(m);
+    }
+    lua_pushboolean(L,r);
+    return 1;
+}
+
+static int
+luaflac_metadata_iterator_set_block(lua_State *L) {
+    return luaflac_metadata_iterator_block_op(L,FLAC__metadata_iterator_set_block);
+}
+
+static int
+luaflac_metadata_iterator_insert_block_before(lua_State *L) {
+    return luaflac_metadata_iterator_block_op(L,FLAC__metadata_iterator_insert_block_before);
+}
+
+static int
+luaflac_metadata_iterator_insert_block_after(lua_State *L) {
+    return luaflac_metadata_iterator_block_op(L,FLAC__metadata_iterator_insert_block_after);
+}
+
+static int
+luaflac_metadata_iterator_delete_block(lua_State *L) {
+    luaflac_iterator_userdata *u = luaflac_metadata_iterator_check(L,1);
+    lua_pushboolean(L,FLAC__metadata_iterator_delete_block(u->iterator,lua_toboolean(L,2)));
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_metadata_chain_functions[] = {
+    { "FLAC__metadata_chain_new", luaflac_metadata_chain_new },
+    { "FLAC__metadata_chain_status", luaflac_metadata_chain_status },
+    { "FLAC__metadata_chain_check_if_tempfile_needed", luaflac_metadata_chain_check_if_tempfile_needed },
+    { "FLAC__metadata_chain_write", luaflac_metadata_chain_write },
+    { "FLAC__metadata_chain_merge_padding", luaflac_metadata_chain_merge_padding },
+    { "FLAC__metadata_chain_sort_padding", luaflac_metadata_chain_sort_padding },
+    { "FLAC__metadata_iterator_new", luaflac_metadata_iterator_new },
+    { "FLAC__metadata_iterator_init", luaflac_metadata_iterator_init },
+    { "FLAC__metadata_iterator_next", luaflac_metadata_iterator_next },
+    { "FLAC__metadata_iterator_prev", luaflac_metadata_iterator_prev },
+    { "FLAC__metadata_iterator_get_block_type", luaflac_metadata_iterator_get_block_type },
+    { "FLAC__metadata_iterator_get_block", luaflac_metadata_iterator_get_block },
+    { "FLAC__metadata_iterator_set_block", luaflac_metadata_iterator_set_block },
+    { "FLAC__metadata_iterator_delete_block", luaflac_metadata_iterator_delete_block },
+    { "FLAC__metadata_iterator_insert_block_before", luaflac_metadata_iterator_insert_block_before },
+    { "FLAC__metadata_iterator_insert_block_after", luaflac_metadata_iterator_insert_block_after },
+    { NULL, NULL },
+};
+
+static const luaflac_metamethods luaflac_metadata_chain_metamethods[] = {
+    { "FLAC__metadata_chain_status" , "status" },
+    { "FLAC__metadata_chain_read" , "read" },
+    { "FLAC__metadata_chain_read_ogg" , "read_ogg" },
+    { "FLAC__metadata_chain_check_if_tempfile_needed" , "check_if_tempfile_needed" },
+    { "FLAC__metadata_chain_write" , "write" },
+    { "FLAC__metadata_chain_merge_padding" , "merge_padding" },
+    { "FLAC__metadata_chain_sort_padding" , "sort_padding" },
+    { NULL, NULL },
+};
+
+static const luaflac_metamethods luaflac_metadata_iterator_metamethods[] = {
+    { "FLAC__metadata_iterator_init" , "init" },
+    { "FLAC__metadata_iterator_next" , "next" },
+    { "FLAC__metadata_iterator_prev" , "prev" },
+    { "FLAC__metadata_iterator_get_block_type" , "get_block_type" },
+    { "FLAC__metadata_iterator_get_block" , "get_block" },
+    { "FLAC__metadata_iterator_set_block" , "set_block" },
+    { "FLAC__metadata_iterator_delete_block" , "delete_block" },
+    { "FLAC__metadata_iterator_insert_block_before" , "insert_block_before" },
+    { "FLAC__metadata_iterator_insert_block_after" , "insert_block_after" },
+    { NULL, NULL },
+};
+
+static void
+luaflac_metadata_chain_newmetatable(lua_State *L, const char *mt, lua_CFunction gc, const luaflac_metamethods *m) {
+    luaL_newmetatable(L,mt);
+    lua_pushcclosure(L,gc,0);
+    lua_setfield(L,-2,"__gc");
+
+    lua_newtable(L); /* __index */
+
+    while(m->name != NULL) {
+        lua_getfield(L,-3,m->name);
+        lua_setfield(L,-2,m->metaname);
+        m++;
+    }
+
+    lua_setfield(L,-2,"__index");
+
+    lua_pop(L,1);
+}
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_metadata_chain(lua_State *L) {
+    lua_getglobal(L,"require");
+    lua_pushstring(L,"luaflac.uint64");
+    lua_call(L,1,1);
+    lua_pop(L,1);
+
+    lua_newtable(L);
+
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_OK);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_ILLEGAL_INPUT);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_ERROR_OPENING_FILE);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_NOT_A_FLAC_FILE);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_NOT_WRITABLE);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_BAD_METADATA);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_READ_ERROR);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_SEEK_ERROR);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_WRITE_ERROR);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_RENAME_ERROR);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_UNLINK_ERROR);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_MEMORY_ALLOCATION_ERROR);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_INTERNAL_ERROR);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_INVALID_CALLBACKS);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_READ_WRITE_MISMATCH);
+    luaflac_push_const(FLAC__METADATA_CHAIN_STATUS_WRONG_WRITE_CALL);
+
+    luaL_setfuncs(L,luaflac_metadata_chain_functions,0);
+
+    lua_pushlightuserdata(L, FLAC__metadata_chain_read);
+    lua_pushcclosure(L,luaflac_metadata_chain_read,1);
+    lua_setfield(L,-2,"FLAC__metadata_chain_read");
+
+    if(FLAC_API_SUPPORTS_OGG_FLAC) {
+        lua_pushlightuserdata(L, FLAC__metadata_chain_read_ogg);
+        lua_pushcclosure(L,luaflac_metadata_chain_read,1);
+        lua_setfield(L,-2,"FLAC__metadata_chain_read_ogg");
+    } else {
+        lua_pushcclosure(L,luaflac_no_ogg, 0);
+        lua_setfield(L,-2, "FLAC__metadata_chain_read_ogg");
+    }
+
+    luaflac_metadata_chain_newmetatable(L,luaflac_metadata_chain_mt,
+      luaflac_metadata_chain_delete,luaflac_metadata_chain_metamethods);
+    luaflac_metadata_chain_newmetatable(L,luaflac_metadata_iterator_mt,
+      luaflac_metadata_iterator_delete,luaflac_metadata_iterator_metamethods);
+
+    return 1;
+}
@@ -0,0 +1,464 @@
+#include "luaflac_internal.h"
+#include <FLAC/metadata.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* native parsing of FLAC stream headers and metadata blocks,
+ * used where going through a FLAC__StreamDecoder is too heavy */
+
+static FLAC__uint32
+luaflac_unpack_uint32_be(const FLAC__byte *b, unsigned int bytes) {
+    FLAC__uint32 r = 0;
+    unsigned int i = 0;
+    while(i<bytes) {
+        r = (r << 8) | b[i++];
+    }
+    return r;
+}
+
+static FLAC__uint64
+luaflac_unpack_uint64_be(const FLAC__byte *b, unsigned int bytes) {
+    FLAC__uint64 r = 0;
+    unsigned int i = 0;
+    while(i<bytes) {
+        r = (r << 8) | b[i++];
+    }
+    return r;
+}
+
+static FLAC__uint32
+luaflac_unpack_uint32_le(const FLAC__byte *b) {
+    return ((FLAC__uint32)b[0])       | ((FLAC__uint32)b[1] << 8) |
+           ((FLAC__uint32)b[2] << 16) | ((FLAC__uint32)b[3] << 24);
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_parse_stream_start(FILE *f, FLAC__uint64 *marker_offset) {
+    FLAC__byte b[10];
+    FLAC__uint64 offset = 0;
+
+    if(luaflac_fseek(f,0)) return 0;
+
+    for(;;) {
+        if(fread(b,1,4,f) != 4) return 0;
+        if(memcmp(b,"fLaC",4) == 0) {
+            *marker_offset = offset;
+            return 1;
+        }
+        if(memcmp(b,"ID3",3) != 0) return 0;
+
+        /* skip over an ID3v2 tag, the size is a 28-bit syncsafe integer */
+        if(fread(&b[4],1,6,f) != 6) return 0;
+        offset += 10 +
+          (((FLAC__uint64)(b[6] & 0x7F) << 21) |
+           ((FLAC__uint64)(b[7] & 0x7F) << 14) |
+           ((FLAC__uint64)(b[8] & 0x7F) << 7) |
+           ((FLAC__uint64)(b[9] & 0x7F)));
+        if(b[5] & 0x10) offset += 10; /* footer present */
+        if(luaflac_fseek(f,offset)) return 0;
+    }
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_parse_block_header(FILE *f, FLAC__uint64 offset, luaflac_block_header *h) {
+    FLAC__byte b[4];
+
+    if(luaflac_fseek(f,offset)) return 0;
+    if(fread(b,1,4,f) != 4) return 0;
+
+    h->offset = offset;
+    h->is_last = b[0] >> 7;
+    h->type = (FLAC__MetadataType)(b[0] & 0x7F);
+    h->length = luaflac_unpack_uint32_be(&b[1],3);
+
+    /* 127 is invalid, to avoid confusion with a frame sync code */
+    return h->type != 127;
+}
+
+static int
+luaflac_parse_streaminfo(FLAC__StreamMetadata *m, const FLAC__byte *b, FLAC__uint32 len) {
+    if(len < FLAC__STREAM_METADATA_STREAMINFO_LENGTH) return 0;
+
+    m->data.stream_info.min_blocksize = luaflac_unpack_uint32_be(&b[0],2);
+    m->data.stream_info.max_blocksize = luaflac_unpack_uint32_be(&b[2],2);
+    m->data.stream_info.min_framesize = luaflac_unpack_uint32_be(&b[4],3);
+    m->data.stream_info.max_framesize = luaflac_unpack_uint32_be(&b[7],3);
+    m->data.stream_info.sample_rate = luaflac_unpack_uint32_be(&b[10],3) >> 4;
+    m->data.stream_info.channels = ((b[12] >> 1) & 0x07) + 1;
+    m->data.stream_info.bits_per_sample = (((b[12] & 0x01) << 4) | (b[13] >> 4)) + 1;
+    m->data.stream_info.total_samples = luaflac_unpack_uint64_be(&b[13],5) & 0x0FFFFFFFFFULL;
+    memcpy(m->data.stream_info.md5sum,&b[18],16);
+    return 1;
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_pack_streaminfo(FLAC__byte *b, const FLAC__StreamMetadata_StreamInfo *s) {
+    b[0] = (FLAC__byte)(s->min_blocksize >> 8);
+    b[1] = (FLAC__byte)(s->min_blocksize);
+    b[2] = (FLAC__byte)(s->max_blocksize >> 8);
+    b[3] = (FLAC__byte)(s->max_blocksize);
+    b[4] = (FLAC__byte)(s->min_framesize >> 16);
+    b[5] = (FLAC__byte)(s->min_framesize >> 8);
+    b[6] = (FLAC__byte)(s->min_framesize);
+    b[7] = (FLAC__byte)(s->max_framesize >> 16);
+    b[8] = (FLAC__byte)(s->max_framesize >> 8);
+    b[9] = (FLAC__byte)(s->max_framesize);
+    b[10] = (FLAC__byte)(s->sample_rate >> 12);
+    b[11] = (FLAC__byte)(s->sample_rate >> 4);
+    b[12] = (FLAC__byte)(((s->sample_rate & 0x0F) << 4) | ((s->channels - 1) << 1) |
+      ((s->bits_per_sample - 1) >> 4));
+    b[13] = (FLAC__byte)((((s->bits_per_sample - 1) & 0x0F) << 4) |
+      ((s->total_samples >> 32) & 0x0F));
+    b[14] = (FLAC__byte)(s->total_samples >> 24);
+    b[15] = (FLAC__byte)(s->total_samples >> 16);
+    b[16] = (FLAC__byte)(s->total_samples >> 8);
+    b[17] = (FLAC__byte)(s->total_samples);
+    memcpy(&b[18],s->md5sum,16);
+}
+
+static int
+luaflac_parse_application(FLAC__StreamMetadata *m, const FLAC__byte *b, FLAC__uint32 len) {
+    if(len < 4) return 0;
+    memcpy(m->data.application.id,b,4);
+    return FLAC__metadata_object_application_set_data(m,(FLAC__byte *)&b[4],len - 4,1);
+}
+
+static int
+luaflac_parse_seek_table(FLAC__StreamMetadata *m, const FLAC__byte *b, FLAC__uint32 len) {
+    unsigned int i = 0;
+    unsigned int num_points = len / 18;
+    FLAC__StreamMetadata_SeekPoint point;
+
+    if(!FLAC__metadata_object_seektable_resize_points(m,num_points)) return 0;
+
+    while(i<num_points) {
+        point.sample_number = luaflac_unpack_uint64_be(b,8);
+        point.stream_offset = luaflac_unpack_uint64_be(&b[8],8);
+        point.frame_samples = luaflac_unpack_uint32_be(&b[16],2);
+        FLAC__metadata_object_seektable_set_point(m,i,point);
+        b += 18;
+        i++;
+    }
+    return 1;
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_vorbiscomment_entry_set(FLAC__StreamMetadata_VorbisComment_Entry *entry,
+  const FLAC__byte *data, FLAC__uint32 length) {
+    FLAC__byte *tmp = malloc((size_t)length + 1);
+
+    if(tmp == NULL) return 0;
+    memcpy(tmp,data,length);
+    tmp[length] = '\0';
+    free(entry->entry);
+    entry->entry = tmp;
+    entry->length = length;
+    return 1;
+}
+
+/* entries are copied as they are: a tag libFLAC considers illegal (bad
+ * UTF-8, no '=') shouldn't stop the rest of the file from being read */
+static int
+luaflac_parse_vorbis_comment(FLAC__StreamMetadata *m, const FLAC__byte *b, FLAC__uint32 len) {
+    const FLAC__byte *end = b + len;
+    FLAC__StreamMetadata_VorbisComment *vc = &m->data.vorbis_comment;
+    FLAC__uint32 num_comments = 0;
+    FLAC__uint32 length = 0;
+    FLAC__uint32 i = 0;
+
+    if(end - b < 4) return 0;
+    length = luaflac_unpack_uint32_le(b);
+    b += 4;
+    if((FLAC__uint32)(end - b) < length) return 0;
+    if(!luaflac_vorbiscomment_entry_set(&vc->vendor_string,b,length)) return 0;
+    b += length;
+
+    if(end - b < 4) return 0;
+    num_comments = luaflac_unpack_uint32_le(b);
+    b += 4;
+    /* every comment needs at least a length field */
+    if(num_comments > (FLAC__uint32)(end - b) / 4) return 0;
+    if(!FLAC__metadata_object_vorbiscomment_resize_comments(m,num_comments)) return 0;
+
+    while(i<num_comments) {
+        if(end - b < 4) return 0;
+        length = luaflac_unpack_uint32_le(b);
+        b += 4;
+        if((FLAC__uint32)(end - b) < length) return 0;
+        if(!luaflac_vorbiscomment_entry_set(&vc->comments[i],b,length)) return 0;
+        b += length;
+        i++;
+    }
+    m->length = (unsigned int)(len - (FLAC__uint32)(end - b));
+    return 1;
+}
+
+static int
+luaflac_parse_cue_sheet(FLAC__StreamMetadata *m, const FLAC__byte *b, FLAC__uint32 len) {
+    const FLAC__byte *end = b + len;
+    unsigned int num_tracks = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+    FLAC__StreamMetadata_CueSheet_Track *track = NULL;
+
+    if(len < 396) return 0;
+
+    memcpy(m->data.cue_sheet.media_catalog_number,b,128);
+    m->data.cue_sheet.media_catalog_number[128] = '\0';
+    m->data.cue_sheet.lead_in = luaflac_unpack_uint64_be(&b[128],8);
+    m->data.cue_sheet.is_cd = b[136] >> 7;
+    num_tracks = b[395];
+    b += 396;
+
+    if(!FLAC__metadata_object_cuesheet_resize_tracks(m,num_tracks)) return 0;
+
+    while(i<num_tracks) {
+        if(end - b < 36) return 0;
+        track = &m->data.cue_sheet.tracks[i];
+        track->offset = luaflac_unpack_uint64_be(b,8);
+        track->number = b[8];
+        memcpy(track->isrc,&b[9],12);
+        track->isrc[12] = '\0';
+        track->type = b[21] >> 7;
+        track->pre_emphasis = (b[21] >> 6) & 0x01;
+        if(!FLAC__metadata_object_cuesheet_track_resize_indices(m,i,b[35])) return 0;
+        b += 36;
+
+        j = 0;
+        while(j<track->num_indices) {
+            if(end - b < 12) return 0;
+            track->indices[j].offset = luaflac_unpack_uint64_be(b,8);
+            track->indices[j].number = b[8];
+            b += 12;
+            j++;
+        }
+        i++;
+    }
+    return 1;
+}
+
+/* reads the picture fields one at a time, so the data can be skipped */
+static int
+luaflac_parse_picture(FLAC__StreamMetadata *m, FILE *f, FLAC__uint32 len, int nodata) {
+    FLAC__byte b[20];
+    FLAC__byte *str = NULL;
+    FLAC__uint32 str_len = 0;
+    FLAC__uint32 used = 0;
+    int ok = 0;
+
+    if(len < 32) return 0;
+    if(fread(b,1,8,f) != 8) return 0;
+    m->data.picture.type = (FLAC__StreamMetadata_Picture_Type)luaflac_unpack_uint32_be(b,4);
+    str_len = luaflac_unpack_uint32_be(&b[4],4);
+    used = 8;
+
+    if(str_len > len - 32) return 0;
+    str = malloc(str_len + 1);
+    if(str == NULL) return 0;
+    if(fread(str,1,str_len,f) != str_len) goto luaflac_parse_picture_done;
+    str[str_len] = '\0';
+    if(!FLAC__metadata_object_picture_set_mime_type(m,(char *)str,1)) goto luaflac_parse_picture_done;
+    free(str);
+    str = NULL;
+    used += str_len;
+
+    if(fread(b,1,4,f) != 4) return 0;
+    str_len = luaflac_unpack_uint32_be(b,4);
+    used += 4;
+    if(str_len > len - used - 20) return 0;
+    str = malloc(str_len + 1);
+    if(str == NULL) return 0;
+    if(fread(str,1,str_len,f) != str_len) goto luaflac_parse_picture_done;
+    str[str_len] = '\0';
+    if(!FLAC__metadata_object_picture_set_description(m,str,1)) goto luaflac_parse_picture_done;
+    free(str);
+    str = NULL;
+    used += str_len;
+
+    if(fread(b,1,20,f) != 20) return 0;
+    m->data.picture.width = luaflac_unpack_uint32_be(&b[0],4);
+    m->data.picture.height = luaflac_unpack_uint32_be(&b[4],4);
+    m->data.picture.depth = luaflac_unpack_uint32_be(&b[8],4);
+    m->data.picture.colors = luaflac_unpack_uint32_be(&b[12],4);
+    str_len = luaflac_unpack_uint32_be(&b[16],4);
+    used += 20;
+    if(str_len > len - used) return 0;
+
+    if(nodata) {
+        /* data stays NULL, callers only look at data_length */
+        m->data.picture.data_length = str_len;
+        return 1;
+    }
+
+    str = malloc(str_len + 1);
+    if(str == NULL) return 0;
+    if(fread(str,1,str_len,f) != str_len) goto luaflac_parse_picture_done;
+    ok = FLAC__metadata_object_picture_set_data(m,str,str_len,0);
+    if(ok) str = NULL;
+
+    luaflac_parse_picture_done:
+    free(str);
+    return ok;
+}
+
+LUAFLAC_PRIVATE
+FLAC__StreamMetadata *
+luaflac_parse_block(FILE *f, const luaflac_block_header *h, int flags) {
+    FLAC__StreamMetadata *m = NULL;
+    FLAC__byte *b = NULL;
+    int ok = 0;
+
+    m = FLAC__metadata_object_new(h->type);
+    if(m == NULL) return NULL;
+    m->is_last = h->is_last;
+
+    if(luaflac_fseek(f,h->offset + 4)) goto luaflac_parse_block_error;
+
+    switch(h->type) {
+        case FLAC__METADATA_TYPE_PADDING: {
+            /* no need to read zeroes */
+            m->length = h->length;
+            return m;
+        }
+        case FLAC__METADATA_TYPE_PICTURE: {
+            if(!luaflac_parse_picture(m,f,h->length,flags & LUAFLAC_PARSE_PICTURE_NODATA)) {
+                goto luaflac_parse_block_error;
+            }
+            if(m->data.picture.data == NULL) {
+                /* libFLAC would have computed this from the data */
+                m->length = h->length;
+            }
+            return m;
+        }
+        default: break;
+    }
+
+    b = malloc(h->length ? h->length : 1);
+    if(b == NULL) goto luaflac_parse_block_error;
+    if(fread(b,1,h->length,f) != h->length) goto luaflac_parse_block_error;
+
+    switch(h->type) {
+        case FLAC__METADATA_TYPE_STREAMINFO: {
+            ok = luaflac_parse_streaminfo(m,b,h->length);
+            break;
+        }
+        case FLAC__METADATA_TYPE_APPLICATION: {
+            ok = luaflac_parse_application(m,b,h->length);
+            break;
+        }
+        case FLAC__METADATA_TYPE_SEEKTABLE: {
+            ok = luaflac_parse_seek_table(m,b,h->length);
+            break;
+        }
+        case FLAC__METADATA_TYPE_VORBIS_COMMENT: {
+            ok = luaflac_parse_vorbis_comment(m,b,h->length);
+            break;
+        }
+        case FLAC__METADATA_TYPE_CUESHEET: {
+            ok = luaflac_parse_cue_sheet(m,b,h->length);
+            break;
+        }
+        default: {
+            /* unknown block, hand the raw bytes over to the object */
+            m->data.unknown.data = b;
+            m->length = h->length;
+            return m;
+        }
+    }
+
+    free(b);
+    if(ok) return m;
+    b = NULL;
+
+    luaflac_parse_block_error:
+    free(b);
+    FLAC__metadata_object_delete(m);
+    return NULL;
+}
+
+static int
+luaflac_parse_singleton(int type) {
+    /* types that can appear at most once in a stream */
+    return type == FLAC__METADATA_TYPE_STREAMINFO ||
+           type == FLAC__METADATA_TYPE_SEEKTABLE ||
+           type == FLAC__METADATA_TYPE_VORBIS_COMMENT;
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_parse_metadata(FILE *f, unsigned char *want, int flags,
+  luaflac_parsed_block **blocks, unsigned int *num_blocks) {
+    luaflac_parsed_block *list = NULL;
+    luaflac_parsed_block *tmp = NULL;
+    unsigned int num = 0;
+    unsigned int remaining = 0; /* requested singleton types not seen yet */
+    unsigned int repeatable = 0; /* requested types that may appear more than once */
+    luaflac_block_header h;
+    FLAC__uint64 offset = 0;
+    unsigned int i = 0;
+
+    for(i=0;i<=FLAC__MAX_METADATA_TYPE_CODE;i++) {
+        if(!want[i]) continue;
+        if(luaflac_parse_singleton(i)) remaining++;
+        else repeatable++;
+    }
+
+    if(!luaflac_parse_stream_start(f,&offset)) return 0;
+    offset += 4;
+
+    do {
+        if(!luaflac_parse_block_header(f,offset,&h)) goto luaflac_parse_metadata_error;
+        if(want[h.type]) {
+            if((num & 7) == 0) {
+                tmp = realloc(list,sizeof(luaflac_parsed_block) * (num + 8));
+                if(tmp == NULL) goto luaflac_parse_metadata_error;
+                list = tmp;
+            }
+            list[num].header = h;
+            list[num].metadata = luaflac_parse_block(f,&h,flags);
+            if(list[num].metadata == NULL) goto luaflac_parse_metadata_error;
+            num++;
+            if(luaflac_parse_singleton(h.type)) {
+                want[h.type] = 0;
+                remaining--;
+            }
+        }
+        offset += 4 + (FLAC__uint64)h.length;
+    } while(!h.is_last && (remaining > 0 || repeatable > 0));
+
+    *blocks = list;
+    *num_blocks = num;
+    return 1;
+
+    luaflac_parse_metadata_error:
+    luaflac_parsed_free(list,num);
+    return 0;
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_parsed_free(luaflac_parsed_block *blocks, unsigned int num_blocks) {
+    unsigned int i = 0;
+    for(i=0;i<num_blocks;i++) {
+        FLAC__metadata_object_delete(blocks[i].metadata);
+    }
+    free(blocks);
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_push_parsed_block(lua_State *L, const luaflac_parsed_block *b, int flags) {
+    const FLAC__StreamMetadata *m = b->metadata;
+    FLAC__uint64 data_offset = 0;
+    flags &= ~LUAFLAC_PUSH_LAZY_PICTURE;
+    if(m->type == FLAC__METADATA_TYPE_PICTURE && m->data.picture.data == NULL) {
+        flags |= LUAFLAC_PUSH_LAZY_PICTURE;
+        data_offset = b->header.offset + 4 + b->header.length - m->data.picture.data_length;
+    }
+    luaflac_pushstreammetadata_flags(L,m,flags,data_offset);
+}
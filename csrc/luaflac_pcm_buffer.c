@@ -0,0 +1,646 @@
+#include "luaflac_internal.h"
+#include <FLAC/format.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* flac.pcm_buffer - planar int32 or float32 samples kept in C. Decoders
+ * can pass them to the write callback, encoders take them directly, and
+ * each operation is a plain loop over one channel at a time, so the
+ * compiler can vectorize it. Integer samples go through doubles a chunk
+ * at a time so gain, mixing and conversion share one rounding and
+ * clipping path */
+
+LUAFLAC_PRIVATE
+const char * const luaflac_pcm_buffer_mt = "luaflac_pcm_buffer";
+
+/* samples converted through doubles at a time */
+#define LUAFLAC_PCM_CHUNK 1024
+
+
+static const char * const luaflac_pcm_formats[] = { "int32", "float32", NULL };
+
+static double
+luaflac_pcm_scale(unsigned int bits) {
+    return (double)((FLAC__uint64)1 << (bits - 1));
+}
+
+/* stores n doubles as floats, counting (and with clip, limiting) the
+ * ones past full scale */
+static size_t
+luaflac_pcm_store_float(const double *d, float *out, size_t n, int clip) {
+    size_t clipped = 0;
+    size_t i = 0;
+    double v = 0.0;
+
+    for(i=0;i<n;i++) {
+        v = d[i];
+        if(v > 1.0) {
+            clipped++;
+            if(clip) v = 1.0;
+        } else if(v < -1.0) {
+            clipped++;
+            if(clip) v = -1.0;
+        }
+        out[i] = (float)v;
+    }
+    return clipped;
+}
+
+static void
+luaflac_pcm_put32(unsigned char *p, FLAC__uint32 v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static FLAC__uint32
+luaflac_pcm_get32(const unsigned char *p) {
+    return (FLAC__uint32)p[0] | (FLAC__uint32)p[1] << 8 |
+      (FLAC__uint32)p[2] << 16 | (FLAC__uint32)p[3] << 24;
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_pcm_buffer_resize(luaflac_pcm_buffer *b, unsigned int channels, size_t frames) {
+    /* int32 and float32 samples are the same size */
+    size_t size = (size_t)channels * frames * sizeof(FLAC__int32);
+    void *data = NULL;
+    unsigned int c = 0;
+
+    if(size > b->size) {
+        data = realloc(b->data,size);
+        if(data == NULL) return 0;
+        b->data = data;
+        b->size = size;
+    }
+    b->channels = channels;
+    b->frames = frames;
+    for(c=0;c<FLAC__MAX_CHANNELS;c++) {
+        b->planar[c] = c < channels ? (void *)luaflac_pcm_buffer_int(b,c) : NULL;
+    }
+    return 1;
+}
+
+LUAFLAC_PRIVATE
+luaflac_pcm_buffer *
+luaflac_pcm_buffer_push(lua_State *L, int format, unsigned int bits_per_sample,
+  unsigned int channels, size_t frames) {
+    luaflac_pcm_buffer *b = lua_newuserdata(L,sizeof(luaflac_pcm_buffer));
+    memset(b,0,sizeof(luaflac_pcm_buffer));
+    b->format = format;
+    b->bits_per_sample = format == LUAFLAC_PCM_INT32 ? bits_per_sample : 0;
+    luaL_setmetatable(L,luaflac_pcm_buffer_mt);
+    if(!luaflac_pcm_buffer_resize(b,channels,frames)) {
+        luaL_error(L,"out of memory");
+        return NULL;
+    }
+    return b;
+}
+
+LUAFLAC_PRIVATE
+luaflac_pcm_buffer *
+luaflac_pcm_buffer_test(lua_State *L, int idx) {
+    return luaL_testudata(L,idx,luaflac_pcm_buffer_mt);
+}
+
+LUAFLAC_PRIVATE
+size_t
+luaflac_pcm_buffer_to_int(const luaflac_pcm_buffer *b, unsigned int bits,
+  FLAC__int32 *const out[], FLAC__uint32 *dither) {
+    double d[LUAFLAC_PCM_CHUNK];
+    const FLAC__int32 *in = NULL;
+    const float *f = NULL;
+    double scale = 0.0;
+    unsigned int shift = 0;
+    unsigned int c = 0;
+    size_t clipped = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+
+    for(c=0;c<b->channels;c++) {
+        if(b->format == LUAFLAC_PCM_INT32 && b->bits_per_sample == bits) {
+            memcpy(out[c],luaflac_pcm_buffer_int(b,c),sizeof(FLAC__int32) * b->frames);
+            continue;
+        }
+        if(b->format == LUAFLAC_PCM_INT32 && b->bits_per_sample < bits) {
+            /* widening is exact */
+            in = luaflac_pcm_buffer_int(b,c);
+            shift = bits - b->bits_per_sample;
+            for(i=0;i<b->frames;i++) {
+                out[c][i] = (FLAC__int32)((FLAC__uint32)in[i] << shift);
+            }
+            continue;
+        }
+
+        if(b->format == LUAFLAC_PCM_FLOAT32) {
+            f = luaflac_pcm_buffer_float(b,c);
+            scale = luaflac_pcm_scale(bits);
+        } else {
+            in = luaflac_pcm_buffer_int(b,c);
+            scale = luaflac_pcm_scale(bits) / luaflac_pcm_scale(b->bits_per_sample);
+        }
+        for(i=0;i<b->frames;i+=n) {
+            n = b->frames - i < LUAFLAC_PCM_CHUNK ? b->frames - i : LUAFLAC_PCM_CHUNK;
+            if(f != NULL) {
+                for(j=0;j<n;j++) d[j] = (double)f[i+j] * scale;
+            } else {
+                for(j=0;j<n;j++) d[j] = (double)in[i+j] * scale;
+            }
+            clipped += luaflac_pcm_round(d,bits,out[c] + i,n,dither);
+        }
+    }
+    return clipped;
+}
+
+static luaflac_pcm_buffer *
+luaflac_pcm_buffer_check(lua_State *L, int idx) {
+    return luaL_checkudata(L,idx,luaflac_pcm_buffer_mt);
+}
+
+static unsigned int
+luaflac_pcm_buffer_checkchannel(lua_State *L, int idx, const luaflac_pcm_buffer *b) {
+    lua_Integer c = luaL_checkinteger(L,idx);
+    if(c < 1 || c > (lua_Integer)b->channels) {
+        luaL_error(L,"channel %d out of range",(int)c);
+        return 0;
+    }
+    return (unsigned int)(c - 1);
+}
+
+static unsigned int
+luaflac_pcm_buffer_checkchannels(lua_State *L, lua_Integer channels) {
+    if(channels < 1 || channels > FLAC__MAX_CHANNELS) {
+        luaL_error(L,"invalid number of channels");
+        return 0;
+    }
+    return (unsigned int)channels;
+}
+
+/* the dither state for the options table at idx. The methods share one
+ * state as their upvalue, so the noise carries on from call to call (and
+ * buffer to buffer) instead of repeating */
+static FLAC__uint32 *
+luaflac_pcm_buffer_dither(lua_State *L, int idx) {
+    return luaflac_pcm_dither_options(L,idx,lua_touserdata(L,lua_upvalueindex(1)));
+}
+
+static int
+luaflac_pcm_buffer_optclip(lua_State *L, int idx) {
+    int clip = 0;
+    if(!lua_istable(L,idx)) return 0;
+    lua_getfield(L,idx,"clip");
+    clip = lua_toboolean(L,-1);
+    lua_pop(L,1);
+    return clip;
+}
+
+/* fills b from packed samples, interleaved and little-endian */
+static void
+luaflac_pcm_buffer_unpack(luaflac_pcm_buffer *b, const unsigned char *p) {
+    FLAC__int32 tmp[LUAFLAC_PCM_CHUNK];
+    unsigned int width = (b->bits_per_sample + 7) / 8;
+    size_t step = LUAFLAC_PCM_CHUNK / b->channels;
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+    unsigned int c = 0;
+    FLAC__uint32 v = 0;
+    float f = 0.0f;
+
+    if(b->format == LUAFLAC_PCM_FLOAT32) {
+        for(i=0;i<b->frames;i++) {
+            for(c=0;c<b->channels;c++) {
+                v = luaflac_pcm_get32(p);
+                memcpy(&f,&v,sizeof(f));
+                luaflac_pcm_buffer_float(b,c)[i] = f;
+                p += 4;
+            }
+        }
+        return;
+    }
+
+    for(i=0;i<b->frames;i+=n) {
+        n = b->frames - i < step ? b->frames - i : step;
+        luaflac_pcm_unpack(p,width,tmp,n * b->channels);
+        for(c=0;c<b->channels;c++) {
+            for(j=0;j<n;j++) {
+                luaflac_pcm_buffer_int(b,c)[i+j] = tmp[j * b->channels + c];
+            }
+        }
+        p += n * b->channels * width;
+    }
+}
+
+static int
+luaflac_pcm_buffer_gc(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    free(b->data);
+    b->data = NULL;
+    b->size = 0;
+    b->frames = 0;
+    return 0;
+}
+
+static int
+luaflac_pcm_buffer_new(lua_State *L) {
+    unsigned int channels = luaflac_pcm_buffer_checkchannels(L,luaL_checkinteger(L,1));
+    lua_Integer frames = luaL_optinteger(L,2,-1);
+    int format = LUAFLAC_PCM_INT32;
+    unsigned int bits_per_sample = 0;
+    const char *data = NULL;
+    size_t len = 0;
+    size_t width = 4;
+    luaflac_pcm_buffer *b = NULL;
+
+    if(lua_istable(L,3)) {
+        lua_getfield(L,3,"format");
+        format = luaL_checkoption(L,-1,"int32",luaflac_pcm_formats);
+        lua_pop(L,1);
+        lua_getfield(L,3,"bits_per_sample");
+        bits_per_sample = (unsigned int)luaL_optinteger(L,-1,0);
+        lua_pop(L,1);
+        lua_getfield(L,3,"data");
+        if(!lua_isnil(L,-1)) data = luaL_checklstring(L,-1,&len);
+        lua_pop(L,1);
+    }
+
+    if(format == LUAFLAC_PCM_INT32) {
+        if(bits_per_sample < 4 || bits_per_sample > 32) {
+            return luaL_error(L,"invalid bits per sample");
+        }
+        width = (bits_per_sample + 7) / 8;
+    }
+    if(data != NULL) {
+        if(len % (channels * width) != 0) {
+            return luaL_error(L,"data isn't a whole number of samples");
+        }
+        if(frames < 0) frames = (lua_Integer)(len / (channels * width));
+        if((size_t)frames != len / (channels * width)) {
+            return luaL_error(L,"data doesn't hold %d frames",(int)frames);
+        }
+    }
+    if(frames < 0) {
+        return luaL_argerror(L,2,"number of frames expected");
+    }
+
+    b = luaflac_pcm_buffer_push(L,format,bits_per_sample,channels,(size_t)frames);
+    if(data != NULL) {
+        luaflac_pcm_buffer_unpack(b,(const unsigned char *)data);
+    } else if(b->data != NULL) {
+        memset(b->data,0,sizeof(FLAC__int32) * channels * (size_t)frames);
+    }
+    return 1;
+}
+
+static int
+luaflac_pcm_buffer_channels(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    lua_pushinteger(L,b->channels);
+    return 1;
+}
+
+static int
+luaflac_pcm_buffer_frames(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    lua_pushinteger(L,(lua_Integer)b->frames);
+    return 1;
+}
+
+static int
+luaflac_pcm_buffer_format(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    lua_pushstring(L,luaflac_pcm_formats[b->format]);
+    return 1;
+}
+
+static int
+luaflac_pcm_buffer_bits_per_sample(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    if(b->format != LUAFLAC_PCM_INT32) return 0;
+    lua_pushinteger(L,b->bits_per_sample);
+    return 1;
+}
+
+static size_t
+luaflac_pcm_buffer_checkframe(lua_State *L, int idx, const luaflac_pcm_buffer *b) {
+    lua_Integer i = luaL_checkinteger(L,idx);
+    if(i < 1 || (size_t)i > b->frames) {
+        luaL_error(L,"frame %d out of range",(int)i);
+        return 0;
+    }
+    return (size_t)(i - 1);
+}
+
+static int
+luaflac_pcm_buffer_get(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    unsigned int c = luaflac_pcm_buffer_checkchannel(L,2,b);
+    size_t i = luaflac_pcm_buffer_checkframe(L,3,b);
+
+    if(b->format == LUAFLAC_PCM_FLOAT32) {
+        lua_pushnumber(L,luaflac_pcm_buffer_float(b,c)[i]);
+    } else {
+        lua_pushinteger(L,luaflac_pcm_buffer_int(b,c)[i]);
+    }
+    return 1;
+}
+
+static int
+luaflac_pcm_buffer_set(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    unsigned int c = luaflac_pcm_buffer_checkchannel(L,2,b);
+    size_t i = luaflac_pcm_buffer_checkframe(L,3,b);
+
+    if(b->format == LUAFLAC_PCM_FLOAT32) {
+        luaflac_pcm_buffer_float(b,c)[i] = (float)luaL_checknumber(L,4);
+    } else {
+        luaflac_pcm_buffer_int(b,c)[i] = (FLAC__int32)luaL_checkinteger(L,4);
+    }
+    return 0;
+}
+
+/* buffer:gain(g [, options]) - in place */
+static int
+luaflac_pcm_buffer_gain(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    double g = luaL_checknumber(L,2);
+    int clip = luaflac_pcm_buffer_optclip(L,3);
+    FLAC__uint32 *dither = luaflac_pcm_buffer_dither(L,3);
+    double d[LUAFLAC_PCM_CHUNK];
+    FLAC__int32 *in = NULL;
+    float *f = NULL;
+    unsigned int c = 0;
+    size_t clipped = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+
+    for(c=0;c<b->channels;c++) {
+        for(i=0;i<b->frames;i+=n) {
+            n = b->frames - i < LUAFLAC_PCM_CHUNK ? b->frames - i : LUAFLAC_PCM_CHUNK;
+            if(b->format == LUAFLAC_PCM_FLOAT32) {
+                f = luaflac_pcm_buffer_float(b,c) + i;
+                for(j=0;j<n;j++) d[j] = (double)f[j] * g;
+                clipped += luaflac_pcm_store_float(d,f,n,clip);
+            } else {
+                in = luaflac_pcm_buffer_int(b,c) + i;
+                for(j=0;j<n;j++) d[j] = (double)in[j] * g;
+                clipped += luaflac_pcm_round(d,b->bits_per_sample,in,n,dither);
+            }
+        }
+    }
+
+    lua_pushvalue(L,1);
+    lua_pushinteger(L,(lua_Integer)clipped);
+    return 2;
+}
+
+/* buffer:mix(matrix [, options]) - matrix[out][in] is the gain from each
+ * input channel to each output channel */
+static int
+luaflac_pcm_buffer_mix(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    double m[FLAC__MAX_CHANNELS][FLAC__MAX_CHANNELS];
+    double d[LUAFLAC_PCM_CHUNK];
+    unsigned int outs = 0;
+    unsigned int o = 0;
+    unsigned int k = 0;
+    int clip = luaflac_pcm_buffer_optclip(L,3);
+    FLAC__uint32 *dither = luaflac_pcm_buffer_dither(L,3);
+    luaflac_pcm_buffer *r = NULL;
+    const FLAC__int32 *in = NULL;
+    const float *f = NULL;
+    double g = 0.0;
+    size_t clipped = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+
+    luaL_checktype(L,2,LUA_TTABLE);
+    outs = luaflac_pcm_buffer_checkchannels(L,(lua_Integer)lua_rawlen(L,2));
+    for(o=0;o<outs;o++) {
+        lua_rawgeti(L,2,o+1);
+        if(!lua_istable(L,-1)) {
+            return luaL_error(L,"mix row %d isn't a table",(int)(o + 1));
+        }
+        if(lua_rawlen(L,-1) > b->channels) {
+            return luaL_error(L,"mix row %d has more gains than the buffer has channels",(int)(o + 1));
+        }
+        for(k=0;k<b->channels;k++) {
+            lua_rawgeti(L,-1,k+1);
+            m[o][k] = lua_isnil(L,-1) ? 0.0 : luaL_checknumber(L,-1);
+            lua_pop(L,1);
+        }
+        lua_pop(L,1);
+    }
+
+    r = luaflac_pcm_buffer_push(L,b->format,b->bits_per_sample,outs,b->frames);
+    for(o=0;o<outs;o++) {
+        for(i=0;i<b->frames;i+=n) {
+            n = b->frames - i < LUAFLAC_PCM_CHUNK ? b->frames - i : LUAFLAC_PCM_CHUNK;
+            memset(d,0,sizeof(double) * n);
+            for(k=0;k<b->channels;k++) {
+                g = m[o][k];
+                if(g == 0.0) continue;
+                if(b->format == LUAFLAC_PCM_FLOAT32) {
+                    f = luaflac_pcm_buffer_float(b,k) + i;
+                    for(j=0;j<n;j++) d[j] += (double)f[j] * g;
+                } else {
+                    in = luaflac_pcm_buffer_int(b,k) + i;
+                    for(j=0;j<n;j++) d[j] += (double)in[j] * g;
+                }
+            }
+            if(b->format == LUAFLAC_PCM_FLOAT32) {
+                clipped += luaflac_pcm_store_float(d,luaflac_pcm_buffer_float(r,o) + i,n,clip);
+            } else {
+                clipped += luaflac_pcm_round(d,b->bits_per_sample,luaflac_pcm_buffer_int(r,o) + i,n,dither);
+            }
+        }
+    }
+
+    lua_pushinteger(L,(lua_Integer)clipped);
+    return 2;
+}
+
+/* buffer:select(channels) - a new buffer with the listed channels, in order */
+static int
+luaflac_pcm_buffer_select(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    unsigned int map[FLAC__MAX_CHANNELS];
+    unsigned int outs = 0;
+    unsigned int o = 0;
+    luaflac_pcm_buffer *r = NULL;
+
+    luaL_checktype(L,2,LUA_TTABLE);
+    outs = luaflac_pcm_buffer_checkchannels(L,(lua_Integer)lua_rawlen(L,2));
+    for(o=0;o<outs;o++) {
+        lua_rawgeti(L,2,o+1);
+        map[o] = luaflac_pcm_buffer_checkchannel(L,-1,b);
+        lua_pop(L,1);
+    }
+
+    r = luaflac_pcm_buffer_push(L,b->format,b->bits_per_sample,outs,b->frames);
+    for(o=0;o<outs;o++) {
+        memcpy(luaflac_pcm_buffer_int(r,o),luaflac_pcm_buffer_int(b,map[o]),
+          sizeof(FLAC__int32) * b->frames);
+    }
+    return 1;
+}
+
+/* buffer:slice(first [, last]) - a copy of frames first through last */
+static int
+luaflac_pcm_buffer_slice(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    lua_Integer first = luaL_checkinteger(L,2);
+    lua_Integer last = luaL_optinteger(L,3,(lua_Integer)b->frames);
+    luaflac_pcm_buffer *r = NULL;
+    size_t frames = 0;
+    unsigned int c = 0;
+
+    if(first < 1) first = 1;
+    if(last > (lua_Integer)b->frames) last = (lua_Integer)b->frames;
+    if(last >= first) frames = (size_t)(last - first + 1);
+
+    r = luaflac_pcm_buffer_push(L,b->format,b->bits_per_sample,b->channels,frames);
+    for(c=0;c<b->channels && frames > 0;c++) {
+        memcpy(luaflac_pcm_buffer_int(r,c),luaflac_pcm_buffer_int(b,c) + (first - 1),
+          sizeof(FLAC__int32) * frames);
+    }
+    return 1;
+}
+
+/* buffer:convert(options) - a copy in another format or bit depth */
+static int
+luaflac_pcm_buffer_convert(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    int format = b->format;
+    unsigned int bits_per_sample = b->bits_per_sample;
+    FLAC__uint32 *dither = NULL;
+    FLAC__int32 *out[FLAC__MAX_CHANNELS];
+    luaflac_pcm_buffer *r = NULL;
+    const FLAC__int32 *in = NULL;
+    float *f = NULL;
+    float scale = 0.0f;
+    size_t clipped = 0;
+    unsigned int c = 0;
+    size_t i = 0;
+
+    luaL_checktype(L,2,LUA_TTABLE);
+    lua_getfield(L,2,"format");
+    format = luaL_checkoption(L,-1,luaflac_pcm_formats[b->format],luaflac_pcm_formats);
+    lua_pop(L,1);
+    lua_getfield(L,2,"bits_per_sample");
+    bits_per_sample = (unsigned int)luaL_optinteger(L,-1,b->bits_per_sample);
+    lua_pop(L,1);
+    dither = luaflac_pcm_buffer_dither(L,2);
+
+    if(format == LUAFLAC_PCM_INT32 && (bits_per_sample < 4 || bits_per_sample > 32)) {
+        return luaL_error(L,"invalid bits per sample");
+    }
+
+    r = luaflac_pcm_buffer_push(L,format,bits_per_sample,b->channels,b->frames);
+    if(format == LUAFLAC_PCM_INT32) {
+        for(c=0;c<b->channels;c++) {
+            out[c] = luaflac_pcm_buffer_int(r,c);
+        }
+        clipped = luaflac_pcm_buffer_to_int(b,bits_per_sample,out,dither);
+    } else if(b->format == LUAFLAC_PCM_FLOAT32) {
+        memcpy(r->data,b->data,sizeof(float) * b->channels * b->frames);
+    } else {
+        /* a power of two, so only samples over 24 bits are rounded */
+        scale = 1.0f / (float)luaflac_pcm_scale(b->bits_per_sample);
+        for(c=0;c<b->channels;c++) {
+            in = luaflac_pcm_buffer_int(b,c);
+            f = luaflac_pcm_buffer_float(r,c);
+            for(i=0;i<b->frames;i++) f[i] = (float)in[i] * scale;
+        }
+    }
+
+    lua_pushinteger(L,(lua_Integer)clipped);
+    return 2;
+}
+
+/* buffer:pack() - interleaved and little-endian, the layout
+ * process_packed, process_float and decode_range use */
+static int
+luaflac_pcm_buffer_pack(lua_State *L) {
+    luaflac_pcm_buffer *b = luaflac_pcm_buffer_check(L,1);
+    FLAC__int32 tmp[LUAFLAC_PCM_CHUNK];
+    unsigned char bytes[LUAFLAC_PCM_CHUNK * 4];
+    unsigned int width = b->format == LUAFLAC_PCM_FLOAT32 ? 4 : (b->bits_per_sample + 7) / 8;
+    size_t step = LUAFLAC_PCM_CHUNK / b->channels;
+    luaL_Buffer buf;
+    FLAC__uint32 v = 0;
+    unsigned int c = 0;
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+
+    luaL_buffinit(L,&buf);
+    for(i=0;i<b->frames;i+=n) {
+        n = b->frames - i < step ? b->frames - i : step;
+        for(c=0;c<b->channels;c++) {
+            for(j=0;j<n;j++) {
+                if(b->format == LUAFLAC_PCM_FLOAT32) {
+                    memcpy(&v,&luaflac_pcm_buffer_float(b,c)[i+j],sizeof(v));
+                    luaflac_pcm_put32(&bytes[(j * b->channels + c) * 4],v);
+                } else {
+                    tmp[j * b->channels + c] = luaflac_pcm_buffer_int(b,c)[i+j];
+                }
+            }
+        }
+        if(b->format == LUAFLAC_PCM_INT32) {
+            luaflac_pcm_pack(bytes,width,tmp,n * b->channels);
+        }
+        luaL_addlstring(&buf,(const char *)bytes,n * b->channels * width);
+    }
+    luaL_pushresult(&buf);
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_pcm_buffer_functions[] = {
+    { "pcm_buffer", luaflac_pcm_buffer_new },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaflac_pcm_buffer_methods[] = {
+    { "channels", luaflac_pcm_buffer_channels },
+    { "frames", luaflac_pcm_buffer_frames },
+    { "format", luaflac_pcm_buffer_format },
+    { "bits_per_sample", luaflac_pcm_buffer_bits_per_sample },
+    { "get", luaflac_pcm_buffer_get },
+    { "set", luaflac_pcm_buffer_set },
+    { "gain", luaflac_pcm_buffer_gain },
+    { "mix", luaflac_pcm_buffer_mix },
+    { "select", luaflac_pcm_buffer_select },
+    { "slice", luaflac_pcm_buffer_slice },
+    { "convert", luaflac_pcm_buffer_convert },
+    { "pack", luaflac_pcm_buffer_pack },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_pcm_buffer(lua_State *L) {
+    FLAC__uint32 *state = NULL;
+
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_pcm_buffer_functions,0);
+
+    luaL_newmetatable(L,luaflac_pcm_buffer_mt);
+    lua_pushcclosure(L,luaflac_pcm_buffer_gc,0);
+    lua_setfield(L,-2,"__gc");
+    lua_pushcclosure(L,luaflac_pcm_buffer_frames,0);
+    lua_setfield(L,-2,"__len");
+    lua_newtable(L); /* __index */
+    state = lua_newuserdata(L,sizeof(FLAC__uint32));
+    *state = LUAFLAC_PCM_SEED;
+    luaL_setfuncs(L,luaflac_pcm_buffer_methods,1);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    return 1;
+}
@@ -0,0 +1,560 @@
+#if !defined(_WIN32) && !defined(_WIN64)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "luaflac_internal.h"
+#include "luaflac_thread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* flac.playlist - plays a list of files as one stream, for gapless
+ * playback. A background thread keeps the next few tracks open, with their
+ * metadata read and their first frames decoded, so moving on to the next
+ * track doesn't wait on opening a file.
+ *
+ * Tracks are decoded with the frame reader and the memory-fed frame
+ * decoder, which never call into Lua, so the thread can work on them while
+ * Lua reads the track before. The playlist only hands a track over once
+ * the thread is done with it. */
+
+LUAFLAC_PRIVATE
+const char * const luaflac_playlist_mt = "luaflac_playlist";
+
+#define LUAFLAC_PLAYLIST_PREFETCH 2
+#define LUAFLAC_PLAYLIST_PREFETCH_SAMPLES 16384
+#define LUAFLAC_PLAYLIST_READ 4096
+
+enum luaflac_playlist_state_e {
+    LUAFLAC_TRACK_QUEUED,
+    LUAFLAC_TRACK_OPENING,
+    LUAFLAC_TRACK_READY /* opened, or failed with error set */
+};
+
+struct luaflac_playlist_track_s {
+    struct luaflac_playlist_track_s *next;
+    char *path;
+    lua_Integer number; /* in the order tracks were added, from 1 */
+    int state;
+    int prefetched; /* was ready before playback got to it */
+    const char *error;
+
+    FILE *f;
+    luaflac_frame_reader reader;
+    luaflac_frame_decoder decoder;
+    int at_end;
+    FLAC__uint64 played; /* samples per channel handed out */
+
+    /* decoded samples not read yet, from pos to len in each channel */
+    FLAC__int32 *pcm[FLAC__MAX_CHANNELS];
+    size_t pcm_size;
+    size_t pos;
+    size_t len;
+};
+
+typedef struct luaflac_playlist_track_s luaflac_playlist_track;
+
+typedef struct luaflac_playlist_s {
+    luaflac_mutex lock;
+    luaflac_cond wake; /* the thread has something to do */
+    luaflac_cond ready; /* a track finished opening */
+    luaflac_thread thread;
+    int started;
+    int quit;
+    int closed;
+
+    unsigned int prefetch; /* tracks kept open ahead */
+    size_t prefetch_samples; /* decoded per track ahead of time */
+
+    /* tracks after the current one, the thread works on the first few */
+    luaflac_playlist_track *head;
+    luaflac_playlist_track *tail;
+    lua_Integer added;
+
+    /* only touched by Lua's thread */
+    luaflac_playlist_track *current;
+    int announced;
+    unsigned int sample_rate;
+    unsigned int channels;
+    unsigned int bits_per_sample;
+} luaflac_playlist;
+
+static void
+luaflac_playlist_track_free(luaflac_playlist_track *t) {
+    unsigned int c = 0;
+
+    luaflac_frame_decoder_free(&t->decoder);
+    luaflac_frame_reader_free(&t->reader);
+    if(t->f != NULL) fclose(t->f);
+    for(c=0;c<FLAC__MAX_CHANNELS;c++) {
+        free(t->pcm[c]);
+    }
+    free(t->path);
+    free(t);
+}
+
+/* decodes the next frame onto the end of the track's samples */
+static void
+luaflac_playlist_track_decode(luaflac_playlist_track *t) {
+    luaflac_frame frame;
+    FLAC__int32 *tmp = NULL;
+    unsigned int channels = t->reader.streaminfo.channels;
+    unsigned int c = 0;
+    size_t size = 0;
+    int res = 0;
+
+    res = luaflac_frame_reader_next(&t->reader,&frame);
+    if(res == 0) {
+        t->at_end = 1;
+        return;
+    }
+    if(res < 0) {
+        t->error = "error reading frames";
+        return;
+    }
+    if(frame.header.channels != channels) {
+        t->error = "the audio format changed";
+        return;
+    }
+    if(!luaflac_frame_decoder_run(&t->decoder,frame.data,frame.size)) {
+        t->error = t->decoder.error;
+        return;
+    }
+
+    if(t->pos > 0) {
+        for(c=0;c<channels;c++) {
+            memmove(t->pcm[c],t->pcm[c] + t->pos,(t->len - t->pos) * sizeof(FLAC__int32));
+        }
+        t->len -= t->pos;
+        t->pos = 0;
+    }
+    if(t->len + t->decoder.samples > t->pcm_size) {
+        size = t->len + t->decoder.samples;
+        for(c=0;c<channels;c++) {
+            tmp = realloc(t->pcm[c],size * sizeof(FLAC__int32));
+            if(tmp == NULL) {
+                t->error = "out of memory";
+                return;
+            }
+            t->pcm[c] = tmp;
+        }
+        t->pcm_size = size;
+    }
+    for(c=0;c<channels;c++) {
+        memcpy(t->pcm[c] + t->len,t->decoder.pcm[c],t->decoder.samples * sizeof(FLAC__int32));
+    }
+    t->len += t->decoder.samples;
+}
+
+/* reads the metadata and decodes the first samples. Runs on the playlist's
+ * thread without the lock, or on Lua's when there's no thread */
+static void
+luaflac_playlist_track_open(luaflac_playlist_track *t, size_t prefetch_samples) {
+    t->f = fopen(t->path,"rb");
+    if(t->f == NULL) {
+        t->error = "error opening file";
+        return;
+    }
+    if(!luaflac_frame_reader_init(&t->reader,t->f)) {
+        t->error = "error reading metadata";
+        return;
+    }
+    t->decoder.keep = 1;
+    if(!luaflac_frame_decoder_init(&t->decoder,&t->reader.streaminfo)) {
+        t->error = "error creating decoder";
+        return;
+    }
+    while(t->error == NULL && !t->at_end && t->len < prefetch_samples) {
+        luaflac_playlist_track_decode(t);
+    }
+}
+
+static void
+luaflac_playlist_thread(void *arg) {
+    luaflac_playlist *p = (luaflac_playlist *)arg;
+    luaflac_playlist_track *t = NULL;
+    unsigned int i = 0;
+
+    luaflac_mutex_lock(&p->lock);
+    while(!p->quit) {
+        for(t=p->head, i=0; t != NULL && i < p->prefetch; t=t->next, i++) {
+            if(t->state == LUAFLAC_TRACK_QUEUED) break;
+        }
+        if(t == NULL || i == p->prefetch) {
+            luaflac_cond_wait(&p->wake,&p->lock);
+            continue;
+        }
+
+        t->state = LUAFLAC_TRACK_OPENING;
+        luaflac_mutex_unlock(&p->lock);
+        luaflac_playlist_track_open(t,p->prefetch_samples);
+        luaflac_mutex_lock(&p->lock);
+        t->state = LUAFLAC_TRACK_READY;
+        t->prefetched = 1;
+        luaflac_cond_broadcast(&p->ready);
+    }
+    luaflac_mutex_unlock(&p->lock);
+}
+
+/* makes the next track current, waiting for the thread to finish opening it
+ * if needed. Returns 0 at the end of the list */
+static int
+luaflac_playlist_advance(luaflac_playlist *p) {
+    luaflac_playlist_track *t = NULL;
+
+    luaflac_mutex_lock(&p->lock);
+    t = p->head;
+    if(t == NULL) {
+        luaflac_mutex_unlock(&p->lock);
+        return 0;
+    }
+    p->head = t->next;
+    if(p->head == NULL) p->tail = NULL;
+    t->next = NULL;
+
+    if(t->state == LUAFLAC_TRACK_QUEUED) {
+        /* not prefetching, or the thread hasn't got to it */
+        t->state = LUAFLAC_TRACK_OPENING;
+        luaflac_mutex_unlock(&p->lock);
+        luaflac_playlist_track_open(t,0);
+        luaflac_mutex_lock(&p->lock);
+        t->state = LUAFLAC_TRACK_READY;
+    }
+    while(t->state != LUAFLAC_TRACK_READY) {
+        luaflac_cond_wait(&p->ready,&p->lock);
+    }
+    /* one more track fits in the window */
+    luaflac_cond_signal(&p->wake);
+    luaflac_mutex_unlock(&p->lock);
+
+    p->current = t;
+    p->announced = 0;
+    return 1;
+}
+
+static void
+luaflac_playlist_drop(luaflac_playlist *p) {
+    if(p->current == NULL) return;
+    luaflac_playlist_track_free(p->current);
+    p->current = NULL;
+}
+
+static void
+luaflac_playlist_close(luaflac_playlist *p) {
+    luaflac_playlist_track *t = NULL;
+
+    if(p->closed) return;
+    p->closed = 1;
+
+    if(p->started) {
+        luaflac_mutex_lock(&p->lock);
+        p->quit = 1;
+        luaflac_cond_signal(&p->wake);
+        luaflac_mutex_unlock(&p->lock);
+        luaflac_thread_join(&p->thread);
+        p->started = 0;
+    }
+
+    luaflac_playlist_drop(p);
+    while(p->head != NULL) {
+        t = p->head;
+        p->head = t->next;
+        luaflac_playlist_track_free(t);
+    }
+    p->tail = NULL;
+
+    luaflac_cond_destroy(&p->ready);
+    luaflac_cond_destroy(&p->wake);
+    luaflac_mutex_destroy(&p->lock);
+}
+
+static luaflac_playlist *
+luaflac_playlist_check(lua_State *L, int idx) {
+    luaflac_playlist *p = luaL_checkudata(L,idx,luaflac_playlist_mt);
+    if(p->closed) {
+        luaL_error(L,"playlist is closed");
+        return NULL;
+    }
+    return p;
+}
+
+static int
+luaflac_playlist_gc(lua_State *L) {
+    luaflac_playlist *p = luaL_checkudata(L,1,luaflac_playlist_mt);
+    luaflac_playlist_close(p);
+    return 0;
+}
+
+/* queues the path at idx, returns its track number */
+static lua_Integer
+luaflac_playlist_queue(lua_State *L, luaflac_playlist *p, int idx) {
+    size_t len = 0;
+    const char *path = luaL_checklstring(L,idx,&len);
+    luaflac_playlist_track *t = NULL;
+
+    t = calloc(1,sizeof(luaflac_playlist_track));
+    if(t != NULL) t->path = malloc(len + 1);
+    if(t == NULL || t->path == NULL) {
+        free(t);
+        luaL_error(L,"out of memory");
+        return 0;
+    }
+    memcpy(t->path,path,len + 1);
+    t->state = LUAFLAC_TRACK_QUEUED;
+
+    luaflac_mutex_lock(&p->lock);
+    t->number = ++p->added;
+    if(p->tail == NULL) {
+        p->head = t;
+    } else {
+        p->tail->next = t;
+    }
+    p->tail = t;
+    luaflac_cond_signal(&p->wake);
+    luaflac_mutex_unlock(&p->lock);
+
+    return t->number;
+}
+
+static int
+luaflac_playlist_add(lua_State *L) {
+    luaflac_playlist *p = luaflac_playlist_check(L,1);
+    lua_pushinteger(L,luaflac_playlist_queue(L,p,2));
+    return 1;
+}
+
+/* pushes a table describing the current track, or why it can't be played
+ * when error isn't NULL */
+static void
+luaflac_playlist_push_event(lua_State *L, luaflac_playlist *p, const char *error) {
+    luaflac_playlist_track *t = p->current;
+    const FLAC__StreamMetadata_StreamInfo *s = &t->reader.streaminfo;
+
+    lua_createtable(L,0,10);
+    lua_pushinteger(L,t->number);
+    lua_setfield(L,-2,"track");
+    lua_pushstring(L,t->path);
+    lua_setfield(L,-2,"path");
+    if(error != NULL) {
+        lua_pushstring(L,error);
+        lua_setfield(L,-2,"error");
+        return;
+    }
+
+    lua_pushinteger(L,s->sample_rate);
+    lua_setfield(L,-2,"sample_rate");
+    lua_pushinteger(L,s->channels);
+    lua_setfield(L,-2,"channels");
+    lua_pushinteger(L,s->bits_per_sample);
+    lua_setfield(L,-2,"bits_per_sample");
+    if(s->total_samples != 0) {
+        luaflac_pushuint64(L,s->total_samples);
+        lua_setfield(L,-2,"total_samples");
+    }
+    lua_pushboolean(L,p->sample_rate != s->sample_rate || p->channels != s->channels ||
+      p->bits_per_sample != s->bits_per_sample);
+    lua_setfield(L,-2,"format_changed");
+    lua_pushboolean(L,t->prefetched);
+    lua_setfield(L,-2,"prefetched");
+
+    p->sample_rate = s->sample_rate;
+    p->channels = s->channels;
+    p->bits_per_sample = s->bits_per_sample;
+}
+
+static int
+luaflac_playlist_read(lua_State *L) {
+    luaflac_playlist *p = luaflac_playlist_check(L,1);
+    lua_Integer frames = luaL_optinteger(L,2,LUAFLAC_PLAYLIST_READ);
+    luaflac_pcm_buffer *b = NULL;
+    luaflac_playlist_track *t = NULL;
+    unsigned int channels = 0;
+    unsigned int c = 0;
+    size_t n = 0;
+
+    if(frames < 1) {
+        return luaL_argerror(L,2,"frames must be positive");
+    }
+    if(!lua_isnoneornil(L,3) && luaflac_pcm_buffer_test(L,3) == NULL) {
+        return luaL_argerror(L,3,"pcm_buffer expected");
+    }
+
+    for(;;) {
+        if(p->current == NULL && !luaflac_playlist_advance(p)) {
+            lua_pushnil(L);
+            return 1;
+        }
+        t = p->current;
+
+        if(t->error == NULL && t->pos == t->len && !t->at_end) {
+            luaflac_playlist_track_decode(t);
+        }
+        /* samples decoded before an error still get played */
+        if(t->pos < t->len) break;
+        if(t->error != NULL) {
+            lua_pushboolean(L,0);
+            luaflac_playlist_push_event(L,p,t->error);
+            luaflac_playlist_drop(p);
+            return 2;
+        }
+
+        /* the track ended, carry on with the next one */
+        luaflac_playlist_drop(p);
+    }
+
+    channels = t->reader.streaminfo.channels;
+    n = t->len - t->pos;
+    if((size_t)frames < n) n = (size_t)frames;
+
+    if(lua_isnoneornil(L,3)) {
+        b = luaflac_pcm_buffer_push(L,LUAFLAC_PCM_INT32,t->reader.streaminfo.bits_per_sample,channels,n);
+    } else {
+        lua_pushvalue(L,3);
+        b = luaflac_pcm_buffer_test(L,-1);
+        b->format = LUAFLAC_PCM_INT32;
+        b->bits_per_sample = t->reader.streaminfo.bits_per_sample;
+        if(!luaflac_pcm_buffer_resize(b,channels,n)) {
+            return luaL_error(L,"out of memory");
+        }
+    }
+    for(c=0;c<channels;c++) {
+        memcpy(luaflac_pcm_buffer_int(b,c),t->pcm[c] + t->pos,n * sizeof(FLAC__int32));
+    }
+    t->pos += n;
+    t->played += n;
+
+    if(!p->announced) {
+        p->announced = 1;
+        luaflac_playlist_push_event(L,p,NULL);
+        return 2;
+    }
+    return 1;
+}
+
+static int
+luaflac_playlist_skip(lua_State *L) {
+    luaflac_playlist *p = luaflac_playlist_check(L,1);
+    luaflac_playlist_drop(p);
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* the current track's number and how far into it reading is */
+static int
+luaflac_playlist_position(lua_State *L) {
+    luaflac_playlist *p = luaflac_playlist_check(L,1);
+    luaflac_playlist_track *t = p->current;
+
+    if(t == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushinteger(L,t->number);
+    luaflac_pushuint64(L,t->played);
+    return 2;
+}
+
+static int
+luaflac_playlist_close_method(lua_State *L) {
+    luaflac_playlist *p = luaL_checkudata(L,1,luaflac_playlist_mt);
+    luaflac_playlist_close(p);
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaflac_playlist_new(lua_State *L) {
+    luaflac_playlist *p = NULL;
+    lua_Integer prefetch = LUAFLAC_PLAYLIST_PREFETCH;
+    lua_Integer prefetch_samples = LUAFLAC_PLAYLIST_PREFETCH_SAMPLES;
+    int has_paths = 0;
+    lua_Integer i = 0;
+
+    lua_settop(L,2);
+    if(!lua_isnil(L,2)) {
+        luaL_checktype(L,2,LUA_TTABLE);
+        lua_getfield(L,2,"prefetch");
+        prefetch = luaL_optinteger(L,-1,prefetch);
+        lua_getfield(L,2,"prefetch_samples");
+        prefetch_samples = luaL_optinteger(L,-1,prefetch_samples);
+        lua_pop(L,2);
+    }
+    if(!lua_isnil(L,1)) {
+        luaL_checktype(L,1,LUA_TTABLE);
+        has_paths = 1;
+    }
+    if(prefetch < 0) prefetch = 0;
+    if(prefetch_samples < 0) prefetch_samples = 0;
+
+    p = lua_newuserdata(L,sizeof(luaflac_playlist));
+    memset(p,0,sizeof(luaflac_playlist));
+    p->prefetch = (unsigned int)prefetch;
+    p->prefetch_samples = (size_t)prefetch_samples;
+    p->closed = 1; /* until the lock exists */
+    luaL_setmetatable(L,luaflac_playlist_mt);
+
+    if(luaflac_mutex_init(&p->lock) != 0) {
+        return luaL_error(L,"error creating mutex");
+    }
+    if(luaflac_cond_init(&p->wake) != 0) {
+        luaflac_mutex_destroy(&p->lock);
+        return luaL_error(L,"error creating condition variable");
+    }
+    if(luaflac_cond_init(&p->ready) != 0) {
+        luaflac_cond_destroy(&p->wake);
+        luaflac_mutex_destroy(&p->lock);
+        return luaL_error(L,"error creating condition variable");
+    }
+    p->closed = 0;
+
+    /* without the thread, tracks are opened when they're reached */
+    if(p->prefetch > 0) {
+        p->started = luaflac_thread_create(&p->thread,luaflac_playlist_thread,p) == 0;
+    }
+
+    if(has_paths) {
+        for(i=1;i<=(lua_Integer)lua_rawlen(L,1);i++) {
+            lua_rawgeti(L,1,i);
+            luaflac_playlist_queue(L,p,-1);
+            lua_pop(L,1);
+        }
+    }
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_playlist_functions[] = {
+    { "playlist", luaflac_playlist_new },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaflac_playlist_methods[] = {
+    { "add", luaflac_playlist_add },
+    { "read", luaflac_playlist_read },
+    { "skip", luaflac_playlist_skip },
+    { "position", luaflac_playlist_position },
+    { "close", luaflac_playlist_close_method },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_playlist(lua_State *L) {
+    lua_getglobal(L,"require");
+    lua_pushstring(L,"luaflac.uint64");
+    lua_call(L,1,1);
+    lua_pop(L,1);
+
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_playlist_functions,0);
+
+    luaL_newmetatable(L,luaflac_playlist_mt);
+    lua_pushcclosure(L,luaflac_playlist_gc,0);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L); /* __index */
+    luaL_setfuncs(L,luaflac_playlist_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    return 1;
+}
@@ -0,0 +1,429 @@
+#if !defined(_WIN32) && !defined(_WIN64)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "luaflac_internal.h"
+#include "luaflac_thread.h"
+#include <FLAC/metadata.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#endif
+
+/* flac.scan - reads metadata from many files on a pool of threads.
+ * The worker threads never touch the Lua state, they parse blocks
+ * into FLAC__StreamMetadata objects and queue them up, and blocks are
+ * only converted to tables when Lua asks for the next result. */
+
+LUAFLAC_PRIVATE
+const char * const luaflac_scan_mt = "luaflac_scan";
+
+#define LUAFLAC_SCAN_READAHEAD 65536
+
+struct luaflac_scan_result_s {
+    size_t index;
+    const char *error;
+    luaflac_parsed_block *blocks;
+    unsigned int num_blocks;
+};
+
+typedef struct luaflac_scan_result_s luaflac_scan_result;
+
+struct luaflac_scan_s {
+    luaflac_mutex lock;
+    luaflac_cond ready; /* a result was queued */
+    luaflac_cond space; /* a result was taken off the queue */
+
+    char **paths;
+    size_t num_paths;
+    size_t next;      /* next path to hand to a worker */
+    size_t delivered; /* results returned to Lua */
+
+    /* ring buffer of finished results, bounds how far workers run ahead */
+    luaflac_scan_result *queue;
+    size_t queue_size;
+    size_t queue_head;
+    size_t queue_count;
+
+    unsigned char want[FLAC__MAX_METADATA_TYPE_CODE + 1];
+    int flags;
+    int push_flags;
+    long readahead;
+    int stop;
+
+    luaflac_thread *threads;
+    unsigned int num_threads;
+};
+
+typedef struct luaflac_scan_s luaflac_scan;
+
+struct luaflac_scan_userdata_s {
+    luaflac_scan *scan;
+};
+
+typedef struct luaflac_scan_userdata_s luaflac_scan_userdata;
+
+static void
+luaflac_scan_probe(luaflac_scan *s, size_t index, luaflac_scan_result *r) {
+    unsigned char want[FLAC__MAX_METADATA_TYPE_CODE + 1];
+    FILE *f = NULL;
+
+    r->index = index;
+    r->error = NULL;
+    r->blocks = NULL;
+    r->num_blocks = 0;
+
+    f = fopen(s->paths[index],"rb");
+    if(f == NULL) {
+        r->error = "error opening file";
+        return;
+    }
+
+#if defined(POSIX_FADV_WILLNEED)
+    if(s->readahead > 0) {
+        /* metadata is at the start of the file, have the kernel fetch it
+         * while the stdio buffer only asks for a few KB at a time */
+        posix_fadvise(fileno(f),0,s->readahead,POSIX_FADV_WILLNEED);
+    }
+#endif
+
+    memcpy(want,s->want,sizeof(want));
+    if(!luaflac_parse_metadata(f,want,s->flags,&r->blocks,&r->num_blocks)) {
+        r->error = "error reading metadata";
+    }
+    fclose(f);
+}
+
+static void
+luaflac_scan_worker(void *arg) {
+    luaflac_scan *s = (luaflac_scan *)arg;
+    luaflac_scan_result r;
+    size_t index = 0;
+
+    luaflac_mutex_lock(&s->lock);
+    while(!s->stop && s->next < s->num_paths) {
+        index = s->next++;
+        luaflac_mutex_unlock(&s->lock);
+
+        luaflac_scan_probe(s,index,&r);
+
+        luaflac_mutex_lock(&s->lock);
+        while(!s->stop && s->queue_count == s->queue_size) {
+            luaflac_cond_wait(&s->space,&s->lock);
+        }
+        if(s->stop) {
+            luaflac_parsed_free(r.blocks,r.num_blocks);
+            break;
+        }
+        s->queue[(s->queue_head + s->queue_count) % s->queue_size] = r;
+        s->queue_count++;
+        luaflac_cond_signal(&s->ready);
+    }
+    luaflac_mutex_unlock(&s->lock);
+}
+
+static void
+luaflac_scan_free(luaflac_scan *s) {
+    unsigned int i = 0;
+    size_t j = 0;
+
+    if(s->threads != NULL) {
+        luaflac_mutex_lock(&s->lock);
+        s->stop = 1;
+        luaflac_cond_broadcast(&s->space);
+        luaflac_mutex_unlock(&s->lock);
+
+        for(i=0;i<s->num_threads;i++) {
+            luaflac_thread_join(&s->threads[i]);
+        }
+        free(s->threads);
+    }
+
+    for(j=0;j<s->queue_count;j++) {
+        luaflac_scan_result *r = &s->queue[(s->queue_head + j) % s->queue_size];
+        luaflac_parsed_free(r->blocks,r->num_blocks);
+    }
+    free(s->queue);
+
+    if(s->paths != NULL) {
+        for(j=0;j<s->num_paths;j++) {
+            free(s->paths[j]);
+        }
+        free(s->paths);
+    }
+
+    luaflac_cond_destroy(&s->space);
+    luaflac_cond_destroy(&s->ready);
+    luaflac_mutex_destroy(&s->lock);
+    free(s);
+}
+
+static int
+luaflac_scan_close(lua_State *L) {
+    luaflac_scan_userdata *u = luaL_checkudata(L,1,luaflac_scan_mt);
+    if(u->scan != NULL) {
+        luaflac_scan_free(u->scan);
+        u->scan = NULL;
+    }
+    return 0;
+}
+
+/* pops one result off the queue, waiting for a worker if needed.
+ * Returns 0 once every result has been delivered */
+static int
+luaflac_scan_pop(luaflac_scan *s, luaflac_scan_result *r, int wait) {
+    int ok = 0;
+    luaflac_mutex_lock(&s->lock);
+    while(wait && s->queue_count == 0 && s->delivered < s->num_paths) {
+        luaflac_cond_wait(&s->ready,&s->lock);
+    }
+    if(s->queue_count > 0) {
+        *r = s->queue[s->queue_head];
+        s->queue_head = (s->queue_head + 1) % s->queue_size;
+        s->queue_count--;
+        s->delivered++;
+        luaflac_cond_signal(&s->space);
+        ok = 1;
+    }
+    luaflac_mutex_unlock(&s->lock);
+    return ok;
+}
+
+static void
+luaflac_scan_push_result(lua_State *L, luaflac_scan *s, luaflac_scan_result *r) {
+    unsigned int i = 0;
+
+    lua_createtable(L,0,3);
+    lua_pushinteger(L,r->index + 1);
+    lua_setfield(L,-2,"index");
+    lua_pushstring(L,s->paths[r->index]);
+    lua_setfield(L,-2,"path");
+
+    if(r->error != NULL) {
+        lua_pushstring(L,r->error);
+        lua_setfield(L,-2,"error");
+        return;
+    }
+
+    lua_createtable(L,r->num_blocks,0);
+    for(i=0;i<r->num_blocks;i++) {
+        luaflac_push_parsed_block(L,&r->blocks[i],s->push_flags);
+        lua_rawseti(L,-2,i+1);
+    }
+    lua_setfield(L,-2,"blocks");
+
+    luaflac_parsed_free(r->blocks,r->num_blocks);
+    r->blocks = NULL;
+    r->num_blocks = 0;
+}
+
+static int
+luaflac_scan_next(lua_State *L) {
+    luaflac_scan_userdata *u = luaL_checkudata(L,1,luaflac_scan_mt);
+    luaflac_scan_result r;
+
+    if(u->scan == NULL || !luaflac_scan_pop(u->scan,&r,1)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    luaflac_scan_push_result(L,u->scan,&r);
+    return 1;
+}
+
+static int
+luaflac_scan_batch(lua_State *L) {
+    luaflac_scan_userdata *u = luaL_checkudata(L,1,luaflac_scan_mt);
+    lua_Integer max = luaL_optinteger(L,2,0);
+    luaflac_scan_result r;
+    lua_Integer n = 0;
+
+    if(u->scan == NULL || !luaflac_scan_pop(u->scan,&r,1)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* wait for the first result, then take whatever else is ready */
+    lua_newtable(L);
+    do {
+        luaflac_scan_push_result(L,u->scan,&r);
+        lua_rawseti(L,-2,++n);
+    } while( (max <= 0 || n < max) && luaflac_scan_pop(u->scan,&r,0));
+
+    return 1;
+}
+
+static int
+luaflac_scan_call(lua_State *L) {
+    /* lets the scanner be used directly in a generic for */
+    lua_settop(L,1);
+    return luaflac_scan_next(L);
+}
+
+static int
+luaflac_scan_start(luaflac_scan *s, unsigned int threads) {
+    unsigned int i = 0;
+
+    s->threads = malloc(sizeof(luaflac_thread) * threads);
+    if(s->threads == NULL) return 0;
+
+    for(i=0;i<threads;i++) {
+        if(luaflac_thread_create(&s->threads[i],luaflac_scan_worker,s) != 0) break;
+        s->num_threads++;
+    }
+    return s->num_threads > 0;
+}
+
+static int
+luaflac_scan_new(lua_State *L) {
+    luaflac_scan_userdata *u = NULL;
+    luaflac_scan *s = NULL;
+    lua_Integer threads = 0;
+    lua_Integer queue = 0;
+    lua_Integer type = 0;
+    const char *path = NULL;
+    size_t len = 0;
+    size_t i = 0;
+
+    luaL_checktype(L,1,LUA_TTABLE);
+    if(!lua_isnoneornil(L,2)) {
+        luaL_checktype(L,2,LUA_TTABLE);
+    }
+
+    u = lua_newuserdata(L,sizeof(luaflac_scan_userdata));
+    u->scan = NULL;
+    luaL_setmetatable(L,luaflac_scan_mt);
+
+    s = calloc(1,sizeof(luaflac_scan));
+    if(s == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    if(luaflac_mutex_init(&s->lock) != 0) {
+        free(s);
+        return luaL_error(L,"error creating mutex");
+    }
+    luaflac_cond_init(&s->ready);
+    luaflac_cond_init(&s->space);
+    u->scan = s;
+
+    s->want[FLAC__METADATA_TYPE_STREAMINFO] = 1;
+    s->want[FLAC__METADATA_TYPE_VORBIS_COMMENT] = 1;
+    s->want[FLAC__METADATA_TYPE_PICTURE] = 1;
+    s->flags = LUAFLAC_PARSE_PICTURE_NODATA;
+    threads = luaflac_thread_cpus();
+
+    if(lua_istable(L,2)) {
+        lua_getfield(L,2,"threads");
+        threads = luaL_optinteger(L,-1,threads);
+        lua_pop(L,1);
+
+        lua_getfield(L,2,"queue");
+        queue = luaL_optinteger(L,-1,0);
+        lua_pop(L,1);
+
+        lua_getfield(L,2,"readahead");
+        if(lua_isnumber(L,-1)) {
+            s->readahead = (long)lua_tointeger(L,-1);
+        } else if(lua_toboolean(L,-1)) {
+            s->readahead = LUAFLAC_SCAN_READAHEAD;
+        }
+        lua_pop(L,1);
+
+        lua_getfield(L,2,"lazy_pictures");
+        if(!lua_isnil(L,-1) && !lua_toboolean(L,-1)) {
+            s->flags &= ~LUAFLAC_PARSE_PICTURE_NODATA;
+        }
+        lua_pop(L,1);
+
+        lua_getfield(L,2,"packed_seektable");
+        if(lua_toboolean(L,-1)) s->push_flags |= LUAFLAC_PUSH_PACKED_SEEKTABLE;
+        lua_pop(L,1);
+
+        lua_getfield(L,2,"types");
+        if(lua_istable(L,-1)) {
+            memset(s->want,0,sizeof(s->want));
+            for(i=1;i<=lua_rawlen(L,-1);i++) {
+                lua_rawgeti(L,-1,i);
+                type = luaL_checkinteger(L,-1);
+                lua_pop(L,1);
+                if(type < 0 || type > FLAC__MAX_METADATA_TYPE_CODE) {
+                    return luaL_error(L,"invalid metadata type %d",(int)type);
+                }
+                s->want[type] = 1;
+            }
+        }
+        lua_pop(L,1);
+    }
+
+    if(threads < 1) threads = 1;
+    if(queue < 1) queue = threads * 16;
+
+    s->num_paths = lua_rawlen(L,1);
+    s->paths = calloc(s->num_paths ? s->num_paths : 1,sizeof(char *));
+    s->queue_size = (size_t)queue;
+    s->queue = malloc(sizeof(luaflac_scan_result) * s->queue_size);
+    if(s->paths == NULL || s->queue == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+
+    for(i=0;i<s->num_paths;i++) {
+        lua_rawgeti(L,1,i+1);
+        path = lua_tolstring(L,-1,&len);
+        if(path == NULL) {
+            return luaL_error(L,"path %d is not a string",(int)(i+1));
+        }
+        s->paths[i] = malloc(len + 1);
+        if(s->paths[i] == NULL) {
+            return luaL_error(L,"out of memory");
+        }
+        memcpy(s->paths[i],path,len + 1);
+        lua_pop(L,1);
+    }
+
+    if((size_t)threads > s->num_paths) threads = s->num_paths;
+    if(threads > 0 && !luaflac_scan_start(s,(unsigned int)threads)) {
+        return luaL_error(L,"error starting scan threads");
+    }
+
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_scan_functions[] = {
+    { "scan", luaflac_scan_new },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaflac_scan_methods[] = {
+    { "next", luaflac_scan_next },
+    { "batch", luaflac_scan_batch },
+    { "close", luaflac_scan_close },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_scan(lua_State *L) {
+    lua_getglobal(L,"require");
+    lua_pushstring(L,"luaflac.uint64");
+    lua_call(L,1,1);
+    lua_pop(L,1);
+
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_scan_functions,0);
+
+    luaL_newmetatable(L,luaflac_scan_mt);
+    lua_pushcclosure(L,luaflac_scan_close,0);
+    lua_setfield(L,-2,"__gc");
+    lua_pushcclosure(L,luaflac_scan_call,0);
+    lua_setfield(L,-2,"__call");
+
+    lua_newtable(L); /* __index */
+    luaL_setfuncs(L,luaflac_scan_methods,0);
+    lua_setfield(L,-2,"__index");
+
+    lua_pop(L,1);
+
+    return 1;
+}
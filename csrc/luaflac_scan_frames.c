@@ -0,0 +1,519 @@
+#include "luaflac_internal.h"
+#include <FLAC/format.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* flac.scan_frames - walks the frames of a stream using only their
+ * headers, for statistics that would otherwise need a full decode.
+ * Everything is collected in C arrays and converted to Lua at the end.
+ *
+ * flac.duration - gets the length of a stream from the last frame when
+ * STREAMINFO doesn't have it, reading only the end of the file. */
+
+LUAFLAC_PRIVATE
+const char * const luaflac_frame_index_mt = "luaflac_frame_index";
+
+struct luaflac_frame_index_userdata_s {
+    luaflac_frame_index *index;
+};
+
+typedef struct luaflac_frame_index_userdata_s luaflac_frame_index_userdata;
+
+/* how far past the samples seen so far a frame can start when STREAMINFO
+ * doesn't have the total, enough for a run of damaged frames */
+#define LUAFLAC_SCAN_FRAMES_SLACK 1048576
+
+typedef struct luaflac_frame_stats_blocksize_s {
+    FLAC__uint32 blocksize;
+    FLAC__uint64 count;
+} luaflac_frame_stats_blocksize;
+
+typedef struct luaflac_frame_stats_s {
+    FLAC__uint64 frames;
+    FLAC__uint64 samples;
+    FLAC__uint64 bytes;
+    FLAC__uint64 crc_errors;
+    FLAC__uint32 min_framesize;
+    FLAC__uint32 max_framesize;
+    FLAC__uint32 sample_rate;
+    FLAC__uint64 total_samples; /* from STREAMINFO, 0 if unknown */
+    FLAC__uint64 end; /* one past the last sample of any frame in range */
+    FLAC__uint64 out_of_range; /* frames starting past the end of the stream */
+    FLAC__uint64 channel_assignments[4];
+
+    luaflac_frame_stats_blocksize *blocksizes;
+    size_t num_blocksizes;
+
+    FLAC__uint64 *seconds; /* bytes of audio per second */
+    size_t num_seconds;
+} luaflac_frame_stats;
+
+LUAFLAC_PRIVATE
+luaflac_frame_index *
+luaflac_frame_index_check(lua_State *L, int idx) {
+    luaflac_frame_index_userdata *u = luaL_checkudata(L,idx,luaflac_frame_index_mt);
+    return u->index;
+}
+
+LUAFLAC_PRIVATE
+luaflac_frame_index *
+luaflac_frame_index_push_new(lua_State *L) {
+    luaflac_frame_index_userdata *u = lua_newuserdata(L,sizeof(luaflac_frame_index_userdata));
+    u->index = NULL;
+    luaL_setmetatable(L,luaflac_frame_index_mt);
+    u->index = calloc(1,sizeof(luaflac_frame_index));
+    if(u->index == NULL) {
+        luaL_error(L,"out of memory");
+        return NULL;
+    }
+    return u->index;
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_index_append(luaflac_frame_index *index, const luaflac_frame *frame) {
+    size_t max = 0;
+    void *tmp = NULL;
+
+    if(index->num_frames == index->max_frames) {
+        max = index->max_frames ? index->max_frames * 2 : 1024;
+        if((tmp = realloc(index->offsets,sizeof(FLAC__uint64) * max)) == NULL) return 0;
+        index->offsets = tmp;
+        if((tmp = realloc(index->samples,sizeof(FLAC__uint64) * max)) == NULL) return 0;
+        index->samples = tmp;
+        if((tmp = realloc(index->sizes,sizeof(FLAC__uint32) * max)) == NULL) return 0;
+        index->sizes = tmp;
+        if((tmp = realloc(index->blocksizes,sizeof(FLAC__uint32) * max)) == NULL) return 0;
+        index->blocksizes = tmp;
+        index->max_frames = max;
+    }
+
+    index->offsets[index->num_frames] = frame->offset;
+    index->samples[index->num_frames] = frame->sample;
+    index->sizes[index->num_frames] = frame->size;
+    index->blocksizes[index->num_frames] = frame->header.blocksize;
+    index->num_frames++;
+    return 1;
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_frame_index_find(const luaflac_frame_index *index, FLAC__uint64 sample, size_t *i) {
+    size_t lo = 0;
+    size_t hi = index->num_frames;
+    size_t mid = 0;
+
+    /* last frame starting at or before sample */
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(index->samples[mid] <= sample) lo = mid + 1;
+        else hi = mid;
+    }
+    if(lo == 0) return 0;
+    lo--;
+    if(sample >= index->samples[lo] + index->blocksizes[lo]) return 0;
+    *i = lo;
+    return 1;
+}
+
+static size_t
+luaflac_frame_index_checkindex(lua_State *L, int idx, const luaflac_frame_index *index) {
+    lua_Integer i = luaL_checkinteger(L,idx);
+    if(i < 1 || (size_t)i > index->num_frames) {
+        luaL_error(L,"frame %d out of range",(int)i);
+        return 0;
+    }
+    return (size_t)(i - 1);
+}
+
+static int
+luaflac_frame_index_gc(lua_State *L) {
+    luaflac_frame_index_userdata *u = luaL_checkudata(L,1,luaflac_frame_index_mt);
+    if(u->index != NULL) {
+        free(u->index->offsets);
+        free(u->index->samples);
+        free(u->index->sizes);
+        free(u->index->blocksizes);
+        free(u->index);
+        u->index = NULL;
+    }
+    return 0;
+}
+
+static int
+luaflac_frame_index_len(lua_State *L) {
+    luaflac_frame_index *index = luaflac_frame_index_check(L,1);
+    lua_pushinteger(L,index->num_frames);
+    return 1;
+}
+
+static int
+luaflac_frame_index_get(lua_State *L) {
+    luaflac_frame_index *index = luaflac_frame_index_check(L,1);
+    size_t i = luaflac_frame_index_checkindex(L,2,index);
+
+    luaflac_pushuint64(L,index->offsets[i]);
+    lua_pushinteger(L,index->sizes[i]);
+    lua_pushinteger(L,index->blocksizes[i]);
+    luaflac_pushuint64(L,index->samples[i]);
+    return 4;
+}
+
+static int
+luaflac_frame_index_find_sample(lua_State *L) {
+    luaflac_frame_index *index = luaflac_frame_index_check(L,1);
+    FLAC__uint64 sample = luaflac_touint64(L,2);
+    size_t i = 0;
+
+    if(!luaflac_frame_index_find(index,sample,&i)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushinteger(L,i + 1);
+    return 1;
+}
+
+static int
+luaflac_frame_stats_add(luaflac_frame_stats *s, const luaflac_frame *frame) {
+    size_t i = 0;
+    size_t second = 0;
+    void *tmp = NULL;
+
+    s->frames++;
+    s->samples += frame->header.blocksize;
+    s->bytes += frame->size;
+    if(s->min_framesize == 0 || frame->size < s->min_framesize) s->min_framesize = frame->size;
+    if(frame->size > s->max_framesize) s->max_framesize = frame->size;
+    s->channel_assignments[frame->header.channel_assignment]++;
+
+    /* variable blocksize streams can have any number of sizes,
+     * but in practice there's only a handful */
+    for(i=0;i<s->num_blocksizes;i++) {
+        if(s->blocksizes[i].blocksize == frame->header.blocksize) break;
+    }
+    if(i == s->num_blocksizes) {
+        if((tmp = realloc(s->blocksizes,sizeof(luaflac_frame_stats_blocksize) * (i + 1))) == NULL) return 0;
+        s->blocksizes = tmp;
+        s->blocksizes[i].blocksize = frame->header.blocksize;
+        s->blocksizes[i].count = 0;
+        s->num_blocksizes++;
+    }
+    s->blocksizes[i].count++;
+
+    if(s->sample_rate == 0) s->sample_rate = frame->header.sample_rate;
+    if(s->sample_rate == 0) return 1;
+
+    /* a bogus header the reader resynced onto can claim any sample up to
+     * 2^36, keep it out of the profile instead of growing it to match */
+    if(s->total_samples > 0 ? frame->sample >= s->total_samples :
+       frame->sample > s->end + LUAFLAC_SCAN_FRAMES_SLACK) {
+        s->out_of_range++;
+        return 1;
+    }
+    if(frame->sample + frame->header.blocksize > s->end) {
+        s->end = frame->sample + frame->header.blocksize;
+    }
+
+    second = (size_t)(frame->sample / s->sample_rate);
+    if(second >= s->num_seconds) {
+        if((tmp = realloc(s->seconds,sizeof(FLAC__uint64) * (second + 1))) == NULL) return 0;
+        s->seconds = tmp;
+        memset(&s->seconds[s->num_seconds],0,sizeof(FLAC__uint64) * (second + 1 - s->num_seconds));
+        s->num_seconds = second + 1;
+    }
+    s->seconds[second] += frame->size;
+    return 1;
+}
+
+static void
+luaflac_frame_stats_push(lua_State *L, const luaflac_frame_stats *s, const luaflac_frame_reader *r, int crc) {
+    FLAC__uint64 last = 0;
+    double duration = 0.0;
+    size_t i = 0;
+
+    lua_newtable(L);
+
+    lua_pushinteger(L,s->frames);
+    lua_setfield(L,-2,"frames");
+    luaflac_pushuint64(L,s->samples);
+    lua_setfield(L,-2,"samples");
+    lua_pushinteger(L,s->sample_rate);
+    lua_setfield(L,-2,"sample_rate");
+    lua_pushinteger(L,r->streaminfo.channels);
+    lua_setfield(L,-2,"channels");
+    lua_pushinteger(L,r->streaminfo.bits_per_sample);
+    lua_setfield(L,-2,"bits_per_sample");
+    luaflac_pushuint64(L,r->audio_offset);
+    lua_setfield(L,-2,"audio_offset");
+    luaflac_pushuint64(L,s->bytes);
+    lua_setfield(L,-2,"audio_bytes");
+    lua_pushinteger(L,s->min_framesize);
+    lua_setfield(L,-2,"min_framesize");
+    lua_pushinteger(L,s->max_framesize);
+    lua_setfield(L,-2,"max_framesize");
+    lua_pushinteger(L,(lua_Integer)r->skipped);
+    lua_setfield(L,-2,"skipped");
+    lua_pushinteger(L,(lua_Integer)r->breaks);
+    lua_setfield(L,-2,"numbering_breaks");
+    lua_pushinteger(L,(lua_Integer)s->out_of_range);
+    lua_setfield(L,-2,"out_of_range");
+    if(crc) {
+        lua_pushinteger(L,(lua_Integer)s->crc_errors);
+        lua_setfield(L,-2,"crc_errors");
+    }
+
+    if(s->sample_rate > 0) {
+        duration = (double)s->samples / (double)s->sample_rate;
+    }
+    lua_pushnumber(L,duration);
+    lua_setfield(L,-2,"duration");
+    lua_pushnumber(L,duration > 0.0 ? (double)s->bytes * 8.0 / duration : 0.0);
+    lua_setfield(L,-2,"bitrate");
+
+    lua_createtable(L,0,s->num_blocksizes);
+    for(i=0;i<s->num_blocksizes;i++) {
+        lua_pushinteger(L,(lua_Integer)s->blocksizes[i].count);
+        lua_rawseti(L,-2,s->blocksizes[i].blocksize);
+    }
+    lua_setfield(L,-2,"blocksizes");
+
+    lua_createtable(L,0,4);
+    for(i=0;i<4;i++) {
+        lua_pushinteger(L,(lua_Integer)s->channel_assignments[i]);
+        lua_rawseti(L,-2,i);
+    }
+    lua_setfield(L,-2,"channel_assignments");
+
+    /* bits per second, the last second only counts the samples it has */
+    lua_createtable(L,s->num_seconds,0);
+    for(i=0;i<s->num_seconds;i++) {
+        if(i + 1 == s->num_seconds && s->samples > (FLAC__uint64)i * s->sample_rate) {
+            last = s->samples - (FLAC__uint64)i * s->sample_rate;
+            if(last > s->sample_rate) last = s->sample_rate;
+            lua_pushnumber(L,(double)s->seconds[i] * 8.0 * (double)s->sample_rate / (double)last);
+        }
+        else {
+            lua_pushnumber(L,(double)s->seconds[i] * 8.0);
+        }
+        lua_rawseti(L,-2,i+1);
+    }
+    lua_setfield(L,-2,"bitrate_profile");
+}
+
+static int
+luaflac_scan_frames(lua_State *L) {
+    luaflac_frame_reader r;
+    luaflac_frame frame;
+    luaflac_frame_stats s;
+    luaflac_frame_index *index = NULL;
+    FILE *f = NULL;
+    int owned = 0;
+    int crc = 0;
+    int want_index = 1;
+    int res = 0;
+    const char *error = NULL;
+
+    if(!lua_isnoneornil(L,2)) {
+        luaL_checktype(L,2,LUA_TTABLE);
+        lua_getfield(L,2,"crc");
+        crc = lua_toboolean(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,2,"index");
+        if(!lua_isnil(L,-1) && !lua_toboolean(L,-1)) want_index = 0;
+        lua_pop(L,1);
+    }
+
+    /* created up front so the arrays are collected if anything below errors */
+    if(want_index) {
+        index = luaflac_frame_index_push_new(L);
+    }
+
+    f = luaflac_checkfile(L,1,"rb",&owned);
+    if(f == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,1));
+        return 2;
+    }
+
+    memset(&s,0,sizeof(s));
+    if(!luaflac_frame_reader_init(&r,f)) {
+        error = "error reading metadata";
+        goto luaflac_scan_frames_done;
+    }
+    s.sample_rate = r.streaminfo.sample_rate;
+    s.total_samples = r.streaminfo.total_samples;
+
+    while( (res = luaflac_frame_reader_next(&r,&frame)) == 1) {
+        if(crc && !luaflac_frame_check_crc(&frame)) s.crc_errors++;
+        if(!luaflac_frame_stats_add(&s,&frame) ||
+           (index != NULL && !luaflac_frame_index_append(index,&frame))) {
+            error = "out of memory";
+            goto luaflac_scan_frames_done;
+        }
+    }
+    if(res < 0) {
+        error = "error reading frames";
+    }
+
+    luaflac_scan_frames_done:
+    luaflac_frame_reader_free(&r);
+    if(owned) fclose(f);
+
+    if(error != NULL) {
+        free(s.blocksizes);
+        free(s.seconds);
+        lua_pushnil(L);
+        lua_pushstring(L,error);
+        return 2;
+    }
+
+    luaflac_frame_stats_push(L,&s,&r,crc);
+    free(s.blocksizes);
+    free(s.seconds);
+
+    if(index != NULL) {
+        lua_pushvalue(L,-2);
+        lua_setfield(L,-2,"index");
+    }
+    return 1;
+}
+
+/* total_samples is the low 36 bits of bytes 13-17 of STREAMINFO */
+static int
+luaflac_duration_write(luaflac_frame_reader *r, FLAC__uint64 total_samples) {
+    FLAC__byte b[5];
+    FLAC__uint64 offset = r->streaminfo_offset + 4 + 13;
+
+    if(luaflac_fseek(r->f,offset) != 0) return 0;
+    if(fread(b,1,1,r->f) != 1) return 0;
+    b[0] = (FLAC__byte)((b[0] & 0xF0) | ((total_samples >> 32) & 0x0F));
+    b[1] = (FLAC__byte)(total_samples >> 24);
+    b[2] = (FLAC__byte)(total_samples >> 16);
+    b[3] = (FLAC__byte)(total_samples >> 8);
+    b[4] = (FLAC__byte)(total_samples);
+
+    if(luaflac_fseek(r->f,offset) != 0) return 0;
+    if(fwrite(b,1,5,r->f) != 5) return 0;
+    return fflush(r->f) == 0;
+}
+
+static int
+luaflac_duration(lua_State *L) {
+    luaflac_frame_reader r;
+    luaflac_frame frame;
+    FLAC__uint64 total_samples = 0;
+    FILE *f = NULL;
+    int owned = 0;
+    int write_back = 0;
+    int force = 0;
+    int from_streaminfo = 0;
+    int written = 0;
+    int res = 0;
+    const char *error = NULL;
+
+    if(!lua_isnoneornil(L,2)) {
+        luaL_checktype(L,2,LUA_TTABLE);
+        lua_getfield(L,2,"write");
+        write_back = lua_toboolean(L,-1);
+        lua_pop(L,1);
+        lua_getfield(L,2,"force");
+        force = lua_toboolean(L,-1);
+        lua_pop(L,1);
+    }
+
+    f = luaflac_checkfile(L,1,write_back ? "r+b" : "rb",&owned);
+    if(f == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,1));
+        return 2;
+    }
+
+    if(!luaflac_frame_reader_init(&r,f)) {
+        error = "error reading metadata";
+        goto luaflac_duration_done;
+    }
+
+    total_samples = r.streaminfo.total_samples;
+    if(total_samples > 0 && !force) {
+        from_streaminfo = 1;
+        goto luaflac_duration_done;
+    }
+
+    res = luaflac_frame_reader_last(&r,&frame);
+    if(res != 1) {
+        error = res == 0 ? "no frames found" : "error reading frames";
+        goto luaflac_duration_done;
+    }
+    total_samples = frame.sample + frame.header.blocksize;
+
+    if(write_back && total_samples != r.streaminfo.total_samples) {
+        if(r.streaminfo_offset == 0 || total_samples >= ((FLAC__uint64)1 << 36)) {
+            error = "can't store total samples in STREAMINFO";
+        } else if(!luaflac_duration_write(&r,total_samples)) {
+            error = "error writing STREAMINFO";
+        } else {
+            written = 1;
+        }
+    }
+
+    luaflac_duration_done:
+    luaflac_frame_reader_free(&r);
+    if(owned) fclose(f);
+
+    if(error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,error);
+        return 2;
+    }
+
+    lua_createtable(L,0,4);
+    luaflac_pushuint64(L,total_samples);
+    lua_setfield(L,-2,"samples");
+    lua_pushnumber(L,r.streaminfo.sample_rate > 0 ?
+      (double)total_samples / (double)r.streaminfo.sample_rate : 0.0);
+    lua_setfield(L,-2,"duration");
+    lua_pushstring(L,from_streaminfo ? "streaminfo" : "last_frame");
+    lua_setfield(L,-2,"source");
+    lua_pushboolean(L,written);
+    lua_setfield(L,-2,"written");
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_scan_frames_functions[] = {
+    { "scan_frames", luaflac_scan_frames },
+    { "duration", luaflac_duration },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaflac_frame_index_methods[] = {
+    { "get", luaflac_frame_index_get },
+    { "find", luaflac_frame_index_find_sample },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_scan_frames(lua_State *L) {
+    lua_getglobal(L,"require");
+    lua_pushstring(L,"luaflac.uint64");
+    lua_call(L,1,1);
+    lua_pop(L,1);
+
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_scan_frames_functions,0);
+
+    luaL_newmetatable(L,luaflac_frame_index_mt);
+    lua_pushcclosure(L,luaflac_frame_index_gc,0);
+    lua_setfield(L,-2,"__gc");
+    lua_pushcclosure(L,luaflac_frame_index_len,0);
+    lua_setfield(L,-2,"__len");
+
+    lua_newtable(L); /* __index */
+    luaL_setfuncs(L,luaflac_frame_index_methods,0);
+    lua_setfield(L,-2,"__index");
+
+    lua_pop(L,1);
+
+    return 1;
+}
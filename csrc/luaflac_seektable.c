@@ -0,0 +1,375 @@
+#include "luaflac_internal.h"
+#include <FLAC/format.h>
+#include <FLAC/metadata.h>
+
+#include <string.h>
+
+/* a SEEKTABLE block kept as a FLAC__StreamMetadata, so large tables
+ * don't turn into a Lua table (and two uint64 userdata) per point */
+
+LUAFLAC_PRIVATE
+const char * const luaflac_seektable_mt = "luaflac_seektable";
+
+/* size of a seek point in a SEEKTABLE block */
+#define LUAFLAC_SEEKPOINT_LENGTH 18
+
+struct luaflac_seektable_userdata_s {
+    FLAC__StreamMetadata *m;
+};
+
+typedef struct luaflac_seektable_userdata_s luaflac_seektable_userdata;
+
+static FLAC__StreamMetadata *
+luaflac_seektable_check(lua_State *L, int idx) {
+    luaflac_seektable_userdata *u = luaL_checkudata(L,idx,luaflac_seektable_mt);
+    return u->m;
+}
+
+static unsigned int
+luaflac_seektable_checkindex(lua_State *L, int idx, const FLAC__StreamMetadata *m) {
+    lua_Integer i = luaL_checkinteger(L,idx);
+    if(i < 1 || i > (lua_Integer)m->data.seek_table.num_points) {
+        luaL_error(L,"seek point %d out of range",(int)i);
+        return 0;
+    }
+    return (unsigned int)(i - 1);
+}
+
+/* creates an empty seektable userdata on the stack */
+static FLAC__StreamMetadata *
+luaflac_seektable_push_new(lua_State *L) {
+    luaflac_seektable_userdata *u = lua_newuserdata(L,sizeof(luaflac_seektable_userdata));
+    u->m = NULL;
+    luaL_setmetatable(L,luaflac_seektable_mt);
+    u->m = FLAC__metadata_object_new(FLAC__METADATA_TYPE_SEEKTABLE);
+    if(u->m == NULL) {
+        luaL_error(L,"out of memory");
+        return NULL;
+    }
+    return u->m;
+}
+
+LUAFLAC_PRIVATE
+void
+luaflac_pushseektable(lua_State *L, const FLAC__StreamMetadata *m) {
+    FLAC__StreamMetadata *t = luaflac_seektable_push_new(L);
+    if(!FLAC__metadata_object_seektable_resize_points(t,m->data.seek_table.num_points)) {
+        luaL_error(L,"out of memory");
+        return;
+    }
+    if(m->data.seek_table.num_points > 0) {
+        memcpy(t->data.seek_table.points,m->data.seek_table.points,
+          sizeof(FLAC__StreamMetadata_SeekPoint) * m->data.seek_table.num_points);
+    }
+}
+
+LUAFLAC_PRIVATE
+int
+luaflac_seektable_copy(lua_State *L, int idx, FLAC__StreamMetadata *dest) {
+    const FLAC__StreamMetadata *m = luaflac_seektable_check(L,idx);
+    if(!FLAC__metadata_object_seektable_resize_points(dest,m->data.seek_table.num_points)) {
+        return 0;
+    }
+    if(m->data.seek_table.num_points > 0) {
+        memcpy(dest->data.seek_table.points,m->data.seek_table.points,
+          sizeof(FLAC__StreamMetadata_SeekPoint) * m->data.seek_table.num_points);
+    }
+    return 1;
+}
+
+static int
+luaflac_seektable_unserialize(FLAC__StreamMetadata *m, const unsigned char *b, size_t len) {
+    unsigned int num_points = (unsigned int)(len / LUAFLAC_SEEKPOINT_LENGTH);
+    unsigned int i = 0;
+    unsigned int j = 0;
+    FLAC__StreamMetadata_SeekPoint *p = NULL;
+
+    if(!FLAC__metadata_object_seektable_resize_points(m,num_points)) return 0;
+    for(i=0;i<num_points;i++) {
+        p = &m->data.seek_table.points[i];
+        p->sample_number = 0;
+        p->stream_offset = 0;
+        for(j=0;j<8;j++) p->sample_number = (p->sample_number << 8) | *b++;
+        for(j=0;j<8;j++) p->stream_offset = (p->stream_offset << 8) | *b++;
+        p->frame_samples = ((unsigned)b[0] << 8) | b[1];
+        b += 2;
+    }
+    return 1;
+}
+
+static int
+luaflac_seektable_gc(lua_State *L) {
+    luaflac_seektable_userdata *u = luaL_checkudata(L,1,luaflac_seektable_mt);
+    if(u->m != NULL) {
+        FLAC__metadata_object_delete(u->m);
+        u->m = NULL;
+    }
+    return 0;
+}
+
+static int
+luaflac_seektable_new(lua_State *L) {
+    FLAC__StreamMetadata *m = NULL;
+    FLAC__StreamMetadata *src = NULL;
+    const char *str = NULL;
+    size_t len = 0;
+
+    lua_settop(L,1);
+
+    if(lua_type(L,1) == LUA_TSTRING) {
+        str = lua_tolstring(L,1,&len);
+        if(len % LUAFLAC_SEEKPOINT_LENGTH != 0) {
+            return luaL_error(L,"seektable length must be a multiple of %d",LUAFLAC_SEEKPOINT_LENGTH);
+        }
+        m = luaflac_seektable_push_new(L);
+        if(!luaflac_seektable_unserialize(m,(const unsigned char *)str,len)) {
+            return luaL_error(L,"out of memory");
+        }
+        return 1;
+    }
+
+    if(lua_istable(L,1) || luaL_testudata(L,1,luaflac_seektable_mt) != NULL) {
+        /* accepts a full SEEKTABLE block, or a seek_table table */
+        if(lua_istable(L,1)) {
+            lua_getfield(L,1,"seek_table");
+            if(lua_isnil(L,-1)) {
+                lua_pop(L,1);
+                lua_newtable(L);
+                lua_pushvalue(L,1);
+                lua_setfield(L,-2,"seek_table");
+                lua_pushinteger(L,FLAC__METADATA_TYPE_SEEKTABLE);
+                lua_setfield(L,-2,"type");
+            } else {
+                lua_pop(L,1);
+                lua_pushvalue(L,1);
+            }
+        } else {
+            lua_pushvalue(L,1);
+        }
+        src = luaflac_toflac_streammetadata(L,-1,0);
+        lua_pop(L,1);
+        if(src == NULL) {
+            return luaL_error(L,"invalid seektable");
+        }
+        luaflac_pushseektable(L,src);
+        FLAC__metadata_object_delete(src);
+        return 1;
+    }
+
+    m = luaflac_seektable_push_new(L);
+    if(!lua_isnil(L,1)) {
+        if(!FLAC__metadata_object_seektable_resize_points(m,(unsigned)luaL_checkinteger(L,1))) {
+            return luaL_error(L,"out of memory");
+        }
+    }
+    return 1;
+}
+
+static int
+luaflac_seektable_get(lua_State *L) {
+    const FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    unsigned int i = luaflac_seektable_checkindex(L,2,m);
+    luaflac_pushuint64(L,m->data.seek_table.points[i].sample_number);
+    luaflac_pushuint64(L,m->data.seek_table.points[i].stream_offset);
+    lua_pushinteger(L,m->data.seek_table.points[i].frame_samples);
+    return 3;
+}
+
+static int
+luaflac_seektable_set(lua_State *L) {
+    FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    unsigned int i = luaflac_seektable_checkindex(L,2,m);
+    FLAC__StreamMetadata_SeekPoint point;
+    point.sample_number = luaflac_touint64(L,3);
+    point.stream_offset = luaflac_touint64(L,4);
+    point.frame_samples = (unsigned)luaL_checkinteger(L,5);
+    FLAC__metadata_object_seektable_set_point(m,i,point);
+    return 0;
+}
+
+static int
+luaflac_seektable_resize(lua_State *L) {
+    FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    lua_pushboolean(L,FLAC__metadata_object_seektable_resize_points(m,(unsigned)luaL_checkinteger(L,2)));
+    return 1;
+}
+
+/* returns the index of the last point at or before sample, or nil */
+static int
+luaflac_seektable_find(lua_State *L) {
+    const FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    FLAC__uint64 sample = luaflac_touint64(L,2);
+    const FLAC__StreamMetadata_SeekPoint *p = m->data.seek_table.points;
+    unsigned int lo = 0;
+    unsigned int hi = m->data.seek_table.num_points;
+    unsigned int mid = 0;
+
+    /* placeholders sort to the end, so the points are in sample order */
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(p[mid].sample_number != FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER &&
+           p[mid].sample_number <= sample) lo = mid + 1;
+        else hi = mid;
+    }
+    if(lo == 0) {
+        lua_pushnil(L);
+    } else {
+        lua_pushinteger(L,lo);
+    }
+    return 1;
+}
+
+static int
+luaflac_seektable_is_legal(lua_State *L) {
+    const FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    lua_pushboolean(L,FLAC__format_seektable_is_legal(&m->data.seek_table));
+    return 1;
+}
+
+static int
+luaflac_seektable_append_placeholders(lua_State *L) {
+    FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    lua_pushboolean(L,FLAC__metadata_object_seektable_template_append_placeholders(m,(unsigned)luaL_checkinteger(L,2)));
+    return 1;
+}
+
+static int
+luaflac_seektable_append_point(lua_State *L) {
+    FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    lua_pushboolean(L,FLAC__metadata_object_seektable_template_append_point(m,luaflac_touint64(L,2)));
+    return 1;
+}
+
+static int
+luaflac_seektable_append_spaced_points(lua_State *L) {
+    FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    lua_pushboolean(L,FLAC__metadata_object_seektable_template_append_spaced_points(m,
+      (unsigned)luaL_checkinteger(L,2),luaflac_touint64(L,3)));
+    return 1;
+}
+
+static int
+luaflac_seektable_append_spaced_points_by_samples(lua_State *L) {
+    FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    lua_pushboolean(L,FLAC__metadata_object_seektable_template_append_spaced_points_by_samples(m,
+      (unsigned)luaL_checkinteger(L,2),luaflac_touint64(L,3)));
+    return 1;
+}
+
+static int
+luaflac_seektable_sort(lua_State *L) {
+    FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    lua_pushboolean(L,FLAC__metadata_object_seektable_template_sort(m,lua_toboolean(L,2)));
+    return 1;
+}
+
+static int
+luaflac_seektable_serialize(lua_State *L) {
+    const FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    const FLAC__StreamMetadata_SeekPoint *p = NULL;
+    unsigned char b[LUAFLAC_SEEKPOINT_LENGTH];
+    luaL_Buffer buf;
+    unsigned int i = 0;
+    unsigned int j = 0;
+
+    luaL_buffinit(L,&buf);
+    for(i=0;i<m->data.seek_table.num_points;i++) {
+        p = &m->data.seek_table.points[i];
+        for(j=0;j<8;j++) b[j] = (unsigned char)(p->sample_number >> (56 - (j * 8)));
+        for(j=0;j<8;j++) b[8+j] = (unsigned char)(p->stream_offset >> (56 - (j * 8)));
+        b[16] = (unsigned char)(p->frame_samples >> 8);
+        b[17] = (unsigned char)(p->frame_samples);
+        luaL_addlstring(&buf,(const char *)b,LUAFLAC_SEEKPOINT_LENGTH);
+    }
+    luaL_pushresult(&buf);
+    return 1;
+}
+
+static int
+luaflac_seektable_to_metadata(lua_State *L) {
+    luaflac_pushstreammetadata(L,luaflac_seektable_check(L,1));
+    return 1;
+}
+
+static int
+luaflac_seektable_len(lua_State *L) {
+    const FLAC__StreamMetadata *m = luaflac_seektable_check(L,1);
+    lua_pushinteger(L,m->data.seek_table.num_points);
+    return 1;
+}
+
+static int
+luaflac_seektable_index(lua_State *L) {
+    const FLAC__StreamMetadata *m = NULL;
+    unsigned int i = 0;
+
+    /* st[i] returns the point as a table, like the unpacked form */
+    if(lua_type(L,2) == LUA_TNUMBER) {
+        m = luaflac_seektable_check(L,1);
+        i = (unsigned int)lua_tointeger(L,2);
+        if(i < 1 || i > m->data.seek_table.num_points) {
+            lua_pushnil(L);
+            return 1;
+        }
+        lua_createtable(L,0,3);
+        luaflac_pushuint64(L,m->data.seek_table.points[i-1].sample_number);
+        lua_setfield(L,-2,"sample_number");
+        luaflac_pushuint64(L,m->data.seek_table.points[i-1].stream_offset);
+        lua_setfield(L,-2,"stream_offset");
+        lua_pushinteger(L,m->data.seek_table.points[i-1].frame_samples);
+        lua_setfield(L,-2,"frame_samples");
+        return 1;
+    }
+
+    lua_pushvalue(L,2);
+    lua_rawget(L,lua_upvalueindex(1));
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_seektable_functions[] = {
+    { "seektable", luaflac_seektable_new },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaflac_seektable_methods[] = {
+    { "get", luaflac_seektable_get },
+    { "set", luaflac_seektable_set },
+    { "resize", luaflac_seektable_resize },
+    { "find", luaflac_seektable_find },
+    { "is_legal", luaflac_seektable_is_legal },
+    { "append_placeholders", luaflac_seektable_append_placeholders },
+    { "append_point", luaflac_seektable_append_point },
+    { "append_spaced_points", luaflac_seektable_append_spaced_points },
+    { "append_spaced_points_by_samples", luaflac_seektable_append_spaced_points_by_samples },
+    { "sort", luaflac_seektable_sort },
+    { "serialize", luaflac_seektable_serialize },
+    { "to_metadata", luaflac_seektable_to_metadata },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_seektable(lua_State *L) {
+    lua_getglobal(L,"require");
+    lua_pushstring(L,"luaflac.uint64");
+    lua_call(L,1,1);
+    lua_pop(L,1);
+
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_seektable_functions,0);
+
+    luaL_newmetatable(L,luaflac_seektable_mt);
+    lua_pushcclosure(L,luaflac_seektable_gc,0);
+    lua_setfield(L,-2,"__gc");
+    lua_pushcclosure(L,luaflac_seektable_len,0);
+    lua_setfield(L,-2,"__len");
+
+    lua_newtable(L); /* methods, an upvalue of __index */
+    luaL_setfuncs(L,luaflac_seektable_methods,0);
+    lua_pushcclosure(L,luaflac_seektable_index,1);
+    lua_setfield(L,-2,"__index");
+
+    lua_pop(L,1);
+
+    return 1;
+}
@@ -1,20 +1,121 @@
 #include "luaflac_internal.h"
 #include <FLAC/stream_decoder.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
 LUAFLAC_PRIVATE
 const char * const luaflac_stream_decoder_mt = "FLAC__StreamDecoder";
 
+/* a fast_start file is presented to libFLAC as a list of segments,
+ * leaving out any metadata blocks the decoder would ignore */
+struct luaflac_decoder_segment_s {
+    FLAC__uint64 start;  /* position in the stream libFLAC sees */
+    FLAC__uint64 offset; /* position in the file */
+    FLAC__uint64 length;
+    int first_byte;      /* if >= 0, replaces the first byte (a block header) */
+};
+
+typedef struct luaflac_decoder_segment_s luaflac_decoder_segment;
+
+struct luaflac_decoder_source_s {
+    FILE *f;
+    FLAC__uint64 pos;
+    FLAC__uint64 file_pos;
+    FLAC__uint64 length;
+    luaflac_decoder_segment *segments;
+    unsigned int num_segments;
+    unsigned int current;
+    luaflac_block_header *skipped;
+    unsigned int num_skipped;
+};
+
+typedef struct luaflac_decoder_source_s luaflac_decoder_source;
+
+/* what the write callback gets samples as */
+enum luaflac_decoder_format_e {
+    LUAFLAC_FORMAT_TABLE,
+    LUAFLAC_FORMAT_PACKED,
+    LUAFLAC_FORMAT_FLOAT,
+    LUAFLAC_FORMAT_BUFFER
+};
+
+/* decode_range sends samples to one of these instead of the write callback */
+enum luaflac_decoder_sink_e {
+    LUAFLAC_SINK_FUNCTION,
+    LUAFLAC_SINK_FILE,
+    LUAFLAC_SINK_ENCODER,
+    LUAFLAC_SINK_WAV,
+    LUAFLAC_SINK_LOUDNESS,
+    LUAFLAC_SINK_WAVEFORM
+};
+
+struct luaflac_decoder_range_s {
+    int active;
+    int sink;
+    FLAC__uint64 first;
+    FLAC__uint64 end; /* one past the last sample */
+    FLAC__uint64 written;
+    int done;
+    const char *error;
+    FILE *f;
+    FLAC__StreamEncoder *encoder;
+    luaflac_wav_writer *wav;
+    luaflac_loudness *loudness;
+    luaflac_waveform *waveform;
+};
+
+typedef struct luaflac_decoder_range_s luaflac_decoder_range;
+
 struct luaflac_decoder_userdata_s {
     lua_State *L;
     int table_ref;
     FLAC__StreamDecoder *decoder;
+    int lazy_pictures;
+    int packed_seektable;
+    int write_format;
+    unsigned char *packed; /* samples for the write callback or decode_range */
+    size_t packed_size;
+    luaflac_pcm_buffer *pcm; /* reused for every frame with LUAFLAC_FORMAT_BUFFER */
+    int pcm_ref;
+    luaflac_decoder_source *source;
+    /* mirror of libFLAC's metadata filter, used by fast_start */
+    unsigned char metadata_respond[FLAC__MAX_METADATA_TYPE_CODE + 1];
+    int application_filters;
+    /* decoded frames, when cache_pending is set the stream is being played
+     * back from the cache and libFLAC has to seek to cache_pos to resume */
+    luaflac_frame_cache *cache;
+    int cache_pending;
+    FLAC__uint64 cache_pos;
+    int cache_mute; /* decode into the cache without calling the write callback */
+    /* when total_samples is unknown the end of the stream is where the last
+     * frame libFLAC wrote before reaching it stopped, 0 until then */
+    FLAC__uint64 decoded_end;
+    FLAC__uint64 stream_end;
+    luaflac_decoder_range range;
+    luaflac_loudness *loudness; /* sees every frame the decoder hands out */
 };
 
 typedef struct luaflac_decoder_userdata_s luaflac_decoder_userdata;
 
+static void
+luaflac_stream_decoder_source_free(luaflac_decoder_source *s) {
+    if(s == NULL) return;
+    if(s->f != NULL) fclose(s->f);
+    free(s->segments);
+    free(s->skipped);
+    free(s);
+}
+
+static void
+luaflac_stream_decoder_reset_filter(luaflac_decoder_userdata *u) {
+    /* libFLAC's defaults: only STREAMINFO is passed to the metadata callback */
+    memset(u->metadata_respond,0,sizeof(u->metadata_respond));
+    u->metadata_respond[FLAC__METADATA_TYPE_STREAMINFO] = 1;
+    u->application_filters = 0;
+}
+
 static int
 luaflac_stream_decoder_delete(lua_State *L) {
     luaflac_decoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_decoder_mt);
@@ -22,6 +123,17 @@ luaflac_stream_decoder_delete(lua_State *L) {
         FLAC__stream_decoder_delete(u->decoder);
         u->decoder = NULL;
     }
+    luaflac_stream_decoder_source_free(u->source);
+    u->source = NULL;
+    luaflac_frame_cache_free(u->cache);
+    u->cache = NULL;
+    free(u->packed);
+    u->packed = NULL;
+    if(u->pcm_ref != LUA_NOREF) {
+        luaL_unref(u->L,LUA_REGISTRYINDEX,u->pcm_ref);
+        u->pcm_ref = LUA_NOREF;
+        u->pcm = NULL;
+    }
     if(u->table_ref != LUA_NOREF) {
         luaL_unref(u->L,LUA_REGISTRYINDEX,u->table_ref);
         u->table_ref = LUA_NOREF;
@@ -40,6 +152,23 @@ luaflac_stream_decoder_new(lua_State *L) {
     }
 
     u->L = L;
+    u->lazy_pictures = 0;
+    u->packed_seektable = 0;
+    u->write_format = LUAFLAC_FORMAT_TABLE;
+    u->packed = NULL;
+    u->packed_size = 0;
+    u->pcm = NULL;
+    u->pcm_ref = LUA_NOREF;
+    u->source = NULL;
+    u->cache = NULL;
+    u->cache_pending = 0;
+    u->cache_pos = 0;
+    u->cache_mute = 0;
+    u->decoded_end = 0;
+    u->stream_end = 0;
+    memset(&u->range,0,sizeof(luaflac_decoder_range));
+    u->loudness = NULL;
+    luaflac_stream_decoder_reset_filter(u);
     u->decoder = FLAC__stream_decoder_new();
     if(u->decoder == NULL) {
         return luaL_error(L,"out of memory");
@@ -70,7 +199,10 @@ luaflac_stream_decoder_set_md5_checking(lua_State *L) {
 static int
 luaflac_stream_decoder_set_metadata_respond(lua_State *L) {
     luaflac_decoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_decoder_mt);
-    lua_pushboolean(L,FLAC__stream_decoder_set_metadata_respond(u->decoder,lua_tointeger(L,2)));
+    lua_Integer type = lua_tointeger(L,2);
+    FLAC__bool r = FLAC__stream_decoder_set_metadata_respond(u->decoder,type);
+    if(r) u->metadata_respond[type] = 1;
+    lua_pushboolean(L,r);
     return 1;
 }
 
@@ -83,21 +215,31 @@ luaflac_stream_decoder_set_metadata_respond_application(lua_State *L) {
     if(idlen != 4) {
         return luaL_error(L,"invalid application id");
     }
-    lua_pushboolean(L,FLAC__stream_decoder_set_metadata_respond_application(u->decoder,(const FLAC__byte *)id));
+    FLAC__bool r = FLAC__stream_decoder_set_metadata_respond_application(u->decoder,(const FLAC__byte *)id);
+    if(r) u->application_filters++;
+    lua_pushboolean(L,r);
     return 1;
 }
 
 static int
 luaflac_stream_decoder_set_metadata_respond_all(lua_State *L) {
     luaflac_decoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_decoder_mt);
-    lua_pushboolean(L,FLAC__stream_decoder_set_metadata_respond_all(u->decoder));
+    FLAC__bool r = FLAC__stream_decoder_set_metadata_respond_all(u->decoder);
+    if(r) {
+        memset(u->metadata_respond,1,sizeof(u->metadata_respond));
+        u->application_filters = 0;
+    }
+    lua_pushboolean(L,r);
     return 1;
 }
 
 static int
 luaflac_stream_decoder_set_metadata_ignore(lua_State *L) {
     luaflac_decoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_decoder_mt);
-    lua_pushboolean(L,FLAC__stream_decoder_set_metadata_ignore(u->decoder,lua_tointeger(L,2)));
+    lua_Integer type = lua_tointeger(L,2);
+    FLAC__bool r = FLAC__stream_decoder_set_metadata_ignore(u->decoder,type);
+    if(r) u->metadata_respond[type] = 0;
+    lua_pushboolean(L,r);
     return 1;
 }
 
@@ -110,14 +252,68 @@ luaflac_stream_decoder_set_metadata_ignore_application(lua_State *L) {
     if(idlen != 4) {
         return luaL_error(L,"invalid application id");
     }
-    lua_pushboolean(L,FLAC__stream_decoder_set_metadata_ignore_application(u->decoder,(const FLAC__byte *)id));
+    FLAC__bool r = FLAC__stream_decoder_set_metadata_ignore_application(u->decoder,(const FLAC__byte *)id);
+    if(r) u->application_filters++;
+    lua_pushboolean(L,r);
     return 1;
 }
 
 static int
 luaflac_stream_decoder_set_metadata_ignore_all(lua_State *L) {
     luaflac_decoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_decoder_mt);
-    lua_pushboolean(L,FLAC__stream_decoder_set_metadata_ignore_all(u->decoder));
+    FLAC__bool r = FLAC__stream_decoder_set_metadata_ignore_all(u->decoder);
+    if(r) {
+        memset(u->metadata_respond,0,sizeof(u->metadata_respond));
+        u->application_filters = 0;
+    }
+    lua_pushboolean(L,r);
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_set_lazy_pictures(lua_State *L) {
+    luaflac_decoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    u->lazy_pictures = lua_toboolean(L,2);
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_set_packed_seektable(lua_State *L) {
+    luaflac_decoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    u->packed_seektable = lua_toboolean(L,2);
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_get_packed_seektable(lua_State *L) {
+    luaflac_decoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    lua_pushboolean(L,u->packed_seektable);
+    return 1;
+}
+
+static const char * const luaflac_stream_decoder_formats[] = { "table", "packed", "float", "buffer", NULL };
+
+static int
+luaflac_stream_decoder_set_write_format(lua_State *L) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    u->write_format = luaL_checkoption(L,2,NULL,luaflac_stream_decoder_formats);
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_get_write_format(lua_State *L) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    lua_pushstring(L,luaflac_stream_decoder_formats[u->write_format]);
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_get_lazy_pictures(lua_State *L) {
+    luaflac_decoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    lua_pushboolean(L,u->lazy_pictures);
     return 1;
 }
 
@@ -379,11 +575,224 @@ luaflac_stream_decoder_eof_callback(const FLAC__StreamDecoder *decoder, void *cl
     return status;
 }
 
+static luaflac_decoder_segment *
+luaflac_stream_decoder_source_segment(luaflac_decoder_source *s, FLAC__uint64 pos) {
+    luaflac_decoder_segment *seg = &s->segments[s->current];
+    unsigned int lo = 0;
+    unsigned int hi = s->num_segments;
+    unsigned int mid = 0;
+
+    if(pos >= seg->start && pos < seg->start + seg->length) return seg;
+    if(s->current + 1 < s->num_segments) {
+        seg++;
+        if(pos >= seg->start && pos < seg->start + seg->length) {
+            s->current++;
+            return seg;
+        }
+    }
+
+    while(hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if(s->segments[mid].start <= pos) lo = mid;
+        else hi = mid;
+    }
+    s->current = lo;
+    return &s->segments[lo];
+}
+
+static FLAC__uint64
+luaflac_stream_decoder_source_offset(luaflac_decoder_source *s, FLAC__uint64 pos) {
+    luaflac_decoder_segment *seg = NULL;
+    if(pos >= s->length) return 0;
+    seg = luaflac_stream_decoder_source_segment(s,pos);
+    return seg->offset + (pos - seg->start);
+}
+
+static FLAC__StreamDecoderReadStatus
+luaflac_stream_decoder_source_read_callback(const FLAC__StreamDecoder *decoder,
+  FLAC__byte buffer[],
+  size_t *bytes,
+  void *client_data) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)client_data;
+    luaflac_decoder_source *s = u->source;
+    luaflac_decoder_segment *seg = NULL;
+    FLAC__uint64 offset = 0;
+    size_t want = 0;
+    size_t got = 0;
+    (void)decoder;
+
+    if(s->pos >= s->length) {
+        *bytes = 0;
+        return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+    }
+
+    seg = luaflac_stream_decoder_source_segment(s,s->pos);
+    want = *bytes;
+    if(want > seg->start + seg->length - s->pos) {
+        want = (size_t)(seg->start + seg->length - s->pos);
+    }
+
+    offset = seg->offset + (s->pos - seg->start);
+    if(offset != s->file_pos) {
+        if(luaflac_fseek(s->f,offset) != 0) {
+            *bytes = 0;
+            return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+        }
+        s->file_pos = offset;
+    }
+
+    got = fread(buffer,1,want,s->f);
+    if(got == 0) {
+        *bytes = 0;
+        if(ferror(s->f)) return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+        return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+    }
+
+    if(s->pos == seg->start && seg->first_byte >= 0) {
+        buffer[0] = (FLAC__byte)seg->first_byte;
+    }
+
+    s->pos += got;
+    s->file_pos += got;
+    *bytes = got;
+    return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__StreamDecoderSeekStatus
+luaflac_stream_decoder_source_seek_callback(const FLAC__StreamDecoder *decoder,
+  FLAC__uint64 absolute_byte_offset,
+  void *client_data) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)client_data;
+    (void)decoder;
+    if(absolute_byte_offset > u->source->length) {
+        return FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
+    }
+    u->source->pos = absolute_byte_offset;
+    return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
+}
+
+static FLAC__StreamDecoderTellStatus
+luaflac_stream_decoder_source_tell_callback(const FLAC__StreamDecoder *decoder,
+  FLAC__uint64 *absolute_byte_offset,
+  void *client_data) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)client_data;
+    (void)decoder;
+    *absolute_byte_offset = u->source->pos;
+    return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+}
+
+static FLAC__StreamDecoderLengthStatus
+luaflac_stream_decoder_source_length_callback(const FLAC__StreamDecoder *decoder,
+  FLAC__uint64 *stream_length,
+  void *client_data) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)client_data;
+    (void)decoder;
+    *stream_length = u->source->length;
+    return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+}
+
+static FLAC__bool
+luaflac_stream_decoder_source_eof_callback(const FLAC__StreamDecoder *decoder,
+  void *client_data) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)client_data;
+    (void)decoder;
+    return u->source->pos >= u->source->length;
+}
+
+static int
+luaflac_stream_decoder_source_add(luaflac_decoder_source *s, FLAC__uint64 offset, FLAC__uint64 length, int first_byte) {
+    luaflac_decoder_segment *segments = NULL;
+    if((s->num_segments & 7) == 0) {
+        segments = realloc(s->segments,sizeof(luaflac_decoder_segment) * (s->num_segments + 8));
+        if(segments == NULL) return 1;
+        s->segments = segments;
+    }
+    segments = &s->segments[s->num_segments++];
+    segments->start = s->length;
+    segments->offset = offset;
+    segments->length = length;
+    segments->first_byte = first_byte;
+    s->length += length;
+    return 0;
+}
+
+static int
+luaflac_stream_decoder_source_skip(luaflac_decoder_source *s, const luaflac_block_header *h) {
+    luaflac_block_header *skipped = NULL;
+    if((s->num_skipped & 7) == 0) {
+        skipped = realloc(s->skipped,sizeof(luaflac_block_header) * (s->num_skipped + 8));
+        if(skipped == NULL) return 1;
+        s->skipped = skipped;
+    }
+    s->skipped[s->num_skipped++] = *h;
+    return 0;
+}
+
+static int
+luaflac_stream_decoder_source_keep(luaflac_decoder_userdata *u, const luaflac_block_header *h) {
+    /* libFLAC always reads these itself, whatever the filter says */
+    if(h->type == FLAC__METADATA_TYPE_STREAMINFO) return 1;
+    if(h->type == FLAC__METADATA_TYPE_SEEKTABLE) return 1;
+    if(u->metadata_respond[h->type]) return 1;
+    if(h->type == FLAC__METADATA_TYPE_APPLICATION && u->application_filters) return 1;
+    return 0;
+}
+
+/* builds a view of the file without the metadata blocks the decoder
+ * would ignore anyway, so libFLAC never has to read past them */
+static luaflac_decoder_source *
+luaflac_stream_decoder_source_open(luaflac_decoder_userdata *u, const char *filename) {
+    luaflac_decoder_source *s = NULL;
+    luaflac_block_header h;
+    FLAC__uint64 offset = 0;
+    FLAC__uint64 size = 0;
+    unsigned int last_kept = 0;
+    FLAC__MetadataType last_type = FLAC__METADATA_TYPE_STREAMINFO;
+
+    s = (luaflac_decoder_source *)calloc(1,sizeof(luaflac_decoder_source));
+    if(s == NULL) return NULL;
+
+    s->f = fopen(filename,"rb");
+    if(s->f == NULL) goto fail;
+
+    if(!luaflac_parse_stream_start(s->f,&offset)) goto fail;
+    if(luaflac_stream_decoder_source_add(s,offset,4,-1) != 0) goto fail;
+    offset += 4;
+
+    do {
+        if(!luaflac_parse_block_header(s->f,offset,&h)) goto fail;
+        if(luaflac_stream_decoder_source_keep(u,&h)) {
+            if(luaflac_stream_decoder_source_add(s,offset,4 + (FLAC__uint64)h.length,-1) != 0) goto fail;
+            last_kept = s->num_segments - 1;
+            last_type = h.type;
+        } else {
+            if(luaflac_stream_decoder_source_skip(s,&h) != 0) goto fail;
+        }
+        offset += 4 + (FLAC__uint64)h.length;
+    } while(!h.is_last);
+
+    if(s->num_skipped > 0 && s->skipped[s->num_skipped - 1].is_last) {
+        s->segments[last_kept].first_byte = 0x80 | (int)last_type;
+    }
+
+    if(luaflac_fsize(s->f,&size) != 0 || size < offset) goto fail;
+    if(luaflac_stream_decoder_source_add(s,offset,size - offset,-1) != 0) goto fail;
+
+    s->file_pos = (FLAC__uint64)-1;
+    return s;
+
+    fail:
+    luaflac_stream_decoder_source_free(s);
+    return NULL;
+}
+
 static void
 luaflac_stream_decoder_metadata_callback(const FLAC__StreamDecoder *decoder,
   const FLAC__StreamMetadata *metadata,
   void *client_data) {
     int top;
+    int flags = 0;
+    FLAC__uint64 data_offset = 0;
     luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)client_data;
     top = lua_gettop(u->L);
 
@@ -391,13 +800,28 @@ luaflac_stream_decoder_metadata_callback(const FLAC__StreamDecoder *decoder,
     lua_getfield(u->L,-1,"metadata");
     lua_getfield(u->L,-2,"userdata");
 
-    luaflac_pushstreammetadata(u->L,metadata);
+    if(u->lazy_pictures && metadata->type == FLAC__METADATA_TYPE_PICTURE) {
+        /* the picture data is at the very end of the block, so the
+         * current decode position tells us where it is in the stream */
+        if(FLAC__stream_decoder_get_decode_position(decoder,&data_offset)) {
+            data_offset -= metadata->data.picture.data_length;
+            if(u->source != NULL) {
+                data_offset = luaflac_stream_decoder_source_offset(u->source,data_offset);
+            }
+        } else {
+            data_offset = 0;
+        }
+        flags |= LUAFLAC_PUSH_LAZY_PICTURE;
+    }
+    if(u->packed_seektable) {
+        flags |= LUAFLAC_PUSH_PACKED_SEEKTABLE;
+    }
+    luaflac_pushstreammetadata_flags(u->L,metadata,flags,data_offset);
 
     lua_call(u->L,2,0);
 
     lua_pop(u->L,1);
     assert(top == lua_gettop(u->L));
-    (void)decoder;
 }
 
 static void
@@ -420,6 +844,205 @@ luaflac_stream_decoder_error_callback(const FLAC__StreamDecoder *decoder,
     (void)decoder;
 }
 
+static void
+luaflac_stream_decoder_cache_frame(luaflac_decoder_userdata *u,
+  const FLAC__Frame *frame,
+  const FLAC__int32 *const buffer[]) {
+    FLAC__Frame whole;
+    const FLAC__int32 *whole_buffer[FLAC__MAX_CHANNELS];
+    unsigned int blocksize = FLAC__stream_decoder_get_blocksize(u->decoder);
+    unsigned int delta = 0;
+    unsigned int i = 0;
+
+    /* after a seek libFLAC hands over the target frame with the samples
+     * before the target cut off, but get_blocksize still has the real size */
+    if(blocksize < frame->header.blocksize) return;
+    delta = blocksize - frame->header.blocksize;
+    if(frame->header.number.sample_number < delta) return;
+
+    whole = *frame;
+    whole.header.blocksize = blocksize;
+    whole.header.number.sample_number -= delta;
+    for(i=0;i<frame->header.channels;i++) {
+        whole_buffer[i] = buffer[i] - delta;
+    }
+    luaflac_frame_cache_insert(u->cache,&whole,whole_buffer,whole.header.number.sample_number);
+}
+
+/* interleaves count samples into little-endian signed integers, using as
+ * few bytes per sample as the bit depth needs, or into float32 */
+static int
+luaflac_stream_decoder_pack(luaflac_decoder_userdata *u, const FLAC__Frame *frame,
+  const FLAC__int32 *const buffer[], unsigned int count, size_t *len) {
+    unsigned int width = (frame->header.bits_per_sample + 7) / 8;
+    unsigned int channels = frame->header.channels;
+    unsigned char *p = NULL;
+    unsigned int i = 0;
+    unsigned int c = 0;
+    unsigned int b = 0;
+    FLAC__uint32 v = 0;
+
+    if(u->write_format == LUAFLAC_FORMAT_FLOAT) width = 4;
+    *len = (size_t)count * channels * width;
+    if(*len > u->packed_size) {
+        p = realloc(u->packed,*len);
+        if(p == NULL) return 0;
+        u->packed = p;
+        u->packed_size = *len;
+    }
+
+    if(u->write_format == LUAFLAC_FORMAT_FLOAT) {
+        luaflac_pcm_float(u->packed,frame->header.bits_per_sample,buffer,channels,count);
+        return 1;
+    }
+
+    p = u->packed;
+    for(i=0;i<count;i++) {
+        for(c=0;c<channels;c++) {
+            v = (FLAC__uint32)buffer[c][i];
+            for(b=0;b<width;b++) {
+                *p++ = (unsigned char)(v >> (8 * b));
+            }
+        }
+    }
+    return 1;
+}
+
+/* pushes the decoder's pcm_buffer holding count samples of the frame,
+ * returns 0 when out of memory */
+static int
+luaflac_stream_decoder_push_pcm(luaflac_decoder_userdata *u, const FLAC__Frame *frame,
+  const FLAC__int32 *const buffer[], unsigned int count) {
+    unsigned int c = 0;
+
+    if(u->pcm == NULL) {
+        u->pcm = luaflac_pcm_buffer_push(u->L,LUAFLAC_PCM_INT32,frame->header.bits_per_sample,0,0);
+        u->pcm_ref = luaL_ref(u->L,LUA_REGISTRYINDEX);
+    }
+    if(!luaflac_pcm_buffer_resize(u->pcm,frame->header.channels,count)) return 0;
+    u->pcm->bits_per_sample = frame->header.bits_per_sample;
+    for(c=0;c<frame->header.channels;c++) {
+        memcpy(luaflac_pcm_buffer_int(u->pcm,c),buffer[c],sizeof(FLAC__int32) * count);
+    }
+    lua_rawgeti(u->L,LUA_REGISTRYINDEX,u->pcm_ref);
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_range_sink(luaflac_decoder_userdata *u, const FLAC__Frame *frame,
+  const FLAC__int32 *const buffer[], unsigned int count) {
+    luaflac_decoder_range *r = &u->range;
+    size_t len = 0;
+    int top = 0;
+    int more = 1;
+
+    if(r->sink == LUAFLAC_SINK_ENCODER) {
+        if(!FLAC__stream_encoder_process(r->encoder,buffer,count)) {
+            r->error = FLAC__stream_encoder_get_resolved_state_string(r->encoder);
+            return 0;
+        }
+        return 1;
+    }
+
+    if(r->sink == LUAFLAC_SINK_WAV) {
+        r->error = luaflac_wav_writer_write(r->wav,buffer,frame->header.channels,
+          frame->header.bits_per_sample,count);
+        return r->error == NULL;
+    }
+
+    if(r->sink == LUAFLAC_SINK_LOUDNESS) {
+        r->error = luaflac_loudness_add(r->loudness,buffer,frame->header.channels,
+          frame->header.bits_per_sample,frame->header.sample_rate,count);
+        return r->error == NULL;
+    }
+
+    if(r->sink == LUAFLAC_SINK_WAVEFORM) {
+        r->error = luaflac_waveform_add(r->waveform,buffer,frame->header.channels,
+          frame->header.bits_per_sample,count);
+        return r->error == NULL;
+    }
+
+    if(r->sink == LUAFLAC_SINK_FILE || u->write_format != LUAFLAC_FORMAT_BUFFER) {
+        if(!luaflac_stream_decoder_pack(u,frame,buffer,count,&len)) {
+            r->error = "out of memory";
+            return 0;
+        }
+    }
+
+    if(r->sink == LUAFLAC_SINK_FILE) {
+        if(fwrite(u->packed,1,len,r->f) != len) {
+            r->error = "error writing file";
+            return 0;
+        }
+        return 1;
+    }
+
+    top = lua_gettop(u->L);
+    lua_rawgeti(u->L,LUA_REGISTRYINDEX,u->table_ref);
+    lua_getfield(u->L,-1,"range_sink");
+    if(u->write_format == LUAFLAC_FORMAT_BUFFER) {
+        if(!luaflac_stream_decoder_push_pcm(u,frame,buffer,count)) {
+            lua_settop(u->L,top);
+            r->error = "out of memory";
+            return 0;
+        }
+    } else {
+        lua_pushlstring(u->L,(const char *)u->packed,len);
+    }
+    lua_pushinteger(u->L,count);
+    lua_call(u->L,2,1);
+    more = lua_toboolean(u->L,-1);
+    lua_pop(u->L,2);
+    assert(top == lua_gettop(u->L));
+    if(!more) r->done = 1;
+    return 1;
+}
+
+/* trims a frame to the range and hands what's left to the sink. Frames
+ * are never aborted, so libFLAC stays usable when the sink gives up */
+static FLAC__StreamDecoderWriteStatus
+luaflac_stream_decoder_range_write(luaflac_decoder_userdata *u,
+  const FLAC__Frame *frame,
+  const FLAC__int32 *const buffer[]) {
+    luaflac_decoder_range *r = &u->range;
+    const FLAC__int32 *trimmed[FLAC__MAX_CHANNELS];
+    FLAC__uint64 start = frame->header.number.sample_number;
+    FLAC__uint64 stop = start + frame->header.blocksize;
+    unsigned int offset = 0;
+    unsigned int i = 0;
+
+    if(r->done || stop <= r->first) return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    if(start >= r->end) {
+        r->done = 1;
+        return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+
+    if(start < r->first) offset = (unsigned int)(r->first - start);
+    if(stop >= r->end) {
+        stop = r->end;
+        r->done = 1;
+    }
+    for(i=0;i<frame->header.channels;i++) {
+        trimmed[i] = buffer[i] + offset;
+    }
+
+    if(u->loudness != NULL) {
+        r->error = luaflac_loudness_add(u->loudness,trimmed,frame->header.channels,
+          frame->header.bits_per_sample,frame->header.sample_rate,stop - start - offset);
+        if(r->error != NULL) {
+            r->done = 1;
+            return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+        }
+    }
+
+    if(!luaflac_stream_decoder_range_sink(u,frame,trimmed,(unsigned int)(stop - start - offset))) {
+        r->done = 1;
+        return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+    r->written += stop - start - offset;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
 static FLAC__StreamDecoderWriteStatus
 luaflac_stream_decoder_write_callback(const FLAC__StreamDecoder *decoder,
   const FLAC__Frame *frame,
@@ -429,8 +1052,21 @@ luaflac_stream_decoder_write_callback(const FLAC__StreamDecoder *decoder,
     int top;
     unsigned int i;
     unsigned int j;
+    size_t len = 0;
     luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)client_data;
 
+    if(decoder != NULL && frame->header.number_type == FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER) {
+        u->decoded_end = frame->header.number.sample_number + frame->header.blocksize;
+        if(u->cache != NULL) luaflac_stream_decoder_cache_frame(u,frame,buffer);
+    }
+    if(u->cache_mute) return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    if(u->range.active) return luaflac_stream_decoder_range_write(u,frame,buffer);
+
+    if(u->loudness != NULL && luaflac_loudness_add(u->loudness,buffer,frame->header.channels,
+      frame->header.bits_per_sample,frame->header.sample_rate,frame->header.blocksize) != NULL) {
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+
     top = lua_gettop(u->L);
 
     lua_rawgeti(u->L,LUA_REGISTRYINDEX,u->table_ref);
@@ -479,16 +1115,29 @@ luaflac_stream_decoder_write_callback(const FLAC__StreamDecoder *decoder,
     lua_setfield(u->L,-2,"footer"); /* end FLAC__FrameFooter */
 
     /* end FLAC__Frame */
-    lua_newtable(u->L); /* FLAC__int32 *const buffer[] */
-    i=0;
-    while(i<frame->header.channels) {
-        lua_newtable(u->L);
-        j=0;
-        while(j<frame->header.blocksize) {
-            lua_pushinteger(u->L,buffer[i][j]);
-            lua_rawseti(u->L,-2,++j);
+    if(u->write_format == LUAFLAC_FORMAT_BUFFER) {
+        if(!luaflac_stream_decoder_push_pcm(u,frame,buffer,frame->header.blocksize)) {
+            lua_settop(u->L,top);
+            return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+        }
+    } else if(u->write_format != LUAFLAC_FORMAT_TABLE) {
+        if(!luaflac_stream_decoder_pack(u,frame,buffer,frame->header.blocksize,&len)) {
+            lua_settop(u->L,top);
+            return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+        }
+        lua_pushlstring(u->L,(const char *)u->packed,len);
+    } else {
+        lua_newtable(u->L); /* FLAC__int32 *const buffer[] */
+        i=0;
+        while(i<frame->header.channels) {
+            lua_newtable(u->L);
+            j=0;
+            while(j<frame->header.blocksize) {
+                lua_pushinteger(u->L,buffer[i][j]);
+                lua_rawseti(u->L,-2,++j);
+            }
+            lua_rawseti(u->L,-2,++i);
         }
-        lua_rawseti(u->L,-2,++i);
     }
 
     lua_call(u->L,3,1);
@@ -640,6 +1289,8 @@ luaflac_stream_decoder_init_file(lua_State *L) {
     FLAC__StreamDecoderMetadataCallback metadata_callback = NULL;
     FLAC__StreamDecoderErrorCallback error_callback = NULL;
     FLAC__StreamDecoderInitStatus status = 0;
+    luaflac_decoder_source *source = NULL;
+    int fast_start = 0;
 
     if(!lua_istable(L,2)) {
         return luaL_error(L,"missing required parameter table");
@@ -647,6 +1298,13 @@ luaflac_stream_decoder_init_file(lua_State *L) {
 
     init_file = lua_touserdata(L,lua_upvalueindex(1));
 
+    lua_getfield(L,2,"fast_start");
+    fast_start = lua_toboolean(L,-1);
+    lua_pop(L,1);
+    if(fast_start && init_file != FLAC__stream_decoder_init_file) {
+        return luaL_error(L,"fast_start is only supported for native FLAC files");
+    }
+
     u = luaL_checkudata(L,1,luaflac_stream_decoder_mt);
     lua_rawgeti(L,LUA_REGISTRYINDEX,u->table_ref);
 
@@ -690,12 +1348,40 @@ luaflac_stream_decoder_init_file(lua_State *L) {
     lua_getfield(L,2,"userdata");
     lua_setfield(L,-2,"userdata");
 
-    status = init_file(u->decoder,
-      filename,
-      write_callback,
-      metadata_callback,
-      error_callback,
-      u);
+    if(fast_start) {
+        if(FLAC__stream_decoder_get_state(u->decoder) != FLAC__STREAM_DECODER_UNINITIALIZED) {
+            status = FLAC__STREAM_DECODER_INIT_STATUS_ALREADY_INITIALIZED;
+        }
+        else if( (source = luaflac_stream_decoder_source_open(u,filename)) == NULL) {
+            status = FLAC__STREAM_DECODER_INIT_STATUS_ERROR_OPENING_FILE;
+        }
+        else {
+            luaflac_stream_decoder_source_free(u->source);
+            u->source = source;
+            status = FLAC__stream_decoder_init_stream(u->decoder,
+              luaflac_stream_decoder_source_read_callback,
+              luaflac_stream_decoder_source_seek_callback,
+              luaflac_stream_decoder_source_tell_callback,
+              luaflac_stream_decoder_source_length_callback,
+              luaflac_stream_decoder_source_eof_callback,
+              write_callback,
+              metadata_callback,
+              error_callback,
+              u);
+            if(status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+                luaflac_stream_decoder_source_free(u->source);
+                u->source = NULL;
+            }
+        }
+    }
+    else {
+        status = init_file(u->decoder,
+          filename,
+          write_callback,
+          metadata_callback,
+          error_callback,
+          u);
+    }
 
     lua_pop(L,1);
 
@@ -712,12 +1398,69 @@ static int
 luaflac_stream_decoder_finish(lua_State *L) {
     luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
     lua_pushboolean(L,FLAC__stream_decoder_finish(u->decoder));
+    /* the next stream will have different frames */
+    if(u->cache != NULL) luaflac_frame_cache_clear(u->cache);
+    u->cache_pending = 0;
+    u->decoded_end = 0;
+    u->stream_end = 0;
+    /* finish() puts libFLAC's metadata filter back to its defaults */
+    luaflac_stream_decoder_reset_filter(u);
+    luaflac_stream_decoder_source_free(u->source);
+    u->source = NULL;
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_get_skipped_metadata(lua_State *L) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    unsigned int i = 0;
+
+    lua_newtable(L);
+    if(u->source == NULL) return 1;
+
+    for(i=0;i<u->source->num_skipped;i++) {
+        lua_newtable(L);
+        lua_pushinteger(L,u->source->skipped[i].type);
+        lua_setfield(L,-2,"type");
+        luaflac_pushuint64(L,u->source->skipped[i].offset);
+        lua_setfield(L,-2,"offset");
+        lua_pushinteger(L,u->source->skipped[i].length);
+        lua_setfield(L,-2,"length");
+        lua_rawseti(L,-2,i+1);
+    }
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_read_skipped_metadata(lua_State *L) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    lua_Integer i = luaL_checkinteger(L,2);
+    luaflac_parsed_block b;
+    int flags = u->lazy_pictures ? LUAFLAC_PARSE_PICTURE_NODATA : 0;
+
+    if(u->source == NULL || i < 1 || (lua_Integer)u->source->num_skipped < i) {
+        return luaL_error(L,"no skipped metadata block %d",(int)i);
+    }
+
+    /* the decoder reads through file_pos, so force a seek on the next read */
+    u->source->file_pos = (FLAC__uint64)-1;
+    b.header = u->source->skipped[i-1];
+    b.metadata = luaflac_parse_block(u->source->f,&b.header,flags);
+    if(b.metadata == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"error reading metadata block");
+        return 2;
+    }
+
+    luaflac_push_parsed_block(L,&b,u->packed_seektable ? LUAFLAC_PUSH_PACKED_SEEKTABLE : 0);
+    FLAC__metadata_object_delete(b.metadata);
     return 1;
 }
 
 static int
 luaflac_stream_decoder_flush(lua_State *L) {
     luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    u->cache_pending = 0;
     lua_pushboolean(L,FLAC__stream_decoder_flush(u->decoder));
     return 1;
 }
@@ -725,20 +1468,99 @@ luaflac_stream_decoder_flush(lua_State *L) {
 static int
 luaflac_stream_decoder_reset(lua_State *L) {
     luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    u->cache_pending = 0;
     lua_pushboolean(L,FLAC__stream_decoder_reset(u->decoder));
     return 1;
 }
 
+/* hands a cached frame to the write callback, starting at sample */
+static int
+luaflac_stream_decoder_write_cached(luaflac_decoder_userdata *u,
+  const luaflac_frame_cache_entry *e, FLAC__uint64 sample) {
+    FLAC__Frame frame = e->frame;
+    const FLAC__int32 *buffer[FLAC__MAX_CHANNELS];
+    unsigned int delta = (unsigned int)(sample - e->sample);
+    unsigned int i = 0;
+
+    frame.header.blocksize -= delta;
+    frame.header.number.sample_number = sample;
+    for(i=0;i<frame.header.channels;i++) {
+        buffer[i] = &e->pcm[i * e->frame.header.blocksize + delta];
+    }
+    return luaflac_stream_decoder_write_callback(NULL,&frame,buffer,u) ==
+      FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+/* remembers where the stream ends once libFLAC has decoded up to it, since
+ * playing from the cache or seeking away loses the END_OF_STREAM state */
+static void
+luaflac_stream_decoder_note_end(luaflac_decoder_userdata *u) {
+    if(FLAC__stream_decoder_get_state(u->decoder) == FLAC__STREAM_DECODER_END_OF_STREAM) {
+        u->stream_end = u->decoded_end;
+    }
+}
+
+static int
+luaflac_stream_decoder_cache_at_end(luaflac_decoder_userdata *u) {
+    FLAC__uint64 total = FLAC__stream_decoder_get_total_samples(u->decoder);
+    if(total == 0) {
+        luaflac_stream_decoder_note_end(u);
+        total = u->stream_end;
+    }
+    return total > 0 && u->cache_pos >= total;
+}
+
+/* plays the next frame while reading from the cache, or on a miss gets
+ * libFLAC back to where the cache left off. The seek decodes the frame
+ * at cache_pos, so either way exactly one frame is processed */
+static int
+luaflac_stream_decoder_cache_next(luaflac_decoder_userdata *u, int skip) {
+    luaflac_frame_cache_entry *e = NULL;
+    int ok = 1;
+
+    if(luaflac_stream_decoder_cache_at_end(u)) return 1;
+
+    e = luaflac_frame_cache_find(u->cache,u->cache_pos);
+    if(e != NULL) {
+        if(!skip) ok = luaflac_stream_decoder_write_cached(u,e,u->cache_pos);
+        u->cache_pos = e->sample + e->frame.header.blocksize;
+        return ok;
+    }
+
+    u->cache_pending = 0;
+    u->cache_mute = skip;
+    ok = FLAC__stream_decoder_seek_absolute(u->decoder,u->cache_pos);
+    u->cache_mute = 0;
+    return ok;
+}
+
+static int
+luaflac_stream_decoder_process_one(luaflac_decoder_userdata *u) {
+    if(u->cache_pending) return luaflac_stream_decoder_cache_next(u,0);
+    return FLAC__stream_decoder_process_single(u->decoder);
+}
+
 static int
 luaflac_stream_decoder_process_single(lua_State *L) {
     luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
-    lua_pushboolean(L,FLAC__stream_decoder_process_single(u->decoder));
+    lua_pushboolean(L,luaflac_stream_decoder_process_one(u));
     return 1;
 }
 
 static int
 luaflac_stream_decoder_process_until_end_of_stream(lua_State *L) {
     luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+
+    while(u->cache_pending) {
+        if(luaflac_stream_decoder_cache_at_end(u)) {
+            lua_pushboolean(L,1);
+            return 1;
+        }
+        if(!luaflac_stream_decoder_cache_next(u,0)) {
+            lua_pushboolean(L,0);
+            return 1;
+        }
+    }
     lua_pushboolean(L,FLAC__stream_decoder_process_until_end_of_stream(u->decoder));
     return 1;
 }
@@ -753,14 +1575,220 @@ luaflac_stream_decoder_process_until_end_of_metadata(lua_State *L) {
 static int
 luaflac_stream_decoder_skip_single_frame(lua_State *L) {
     luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    if(u->cache_pending) {
+        lua_pushboolean(L,luaflac_stream_decoder_cache_next(u,1));
+        return 1;
+    }
     lua_pushboolean(L,FLAC__stream_decoder_skip_single_frame(u->decoder));
     return 1;
 }
 
+static int
+luaflac_stream_decoder_seek(luaflac_decoder_userdata *u, FLAC__uint64 sample) {
+    luaflac_frame_cache_entry *e = NULL;
+
+    luaflac_stream_decoder_note_end(u);
+    if(u->cache != NULL && (e = luaflac_frame_cache_find(u->cache,sample)) != NULL) {
+        /* like libFLAC, the target frame is written out from the target sample */
+        u->cache_pending = 1;
+        u->cache_pos = e->sample + e->frame.header.blocksize;
+        return luaflac_stream_decoder_write_cached(u,e,sample);
+    }
+    u->cache_pending = 0;
+    return FLAC__stream_decoder_seek_absolute(u->decoder,sample);
+}
+
 static int
 luaflac_stream_decoder_seek_absolute(lua_State *L) {
     luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
-    lua_pushboolean(L,FLAC__stream_decoder_seek_absolute(u->decoder,lua_tointeger(L,2)));
+    lua_pushboolean(L,luaflac_stream_decoder_seek(u,(FLAC__uint64)lua_tointeger(L,2)));
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_at_end(luaflac_decoder_userdata *u) {
+    if(u->cache_pending) return luaflac_stream_decoder_cache_at_end(u);
+    return FLAC__stream_decoder_get_state(u->decoder) == FLAC__STREAM_DECODER_END_OF_STREAM;
+}
+
+/* runs protected so the range is always torn down, even if the
+ * sink or another callback raises an error */
+static int
+luaflac_stream_decoder_range_run(lua_State *L) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)lua_touserdata(L,1);
+    luaflac_decoder_range *r = &u->range;
+
+    if(!luaflac_stream_decoder_seek(u,r->first)) {
+        if(r->error == NULL) r->error = FLAC__stream_decoder_get_resolved_state_string(u->decoder);
+        return 0;
+    }
+    while(!r->done && !luaflac_stream_decoder_at_end(u)) {
+        if(!luaflac_stream_decoder_process_one(u)) {
+            if(r->error == NULL) r->error = FLAC__stream_decoder_get_resolved_state_string(u->decoder);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int
+luaflac_stream_decoder_decode_range(lua_State *L) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    luaflac_decoder_range *r = &u->range;
+    FLAC__uint64 first = luaflac_touint64(L,2);
+    FLAC__uint64 last = luaflac_touint64(L,3);
+    FLAC__uint64 total = FLAC__stream_decoder_get_total_samples(u->decoder);
+    int owned = 0;
+    int status = 0;
+
+    if(r->active) {
+        return luaL_error(L,"decode_range is already running");
+    }
+    if(last < first) {
+        return luaL_error(L,"last sample is before the first");
+    }
+
+    r->sink = LUAFLAC_SINK_FUNCTION;
+    r->f = NULL;
+    r->encoder = NULL;
+    r->wav = NULL;
+    r->loudness = NULL;
+    r->waveform = NULL;
+    if(lua_isfunction(L,4)) {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,u->table_ref);
+        lua_pushvalue(L,4);
+        lua_setfield(L,-2,"range_sink");
+        lua_pop(L,1);
+    } else if((r->encoder = luaflac_stream_encoder_test(L,4)) != NULL) {
+        r->sink = LUAFLAC_SINK_ENCODER;
+    } else if((r->wav = luaflac_wav_writer_test(L,4)) != NULL) {
+        r->sink = LUAFLAC_SINK_WAV;
+    } else if((r->loudness = luaflac_loudness_test(L,4)) != NULL) {
+        r->sink = LUAFLAC_SINK_LOUDNESS;
+    } else if((r->waveform = luaflac_waveform_test(L,4)) != NULL) {
+        r->sink = LUAFLAC_SINK_WAVEFORM;
+    } else {
+        r->sink = LUAFLAC_SINK_FILE;
+        r->f = luaflac_checkfile(L,4,"wb",&owned);
+        if(r->f == NULL) {
+            lua_pushnil(L);
+            lua_pushfstring(L,"error opening %s",lua_tostring(L,4));
+            return 2;
+        }
+    }
+
+    r->first = first;
+    r->end = last + 1;
+    if(total > 0 && r->end > total) r->end = total;
+    r->written = 0;
+    r->done = r->first >= r->end;
+    r->error = NULL;
+    if(r->sink == LUAFLAC_SINK_WAVEFORM) {
+        /* buckets are spread over the range */
+        r->error = luaflac_waveform_start(r->waveform,r->end > r->first ? r->end - r->first : 0);
+        if(r->error != NULL) {
+            r->waveform = NULL;
+            lua_pushnil(L);
+            lua_pushstring(L,r->error);
+            return 2;
+        }
+    }
+    r->active = 1;
+
+    lua_pushcfunction(L,luaflac_stream_decoder_range_run);
+    lua_pushlightuserdata(L,u);
+    status = lua_pcall(L,1,0,0);
+
+    r->active = 0;
+    if(r->sink == LUAFLAC_SINK_FUNCTION) {
+        lua_rawgeti(L,LUA_REGISTRYINDEX,u->table_ref);
+        lua_pushnil(L);
+        lua_setfield(L,-2,"range_sink");
+        lua_pop(L,1);
+    }
+    if(owned && fclose(r->f) != 0 && status == 0 && r->error == NULL) {
+        r->error = "error writing file";
+    }
+    if(r->sink == LUAFLAC_SINK_WAVEFORM && status == 0 && r->error == NULL) {
+        r->error = luaflac_waveform_finish(r->waveform);
+    }
+    r->f = NULL;
+    r->encoder = NULL;
+    r->wav = NULL;
+    r->loudness = NULL;
+    r->waveform = NULL;
+
+    if(status != 0) {
+        return lua_error(L);
+    }
+    if(r->error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,r->error);
+        return 2;
+    }
+    luaflac_pushuint64(L,r->written);
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_set_frame_cache(lua_State *L) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    lua_Integer limit = luaL_checkinteger(L,2);
+
+    luaflac_frame_cache_free(u->cache);
+    u->cache = NULL;
+    u->cache_pending = 0;
+    if(limit > 0) {
+        u->cache = luaflac_frame_cache_new((size_t)limit);
+        if(u->cache == NULL) {
+            return luaL_error(L,"out of memory");
+        }
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+/* the analyzer is kept in the callback table so it outlives its use here */
+static int
+luaflac_stream_decoder_set_loudness(lua_State *L) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+    luaflac_loudness *l = NULL;
+
+    if(!lua_isnoneornil(L,2)) {
+        l = luaflac_loudness_test(L,2);
+        if(l == NULL) {
+            return luaL_argerror(L,2,"loudness analyzer expected");
+        }
+    }
+    lua_settop(L,2);
+    lua_rawgeti(L,LUA_REGISTRYINDEX,u->table_ref);
+    lua_pushvalue(L,2);
+    lua_setfield(L,-2,"loudness");
+    lua_pop(L,1);
+    u->loudness = l;
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaflac_stream_decoder_get_frame_cache_stats(lua_State *L) {
+    luaflac_decoder_userdata *u = (luaflac_decoder_userdata *)luaL_checkudata(L,1,luaflac_stream_decoder_mt);
+
+    if(u->cache == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_createtable(L,0,5);
+    lua_pushinteger(L,(lua_Integer)u->cache->hits);
+    lua_setfield(L,-2,"hits");
+    lua_pushinteger(L,(lua_Integer)u->cache->misses);
+    lua_setfield(L,-2,"misses");
+    lua_pushinteger(L,(lua_Integer)u->cache->num_entries);
+    lua_setfield(L,-2,"frames");
+    lua_pushinteger(L,(lua_Integer)u->cache->bytes);
+    lua_setfield(L,-2,"bytes");
+    lua_pushinteger(L,(lua_Integer)u->cache->limit);
+    lua_setfield(L,-2,"limit");
     return 1;
 }
 
@@ -791,6 +1819,18 @@ static const struct luaL_Reg luaflac_stream_decoder_functions[] = {
     { "FLAC__stream_decoder_process_until_end_of_stream", luaflac_stream_decoder_process_until_end_of_stream },
     { "FLAC__stream_decoder_skip_single_frame", luaflac_stream_decoder_skip_single_frame },
     { "FLAC__stream_decoder_seek_absolute", luaflac_stream_decoder_seek_absolute },
+    { "luaflac_stream_decoder_set_lazy_pictures", luaflac_stream_decoder_set_lazy_pictures },
+    { "luaflac_stream_decoder_get_lazy_pictures", luaflac_stream_decoder_get_lazy_pictures },
+    { "luaflac_stream_decoder_set_packed_seektable", luaflac_stream_decoder_set_packed_seektable },
+    { "luaflac_stream_decoder_get_packed_seektable", luaflac_stream_decoder_get_packed_seektable },
+    { "luaflac_stream_decoder_set_write_format", luaflac_stream_decoder_set_write_format },
+    { "luaflac_stream_decoder_get_write_format", luaflac_stream_decoder_get_write_format },
+    { "luaflac_stream_decoder_get_skipped_metadata", luaflac_stream_decoder_get_skipped_metadata },
+    { "luaflac_stream_decoder_read_skipped_metadata", luaflac_stream_decoder_read_skipped_metadata },
+    { "luaflac_stream_decoder_set_frame_cache", luaflac_stream_decoder_set_frame_cache },
+    { "luaflac_stream_decoder_set_loudness", luaflac_stream_decoder_set_loudness },
+    { "luaflac_stream_decoder_get_frame_cache_stats", luaflac_stream_decoder_get_frame_cache_stats },
+    { "luaflac_stream_decoder_decode_range", luaflac_stream_decoder_decode_range },
     { NULL, NULL },
 };
 
@@ -825,6 +1865,18 @@ static const luaflac_metamethods luaflac_stream_decoder_metamethods[] = {
     { "FLAC__stream_decoder_process_until_end_of_metadata" , "process_until_end_of_metadata" },
     { "FLAC__stream_decoder_skip_single_frame" , "skip_single_frame" },
     { "FLAC__stream_decoder_seek_absolute" , "seek_absolute" },
+    { "luaflac_stream_decoder_set_lazy_pictures" , "set_lazy_pictures" },
+    { "luaflac_stream_decoder_get_lazy_pictures" , "get_lazy_pictures" },
+    { "luaflac_stream_decoder_set_packed_seektable" , "set_packed_seektable" },
+    { "luaflac_stream_decoder_get_packed_seektable" , "get_packed_seektable" },
+    { "luaflac_stream_decoder_set_write_format" , "set_write_format" },
+    { "luaflac_stream_decoder_get_write_format" , "get_write_format" },
+    { "luaflac_stream_decoder_get_skipped_metadata" , "get_skipped_metadata" },
+    { "luaflac_stream_decoder_read_skipped_metadata" , "read_skipped_metadata" },
+    { "luaflac_stream_decoder_set_frame_cache" , "set_frame_cache" },
+    { "luaflac_stream_decoder_set_loudness" , "set_loudness" },
+    { "luaflac_stream_decoder_get_frame_cache_stats" , "get_frame_cache_stats" },
+    { "luaflac_stream_decoder_decode_range" , "decode_range" },
     { NULL, NULL },
 };
 
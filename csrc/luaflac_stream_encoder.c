@@ -2,12 +2,55 @@
 #include <FLAC/stream_encoder.h>
 #include <FLAC/metadata.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
 LUAFLAC_PRIVATE
 const char * const luaflac_stream_encoder_mt = "FLAC__StreamEncoder";
 
+/* encoder:init_append. The encoder's frames go on the end of an existing
+ * file, renumbered to follow on from the frames already there, and finish
+ * patches up STREAMINFO and the SEEKTABLE */
+struct luaflac_encoder_append_s {
+    FILE *f;
+    int owned;
+    FLAC__StreamMetadata_StreamInfo streaminfo;
+    FLAC__uint64 streaminfo_offset; /* of the STREAMINFO block header */
+    FLAC__uint64 audio_offset;
+    FLAC__uint64 offset; /* where the next frame goes */
+    int variable; /* numbered by samples instead of frames */
+    FLAC__uint32 blocksize; /* of a fixed blocksize stream */
+
+    FLAC__uint64 seektable_offset; /* of the SEEKTABLE block header, 0 without one */
+    unsigned int seektable_slots;
+    FLAC__StreamMetadata_SeekPoint *points; /* real seek points, in order */
+    size_t num_points;
+    size_t max_points;
+    FLAC__uint64 point_interval;
+    FLAC__uint64 next_point;
+
+    luaflac_frame_decoder tail; /* the short last frame, encoded again */
+    luaflac_frame_decoder check; /* decodes frames for the MD5 */
+    int do_md5;
+    luaflac_md5 md5;
+
+    FLAC__byte *buf; /* a renumbered frame */
+    size_t buf_size;
+
+    FLAC__uint64 frames;
+    FLAC__uint64 samples;
+    FLAC__uint32 min_blocksize;
+    FLAC__uint32 max_blocksize;
+    FLAC__uint32 last_blocksize;
+    int framesizes; /* the frame sizes are known */
+    FLAC__uint32 min_framesize;
+    FLAC__uint32 max_framesize;
+    const char *error;
+};
+
+typedef struct luaflac_encoder_append_s luaflac_encoder_append;
+
 struct luaflac_encoder_userdata_s {
     lua_State *L;
     int table_ref;
@@ -21,10 +64,320 @@ struct luaflac_encoder_userdata_s {
     int planar_ref;
     unsigned int channels;
     unsigned int samples;
+    FLAC__uint32 dither; /* process_float's dither state */
+    luaflac_encoder_append *append;
 };
 
 typedef struct luaflac_encoder_userdata_s luaflac_encoder_userdata;
 
+static void
+luaflac_encoder_append_free(luaflac_encoder_append *a) {
+    luaflac_frame_decoder_free(&a->tail);
+    luaflac_frame_decoder_free(&a->check);
+    free(a->points);
+    free(a->buf);
+    if(a->owned && a->f != NULL) fclose(a->f);
+    free(a);
+}
+
+static int
+luaflac_encoder_append_add_point(luaflac_encoder_append *a, FLAC__uint64 sample,
+  FLAC__uint64 offset, unsigned int frame_samples) {
+    FLAC__StreamMetadata_SeekPoint *tmp = NULL;
+    size_t max = 0;
+
+    if(a->num_points == a->max_points) {
+        max = a->max_points ? a->max_points * 2 : 64;
+        tmp = realloc(a->points,sizeof(FLAC__StreamMetadata_SeekPoint) * max);
+        if(tmp == NULL) return 0;
+        a->points = tmp;
+        a->max_points = max;
+    }
+    a->points[a->num_points].sample_number = sample;
+    a->points[a->num_points].stream_offset = offset;
+    a->points[a->num_points].frame_samples = frame_samples;
+    a->num_points++;
+    return 1;
+}
+
+/* keeps the seek points before the new audio, new points are added at
+ * the same spacing (or every 10 seconds) */
+static int
+luaflac_encoder_append_read_seektable(luaflac_encoder_append *a) {
+    const FLAC__StreamMetadata_SeekPoint *p = NULL;
+    FLAC__StreamMetadata *m = NULL;
+    luaflac_block_header h;
+    FLAC__uint64 offset = 0;
+    unsigned int i = 0;
+    int ok = 1;
+
+    if(!luaflac_parse_stream_start(a->f,&offset)) return 0;
+    offset += 4;
+    do {
+        if(!luaflac_parse_block_header(a->f,offset,&h)) return 0;
+        if(h.type == FLAC__METADATA_TYPE_SEEKTABLE && a->seektable_offset == 0) {
+            m = luaflac_parse_block(a->f,&h,0);
+            if(m == NULL) return 0;
+            a->seektable_offset = offset;
+            a->seektable_slots = m->data.seek_table.num_points;
+            for(i=0;i<m->data.seek_table.num_points && ok;i++) {
+                p = &m->data.seek_table.points[i];
+                if(p->sample_number == FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER ||
+                   p->sample_number >= a->samples) break;
+                ok = luaflac_encoder_append_add_point(a,p->sample_number,p->stream_offset,p->frame_samples);
+            }
+            FLAC__metadata_object_delete(m);
+        }
+        offset += 4 + (FLAC__uint64)h.length;
+    } while(!h.is_last && ok);
+
+    if(a->num_points >= 2) {
+        a->point_interval = a->points[a->num_points - 1].sample_number -
+          a->points[a->num_points - 2].sample_number;
+    }
+    if(a->point_interval == 0) a->point_interval = (FLAC__uint64)a->streaminfo.sample_rate * 10;
+    if(a->num_points > 0) {
+        a->next_point = a->points[a->num_points - 1].sample_number + a->point_interval;
+    }
+    return ok;
+}
+
+/* reads what's already in the file: the audio format, where the new frames
+ * go and how they're numbered. A damaged last frame, like one cut short
+ * when a recorder stopped, is dropped. So is a short last frame in a fixed
+ * blocksize stream, after decoding it so its samples can lead the new
+ * audio, since only the last frame of such a stream can be short */
+static int
+luaflac_encoder_append_open(luaflac_encoder_append *a) {
+    luaflac_frame_reader r;
+    luaflac_frame frame;
+    FLAC__uint64 end = 0;
+    int drop = 0;
+    int res = 0;
+
+    if(!luaflac_frame_reader_init(&r,a->f) || r.streaminfo_offset == 0) {
+        a->error = "error reading metadata";
+        goto luaflac_encoder_append_open_done;
+    }
+    a->streaminfo = r.streaminfo;
+    a->streaminfo_offset = r.streaminfo_offset;
+    a->audio_offset = r.audio_offset;
+    a->framesizes = 1;
+    end = r.audio_offset;
+
+    res = luaflac_frame_reader_last(&r,&frame);
+    if(res < 0) {
+        a->error = "error reading frames";
+        goto luaflac_encoder_append_open_done;
+    }
+
+    if(res == 1) {
+        a->variable = frame.header.variable_blocksize;
+        a->blocksize = r.fixed_blocksize;
+        if(!a->variable && a->blocksize == 0) {
+            a->error = "unknown blocksize";
+            goto luaflac_encoder_append_open_done;
+        }
+
+        if(!luaflac_frame_check_crc(&frame)) {
+            drop = 1;
+        } else if(!a->variable && frame.header.blocksize < a->blocksize) {
+            drop = 1;
+            a->tail.keep = 1;
+            if(!luaflac_frame_decoder_init(&a->tail,&a->streaminfo) ||
+               !luaflac_frame_decoder_run(&a->tail,frame.data,frame.size)) {
+                a->error = "error decoding the last frame";
+                goto luaflac_encoder_append_open_done;
+            }
+        }
+
+        end = drop ? frame.offset : frame.offset + frame.size;
+        a->samples = frame.sample + (drop ? 0 : frame.header.blocksize);
+        a->frames = a->variable ? 0 : frame.header.number + (drop ? 0 : 1);
+        a->min_blocksize = r.streaminfo.min_blocksize;
+        a->max_blocksize = r.streaminfo.max_blocksize;
+        /* a kept last frame isn't the last one any more */
+        a->last_blocksize = drop ? 0 : frame.header.blocksize;
+        a->min_framesize = r.streaminfo.min_framesize;
+        a->max_framesize = r.streaminfo.max_framesize;
+        a->framesizes = a->min_framesize > 0 && a->max_framesize > 0;
+    }
+
+    if(a->do_md5) {
+        luaflac_md5_init(&a->md5);
+        a->check.md5 = &a->md5;
+        if(!luaflac_frame_decoder_init(&a->check,&a->streaminfo)) {
+            a->error = "error setting up the decoder";
+            goto luaflac_encoder_append_open_done;
+        }
+        if(!luaflac_frame_reader_seek(&r,r.audio_offset)) {
+            a->error = "error reading frames";
+            goto luaflac_encoder_append_open_done;
+        }
+        while( (res = luaflac_frame_reader_next(&r,&frame)) == 1 && frame.offset < end) {
+            if(!luaflac_frame_decoder_run(&a->check,frame.data,frame.size)) {
+                a->error = a->check.error;
+                goto luaflac_encoder_append_open_done;
+            }
+        }
+        if(res < 0) {
+            a->error = "error reading frames";
+            goto luaflac_encoder_append_open_done;
+        }
+    }
+
+    if(!luaflac_encoder_append_read_seektable(a)) {
+        a->error = "error reading metadata";
+        goto luaflac_encoder_append_open_done;
+    }
+
+    /* switching from reading to writing needs a seek in between */
+    if(luaflac_fseek(a->f,end) != 0) {
+        a->error = "error seeking";
+        goto luaflac_encoder_append_open_done;
+    }
+    a->offset = end;
+
+    luaflac_encoder_append_open_done:
+    luaflac_frame_reader_free(&r);
+    return a->error == NULL;
+}
+
+static FLAC__StreamEncoderWriteStatus
+luaflac_encoder_append_write(const FLAC__StreamEncoder *encoder, const FLAC__byte buffer[],
+  size_t bytes, unsigned samples, unsigned current_frame, void *client_data) {
+    luaflac_encoder_userdata *u = (luaflac_encoder_userdata *)client_data;
+    luaflac_encoder_append *a = u->append;
+    luaflac_frame_header h;
+    FLAC__byte *p = NULL;
+    size_t n = 0;
+    (void)encoder;
+    (void)current_frame;
+
+    /* the encoder's own stream marker and metadata, the file has its own */
+    if(samples == 0) return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+
+    if(!luaflac_frame_header_parse(buffer,bytes,&a->streaminfo,&h) || bytes < h.length + 2) {
+        a->error = "invalid frame";
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+    }
+
+    if(bytes + LUAFLAC_FRAME_RENUMBER_GROWTH > a->buf_size) {
+        p = realloc(a->buf,bytes + LUAFLAC_FRAME_RENUMBER_GROWTH);
+        if(p == NULL) {
+            a->error = "out of memory";
+            return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+        }
+        a->buf = p;
+        a->buf_size = bytes + LUAFLAC_FRAME_RENUMBER_GROWTH;
+    }
+
+    n = luaflac_frame_renumber(buffer,bytes,&h,a->variable,a->variable ? a->samples : a->frames,a->buf);
+    if(fwrite(a->buf,1,n,a->f) != n) {
+        a->error = "error writing file";
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+    }
+
+    if(a->do_md5 && !luaflac_frame_decoder_run(&a->check,a->buf,n)) {
+        a->error = a->check.error;
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+    }
+
+    if(a->seektable_offset != 0 && a->samples >= a->next_point) {
+        if(!luaflac_encoder_append_add_point(a,a->samples,a->offset - a->audio_offset,h.blocksize)) {
+            a->error = "out of memory";
+            return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+        }
+        a->next_point = a->samples + a->point_interval;
+    }
+
+    /* the last frame doesn't count towards the minimum blocksize */
+    if(a->last_blocksize > 0 && (a->min_blocksize == 0 || a->last_blocksize < a->min_blocksize)) {
+        a->min_blocksize = a->last_blocksize;
+    }
+    if(h.blocksize > a->max_blocksize) a->max_blocksize = h.blocksize;
+    a->last_blocksize = h.blocksize;
+    if(a->framesizes) {
+        if(a->min_framesize == 0 || n < a->min_framesize) a->min_framesize = (FLAC__uint32)n;
+        if(n > a->max_framesize) a->max_framesize = (FLAC__uint32)n;
+    }
+    a->offset += n;
+    a->samples += h.blocksize;
+    a->frames++;
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+static void
+luaflac_encoder_append_pack_point(FLAC__byte *b, const FLAC__StreamMetadata_SeekPoint *p) {
+    FLAC__uint64 sample = p == NULL ? FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER : p->sample_number;
+    FLAC__uint64 offset = p == NULL ? 0 : p->stream_offset;
+    unsigned int frame_samples = p == NULL ? 0 : p->frame_samples;
+    unsigned int i = 0;
+
+    for(i=0;i<8;i++) {
+        b[i] = (FLAC__byte)(sample >> (56 - 8 * i));
+        b[8 + i] = (FLAC__byte)(offset >> (56 - 8 * i));
+    }
+    b[16] = (FLAC__byte)(frame_samples >> 8);
+    b[17] = (FLAC__byte)(frame_samples);
+}
+
+/* cuts the file off after the last frame written and rewrites STREAMINFO
+ * and the SEEKTABLE to match. Done even after an error, so the file
+ * describes the frames that did get written */
+static int
+luaflac_encoder_append_close(luaflac_encoder_append *a) {
+    FLAC__StreamMetadata_StreamInfo s = a->streaminfo;
+    FLAC__byte b[FLAC__STREAM_METADATA_STREAMINFO_LENGTH];
+    FLAC__byte *table = NULL;
+    const FLAC__StreamMetadata_SeekPoint *p = NULL;
+    size_t size = 0;
+    size_t i = 0;
+
+    s.min_blocksize = a->min_blocksize > 0 ? a->min_blocksize : a->last_blocksize;
+    s.max_blocksize = a->max_blocksize;
+    s.min_framesize = a->framesizes ? a->min_framesize : 0;
+    s.max_framesize = a->framesizes ? a->max_framesize : 0;
+    s.total_samples = a->samples;
+    memset(s.md5sum,0,16);
+    if(a->do_md5 && a->error == NULL) luaflac_md5_final(&a->md5,s.md5sum);
+    luaflac_pack_streaminfo(b,&s);
+
+    if(luaflac_ftruncate(a->f,a->offset) != 0 ||
+       luaflac_fseek(a->f,a->streaminfo_offset + 4) != 0 ||
+       fwrite(b,1,sizeof(b),a->f) != sizeof(b)) {
+        if(a->error == NULL) a->error = "error writing file";
+        return 0;
+    }
+
+    if(a->seektable_offset != 0 && a->seektable_slots > 0) {
+        size = (size_t)a->seektable_slots * FLAC__STREAM_METADATA_SEEKPOINT_LENGTH;
+        table = malloc(size);
+        if(table == NULL) {
+            if(a->error == NULL) a->error = "out of memory";
+            return 0;
+        }
+        /* more points than slots get thinned out evenly,
+         * spare slots are filled with placeholders */
+        for(i=0;i<a->seektable_slots;i++) {
+            if(a->num_points > a->seektable_slots) {
+                p = &a->points[i * a->num_points / a->seektable_slots];
+            } else {
+                p = i < a->num_points ? &a->points[i] : NULL;
+            }
+            luaflac_encoder_append_pack_point(&table[i * FLAC__STREAM_METADATA_SEEKPOINT_LENGTH],p);
+        }
+        if(luaflac_fseek(a->f,a->seektable_offset + 4) != 0 ||
+           fwrite(table,1,size,a->f) != size) {
+            if(a->error == NULL) a->error = "error writing file";
+        }
+        free(table);
+    }
+
+    if(fflush(a->f) != 0 && a->error == NULL) a->error = "error writing file";
+    return a->error == NULL;
+}
+
 static void
 luaflac_stream_encoder_free_metadata(lua_State *L, luaflac_encoder_userdata *u) {
     unsigned int i = 0;
@@ -33,7 +386,7 @@ luaflac_stream_encoder_free_metadata(lua_State *L, luaflac_encoder_userdata *u)
         u->metadata_ref = LUA_NOREF;
         while(i<u->num_blocks) {
             if(u->metadata[i] != NULL) {
-                FLAC__metadata_object_delete(u->metadata[i]);
+                luaflac_streammetadata_delete(u->metadata[i],1);
                 u->metadata[i] = NULL;
             }
             i++;
@@ -51,6 +404,13 @@ luaflac_stream_encoder_delete(lua_State *L) {
         u->encoder = NULL;
     }
 
+    /* deleting the encoder finished it, the file gets patched up the same way */
+    if(u->append != NULL) {
+        luaflac_encoder_append_close(u->append);
+        luaflac_encoder_append_free(u->append);
+        u->append = NULL;
+    }
+
     if(u->table_ref != LUA_NOREF) {
         luaL_unref(L,LUA_REGISTRYINDEX,u->table_ref);
         u->table_ref = LUA_NOREF;
@@ -83,6 +443,7 @@ luaflac_stream_encoder_new(lua_State *L) {
     }
 
     u->L = L;
+    u->append = NULL;
     u->metadata = NULL;
     u->metadata_ref = LUA_NOREF;
     u->num_blocks = 0;
@@ -102,6 +463,7 @@ luaflac_stream_encoder_new(lua_State *L) {
     u->buffer_ref = LUA_NOREF;
     u->channels = 0;
     u->samples = 0;
+    u->dither = LUAFLAC_PCM_SEED;
 
     return 1;
 }
@@ -256,14 +618,23 @@ luaflac_stream_encoder_set_metadata(lua_State *L) {
 
     u->num_blocks = lua_rawlen(L,2);
     u->metadata = lua_newuserdata(L,sizeof(FLAC__StreamMetadata *) * u->num_blocks);
+    memset(u->metadata,0,sizeof(FLAC__StreamMetadata *) * u->num_blocks);
+
+    /* large payloads (pictures) reference their Lua strings rather than
+     * being copied, the strings are anchored in the userdata's uservalue */
+    lua_newtable(L);
+    lua_setuservalue(L,-2);
+    lua_getuservalue(L,-1);
+    lua_insert(L,-2);
     u->metadata_ref = luaL_ref(L,LUA_REGISTRYINDEX);
 
     while(i<u->num_blocks) {
         lua_rawgeti(L,2,i+1);
-        u->metadata[i] = luaflac_toflac_streammetadata(L,-1);
+        u->metadata[i] = luaflac_toflac_streammetadata(L,-1,-2);
         lua_pop(L,1);
         i++;
     }
+    lua_pop(L,1);
 
     lua_pushboolean(L,FLAC__stream_encoder_set_metadata(u->encoder,
       u->metadata,
@@ -857,10 +1228,110 @@ luaflac_stream_encoder_init_file(lua_State *L) {
     return 2;
 }
 
+static int
+luaflac_stream_encoder_init_append(lua_State *L) {
+    luaflac_encoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_encoder_mt);
+    luaflac_encoder_append *a = NULL;
+    FLAC__StreamEncoderInitStatus status = 0;
+    FILE *f = NULL;
+    int owned = 0;
+
+    if(!lua_istable(L,2)) {
+        return luaL_error(L,"missing required parameter table");
+    }
+
+    if(FLAC__stream_encoder_get_state(u->encoder) != FLAC__STREAM_ENCODER_UNINITIALIZED) {
+        lua_pushnil(L);
+        lua_pushinteger(L,FLAC__STREAM_ENCODER_INIT_STATUS_ALREADY_INITIALIZED);
+        return 2;
+    }
+
+    lua_getfield(L,2,"filename");
+    if(lua_isnil(L,-1)) {
+        return luaL_error(L,"filename must not be nil");
+    }
+    f = luaflac_checkfile(L,-1,"r+b",&owned);
+    if(f == NULL) {
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,-1));
+        lua_pushnil(L);
+        lua_insert(L,-2);
+        return 2;
+    }
+    lua_pop(L,1);
+
+    a = calloc(1,sizeof(luaflac_encoder_append));
+    if(a == NULL) {
+        if(owned) fclose(f);
+        return luaL_error(L,"out of memory");
+    }
+    a->f = f;
+    a->owned = owned;
+
+    lua_getfield(L,2,"md5");
+    a->do_md5 = lua_toboolean(L,-1);
+    lua_pop(L,1);
+
+    if(!luaflac_encoder_append_open(a)) {
+        lua_pushnil(L);
+        lua_pushstring(L,a->error);
+        luaflac_encoder_append_free(a);
+        return 2;
+    }
+
+    /* the format comes from the file, and frame numbers only
+     * work if the new frames are the same size as the old */
+    FLAC__stream_encoder_set_channels(u->encoder,a->streaminfo.channels);
+    FLAC__stream_encoder_set_bits_per_sample(u->encoder,a->streaminfo.bits_per_sample);
+    FLAC__stream_encoder_set_sample_rate(u->encoder,a->streaminfo.sample_rate);
+    if(!a->variable && a->blocksize > 0) {
+        FLAC__stream_encoder_set_blocksize(u->encoder,a->blocksize);
+    }
+
+    u->append = a;
+    status = FLAC__stream_encoder_init_stream(u->encoder,
+      luaflac_encoder_append_write,
+      NULL,
+      NULL,
+      NULL,
+      u);
+
+    if(status != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+        u->append = NULL;
+        luaflac_encoder_append_free(a);
+        lua_pushnil(L);
+        lua_pushinteger(L,status);
+        return 2;
+    }
+
+    /* fewer samples than a block, so this only queues them up */
+    if(a->tail.samples > 0) {
+        FLAC__stream_encoder_process(u->encoder,
+          (const FLAC__int32 * const *)a->tail.pcm,
+          a->tail.samples);
+    }
+
+    lua_pushboolean(L,1);
+    return 1;
+}
+
 static int
 luaflac_stream_encoder_finish(lua_State *L) {
     luaflac_encoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_encoder_mt);
-    lua_pushboolean(L,FLAC__stream_encoder_finish(u->encoder));
+    const char *error = NULL;
+    int ok = FLAC__stream_encoder_finish(u->encoder);
+
+    if(u->append != NULL) {
+        if(!luaflac_encoder_append_close(u->append)) ok = 0;
+        error = u->append->error;
+        luaflac_encoder_append_free(u->append);
+        u->append = NULL;
+    }
+
+    lua_pushboolean(L,ok);
+    if(!ok && error != NULL) {
+        lua_pushstring(L,error);
+        return 2;
+    }
     return 1;
 }
 
@@ -902,13 +1373,51 @@ luaflac_resize_buffers(lua_State *L, luaflac_encoder_userdata *u, unsigned int c
     }
 }
 
+/* a flac.pcm_buffer goes to libFLAC as it is when it's already at the
+ * encoder's bit depth, otherwise it's converted into the staging buffers */
+static int
+luaflac_stream_encoder_process_pcm(lua_State *L, luaflac_encoder_userdata *u,
+  const luaflac_pcm_buffer *b, FLAC__uint32 *dither) {
+    const FLAC__int32 *planar[FLAC__MAX_CHANNELS];
+    unsigned int bits_per_sample = FLAC__stream_encoder_get_bits_per_sample(u->encoder);
+    unsigned int samples = (unsigned int)b->frames;
+    size_t clipped = 0;
+    unsigned int c = 0;
+
+    if(b->channels != FLAC__stream_encoder_get_channels(u->encoder)) {
+        return luaL_error(L,"the buffer's channels don't match the encoder");
+    }
+
+    if(b->format == LUAFLAC_PCM_INT32 && b->bits_per_sample == bits_per_sample) {
+        for(c=0;c<b->channels;c++) {
+            planar[c] = luaflac_pcm_buffer_int(b,c);
+        }
+    } else {
+        luaflac_resize_buffers(L,u,b->channels,samples);
+        clipped = luaflac_pcm_buffer_to_int(b,bits_per_sample,u->planar,dither);
+        for(c=0;c<b->channels;c++) {
+            planar[c] = u->planar[c];
+        }
+    }
+
+    lua_pushboolean(L,FLAC__stream_encoder_process(u->encoder,planar,samples));
+    lua_pushinteger(L,(lua_Integer)clipped);
+    return 2;
+}
+
 static int
 luaflac_stream_encoder_process(lua_State *L) {
     luaflac_encoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_encoder_mt);
-    unsigned int channels = lua_rawlen(L,2);
+    unsigned int channels = 0;
     unsigned int samples = 0;
     unsigned int c = 0;
     unsigned int s = 0;
+    const luaflac_pcm_buffer *b = luaflac_pcm_buffer_test(L,2);
+
+    if(b != NULL) {
+        return luaflac_stream_encoder_process_pcm(L,u,b,NULL);
+    }
+    channels = lua_rawlen(L,2);
 
     lua_rawgeti(L,2,c+1);
     samples = lua_rawlen(L,-1);
@@ -967,6 +1476,79 @@ luaflac_stream_encoder_process_interleaved(lua_State *L) {
     return 1;
 }
 
+/* interleaved, little-endian signed samples using as many bytes as the
+ * bit depth needs, the layout decode_range and wav readers produce */
+static int
+luaflac_stream_encoder_process_packed(lua_State *L) {
+    luaflac_encoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_encoder_mt);
+    unsigned int channels = FLAC__stream_encoder_get_channels(u->encoder);
+    unsigned int width = (FLAC__stream_encoder_get_bits_per_sample(u->encoder) + 7) / 8;
+    size_t len = 0;
+    const char *data = luaL_checklstring(L,2,&len);
+    unsigned int samples = 0;
+
+    if(len % (channels * width) != 0) {
+        return luaL_error(L,"data isn't a whole number of samples");
+    }
+    samples = (unsigned int)(len / (channels * width));
+
+    luaflac_resize_buffers(L,u,channels,samples);
+    luaflac_pcm_unpack((const unsigned char *)data,width,u->buffer,(size_t)samples * channels);
+
+    lua_pushboolean(L,FLAC__stream_encoder_process_interleaved(u->encoder,
+      u->buffer,
+      samples));
+    return 1;
+}
+
+/* packed float32 samples or a pcm_buffer, converted to the encoder's bit
+ * depth in C */
+static int
+luaflac_stream_encoder_process_float(lua_State *L) {
+    luaflac_encoder_userdata *u = luaL_checkudata(L,1,luaflac_stream_encoder_mt);
+    unsigned int channels = FLAC__stream_encoder_get_channels(u->encoder);
+    unsigned int bits_per_sample = FLAC__stream_encoder_get_bits_per_sample(u->encoder);
+    size_t len = 0;
+    const char *data = NULL;
+    const luaflac_pcm_buffer *b = luaflac_pcm_buffer_test(L,2);
+    unsigned int samples = 0;
+    size_t clipped = 0;
+    FLAC__uint32 *dither = luaflac_pcm_dither_options(L,3,&u->dither);
+
+    if(b != NULL) {
+        return luaflac_stream_encoder_process_pcm(L,u,b,dither);
+    }
+
+    data = luaL_checklstring(L,2,&len);
+    if(len % (channels * 4) != 0) {
+        return luaL_error(L,"data isn't a whole number of samples");
+    }
+    samples = (unsigned int)(len / (channels * 4));
+
+    luaflac_resize_buffers(L,u,channels,samples);
+    clipped = luaflac_pcm_quantize((const unsigned char *)data,bits_per_sample,
+      u->buffer,(size_t)samples * channels,dither);
+
+    lua_pushboolean(L,FLAC__stream_encoder_process_interleaved(u->encoder,
+      u->buffer,
+      samples));
+    lua_pushinteger(L,(lua_Integer)clipped);
+    return 2;
+}
+
+LUAFLAC_PRIVATE
+FLAC__StreamEncoder *
+luaflac_stream_encoder_get(void *userdata) {
+    return ((luaflac_encoder_userdata *)userdata)->encoder;
+}
+
+LUAFLAC_PRIVATE
+FLAC__StreamEncoder *
+luaflac_stream_encoder_test(lua_State *L, int idx) {
+    luaflac_encoder_userdata *u = luaL_testudata(L,idx,luaflac_stream_encoder_mt);
+    return u == NULL ? NULL : u->encoder;
+}
+
 static const struct luaL_Reg luaflac_stream_encoder_functions[] = {
     { "FLAC__stream_encoder_new", luaflac_stream_encoder_new },
     { "FLAC__stream_encoder_set_verify", luaflac_stream_encoder_set_verify },
@@ -1014,6 +1596,9 @@ static const struct luaL_Reg luaflac_stream_encoder_functions[] = {
     { "FLAC__stream_encoder_finish", luaflac_stream_encoder_finish },
     { "FLAC__stream_encoder_process", luaflac_stream_encoder_process },
     { "FLAC__stream_encoder_process_interleaved", luaflac_stream_encoder_process_interleaved },
+    { "luaflac_stream_encoder_process_packed", luaflac_stream_encoder_process_packed },
+    { "luaflac_stream_encoder_process_float", luaflac_stream_encoder_process_float },
+    { "luaflac_stream_encoder_init_append", luaflac_stream_encoder_init_append },
 
     { NULL, NULL },
 };
@@ -1068,6 +1653,9 @@ static const luaflac_metamethods luaflac_stream_encoder_metamethods[] = {
     { "FLAC__stream_encoder_finish" , "finish" },
     { "FLAC__stream_encoder_process" , "process" },
     { "FLAC__stream_encoder_process_interleaved" , "process_interleaved" },
+    { "luaflac_stream_encoder_process_packed" , "process_packed" },
+    { "luaflac_stream_encoder_process_float" , "process_float" },
+    { "luaflac_stream_encoder_init_append" , "init_append" },
     { NULL, NULL },
 };
 
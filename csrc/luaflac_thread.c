@@ -0,0 +1,199 @@
+#include "luaflac_internal.h"
+#include "luaflac_thread.h"
+#include <stdlib.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <unistd.h>
+#include <time.h>
+#endif
+
+struct luaflac_thread_start_s {
+    luaflac_thread_func func;
+    void *arg;
+};
+
+typedef struct luaflac_thread_start_s luaflac_thread_start;
+
+#if defined(_WIN32) || defined(_WIN64)
+
+static DWORD WINAPI
+luaflac_thread_main(LPVOID param) {
+    luaflac_thread_start start = *(luaflac_thread_start *)param;
+    free(param);
+    start.func(start.arg);
+    return 0;
+}
+
+LUAFLAC_PRIVATE
+int luaflac_thread_create(luaflac_thread *t, luaflac_thread_func func, void *arg) {
+    luaflac_thread_start *start = malloc(sizeof(luaflac_thread_start));
+    if(start == NULL) return -1;
+    start->func = func;
+    start->arg = arg;
+    *t = CreateThread(NULL,0,luaflac_thread_main,start,0,NULL);
+    if(*t == NULL) {
+        free(start);
+        return -1;
+    }
+    return 0;
+}
+
+LUAFLAC_PRIVATE
+void luaflac_thread_join(luaflac_thread *t) {
+    WaitForSingleObject(*t,INFINITE);
+    CloseHandle(*t);
+}
+
+LUAFLAC_PRIVATE
+unsigned int luaflac_thread_cpus(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+LUAFLAC_PRIVATE
+double luaflac_time_now(void) {
+    LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+LUAFLAC_PRIVATE
+int luaflac_mutex_init(luaflac_mutex *m) {
+    InitializeCriticalSection(m);
+    return 0;
+}
+
+LUAFLAC_PRIVATE
+void luaflac_mutex_lock(luaflac_mutex *m) {
+    EnterCriticalSection(m);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_mutex_unlock(luaflac_mutex *m) {
+    LeaveCriticalSection(m);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_mutex_destroy(luaflac_mutex *m) {
+    DeleteCriticalSection(m);
+}
+
+LUAFLAC_PRIVATE
+int luaflac_cond_init(luaflac_cond *c) {
+    InitializeConditionVariable(c);
+    return 0;
+}
+
+LUAFLAC_PRIVATE
+void luaflac_cond_wait(luaflac_cond *c, luaflac_mutex *m) {
+    SleepConditionVariableCS(c,m,INFINITE);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_cond_signal(luaflac_cond *c) {
+    WakeConditionVariable(c);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_cond_broadcast(luaflac_cond *c) {
+    WakeAllConditionVariable(c);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_cond_destroy(luaflac_cond *c) {
+    (void)c;
+}
+
+#else
+
+static void *
+luaflac_thread_main(void *param) {
+    luaflac_thread_start start = *(luaflac_thread_start *)param;
+    free(param);
+    start.func(start.arg);
+    return NULL;
+}
+
+LUAFLAC_PRIVATE
+int luaflac_thread_create(luaflac_thread *t, luaflac_thread_func func, void *arg) {
+    luaflac_thread_start *start = malloc(sizeof(luaflac_thread_start));
+    if(start == NULL) return -1;
+    start->func = func;
+    start->arg = arg;
+    if(pthread_create(t,NULL,luaflac_thread_main,start) != 0) {
+        free(start);
+        return -1;
+    }
+    return 0;
+}
+
+LUAFLAC_PRIVATE
+void luaflac_thread_join(luaflac_thread *t) {
+    pthread_join(*t,NULL);
+}
+
+LUAFLAC_PRIVATE
+unsigned int luaflac_thread_cpus(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n > 0) return (unsigned int)n;
+#endif
+    return 1;
+}
+
+LUAFLAC_PRIVATE
+double luaflac_time_now(void) {
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC,&ts) != 0) return 0.0;
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+LUAFLAC_PRIVATE
+int luaflac_mutex_init(luaflac_mutex *m) {
+    return pthread_mutex_init(m,NULL);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_mutex_lock(luaflac_mutex *m) {
+    pthread_mutex_lock(m);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_mutex_unlock(luaflac_mutex *m) {
+    pthread_mutex_unlock(m);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_mutex_destroy(luaflac_mutex *m) {
+    pthread_mutex_destroy(m);
+}
+
+LUAFLAC_PRIVATE
+int luaflac_cond_init(luaflac_cond *c) {
+    return pthread_cond_init(c,NULL);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_cond_wait(luaflac_cond *c, luaflac_mutex *m) {
+    pthread_cond_wait(c,m);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_cond_signal(luaflac_cond *c) {
+    pthread_cond_signal(c);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_cond_broadcast(luaflac_cond *c) {
+    pthread_cond_broadcast(c);
+}
+
+LUAFLAC_PRIVATE
+void luaflac_cond_destroy(luaflac_cond *c) {
+    pthread_cond_destroy(c);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef LUAFLAC_THREAD_H
+#define LUAFLAC_THREAD_H
+
+/* minimal threading wrappers, pthreads everywhere except Windows.
+ * include after luaflac_internal.h */
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+typedef HANDLE luaflac_thread;
+typedef CRITICAL_SECTION luaflac_mutex;
+typedef CONDITION_VARIABLE luaflac_cond;
+#else
+#include <pthread.h>
+typedef pthread_t luaflac_thread;
+typedef pthread_mutex_t luaflac_mutex;
+typedef pthread_cond_t luaflac_cond;
+#endif
+
+typedef void (*luaflac_thread_func)(void *);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* all functions that return int return 0 on success */
+
+LUAFLAC_PRIVATE
+int
+luaflac_thread_create(luaflac_thread *t, luaflac_thread_func func, void *arg);
+
+LUAFLAC_PRIVATE
+void
+luaflac_thread_join(luaflac_thread *t);
+
+/* number of online processors, at least 1 */
+LUAFLAC_PRIVATE
+unsigned int
+luaflac_thread_cpus(void);
+
+/* seconds from a monotonic clock, for timing work done on threads */
+LUAFLAC_PRIVATE
+double
+luaflac_time_now(void);
+
+LUAFLAC_PRIVATE
+int
+luaflac_mutex_init(luaflac_mutex *m);
+
+LUAFLAC_PRIVATE
+void
+luaflac_mutex_lock(luaflac_mutex *m);
+
+LUAFLAC_PRIVATE
+void
+luaflac_mutex_unlock(luaflac_mutex *m);
+
+LUAFLAC_PRIVATE
+void
+luaflac_mutex_destroy(luaflac_mutex *m);
+
+LUAFLAC_PRIVATE
+int
+luaflac_cond_init(luaflac_cond *c);
+
+LUAFLAC_PRIVATE
+void
+luaflac_cond_wait(luaflac_cond *c, luaflac_mutex *m);
+
+LUAFLAC_PRIVATE
+void
+luaflac_cond_signal(luaflac_cond *c);
+
+LUAFLAC_PRIVATE
+void
+luaflac_cond_broadcast(luaflac_cond *c);
+
+LUAFLAC_PRIVATE
+void
+luaflac_cond_destroy(luaflac_cond *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,457 @@
+#if !defined(_WIN32) && !defined(_WIN64)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "luaflac_internal.h"
+#include "luaflac_thread.h"
+#include <FLAC/stream_decoder.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* flac.verify_crc - checks the CRC-16 of every frame without decoding.
+ * The audio is split into byte ranges, each thread opens the file on its
+ * own, syncs on the first frame header in its range and checks every frame
+ * that starts there. The ranges are stitched back together at the end.
+ *
+ * flac.verify_md5 - fully decodes a list of files on a pool of threads,
+ * with libFLAC's MD5 checking and no Lua callbacks at all. */
+
+struct luaflac_verify_region_s {
+    const char *path;
+    FILE *f; /* used instead of path when set */
+    FLAC__uint64 start;
+    FLAC__uint64 end;
+
+    FLAC__uint64 frames;
+    FLAC__uint64 first; /* offset of the first frame in the region */
+    FLAC__uint64 last_end; /* end of the last frame */
+    FLAC__uint64 *bad;
+    size_t num_bad;
+    size_t max_bad;
+    const char *error;
+
+    luaflac_thread thread;
+    int started;
+};
+
+typedef struct luaflac_verify_region_s luaflac_verify_region;
+
+static void
+luaflac_verify_bad(luaflac_verify_region *g, FLAC__uint64 offset) {
+    FLAC__uint64 *tmp = NULL;
+    size_t max = 0;
+
+    if(g->num_bad == g->max_bad) {
+        max = g->max_bad ? g->max_bad * 2 : 16;
+        tmp = realloc(g->bad,sizeof(FLAC__uint64) * max);
+        if(tmp == NULL) {
+            g->error = "out of memory";
+            return;
+        }
+        g->bad = tmp;
+        g->max_bad = max;
+    }
+    g->bad[g->num_bad++] = offset;
+}
+
+static void
+luaflac_verify_region_run(void *arg) {
+    luaflac_verify_region *g = (luaflac_verify_region *)arg;
+    luaflac_frame_reader r;
+    luaflac_frame frame;
+    FILE *f = g->f;
+    FLAC__uint64 skipped = 0;
+    int res = 0;
+
+    memset(&r,0,sizeof(r));
+    if(f == NULL) f = fopen(g->path,"rb");
+    if(f == NULL) {
+        g->error = "error opening file";
+        return;
+    }
+
+    if(!luaflac_frame_reader_init(&r,f) || !luaflac_frame_reader_seek(&r,g->start)) {
+        g->error = "error reading metadata";
+        goto luaflac_verify_region_done;
+    }
+
+    while( (res = luaflac_frame_reader_next(&r,&frame)) == 1) {
+        if(frame.offset >= g->end) break;
+
+        if(g->frames == 0) {
+            g->first = frame.offset;
+        } else if(frame.offset != g->last_end) {
+            /* something between the frames that isn't a frame */
+            luaflac_verify_bad(g,g->last_end);
+        } else if(frame.numbering_break) {
+            /* nothing in between but frames are missing */
+            luaflac_verify_bad(g,frame.offset);
+        }
+        if(!luaflac_frame_check_crc(&frame)) {
+            luaflac_verify_bad(g,frame.offset);
+        }
+        g->last_end = frame.offset + frame.size;
+        g->frames++;
+        skipped = r.skipped;
+    }
+    if(res < 0) {
+        g->error = "error reading frames";
+    } else if(res == 0 && g->frames > 0 && r.skipped != skipped) {
+        /* the end of the file isn't a frame, like a last frame with a
+         * damaged header */
+        luaflac_verify_bad(g,g->last_end);
+    }
+
+    luaflac_verify_region_done:
+    luaflac_frame_reader_free(&r);
+    if(g->f == NULL) fclose(f);
+}
+
+static int
+luaflac_verify_crc(lua_State *L) {
+    luaflac_verify_region *regions = NULL;
+    luaflac_frame_reader r;
+    FLAC__uint64 size = 0;
+    FLAC__uint64 audio = 0;
+    FLAC__uint64 expected = 0;
+    FLAC__uint64 frames = 0;
+    lua_Integer threads = luaflac_thread_cpus();
+    const char *path = NULL;
+    const char *error = NULL;
+    FILE *f = NULL;
+    int owned = 0;
+    int n = 0;
+    size_t i = 0;
+    lua_Integer j = 0;
+    lua_Integer num_bad = 0;
+
+    if(!lua_isnoneornil(L,2)) {
+        luaL_checktype(L,2,LUA_TTABLE);
+        lua_getfield(L,2,"threads");
+        threads = luaL_optinteger(L,-1,threads);
+        lua_pop(L,1);
+    }
+
+    f = luaflac_checkfile(L,1,"rb",&owned);
+    if(f == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,1));
+        return 2;
+    }
+
+    /* threads open their own handles, a Lua file handle is checked in one go */
+    if(owned) {
+        path = lua_tostring(L,1);
+    } else {
+        threads = 1;
+    }
+
+    memset(&r,0,sizeof(r));
+    if(!luaflac_frame_reader_init(&r,f) || luaflac_fsize(f,&size) != 0) {
+        luaflac_frame_reader_free(&r);
+        if(owned) fclose(f);
+        lua_pushnil(L);
+        lua_pushliteral(L,"error reading metadata");
+        return 2;
+    }
+    audio = r.audio_offset;
+    luaflac_frame_reader_free(&r);
+    if(owned) {
+        fclose(f);
+        f = NULL;
+    }
+
+    n = luaflac_frame_regions(audio,size,threads);
+
+    regions = calloc(n,sizeof(luaflac_verify_region));
+    if(regions == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+
+    for(i=0;i<(size_t)n;i++) {
+        regions[i].path = path;
+        regions[i].f = f;
+        luaflac_frame_region(audio,size,n,(int)i,&regions[i].start,&regions[i].end);
+    }
+
+    /* the last region runs on this thread, as do any that fail to start */
+    for(i=0;i+1<(size_t)n;i++) {
+        regions[i].started = luaflac_thread_create(&regions[i].thread,luaflac_verify_region_run,&regions[i]) == 0;
+    }
+    for(i=0;i<(size_t)n;i++) {
+        if(!regions[i].started) luaflac_verify_region_run(&regions[i]);
+    }
+    for(i=0;i<(size_t)n;i++) {
+        if(regions[i].started) luaflac_thread_join(&regions[i].thread);
+    }
+
+    lua_newtable(L);
+    lua_newtable(L); /* bad */
+
+    expected = audio;
+    for(i=0;i<(size_t)n;i++) {
+        if(regions[i].error != NULL && error == NULL) {
+            error = regions[i].error;
+        }
+        if(regions[i].frames == 0) continue;
+
+        /* every region should pick up where the last one ended */
+        if(regions[i].first != expected) {
+            luaflac_pushuint64(L,expected < regions[i].first ? expected : regions[i].first);
+            lua_rawseti(L,-2,++num_bad);
+        }
+        for(j=0;j<(lua_Integer)regions[i].num_bad;j++) {
+            luaflac_pushuint64(L,regions[i].bad[j]);
+            lua_rawseti(L,-2,++num_bad);
+        }
+        expected = regions[i].last_end;
+        frames += regions[i].frames;
+    }
+    if(frames == 0 && error == NULL) {
+        error = "no frames found";
+    }
+
+    for(i=0;i<(size_t)n;i++) {
+        free(regions[i].bad);
+    }
+    free(regions);
+
+    if(error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,error);
+        return 2;
+    }
+
+    lua_rawgeti(L,-1,1);
+    lua_setfield(L,-3,"first_bad");
+    lua_setfield(L,-2,"bad");
+
+    lua_pushboolean(L,num_bad == 0);
+    lua_setfield(L,-2,"ok");
+    lua_pushinteger(L,(lua_Integer)frames);
+    lua_setfield(L,-2,"frames");
+    lua_pushinteger(L,n);
+    lua_setfield(L,-2,"threads");
+
+    return 1;
+}
+
+struct luaflac_verify_file_s {
+    const char *path;
+    int ok;
+    int md5_checked; /* STREAMINFO had an MD5 to check against */
+    FLAC__uint64 total_samples; /* from STREAMINFO */
+    FLAC__uint64 samples; /* decoded */
+    unsigned int sample_rate;
+    double seconds;
+    const char *error;
+};
+
+typedef struct luaflac_verify_file_s luaflac_verify_file;
+
+struct luaflac_verify_batch_s {
+    luaflac_mutex lock;
+    luaflac_verify_file *files;
+    size_t num_files;
+    size_t next;
+};
+
+typedef struct luaflac_verify_batch_s luaflac_verify_batch;
+
+static FLAC__StreamDecoderWriteStatus
+luaflac_verify_write(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *client_data) {
+    luaflac_verify_file *v = (luaflac_verify_file *)client_data;
+    (void)decoder;
+    (void)buffer;
+    v->samples += frame->header.blocksize;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void
+luaflac_verify_metadata(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data) {
+    luaflac_verify_file *v = (luaflac_verify_file *)client_data;
+    unsigned int i = 0;
+    (void)decoder;
+
+    if(metadata->type != FLAC__METADATA_TYPE_STREAMINFO) return;
+    v->total_samples = metadata->data.stream_info.total_samples;
+    v->sample_rate = metadata->data.stream_info.sample_rate;
+    for(i=0;i<16;i++) {
+        if(metadata->data.stream_info.md5sum[i] != 0) v->md5_checked = 1;
+    }
+}
+
+static void
+luaflac_verify_error(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data) {
+    luaflac_verify_file *v = (luaflac_verify_file *)client_data;
+    (void)decoder;
+    if(v->error == NULL) v->error = FLAC__StreamDecoderErrorStatusString[status];
+}
+
+static void
+luaflac_verify_decode(FLAC__StreamDecoder *decoder, luaflac_verify_file *v) {
+    FLAC__StreamDecoderInitStatus status;
+    int decoded = 0;
+    int md5_ok = 0;
+    double start = luaflac_time_now();
+
+    /* finish() resets md5 checking along with the other settings */
+    FLAC__stream_decoder_set_md5_checking(decoder,1);
+    status = FLAC__stream_decoder_init_file(decoder,v->path,
+      luaflac_verify_write,luaflac_verify_metadata,luaflac_verify_error,v);
+    if(status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+        v->error = FLAC__StreamDecoderInitStatusString[status];
+        return;
+    }
+
+    decoded = FLAC__stream_decoder_process_until_end_of_stream(decoder);
+    if(!decoded && v->error == NULL) {
+        v->error = FLAC__StreamDecoderStateString[FLAC__stream_decoder_get_state(decoder)];
+    }
+    md5_ok = FLAC__stream_decoder_finish(decoder);
+    v->seconds = luaflac_time_now() - start;
+
+    if(decoded && v->error == NULL) {
+        if(!md5_ok) {
+            v->error = "MD5 mismatch";
+        } else if(v->total_samples != 0 && v->samples != v->total_samples) {
+            v->error = "wrong number of samples";
+        }
+    }
+    v->ok = v->error == NULL;
+}
+
+static void
+luaflac_verify_md5_worker(void *arg) {
+    luaflac_verify_batch *b = (luaflac_verify_batch *)arg;
+    FLAC__StreamDecoder *decoder = FLAC__stream_decoder_new();
+    size_t index = 0;
+
+    luaflac_mutex_lock(&b->lock);
+    while(b->next < b->num_files) {
+        index = b->next++;
+        luaflac_mutex_unlock(&b->lock);
+
+        if(decoder == NULL) {
+            b->files[index].error = "out of memory";
+        } else {
+            luaflac_verify_decode(decoder,&b->files[index]);
+        }
+
+        luaflac_mutex_lock(&b->lock);
+    }
+    luaflac_mutex_unlock(&b->lock);
+
+    if(decoder != NULL) FLAC__stream_decoder_delete(decoder);
+}
+
+static int
+luaflac_verify_md5(lua_State *L) {
+    luaflac_verify_batch b;
+    luaflac_verify_file *v = NULL;
+    luaflac_thread *threads = NULL;
+    lua_Integer num_threads = luaflac_thread_cpus();
+    unsigned int started = 0;
+    unsigned int i = 0;
+    size_t j = 0;
+
+    luaL_checktype(L,1,LUA_TTABLE);
+    if(!lua_isnoneornil(L,2)) {
+        luaL_checktype(L,2,LUA_TTABLE);
+        lua_getfield(L,2,"threads");
+        num_threads = luaL_optinteger(L,-1,num_threads);
+        lua_pop(L,1);
+    }
+
+    memset(&b,0,sizeof(b));
+    b.num_files = lua_rawlen(L,1);
+    if(num_threads < 1) num_threads = 1;
+    if((size_t)num_threads > b.num_files) num_threads = (lua_Integer)b.num_files;
+
+    /* paths point into the strings in the table, which is left alone until we return */
+    b.files = calloc(b.num_files ? b.num_files : 1,sizeof(luaflac_verify_file));
+    if(b.files == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+    for(j=0;j<b.num_files;j++) {
+        lua_rawgeti(L,1,j+1);
+        b.files[j].path = lua_type(L,-1) == LUA_TSTRING ? lua_tostring(L,-1) : NULL;
+        lua_pop(L,1);
+        if(b.files[j].path == NULL) {
+            free(b.files);
+            return luaL_error(L,"path %d is not a string",(int)(j+1));
+        }
+    }
+
+    if(luaflac_mutex_init(&b.lock) != 0) {
+        free(b.files);
+        return luaL_error(L,"error creating mutex");
+    }
+
+    /* this thread works through the list too */
+    if(num_threads > 1) {
+        threads = malloc(sizeof(luaflac_thread) * (num_threads - 1));
+    }
+    if(threads != NULL) {
+        for(i=0;i<(unsigned int)num_threads-1;i++) {
+            if(luaflac_thread_create(&threads[started],luaflac_verify_md5_worker,&b) != 0) break;
+            started++;
+        }
+    }
+    luaflac_verify_md5_worker(&b);
+    for(i=0;i<started;i++) {
+        luaflac_thread_join(&threads[i]);
+    }
+    free(threads);
+    luaflac_mutex_destroy(&b.lock);
+
+    lua_createtable(L,b.num_files,0);
+    for(j=0;j<b.num_files;j++) {
+        v = &b.files[j];
+        lua_createtable(L,0,8);
+        lua_pushstring(L,v->path);
+        lua_setfield(L,-2,"path");
+        lua_pushboolean(L,v->ok);
+        lua_setfield(L,-2,"ok");
+        lua_pushboolean(L,v->md5_checked);
+        lua_setfield(L,-2,"md5_checked");
+        luaflac_pushuint64(L,v->samples);
+        lua_setfield(L,-2,"samples");
+        lua_pushnumber(L,v->seconds);
+        lua_setfield(L,-2,"seconds");
+        if(v->seconds > 0.0 && v->sample_rate > 0) {
+            /* times faster than realtime */
+            lua_pushnumber(L,(double)v->samples / (double)v->sample_rate / v->seconds);
+            lua_setfield(L,-2,"speed");
+        }
+        if(v->error != NULL) {
+            lua_pushstring(L,v->error);
+            lua_setfield(L,-2,"error");
+        }
+        lua_rawseti(L,-2,j+1);
+    }
+    free(b.files);
+
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_verify_functions[] = {
+    { "verify_crc", luaflac_verify_crc },
+    { "verify_md5", luaflac_verify_md5 },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_verify(lua_State *L) {
+    lua_getglobal(L,"require");
+    lua_pushstring(L,"luaflac.uint64");
+    lua_call(L,1,1);
+    lua_pop(L,1);
+
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_verify_functions,0);
+
+    return 1;
+}
@@ -0,0 +1,557 @@
+#include "luaflac_internal.h"
+#include <FLAC/metadata.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* an indexed VORBIS_COMMENT block - comments are kept in their original
+ * order (so they round-trip), with a hash table on the upper-cased
+ * field name for lookups */
+
+LUAFLAC_PRIVATE
+const char * const luaflac_vorbis_comment_mt = "luaflac_vorbis_comment";
+
+#define LUAFLAC_VC_NONE ((size_t)-1)
+
+struct luaflac_vc_entry_s {
+    char *data; /* FIELD=value, not NUL-terminated */
+    size_t length;
+    size_t name_length; /* bytes before the '=', or length if there isn't one */
+    FLAC__uint32 hash;
+    size_t next; /* next entry in the same bucket, in comment order */
+};
+
+typedef struct luaflac_vc_entry_s luaflac_vc_entry;
+
+struct luaflac_vorbis_comment_s {
+    char *vendor;
+    size_t vendor_length;
+    luaflac_vc_entry *entries;
+    size_t num_entries;
+    size_t max_entries;
+    size_t *buckets;
+    size_t num_buckets; /* always a power of 2 */
+};
+
+typedef struct luaflac_vorbis_comment_s luaflac_vorbis_comment;
+
+static unsigned char
+luaflac_vc_upper(unsigned char c) {
+    /* field names are ASCII, avoid toupper() and the locale */
+    return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+static FLAC__uint32
+luaflac_vc_hash(const char *name, size_t len) {
+    /* FNV-1a */
+    FLAC__uint32 h = 2166136261U;
+    size_t i = 0;
+    for(i=0;i<len;i++) {
+        h ^= luaflac_vc_upper((unsigned char)name[i]);
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static int
+luaflac_vc_match(const luaflac_vc_entry *e, const char *name, size_t len, FLAC__uint32 hash) {
+    size_t i = 0;
+    if(e->hash != hash || e->name_length != len) return 0;
+    for(i=0;i<len;i++) {
+        if(luaflac_vc_upper((unsigned char)e->data[i]) != luaflac_vc_upper((unsigned char)name[i])) return 0;
+    }
+    return 1;
+}
+
+static void
+luaflac_vc_link(luaflac_vorbis_comment *vc, size_t index) {
+    size_t *slot = &vc->buckets[vc->entries[index].hash & (vc->num_buckets - 1)];
+    while(*slot != LUAFLAC_VC_NONE) {
+        slot = &vc->entries[*slot].next;
+    }
+    vc->entries[index].next = LUAFLAC_VC_NONE;
+    *slot = index;
+}
+
+static int
+luaflac_vc_rehash(luaflac_vorbis_comment *vc) {
+    size_t num_buckets = 16;
+    size_t *buckets = NULL;
+    size_t i = 0;
+
+    while(num_buckets < vc->num_entries * 2) num_buckets <<= 1;
+    if(num_buckets != vc->num_buckets) {
+        buckets = realloc(vc->buckets,sizeof(size_t) * num_buckets);
+        if(buckets == NULL) return 0;
+        vc->buckets = buckets;
+        vc->num_buckets = num_buckets;
+    }
+
+    for(i=0;i<vc->num_buckets;i++) {
+        vc->buckets[i] = LUAFLAC_VC_NONE;
+    }
+    for(i=0;i<vc->num_entries;i++) {
+        luaflac_vc_link(vc,i);
+    }
+    return 1;
+}
+
+static size_t
+luaflac_vc_find(const luaflac_vorbis_comment *vc, const char *name, size_t len) {
+    FLAC__uint32 hash = luaflac_vc_hash(name,len);
+    size_t i = vc->buckets[hash & (vc->num_buckets - 1)];
+    while(i != LUAFLAC_VC_NONE && !luaflac_vc_match(&vc->entries[i],name,len,hash)) {
+        i = vc->entries[i].next;
+    }
+    return i;
+}
+
+static size_t
+luaflac_vc_find_next(const luaflac_vorbis_comment *vc, size_t i) {
+    const luaflac_vc_entry *e = &vc->entries[i];
+    size_t j = e->next;
+    while(j != LUAFLAC_VC_NONE && !luaflac_vc_match(&vc->entries[j],e->data,e->name_length,e->hash)) {
+        j = vc->entries[j].next;
+    }
+    return j;
+}
+
+/* builds an entry without adding it, returns 0 on allocation failure */
+static int
+luaflac_vc_entry_new(luaflac_vc_entry *e, const char *name, size_t name_len, const char *value, size_t value_len) {
+    e->data = malloc(name_len + 1 + value_len);
+    if(e->data == NULL) return 0;
+    memcpy(e->data,name,name_len);
+    if(value != NULL) {
+        e->data[name_len] = '=';
+        memcpy(&e->data[name_len + 1],value,value_len);
+        e->length = name_len + 1 + value_len;
+    } else {
+        e->length = name_len;
+    }
+    e->name_length = name_len;
+    e->hash = luaflac_vc_hash(name,name_len);
+    e->next = LUAFLAC_VC_NONE;
+    return 1;
+}
+
+static int
+luaflac_vc_reserve(luaflac_vorbis_comment *vc, size_t count) {
+    luaflac_vc_entry *entries = NULL;
+    size_t max = vc->max_entries ? vc->max_entries : 16;
+    if(count <= vc->max_entries) return 1;
+    while(max < count) max <<= 1;
+    entries = realloc(vc->entries,sizeof(luaflac_vc_entry) * max);
+    if(entries == NULL) return 0;
+    vc->entries = entries;
+    vc->max_entries = max;
+    return 1;
+}
+
+/* appends a raw FIELD=value comment */
+static int
+luaflac_vc_append_raw(luaflac_vorbis_comment *vc, const char *entry, size_t len) {
+    const char *eq = memchr(entry,'=',len);
+    size_t name_len = eq == NULL ? len : (size_t)(eq - entry);
+
+    if(!luaflac_vc_reserve(vc,vc->num_entries + 1)) return 0;
+    if(!luaflac_vc_entry_new(&vc->entries[vc->num_entries],entry,name_len,
+      eq == NULL ? NULL : eq + 1, eq == NULL ? 0 : len - name_len - 1)) return 0;
+    vc->num_entries++;
+
+    if(vc->num_entries * 2 > vc->num_buckets) return luaflac_vc_rehash(vc);
+    luaflac_vc_link(vc,vc->num_entries - 1);
+    return 1;
+}
+
+static void
+luaflac_vc_clear(luaflac_vorbis_comment *vc) {
+    size_t i = 0;
+    for(i=0;i<vc->num_entries;i++) {
+        free(vc->entries[i].data);
+    }
+    free(vc->entries);
+    free(vc->buckets);
+    free(vc->vendor);
+    memset(vc,0,sizeof(luaflac_vorbis_comment));
+}
+
+static int
+luaflac_vc_set_vendor(luaflac_vorbis_comment *vc, const char *vendor, size_t len) {
+    char *v = malloc(len ? len : 1);
+    if(v == NULL) return 0;
+    memcpy(v,vendor,len);
+    free(vc->vendor);
+    vc->vendor = v;
+    vc->vendor_length = len;
+    return 1;
+}
+
+static const char *
+luaflac_vc_checkfield(lua_State *L, int idx, size_t *len) {
+    const char *field = luaL_checklstring(L,idx,len);
+    if(memchr(field,'=',*len) != NULL) {
+        luaL_error(L,"field name must not contain '='");
+        return NULL;
+    }
+    return field;
+}
+
+static void
+luaflac_vc_pushvalue(lua_State *L, const luaflac_vc_entry *e) {
+    if(e->length > e->name_length) {
+        lua_pushlstring(L,&e->data[e->name_length + 1],e->length - e->name_length - 1);
+    } else {
+        lua_pushliteral(L,"");
+    }
+}
+
+static luaflac_vorbis_comment *
+luaflac_vc_check(lua_State *L, int idx) {
+    return (luaflac_vorbis_comment *)luaL_checkudata(L,idx,luaflac_vorbis_comment_mt);
+}
+
+static int
+luaflac_vorbis_comment_gc(lua_State *L) {
+    luaflac_vc_clear(luaflac_vc_check(L,1));
+    return 0;
+}
+
+static int
+luaflac_vorbis_comment_new(lua_State *L) {
+    luaflac_vorbis_comment *vc = NULL;
+    const char *str = NULL;
+    size_t len = 0;
+    size_t i = 0;
+    size_t num_comments = 0;
+
+    lua_settop(L,1);
+    vc = lua_newuserdata(L,sizeof(luaflac_vorbis_comment));
+    memset(vc,0,sizeof(luaflac_vorbis_comment));
+    luaL_setmetatable(L,luaflac_vorbis_comment_mt);
+
+    if(!luaflac_vc_rehash(vc)) {
+        return luaL_error(L,"out of memory");
+    }
+
+    if(lua_isnil(L,1)) return 1;
+    luaL_checktype(L,1,LUA_TTABLE);
+
+    /* accept either the full metadata block or just the vorbis_comment table */
+    lua_getfield(L,1,"vorbis_comment");
+    if(!lua_istable(L,-1)) {
+        lua_pop(L,1);
+        lua_pushvalue(L,1);
+    }
+
+    lua_getfield(L,-1,"vendor_string");
+    str = lua_tolstring(L,-1,&len);
+    if(str != NULL && !luaflac_vc_set_vendor(vc,str,len)) {
+        return luaL_error(L,"out of memory");
+    }
+    lua_pop(L,1);
+
+    lua_getfield(L,-1,"comments");
+    if(lua_istable(L,-1)) {
+        num_comments = lua_rawlen(L,-1);
+        if(!luaflac_vc_reserve(vc,num_comments)) {
+            return luaL_error(L,"out of memory");
+        }
+        for(i=0;i<num_comments;i++) {
+            lua_rawgeti(L,-1,i+1);
+            str = lua_tolstring(L,-1,&len);
+            if(str == NULL) {
+                return luaL_error(L,"entry not a string");
+            }
+            if(!luaflac_vc_append_raw(vc,str,len)) {
+                return luaL_error(L,"out of memory");
+            }
+            lua_pop(L,1);
+        }
+    }
+    lua_pop(L,2);
+
+    return 1;
+}
+
+static int
+luaflac_vorbis_comment_get(lua_State *L) {
+    luaflac_vorbis_comment *vc = luaflac_vc_check(L,1);
+    size_t len = 0;
+    const char *field = luaL_checklstring(L,2,&len);
+    size_t i = luaflac_vc_find(vc,field,len);
+
+    if(i == LUAFLAC_VC_NONE) {
+        lua_pushnil(L);
+    } else {
+        luaflac_vc_pushvalue(L,&vc->entries[i]);
+    }
+    return 1;
+}
+
+static int
+luaflac_vorbis_comment_get_all(lua_State *L) {
+    luaflac_vorbis_comment *vc = luaflac_vc_check(L,1);
+    size_t len = 0;
+    const char *field = luaL_checklstring(L,2,&len);
+    size_t i = luaflac_vc_find(vc,field,len);
+    lua_Integer n = 0;
+
+    lua_newtable(L);
+    while(i != LUAFLAC_VC_NONE) {
+        luaflac_vc_pushvalue(L,&vc->entries[i]);
+        lua_rawseti(L,-2,++n);
+        i = luaflac_vc_find_next(vc,i);
+    }
+    return 1;
+}
+
+static int
+luaflac_vorbis_comment_add(lua_State *L) {
+    luaflac_vorbis_comment *vc = luaflac_vc_check(L,1);
+    size_t field_len = 0;
+    size_t value_len = 0;
+    const char *field = luaflac_vc_checkfield(L,2,&field_len);
+    const char *value = luaL_checklstring(L,3,&value_len);
+
+    if(!luaflac_vc_reserve(vc,vc->num_entries + 1)) {
+        return luaL_error(L,"out of memory");
+    }
+    if(!luaflac_vc_entry_new(&vc->entries[vc->num_entries],field,field_len,value,value_len)) {
+        return luaL_error(L,"out of memory");
+    }
+    vc->num_entries++;
+    if(vc->num_entries * 2 > vc->num_buckets) {
+        if(!luaflac_vc_rehash(vc)) return luaL_error(L,"out of memory");
+    } else {
+        luaflac_vc_link(vc,vc->num_entries - 1);
+    }
+    return 0;
+}
+
+static int
+luaflac_vc_insert_values(lua_State *L, luaflac_vc_entry *entries, size_t *n,
+  const char *field, size_t field_len, int values, size_t num_values) {
+    const char *value = NULL;
+    size_t value_len = 0;
+    size_t j = 0;
+
+    for(j=0;j<num_values;j++) {
+        if(lua_istable(L,values)) {
+            lua_rawgeti(L,values,j+1);
+            value = lua_tolstring(L,-1,&value_len);
+            lua_pop(L,1);
+        } else {
+            value = lua_tolstring(L,values,&value_len);
+        }
+        if(value == NULL) continue;
+        if(!luaflac_vc_entry_new(&entries[*n],field,field_len,value,value_len)) return 0;
+        (*n)++;
+    }
+    return 1;
+}
+
+/* replaces every comment for a field with the value at index values (a string,
+ * a list of strings, or nil to remove the field). New values go where the
+ * first old one was, or at the end. Returns the number of comments removed */
+static size_t
+luaflac_vc_replace(lua_State *L, luaflac_vorbis_comment *vc, const char *field, size_t field_len, int values) {
+    luaflac_vc_entry *entries = NULL;
+    luaflac_vc_entry *old = vc->entries;
+    size_t num_old = vc->num_entries;
+    size_t num_values = 0;
+    size_t removed = 0;
+    size_t n = 0;
+    size_t i = 0;
+    int inserted = 0;
+    int ok = 1;
+    FLAC__uint32 hash = luaflac_vc_hash(field,field_len);
+
+    if(lua_istable(L,values)) {
+        num_values = lua_rawlen(L,values);
+    } else if(!lua_isnil(L,values)) {
+        luaL_checkstring(L,values);
+        num_values = 1;
+    }
+
+    entries = malloc(sizeof(luaflac_vc_entry) * (num_old + num_values + 1));
+    if(entries == NULL) {
+        luaL_error(L,"out of memory");
+        return 0;
+    }
+
+    for(i=0;i<num_old;i++) {
+        if(!luaflac_vc_match(&old[i],field,field_len,hash)) {
+            entries[n++] = old[i];
+            continue;
+        }
+        free(old[i].data);
+        removed++;
+        if(!inserted) {
+            ok = luaflac_vc_insert_values(L,entries,&n,field,field_len,values,num_values);
+            inserted = 1;
+        }
+    }
+    if(!inserted) {
+        ok = luaflac_vc_insert_values(L,entries,&n,field,field_len,values,num_values);
+    }
+
+    free(old);
+    vc->entries = entries;
+    vc->num_entries = n;
+    vc->max_entries = num_old + num_values + 1;
+    if(!luaflac_vc_rehash(vc) || !ok) {
+        luaL_error(L,"out of memory");
+    }
+    return removed;
+}
+
+static int
+luaflac_vorbis_comment_set(lua_State *L) {
+    luaflac_vorbis_comment *vc = luaflac_vc_check(L,1);
+    size_t len = 0;
+    const char *field = luaflac_vc_checkfield(L,2,&len);
+    luaflac_vc_replace(L,vc,field,len,3);
+    return 0;
+}
+
+static int
+luaflac_vorbis_comment_remove(lua_State *L) {
+    luaflac_vorbis_comment *vc = luaflac_vc_check(L,1);
+    size_t len = 0;
+    const char *field = luaL_checklstring(L,2,&len);
+
+    if(luaflac_vc_find(vc,field,len) == LUAFLAC_VC_NONE) {
+        lua_pushinteger(L,0);
+        return 1;
+    }
+    lua_settop(L,2);
+    lua_pushnil(L);
+    lua_pushinteger(L,(lua_Integer)luaflac_vc_replace(L,vc,field,len,3));
+    return 1;
+}
+
+static int
+luaflac_vorbis_comment_get_vendor_string(lua_State *L) {
+    luaflac_vorbis_comment *vc = luaflac_vc_check(L,1);
+    lua_pushlstring(L,vc->vendor != NULL ? vc->vendor : "",vc->vendor_length);
+    return 1;
+}
+
+static int
+luaflac_vorbis_comment_set_vendor_string(lua_State *L) {
+    luaflac_vorbis_comment *vc = luaflac_vc_check(L,1);
+    size_t len = 0;
+    const char *vendor = luaL_checklstring(L,2,&len);
+    if(!luaflac_vc_set_vendor(vc,vendor,len)) {
+        return luaL_error(L,"out of memory");
+    }
+    return 0;
+}
+
+static int
+luaflac_vorbis_comment_comments(lua_State *L) {
+    luaflac_vorbis_comment *vc = luaflac_vc_check(L,1);
+    size_t i = 0;
+
+    lua_createtable(L,vc->num_entries,0);
+    for(i=0;i<vc->num_entries;i++) {
+        lua_pushlstring(L,vc->entries[i].data,vc->entries[i].length);
+        lua_rawseti(L,-2,i+1);
+    }
+    return 1;
+}
+
+static int
+luaflac_vorbis_comment_len(lua_State *L) {
+    luaflac_vorbis_comment *vc = luaflac_vc_check(L,1);
+    lua_pushinteger(L,vc->num_entries);
+    return 1;
+}
+
+LUAFLAC_PRIVATE
+FLAC__StreamMetadata *
+luaflac_vorbis_comment_toflac(lua_State *L, int idx) {
+    luaflac_vorbis_comment *vc = luaflac_vc_check(L,idx);
+    FLAC__StreamMetadata *m = NULL;
+    FLAC__StreamMetadata_VorbisComment *c = NULL;
+    size_t i = 0;
+
+    m = FLAC__metadata_object_new(FLAC__METADATA_TYPE_VORBIS_COMMENT);
+    if(m == NULL) goto luaflac_vorbis_comment_toflac_error;
+    c = &m->data.vorbis_comment;
+
+    /* entries go in unchecked, like the parser reads them, so tags that
+     * came from a file can always be written back */
+    if(vc->vendor != NULL) {
+        if(!luaflac_vorbiscomment_entry_set(&c->vendor_string,
+          (const FLAC__byte *)vc->vendor,(FLAC__uint32)vc->vendor_length)) {
+            goto luaflac_vorbis_comment_toflac_error;
+        }
+    }
+
+    if(!FLAC__metadata_object_vorbiscomment_resize_comments(m,(unsigned)vc->num_entries)) {
+        goto luaflac_vorbis_comment_toflac_error;
+    }
+    m->length = 8 + c->vendor_string.length;
+    for(i=0;i<vc->num_entries;i++) {
+        if(!luaflac_vorbiscomment_entry_set(&c->comments[i],
+          (const FLAC__byte *)vc->entries[i].data,(FLAC__uint32)vc->entries[i].length)) {
+            goto luaflac_vorbis_comment_toflac_error;
+        }
+        m->length += 4 + c->comments[i].length;
+    }
+    return m;
+
+    luaflac_vorbis_comment_toflac_error:
+    if(m != NULL) FLAC__metadata_object_delete(m);
+    luaL_error(L,"out of memory");
+    return NULL;
+}
+
+static int
+luaflac_vorbis_comment_to_metadata(lua_State *L) {
+    FLAC__StreamMetadata *m = luaflac_vorbis_comment_toflac(L,1);
+    luaflac_pushstreammetadata(L,m);
+    FLAC__metadata_object_delete(m);
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_vorbis_comment_functions[] = {
+    { "vorbis_comment", luaflac_vorbis_comment_new },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaflac_vorbis_comment_methods[] = {
+    { "get", luaflac_vorbis_comment_get },
+    { "get_all", luaflac_vorbis_comment_get_all },
+    { "set", luaflac_vorbis_comment_set },
+    { "add", luaflac_vorbis_comment_add },
+    { "remove", luaflac_vorbis_comment_remove },
+    { "get_vendor_string", luaflac_vorbis_comment_get_vendor_string },
+    { "set_vendor_string", luaflac_vorbis_comment_set_vendor_string },
+    { "comments", luaflac_vorbis_comment_comments },
+    { "to_metadata", luaflac_vorbis_comment_to_metadata },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_vorbis_comment(lua_State *L) {
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_vorbis_comment_functions,0);
+
+    luaL_newmetatable(L,luaflac_vorbis_comment_mt);
+    lua_pushcclosure(L,luaflac_vorbis_comment_gc,0);
+    lua_setfield(L,-2,"__gc");
+    lua_pushcclosure(L,luaflac_vorbis_comment_len,0);
+    lua_setfield(L,-2,"__len");
+
+    lua_newtable(L); /* __index */
+    luaL_setfuncs(L,luaflac_vorbis_comment_methods,0);
+    lua_setfield(L,-2,"__index");
+
+    lua_pop(L,1);
+
+    return 1;
+}
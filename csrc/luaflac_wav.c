@@ -0,0 +1,907 @@
+#include "luaflac_internal.h"
+#include <FLAC/stream_encoder.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* flac.wav_reader and flac.wav_writer - WAV, RF64 and AIFF files read and
+ * written in C. A reader can feed an encoder directly and a writer can be
+ * a decode_range sink, so converting to or from FLAC never touches
+ * samples in Lua. Sizes in a writer's header are fixed up when it's
+ * closed. */
+
+LUAFLAC_PRIVATE
+const char * const luaflac_wav_reader_mt = "luaflac_wav_reader";
+
+LUAFLAC_PRIVATE
+const char * const luaflac_wav_writer_mt = "luaflac_wav_writer";
+
+/* samples per channel converted at a time */
+#define LUAFLAC_WAV_BLOCK 16384
+
+/* the ds64 chunk body, without the table */
+#define LUAFLAC_WAV_DS64_SIZE 28
+
+enum luaflac_wav_format_e {
+    LUAFLAC_WAV_WAV,
+    LUAFLAC_WAV_RF64,
+    LUAFLAC_WAV_AIFF,
+    LUAFLAC_WAV_AIFC
+};
+
+static const char * const luaflac_wav_format_names[] = {
+    "wav", "rf64", "aiff", "aifc", NULL
+};
+
+/* KSDATAFORMAT_SUBTYPE_PCM, after the format tag */
+static const FLAC__byte luaflac_wav_pcm_guid[14] = {
+    0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+};
+
+struct luaflac_wav_reader_s {
+    FILE *f;
+    int owned;
+    int format;
+    unsigned int channels;
+    unsigned int bits_per_sample;
+    unsigned int width; /* bytes per sample in the file */
+    unsigned int sample_rate;
+    FLAC__uint32 channel_mask;
+    int big_endian;
+    int is_unsigned; /* 8-bit WAV */
+    FLAC__uint64 data_offset;
+    FLAC__uint64 total_samples;
+    int length_known; /* else read to the end of the file */
+    FLAC__uint64 position;
+    FLAC__byte *bytes;
+    FLAC__int32 *samples;
+};
+
+typedef struct luaflac_wav_reader_s luaflac_wav_reader;
+
+struct luaflac_wav_writer_s {
+    FILE *f;
+    int owned;
+    int closed;
+    int format;
+    unsigned int channels;
+    unsigned int bits_per_sample;
+    unsigned int width;
+    unsigned int sample_rate;
+    FLAC__uint64 total_samples; /* promised up front, 0 if unknown */
+    FLAC__uint64 written;
+    FLAC__uint64 data_offset; /* where the samples start */
+    FLAC__uint64 ds64_offset; /* of the ds64 or JUNK chunk, 0 if there isn't one */
+    FLAC__byte *bytes;
+    FLAC__int32 *samples;
+    const char *error;
+};
+
+static FLAC__uint32
+luaflac_wav_le16(const FLAC__byte *b) {
+    return (FLAC__uint32)b[0] | ((FLAC__uint32)b[1] << 8);
+}
+
+static FLAC__uint32
+luaflac_wav_le32(const FLAC__byte *b) {
+    return (FLAC__uint32)b[0] | ((FLAC__uint32)b[1] << 8) |
+      ((FLAC__uint32)b[2] << 16) | ((FLAC__uint32)b[3] << 24);
+}
+
+static FLAC__uint64
+luaflac_wav_le64(const FLAC__byte *b) {
+    return (FLAC__uint64)luaflac_wav_le32(b) | ((FLAC__uint64)luaflac_wav_le32(b + 4) << 32);
+}
+
+static FLAC__uint32
+luaflac_wav_be16(const FLAC__byte *b) {
+    return ((FLAC__uint32)b[0] << 8) | (FLAC__uint32)b[1];
+}
+
+static FLAC__uint32
+luaflac_wav_be32(const FLAC__byte *b) {
+    return ((FLAC__uint32)b[0] << 24) | ((FLAC__uint32)b[1] << 16) |
+      ((FLAC__uint32)b[2] << 8) | (FLAC__uint32)b[3];
+}
+
+static void
+luaflac_wav_put_le16(FLAC__byte *b, FLAC__uint32 v) {
+    b[0] = (FLAC__byte)v;
+    b[1] = (FLAC__byte)(v >> 8);
+}
+
+static void
+luaflac_wav_put_le32(FLAC__byte *b, FLAC__uint32 v) {
+    luaflac_wav_put_le16(b,v);
+    luaflac_wav_put_le16(b + 2,v >> 16);
+}
+
+static void
+luaflac_wav_put_le64(FLAC__byte *b, FLAC__uint64 v) {
+    luaflac_wav_put_le32(b,(FLAC__uint32)v);
+    luaflac_wav_put_le32(b + 4,(FLAC__uint32)(v >> 32));
+}
+
+static void
+luaflac_wav_put_be16(FLAC__byte *b, FLAC__uint32 v) {
+    b[0] = (FLAC__byte)(v >> 8);
+    b[1] = (FLAC__byte)v;
+}
+
+static void
+luaflac_wav_put_be32(FLAC__byte *b, FLAC__uint32 v) {
+    luaflac_wav_put_be16(b,v >> 16);
+    luaflac_wav_put_be16(b + 2,v);
+}
+
+/* the 80-bit extended float AIFF uses for the sample rate */
+static unsigned int
+luaflac_wav_get_extended(const FLAC__byte *b) {
+    int exponent = (int)(luaflac_wav_be16(b) & 0x7FFF) - 16383;
+    FLAC__uint64 mantissa = ((FLAC__uint64)luaflac_wav_be32(b + 2) << 32) | luaflac_wav_be32(b + 6);
+
+    if(exponent < 0 || exponent > 31) return 0;
+    return (unsigned int)(mantissa >> (63 - exponent));
+}
+
+static void
+luaflac_wav_put_extended(FLAC__byte *b, unsigned int rate) {
+    int exponent = 31;
+
+    memset(b,0,10);
+    if(rate == 0) return;
+    while(!(rate & 0x80000000)) {
+        rate <<= 1;
+        exponent--;
+    }
+    luaflac_wav_put_be16(b,(FLAC__uint32)(exponent + 16383));
+    luaflac_wav_put_be32(b + 2,rate);
+}
+
+/* converts samples from the file's layout, values in the file are
+ * left-justified in width bytes */
+static void
+luaflac_wav_unpack(const luaflac_wav_reader *r, const FLAC__byte *b, FLAC__int32 *out, size_t n) {
+    unsigned int shift = 32 - r->bits_per_sample;
+    unsigned int i = 0;
+    FLAC__uint32 v = 0;
+
+    while(n--) {
+        v = 0;
+        for(i=0;i<r->width;i++) {
+            v = (v << 8) | b[r->big_endian ? i : r->width - 1 - i];
+        }
+        v <<= 32 - 8 * r->width;
+        if(r->is_unsigned) v ^= 0x80000000;
+        *out++ = (FLAC__int32)v >> shift;
+        b += r->width;
+    }
+}
+
+static void
+luaflac_wav_pack(const luaflac_wav_writer *w, FLAC__byte *b, const FLAC__int32 *in, size_t n) {
+    int big_endian = w->format == LUAFLAC_WAV_AIFF;
+    unsigned int shift = 32 - w->bits_per_sample;
+    unsigned int i = 0;
+    FLAC__uint32 v = 0;
+
+    while(n--) {
+        v = (FLAC__uint32)*in++ << shift;
+        if(w->width == 1 && !big_endian) v ^= 0x80000000;
+        for(i=0;i<w->width;i++) {
+            b[big_endian ? i : w->width - 1 - i] = (FLAC__byte)(v >> (24 - 8 * i));
+        }
+        b += w->width;
+    }
+}
+
+static int
+luaflac_wav_read_fmt(luaflac_wav_reader *r, const FLAC__byte *b, FLAC__uint32 size) {
+    FLAC__uint32 tag = 0;
+    FLAC__uint32 block_align = 0;
+
+    if(size < 16) return 0;
+    tag = luaflac_wav_le16(b);
+    r->channels = luaflac_wav_le16(b + 2);
+    r->sample_rate = luaflac_wav_le32(b + 4);
+    block_align = luaflac_wav_le16(b + 12);
+    r->bits_per_sample = luaflac_wav_le16(b + 14);
+
+    if(tag == 0xFFFE) {
+        /* WAVE_FORMAT_EXTENSIBLE */
+        if(size < 40 || memcmp(b + 26,luaflac_wav_pcm_guid,14) != 0) return 0;
+        r->bits_per_sample = luaflac_wav_le16(b + 18);
+        r->channel_mask = luaflac_wav_le32(b + 20);
+        tag = luaflac_wav_le16(b + 24);
+    }
+    if(tag != 1 || r->channels == 0) return 0;
+    r->width = block_align / r->channels;
+    r->is_unsigned = r->width == 1;
+    return block_align == r->width * r->channels;
+}
+
+static int
+luaflac_wav_read_comm(luaflac_wav_reader *r, const FLAC__byte *b, FLAC__uint32 size) {
+    if(size < 18) return 0;
+    r->channels = luaflac_wav_be16(b);
+    r->total_samples = luaflac_wav_be32(b + 2);
+    r->bits_per_sample = luaflac_wav_be16(b + 6);
+    r->sample_rate = luaflac_wav_get_extended(b + 8);
+    r->width = (r->bits_per_sample + 7) / 8;
+    r->big_endian = 1;
+
+    if(r->format == LUAFLAC_WAV_AIFC) {
+        if(size < 22) return 0;
+        if(memcmp(b + 18,"sowt",4) == 0) r->big_endian = 0;
+        else if(memcmp(b + 18,"NONE",4) != 0 && memcmp(b + 18,"twos",4) != 0) return 0;
+    }
+    return 1;
+}
+
+/* walks the chunks to find the format and the samples. Returns an error
+ * message or NULL */
+static const char *
+luaflac_wav_reader_open(luaflac_wav_reader *r) {
+    FLAC__byte b[40];
+    FLAC__uint64 offset = 12;
+    FLAC__uint64 file_size = 0;
+    FLAC__uint64 ds64_data = 0;
+    FLAC__uint64 length = 0;
+    FLAC__uint64 size = 0;
+    int have_size = 0;
+    int have_format = 0;
+    int have_data = 0;
+    int riff = 0;
+
+    if(fread(b,1,12,r->f) != 12) return "not a WAV or AIFF file";
+    if(memcmp(b,"RIFF",4) == 0 && memcmp(b + 8,"WAVE",4) == 0) {
+        r->format = LUAFLAC_WAV_WAV;
+    } else if((memcmp(b,"RF64",4) == 0 || memcmp(b,"BW64",4) == 0) && memcmp(b + 8,"WAVE",4) == 0) {
+        r->format = LUAFLAC_WAV_RF64;
+    } else if(memcmp(b,"FORM",4) == 0 && memcmp(b + 8,"AIFF",4) == 0) {
+        r->format = LUAFLAC_WAV_AIFF;
+    } else if(memcmp(b,"FORM",4) == 0 && memcmp(b + 8,"AIFC",4) == 0) {
+        r->format = LUAFLAC_WAV_AIFC;
+    } else {
+        return "not a WAV or AIFF file";
+    }
+    riff = r->format == LUAFLAC_WAV_WAV || r->format == LUAFLAC_WAV_RF64;
+    have_size = luaflac_fsize(r->f,&file_size) == 0;
+
+    while(!have_format || !have_data) {
+        if(luaflac_fseek(r->f,offset) != 0 || fread(b,1,8,r->f) != 8) {
+            return have_format ? "no audio data" : "no format chunk";
+        }
+        size = riff ? luaflac_wav_le32(b + 4) : luaflac_wav_be32(b + 4);
+        offset += 8;
+
+        if(riff && memcmp(b,"ds64",4) == 0) {
+            if(size < LUAFLAC_WAV_DS64_SIZE || fread(b,1,LUAFLAC_WAV_DS64_SIZE,r->f) != LUAFLAC_WAV_DS64_SIZE) {
+                return "invalid ds64 chunk";
+            }
+            ds64_data = luaflac_wav_le64(b + 8);
+        } else if(riff && memcmp(b,"fmt ",4) == 0) {
+            memset(b,0,sizeof(b));
+            if(fread(b,1,size < sizeof(b) ? (size_t)size : sizeof(b),r->f) < 16 ||
+               !luaflac_wav_read_fmt(r,b,(FLAC__uint32)size)) {
+                return "unsupported WAV format";
+            }
+            have_format = 1;
+        } else if(!riff && memcmp(b,"COMM",4) == 0) {
+            memset(b,0,sizeof(b));
+            if(fread(b,1,size < sizeof(b) ? (size_t)size : sizeof(b),r->f) < 18 ||
+               !luaflac_wav_read_comm(r,b,(FLAC__uint32)size)) {
+                return "unsupported AIFF format";
+            }
+            have_format = 1;
+        } else if(riff && memcmp(b,"data",4) == 0) {
+            r->data_offset = offset;
+            length = size;
+            if(r->format == LUAFLAC_WAV_RF64 && size == 0xFFFFFFFF) length = ds64_data;
+            /* a stream that was never finished can have any size here */
+            r->length_known = size != 0 && size != 0xFFFFFFFF;
+            if(r->format == LUAFLAC_WAV_RF64) r->length_known = 1;
+            have_data = 1;
+        } else if(!riff && memcmp(b,"SSND",4) == 0) {
+            if(size < 8 || fread(b,1,8,r->f) != 8) return "invalid SSND chunk";
+            r->data_offset = offset + 8 + luaflac_wav_be32(b);
+            length = size - 8 - luaflac_wav_be32(b);
+            r->length_known = 1;
+            have_data = 1;
+        }
+
+        offset += size + (size & 1);
+        if(have_data && !r->length_known) break;
+    }
+    if(!have_format) return "no format chunk";
+
+    if(r->bits_per_sample < 4 || r->bits_per_sample > 32 || r->width > 4 ||
+       r->bits_per_sample > 8 * r->width || r->channels > FLAC__MAX_CHANNELS) {
+        return "unsupported sample format";
+    }
+
+    if(have_size && r->data_offset <= file_size &&
+       (!r->length_known || r->data_offset + length > file_size)) {
+        length = file_size - r->data_offset;
+        r->length_known = 1;
+    }
+    if(r->length_known) {
+        /* COMM has the real count, the SSND chunk can be padded */
+        if(riff || length / (r->width * r->channels) < r->total_samples) {
+            r->total_samples = length / (r->width * r->channels);
+        }
+    }
+
+    r->bytes = malloc((size_t)LUAFLAC_WAV_BLOCK * r->channels * r->width);
+    r->samples = malloc(sizeof(FLAC__int32) * LUAFLAC_WAV_BLOCK * r->channels);
+    if(r->bytes == NULL || r->samples == NULL) return "out of memory";
+    if(luaflac_fseek(r->f,r->data_offset) != 0) return "error seeking";
+    return NULL;
+}
+
+/* reads up to LUAFLAC_WAV_BLOCK samples into r->samples, returns how many */
+static size_t
+luaflac_wav_reader_block(luaflac_wav_reader *r, FLAC__uint64 want, int *error) {
+    size_t n = LUAFLAC_WAV_BLOCK;
+    size_t got = 0;
+
+    if(want < n) n = (size_t)want;
+    if(r->length_known && r->total_samples - r->position < n) {
+        n = (size_t)(r->total_samples - r->position);
+    }
+    if(n == 0) return 0;
+
+    got = fread(r->bytes,(size_t)r->width * r->channels,n,r->f);
+    if(got < n && ferror(r->f)) *error = 1;
+    luaflac_wav_unpack(r,r->bytes,r->samples,got * r->channels);
+    r->position += got;
+    return got;
+}
+
+static luaflac_wav_reader *
+luaflac_wav_reader_check(lua_State *L, int idx) {
+    luaflac_wav_reader *r = luaL_checkudata(L,idx,luaflac_wav_reader_mt);
+    if(r->f == NULL) {
+        luaL_error(L,"reader is closed");
+        return NULL;
+    }
+    return r;
+}
+
+static void
+luaflac_wav_reader_free(luaflac_wav_reader *r) {
+    if(r->f != NULL && r->owned) fclose(r->f);
+    r->f = NULL;
+    free(r->bytes);
+    r->bytes = NULL;
+    free(r->samples);
+    r->samples = NULL;
+}
+
+static int
+luaflac_wav_reader_gc(lua_State *L) {
+    luaflac_wav_reader *r = luaL_checkudata(L,1,luaflac_wav_reader_mt);
+    luaflac_wav_reader_free(r);
+    return 0;
+}
+
+static int
+luaflac_wav_reader_new(lua_State *L) {
+    luaflac_wav_reader *r = NULL;
+    const char *error = NULL;
+    FILE *f = NULL;
+    int owned = 0;
+
+    f = luaflac_checkfile(L,1,"rb",&owned);
+    if(f == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,1));
+        return 2;
+    }
+
+    r = lua_newuserdata(L,sizeof(luaflac_wav_reader));
+    memset(r,0,sizeof(luaflac_wav_reader));
+    r->f = f;
+    r->owned = owned;
+    luaL_setmetatable(L,luaflac_wav_reader_mt);
+
+    error = luaflac_wav_reader_open(r);
+    if(error != NULL) {
+        luaflac_wav_reader_free(r);
+        lua_pushnil(L);
+        lua_pushstring(L,error);
+        return 2;
+    }
+    return 1;
+}
+
+static int
+luaflac_wav_reader_info(lua_State *L) {
+    luaflac_wav_reader *r = luaflac_wav_reader_check(L,1);
+
+    lua_createtable(L,0,8);
+    lua_pushstring(L,luaflac_wav_format_names[r->format]);
+    lua_setfield(L,-2,"format");
+    lua_pushinteger(L,r->channels);
+    lua_setfield(L,-2,"channels");
+    lua_pushinteger(L,r->bits_per_sample);
+    lua_setfield(L,-2,"bits_per_sample");
+    lua_pushinteger(L,r->sample_rate);
+    lua_setfield(L,-2,"sample_rate");
+    if(r->length_known) {
+        luaflac_pushuint64(L,r->total_samples);
+        lua_setfield(L,-2,"total_samples");
+    }
+    if(r->channel_mask != 0) {
+        lua_pushinteger(L,r->channel_mask);
+        lua_setfield(L,-2,"channel_mask");
+    }
+    luaflac_pushuint64(L,r->data_offset);
+    lua_setfield(L,-2,"data_offset");
+    return 1;
+}
+
+static int
+luaflac_wav_reader_seek(lua_State *L) {
+    luaflac_wav_reader *r = luaflac_wav_reader_check(L,1);
+    FLAC__uint64 sample = luaflac_touint64(L,2);
+
+    if(r->length_known && sample > r->total_samples) sample = r->total_samples;
+    if(luaflac_fseek(r->f,r->data_offset + sample * r->width * r->channels) != 0) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"error seeking");
+        return 2;
+    }
+    r->position = sample;
+    luaflac_pushuint64(L,sample);
+    return 1;
+}
+
+/* returns packed samples, the layout process_packed takes */
+static int
+luaflac_wav_reader_read(lua_State *L) {
+    luaflac_wav_reader *r = luaflac_wav_reader_check(L,1);
+    FLAC__uint64 want = luaflac_touint64(L,2);
+    unsigned int width = (r->bits_per_sample + 7) / 8;
+    luaL_Buffer buf;
+    size_t got = 0;
+    size_t total = 0;
+    int error = 0;
+
+    luaL_buffinit(L,&buf);
+    while(want > 0 && (got = luaflac_wav_reader_block(r,want,&error)) > 0) {
+        /* packed samples are never wider than the file's */
+        luaflac_pcm_pack(r->bytes,width,r->samples,got * r->channels);
+        luaL_addlstring(&buf,(const char *)r->bytes,got * r->channels * width);
+        want -= got;
+        total += got;
+    }
+    if(error) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"error reading file");
+        return 2;
+    }
+    if(total == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    luaL_pushresult(&buf);
+    return 1;
+}
+
+static int
+luaflac_wav_reader_encode(lua_State *L) {
+    luaflac_wav_reader *r = luaflac_wav_reader_check(L,1);
+    FLAC__StreamEncoder *encoder = luaflac_stream_encoder_test(L,2);
+    FLAC__uint64 want = lua_isnoneornil(L,3) ? (FLAC__uint64)-1 : luaflac_touint64(L,3);
+    FLAC__uint64 sent = 0;
+    size_t got = 0;
+    int error = 0;
+
+    if(encoder == NULL) {
+        return luaL_argerror(L,2,"encoder expected");
+    }
+    if(FLAC__stream_encoder_get_channels(encoder) != r->channels ||
+       FLAC__stream_encoder_get_bits_per_sample(encoder) != r->bits_per_sample) {
+        return luaL_error(L,"the encoder's channels and bits per sample don't match the file");
+    }
+
+    while(want > 0 && (got = luaflac_wav_reader_block(r,want,&error)) > 0) {
+        if(!FLAC__stream_encoder_process_interleaved(encoder,r->samples,(unsigned int)got)) {
+            lua_pushnil(L);
+            lua_pushstring(L,FLAC__stream_encoder_get_resolved_state_string(encoder));
+            return 2;
+        }
+        want -= got;
+        sent += got;
+    }
+    if(error) {
+        lua_pushnil(L);
+        lua_pushliteral(L,"error reading file");
+        return 2;
+    }
+    luaflac_pushuint64(L,sent);
+    return 1;
+}
+
+static int
+luaflac_wav_reader_close(lua_State *L) {
+    luaflac_wav_reader *r = luaL_checkudata(L,1,luaflac_wav_reader_mt);
+    luaflac_wav_reader_free(r);
+    return 0;
+}
+
+/* WAVE_FORMAT_EXTENSIBLE speaker positions for FLAC's channel orders */
+static FLAC__uint32
+luaflac_wav_channel_mask(unsigned int channels) {
+    static const FLAC__uint32 masks[] = {
+        0, 0x0004, 0x0003, 0x0007, 0x0033, 0x0607, 0x060F, 0x070F, 0x063F
+    };
+    return channels <= 8 ? masks[channels] : 0;
+}
+
+static FLAC__uint64
+luaflac_wav_data_length(const luaflac_wav_writer *w, FLAC__uint64 samples) {
+    return samples * w->width * w->channels;
+}
+
+/* writes the header, with the sizes for total_samples */
+static int
+luaflac_wav_writer_header(luaflac_wav_writer *w, FLAC__uint64 total_samples) {
+    FLAC__byte b[128];
+    FLAC__uint64 data = luaflac_wav_data_length(w,total_samples);
+    FLAC__uint64 riff = 0;
+    int extensible = w->channels > 2 || (w->bits_per_sample != 8 && w->bits_per_sample != 16);
+    size_t fmt_size = extensible ? 40 : 16;
+    size_t p = 0;
+
+    memset(b,0,sizeof(b));
+    if(w->format == LUAFLAC_WAV_AIFF) {
+        riff = 4 + 8 + 18 + 8 + 8 + data + (data & 1);
+        memcpy(b,"FORM",4);
+        luaflac_wav_put_be32(b + 4,(FLAC__uint32)riff);
+        memcpy(b + 8,"AIFFCOMM",8);
+        luaflac_wav_put_be32(b + 16,18);
+        luaflac_wav_put_be16(b + 20,w->channels);
+        luaflac_wav_put_be32(b + 22,(FLAC__uint32)total_samples);
+        luaflac_wav_put_be16(b + 26,w->bits_per_sample);
+        luaflac_wav_put_extended(b + 28,w->sample_rate);
+        memcpy(b + 38,"SSND",4);
+        luaflac_wav_put_be32(b + 42,(FLAC__uint32)(8 + data));
+        /* offset and block size are left at 0 */
+        p = 54;
+    } else {
+        riff = 4 + (w->ds64_offset ? 8 + LUAFLAC_WAV_DS64_SIZE : 0) + 8 + fmt_size + 8 + data + (data & 1);
+        memcpy(b,w->format == LUAFLAC_WAV_RF64 ? "RF64" : "RIFF",4);
+        luaflac_wav_put_le32(b + 4,w->format == LUAFLAC_WAV_RF64 ? 0xFFFFFFFF : (FLAC__uint32)riff);
+        memcpy(b + 8,"WAVE",4);
+        p = 12;
+        if(w->ds64_offset) {
+            /* a JUNK chunk holds the space in case a WAV outgrows 4GB */
+            memcpy(b + p,w->format == LUAFLAC_WAV_RF64 ? "ds64" : "JUNK",4);
+            luaflac_wav_put_le32(b + p + 4,LUAFLAC_WAV_DS64_SIZE);
+            if(w->format == LUAFLAC_WAV_RF64) {
+                luaflac_wav_put_le64(b + p + 8,riff);
+                luaflac_wav_put_le64(b + p + 16,data);
+                luaflac_wav_put_le64(b + p + 24,total_samples);
+            }
+            p += 8 + LUAFLAC_WAV_DS64_SIZE;
+        }
+        memcpy(b + p,"fmt ",4);
+        luaflac_wav_put_le32(b + p + 4,(FLAC__uint32)fmt_size);
+        luaflac_wav_put_le16(b + p + 8,extensible ? 0xFFFE : 1);
+        luaflac_wav_put_le16(b + p + 10,w->channels);
+        luaflac_wav_put_le32(b + p + 12,w->sample_rate);
+        luaflac_wav_put_le32(b + p + 16,w->sample_rate * w->channels * w->width);
+        luaflac_wav_put_le16(b + p + 20,w->channels * w->width);
+        luaflac_wav_put_le16(b + p + 22,8 * w->width);
+        if(extensible) {
+            luaflac_wav_put_le16(b + p + 24,22);
+            luaflac_wav_put_le16(b + p + 26,w->bits_per_sample);
+            luaflac_wav_put_le32(b + p + 28,luaflac_wav_channel_mask(w->channels));
+            luaflac_wav_put_le16(b + p + 32,1);
+            memcpy(b + p + 34,luaflac_wav_pcm_guid,14);
+        }
+        p += 8 + fmt_size;
+        memcpy(b + p,"data",4);
+        luaflac_wav_put_le32(b + p + 4,w->format == LUAFLAC_WAV_RF64 ? 0xFFFFFFFF : (FLAC__uint32)data);
+        p += 8;
+    }
+
+    if(fwrite(b,1,p,w->f) != p) {
+        w->error = "error writing file";
+        return 0;
+    }
+    w->data_offset = p;
+    return 1;
+}
+
+/* the header sizes can't describe a file this long */
+static int
+luaflac_wav_writer_too_long(const luaflac_wav_writer *w, FLAC__uint64 samples) {
+    FLAC__uint64 data = luaflac_wav_data_length(w,samples);
+    if(w->format == LUAFLAC_WAV_RF64) return 0;
+    if(w->format == LUAFLAC_WAV_AIFF && samples > 0xFFFFFFFF) return 1;
+    return data + 128 > 0xFFFFFFFF;
+}
+
+static int
+luaflac_wav_writer_finish(luaflac_wav_writer *w) {
+    FLAC__byte pad = 0;
+    FLAC__uint64 data = luaflac_wav_data_length(w,w->written);
+
+    if(w->closed) return w->error == NULL;
+    w->closed = 1;
+
+    if(w->error == NULL && (data & 1) && fwrite(&pad,1,1,w->f) != 1) {
+        w->error = "error writing file";
+    }
+    if(w->error == NULL && w->written != w->total_samples) {
+        /* the sizes written up front are wrong, go back and fix them */
+        if(luaflac_wav_writer_too_long(w,w->written)) {
+            if(w->ds64_offset) w->format = LUAFLAC_WAV_RF64;
+            else w->error = "too much audio for the file format";
+        }
+        if(w->error == NULL && luaflac_fseek(w->f,0) != 0) {
+            w->error = "can't seek to fix the header";
+        }
+        if(w->error == NULL) luaflac_wav_writer_header(w,w->written);
+    }
+    if(w->error == NULL && fflush(w->f) != 0) {
+        w->error = "error writing file";
+    }
+    if(w->owned && fclose(w->f) != 0 && w->error == NULL) {
+        w->error = "error writing file";
+    }
+    w->f = NULL;
+    free(w->bytes);
+    w->bytes = NULL;
+    free(w->samples);
+    w->samples = NULL;
+    return w->error == NULL;
+}
+
+static int
+luaflac_wav_writer_put(luaflac_wav_writer *w, const FLAC__int32 *samples, size_t count) {
+    size_t len = (size_t)w->width * w->channels * count;
+
+    luaflac_wav_pack(w,w->bytes,samples,count * w->channels);
+    if(fwrite(w->bytes,1,len,w->f) != len) {
+        w->error = "error writing file";
+        return 0;
+    }
+    w->written += count;
+    return 1;
+}
+
+LUAFLAC_PRIVATE
+luaflac_wav_writer *
+luaflac_wav_writer_test(lua_State *L, int idx) {
+    return luaL_testudata(L,idx,luaflac_wav_writer_mt);
+}
+
+LUAFLAC_PRIVATE
+const char *
+luaflac_wav_writer_write(luaflac_wav_writer *w, const FLAC__int32 *const buffer[],
+  unsigned int channels, unsigned int bits_per_sample, unsigned int count) {
+    unsigned int start = 0;
+    unsigned int n = 0;
+    unsigned int i = 0;
+    unsigned int c = 0;
+    FLAC__int32 *p = NULL;
+
+    if(w->closed) return "writer is closed";
+    if(w->error != NULL) return w->error;
+    if(channels != w->channels || bits_per_sample != w->bits_per_sample) {
+        return "the audio format doesn't match the writer";
+    }
+
+    for(start=0;start<count;start+=n) {
+        n = count - start < LUAFLAC_WAV_BLOCK ? count - start : LUAFLAC_WAV_BLOCK;
+        p = w->samples;
+        for(i=start;i<start+n;i++) {
+            for(c=0;c<channels;c++) {
+                *p++ = buffer[c][i];
+            }
+        }
+        if(!luaflac_wav_writer_put(w,w->samples,n)) return w->error;
+    }
+    return NULL;
+}
+
+static luaflac_wav_writer *
+luaflac_wav_writer_check(lua_State *L, int idx) {
+    luaflac_wav_writer *w = luaL_checkudata(L,idx,luaflac_wav_writer_mt);
+    if(w->closed) {
+        luaL_error(L,"writer is closed");
+        return NULL;
+    }
+    return w;
+}
+
+static int
+luaflac_wav_writer_gc(lua_State *L) {
+    luaflac_wav_writer *w = luaL_checkudata(L,1,luaflac_wav_writer_mt);
+    if(w->f != NULL) luaflac_wav_writer_finish(w);
+    return 0;
+}
+
+static int
+luaflac_wav_writer_new(lua_State *L) {
+    static const char * const formats[] = { "wav", "rf64", "aiff", NULL };
+    static const int format_ids[] = { LUAFLAC_WAV_WAV, LUAFLAC_WAV_RF64, LUAFLAC_WAV_AIFF };
+    luaflac_wav_writer *w = NULL;
+    unsigned int channels = 0;
+    unsigned int bits_per_sample = 0;
+    unsigned int sample_rate = 0;
+    FLAC__uint64 total_samples = 0;
+    int format = LUAFLAC_WAV_WAV;
+    FILE *f = NULL;
+    int owned = 0;
+
+    luaL_checktype(L,2,LUA_TTABLE);
+    lua_getfield(L,2,"channels");
+    channels = (unsigned int)luaL_checkinteger(L,-1);
+    lua_pop(L,1);
+    lua_getfield(L,2,"bits_per_sample");
+    bits_per_sample = (unsigned int)luaL_checkinteger(L,-1);
+    lua_pop(L,1);
+    lua_getfield(L,2,"sample_rate");
+    sample_rate = (unsigned int)luaL_checkinteger(L,-1);
+    lua_pop(L,1);
+    lua_getfield(L,2,"total_samples");
+    if(!lua_isnil(L,-1)) total_samples = luaflac_touint64(L,-1);
+    lua_pop(L,1);
+    lua_getfield(L,2,"format");
+    format = format_ids[luaL_checkoption(L,-1,"wav",formats)];
+    lua_pop(L,1);
+
+    if(channels < 1 || channels > FLAC__MAX_CHANNELS) {
+        return luaL_error(L,"invalid number of channels");
+    }
+    if(bits_per_sample < 4 || bits_per_sample > 32) {
+        return luaL_error(L,"invalid bits per sample");
+    }
+
+    f = luaflac_checkfile(L,1,"wb",&owned);
+    if(f == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,1));
+        return 2;
+    }
+
+    w = lua_newuserdata(L,sizeof(luaflac_wav_writer));
+    memset(w,0,sizeof(luaflac_wav_writer));
+    w->f = f;
+    w->owned = owned;
+    w->format = format;
+    w->channels = channels;
+    w->bits_per_sample = bits_per_sample;
+    w->width = (bits_per_sample + 7) / 8;
+    w->sample_rate = sample_rate;
+    w->total_samples = total_samples;
+    luaL_setmetatable(L,luaflac_wav_writer_mt);
+
+    if(luaflac_wav_writer_too_long(w,total_samples)) {
+        if(w->format == LUAFLAC_WAV_AIFF) {
+            luaflac_wav_writer_finish(w);
+            lua_pushnil(L);
+            lua_pushliteral(L,"too much audio for the file format");
+            return 2;
+        }
+        w->format = LUAFLAC_WAV_RF64;
+    }
+    /* room for a ds64 chunk when the length isn't known */
+    if(w->format == LUAFLAC_WAV_RF64 || (w->format == LUAFLAC_WAV_WAV && total_samples == 0)) {
+        w->ds64_offset = 12;
+    }
+
+    w->bytes = malloc((size_t)LUAFLAC_WAV_BLOCK * w->channels * w->width);
+    w->samples = malloc(sizeof(FLAC__int32) * LUAFLAC_WAV_BLOCK * w->channels);
+    if(w->bytes == NULL || w->samples == NULL) {
+        w->error = "out of memory";
+    } else {
+        luaflac_wav_writer_header(w,total_samples);
+    }
+    if(w->error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,w->error);
+        luaflac_wav_writer_finish(w);
+        return 2;
+    }
+    return 1;
+}
+
+/* takes packed samples, the layout decode_range and reader:read produce */
+static int
+luaflac_wav_writer_write_packed(lua_State *L) {
+    luaflac_wav_writer *w = luaflac_wav_writer_check(L,1);
+    unsigned int width = (w->bits_per_sample + 7) / 8;
+    size_t frame = (size_t)width * w->channels;
+    size_t len = 0;
+    const unsigned char *data = (const unsigned char *)luaL_checklstring(L,2,&len);
+    size_t count = 0;
+    size_t n = 0;
+
+    if(len % frame != 0) {
+        return luaL_error(L,"data isn't a whole number of samples");
+    }
+    if(w->error == NULL) {
+        for(count=len / frame;count > 0;count -= n) {
+            n = count < LUAFLAC_WAV_BLOCK ? count : LUAFLAC_WAV_BLOCK;
+            luaflac_pcm_unpack(data,width,w->samples,n * w->channels);
+            if(!luaflac_wav_writer_put(w,w->samples,n)) break;
+            data += n * frame;
+        }
+    }
+    if(w->error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,w->error);
+        return 2;
+    }
+    lua_pushboolean(L,1);
+    return 1;
+}
+
+static int
+luaflac_wav_writer_close(lua_State *L) {
+    luaflac_wav_writer *w = luaL_checkudata(L,1,luaflac_wav_writer_mt);
+    if(!luaflac_wav_writer_finish(w)) {
+        lua_pushnil(L);
+        lua_pushstring(L,w->error);
+        return 2;
+    }
+    luaflac_pushuint64(L,w->written);
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_wav_functions[] = {
+    { "wav_reader", luaflac_wav_reader_new },
+    { "wav_writer", luaflac_wav_writer_new },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaflac_wav_reader_methods[] = {
+    { "info", luaflac_wav_reader_info },
+    { "seek", luaflac_wav_reader_seek },
+    { "read", luaflac_wav_reader_read },
+    { "encode", luaflac_wav_reader_encode },
+    { "close", luaflac_wav_reader_close },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaflac_wav_writer_methods[] = {
+    { "write", luaflac_wav_writer_write_packed },
+    { "close", luaflac_wav_writer_close },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_wav(lua_State *L) {
+    lua_getglobal(L,"require");
+    lua_pushstring(L,"luaflac.uint64");
+    lua_call(L,1,1);
+    lua_pop(L,1);
+
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_wav_functions,0);
+
+    luaL_newmetatable(L,luaflac_wav_reader_mt);
+    lua_pushcclosure(L,luaflac_wav_reader_gc,0);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L); /* __index */
+    luaL_setfuncs(L,luaflac_wav_reader_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    luaL_newmetatable(L,luaflac_wav_writer_mt);
+    lua_pushcclosure(L,luaflac_wav_writer_gc,0);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L); /* __index */
+    luaL_setfuncs(L,luaflac_wav_writer_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    return 1;
+}
@@ -0,0 +1,703 @@
+#if !defined(_WIN32) && !defined(_WIN64)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "luaflac_internal.h"
+#include "luaflac_thread.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* flac.waveform - min/max/RMS envelopes for drawing waveforms, at one or
+ * more resolutions in a single pass. Each bucket is stored as soon as it
+ * is complete, as packed int8 or int16 values, so nothing bigger than the
+ * output is kept.
+ *
+ * A waveform is filled in as a decode_range sink, or by flac.waveform_file,
+ * which splits the file into byte ranges like flac.verify_crc and decodes
+ * each one on its own thread with the memory-fed frame decoder. A bucket
+ * only one range touches is written straight to the output, the buckets
+ * at the edges of each range are held back and put together at the end. */
+
+LUAFLAC_PRIVATE
+const char * const luaflac_waveform_mt = "luaflac_waveform";
+
+#define LUAFLAC_WAVEFORM_LEVELS 8
+
+/* keeps bucket * length within 64 bits, FLAC streams are under 2^36 samples */
+#define LUAFLAC_WAVEFORM_BUCKETS_MAX 16777216
+
+/* a bucket being filled */
+typedef struct luaflac_waveform_stats_s {
+    FLAC__uint64 bucket;
+    FLAC__uint64 count; /* samples per channel so far, 0 when empty */
+    FLAC__int32 min[FLAC__MAX_CHANNELS];
+    FLAC__int32 max[FLAC__MAX_CHANNELS];
+    double sum[FLAC__MAX_CHANNELS]; /* of squares */
+} luaflac_waveform_stats;
+
+/* one pass over the audio, either all of it or a region */
+typedef struct luaflac_waveform_cursor_s {
+    int keep_head; /* hold back the first bucket, another region may share it */
+    luaflac_waveform_stats head[LUAFLAC_WAVEFORM_LEVELS];
+    luaflac_waveform_stats cur[LUAFLAC_WAVEFORM_LEVELS];
+} luaflac_waveform_cursor;
+
+typedef struct luaflac_waveform_level_s {
+    FLAC__uint64 samples_per_bucket; /* 0 to split the audio into buckets */
+    FLAC__uint64 requested; /* buckets asked for, more than there are samples gets clamped */
+    FLAC__uint64 buckets;
+    unsigned char *data;
+    size_t size; /* bytes allocated */
+} luaflac_waveform_level;
+
+struct luaflac_waveform_s {
+    int bytes; /* per value */
+    int rms;
+    unsigned int num_levels;
+    luaflac_waveform_level levels[LUAFLAC_WAVEFORM_LEVELS];
+    FLAC__uint64 length; /* samples per channel being summarized */
+    FLAC__uint64 position; /* of the next sample added */
+    int grow; /* data is grown as buckets are written, instead of up front */
+    unsigned int channels; /* 0 until the first samples */
+    unsigned int bits_per_sample;
+    luaflac_waveform_cursor cursor;
+};
+
+static FLAC__uint64
+luaflac_waveform_bucket(const luaflac_waveform *w, const luaflac_waveform_level *v, FLAC__uint64 sample) {
+    if(v->samples_per_bucket) return sample / v->samples_per_bucket;
+    return sample * v->buckets / w->length;
+}
+
+/* the first sample in a bucket */
+static FLAC__uint64
+luaflac_waveform_bucket_start(const luaflac_waveform *w, const luaflac_waveform_level *v, FLAC__uint64 bucket) {
+    if(v->samples_per_bucket) return bucket * v->samples_per_bucket;
+    return (bucket * w->length + v->buckets - 1) / v->buckets;
+}
+
+static size_t
+luaflac_waveform_bucket_size(const luaflac_waveform *w) {
+    return (size_t)w->channels * (w->rms ? 3 : 2) * w->bytes;
+}
+
+static void
+luaflac_waveform_free(luaflac_waveform *w) {
+    unsigned int i = 0;
+
+    for(i=0;i<w->num_levels;i++) {
+        free(w->levels[i].data);
+        w->levels[i].data = NULL;
+        w->levels[i].size = 0;
+    }
+}
+
+/* starts over on length samples per channel. With grow, samples_per_bucket
+ * levels are grown as they go, since length can't be trusted. Returns an
+ * error message or NULL */
+static const char *
+luaflac_waveform_begin(luaflac_waveform *w, FLAC__uint64 length, unsigned int channels,
+  unsigned int bits_per_sample, int grow) {
+    luaflac_waveform_level *v = NULL;
+    unsigned int i = 0;
+
+    luaflac_waveform_free(w);
+    memset(&w->cursor,0,sizeof(w->cursor));
+    w->length = length;
+    w->position = 0;
+    w->grow = grow;
+    w->channels = channels;
+    w->bits_per_sample = bits_per_sample;
+
+    for(i=0;i<w->num_levels;i++) {
+        v = &w->levels[i];
+        if(v->samples_per_bucket) {
+            v->buckets = grow ? 0 : (length + v->samples_per_bucket - 1) / v->samples_per_bucket;
+        }
+    }
+    if(channels == 0) return NULL;
+
+    for(i=0;i<w->num_levels;i++) {
+        v = &w->levels[i];
+        if(v->samples_per_bucket && grow) continue;
+        v->size = (size_t)v->buckets * luaflac_waveform_bucket_size(w);
+        v->data = calloc(v->size ? v->size : 1,1);
+        if(v->data == NULL) return "out of memory";
+    }
+    return NULL;
+}
+
+/* buckets of a level split by count, set before begin */
+static void
+luaflac_waveform_set_buckets(luaflac_waveform *w, FLAC__uint64 length) {
+    luaflac_waveform_level *v = NULL;
+    unsigned int i = 0;
+
+    for(i=0;i<w->num_levels;i++) {
+        v = &w->levels[i];
+        if(v->samples_per_bucket == 0) v->buckets = v->requested < length ? v->requested : length;
+    }
+}
+
+static void
+luaflac_waveform_put(unsigned char *p, int bytes, long v) {
+    p[0] = (unsigned char)v;
+    if(bytes == 2) p[1] = (unsigned char)((unsigned long)v >> 8);
+}
+
+/* scales a sample to the output's bit depth */
+static long
+luaflac_waveform_scale(const luaflac_waveform *w, FLAC__int32 v) {
+    int shift = (int)w->bits_per_sample - w->bytes * 8;
+    if(shift > 0) return (long)(v >> shift);
+    return (long)v * (1L << -shift);
+}
+
+static const char *
+luaflac_waveform_write(luaflac_waveform *w, unsigned int level, const luaflac_waveform_stats *s) {
+    luaflac_waveform_level *v = &w->levels[level];
+    size_t bucket_size = luaflac_waveform_bucket_size(w);
+    unsigned char *p = NULL;
+    unsigned char *tmp = NULL;
+    size_t size = 0;
+    double full = (double)(1L << (w->bytes * 8 - 1));
+    double rms = 0.0;
+    unsigned int c = 0;
+    int step = w->bytes;
+
+    if(w->grow && v->samples_per_bucket) {
+        if((s->bucket + 1) * bucket_size > v->size) {
+            size = v->size ? v->size * 2 : bucket_size * 1024;
+            while(size < (s->bucket + 1) * bucket_size) size *= 2;
+            tmp = realloc(v->data,size);
+            if(tmp == NULL) return "out of memory";
+            memset(tmp + v->size,0,size - v->size);
+            v->data = tmp;
+            v->size = size;
+        }
+        if(s->bucket + 1 > v->buckets) v->buckets = s->bucket + 1;
+    }
+    /* past the end of a stream that was longer than it said */
+    if(s->bucket >= v->buckets) return NULL;
+
+    p = v->data + s->bucket * bucket_size;
+    for(c=0;c<w->channels;c++) {
+        luaflac_waveform_put(p,step,luaflac_waveform_scale(w,s->min[c]));
+        p += step;
+        luaflac_waveform_put(p,step,luaflac_waveform_scale(w,s->max[c]));
+        p += step;
+        if(w->rms) {
+            rms = sqrt(s->sum[c] / (double)s->count) * full /
+              (double)((FLAC__uint64)1 << (w->bits_per_sample - 1));
+            rms = floor(rms + 0.5);
+            if(rms > full - 1.0) rms = full - 1.0;
+            luaflac_waveform_put(p,step,(long)rms);
+            p += step;
+        }
+    }
+    return NULL;
+}
+
+static void
+luaflac_waveform_combine(luaflac_waveform_stats *s, const luaflac_waveform_stats *from, unsigned int channels) {
+    unsigned int c = 0;
+
+    for(c=0;c<channels;c++) {
+        if(from->min[c] < s->min[c]) s->min[c] = from->min[c];
+        if(from->max[c] > s->max[c]) s->max[c] = from->max[c];
+        s->sum[c] += from->sum[c];
+    }
+    s->count += from->count;
+}
+
+/* adds count samples per channel, the first being sample */
+static const char *
+luaflac_waveform_run(luaflac_waveform *w, luaflac_waveform_cursor *k,
+  const FLAC__int32 *const buffer[], FLAC__uint64 sample, size_t count) {
+    luaflac_waveform_level *v = NULL;
+    luaflac_waveform_stats *s = NULL;
+    const FLAC__int32 *in = NULL;
+    const char *error = NULL;
+    FLAC__uint64 bucket = 0;
+    FLAC__uint64 end = 0;
+    FLAC__int32 lo = 0;
+    FLAC__int32 hi = 0;
+    double sum = 0.0;
+    double d = 0.0;
+    unsigned int i = 0;
+    unsigned int c = 0;
+    size_t j = 0;
+    size_t n = 0;
+    size_t t = 0;
+
+    for(i=0;i<w->num_levels;i++) {
+        v = &w->levels[i];
+        s = &k->cur[i];
+        if(v->buckets == 0 && !(w->grow && v->samples_per_bucket)) continue;
+
+        for(j=0;j<count;j+=n) {
+            bucket = luaflac_waveform_bucket(w,v,sample + j);
+            if(s->count && s->bucket != bucket) {
+                if(k->keep_head && k->head[i].count == 0) {
+                    k->head[i] = *s;
+                } else if( (error = luaflac_waveform_write(w,i,s)) != NULL) {
+                    return error;
+                }
+                s->count = 0;
+            }
+            if(s->count == 0) {
+                s->bucket = bucket;
+                for(c=0;c<w->channels;c++) {
+                    s->min[c] = buffer[c][j];
+                    s->max[c] = buffer[c][j];
+                    s->sum[c] = 0.0;
+                }
+            }
+
+            end = luaflac_waveform_bucket_start(w,v,bucket + 1);
+            n = count - j;
+            if(end - (sample + j) < n) n = (size_t)(end - (sample + j));
+
+            for(c=0;c<w->channels;c++) {
+                in = buffer[c] + j;
+                lo = s->min[c];
+                hi = s->max[c];
+                sum = 0.0;
+                for(t=0;t<n;t++) {
+                    if(in[t] < lo) lo = in[t];
+                    if(in[t] > hi) hi = in[t];
+                    d = (double)in[t];
+                    sum += d * d;
+                }
+                s->min[c] = lo;
+                s->max[c] = hi;
+                s->sum[c] += sum;
+            }
+            s->count += n;
+        }
+    }
+    return NULL;
+}
+
+LUAFLAC_PRIVATE
+const char *
+luaflac_waveform_start(luaflac_waveform *w, FLAC__uint64 length) {
+    luaflac_waveform_set_buckets(w,length);
+    /* the format comes with the first samples */
+    return luaflac_waveform_begin(w,length,0,0,1);
+}
+
+LUAFLAC_PRIVATE
+const char *
+luaflac_waveform_add(luaflac_waveform *w, const FLAC__int32 *const buffer[],
+  unsigned int channels, unsigned int bits_per_sample, size_t count) {
+    const char *error = NULL;
+
+    if(w->channels == 0) {
+        error = luaflac_waveform_begin(w,w->length,channels,bits_per_sample,1);
+        if(error != NULL) return error;
+    }
+    if(channels != w->channels || bits_per_sample != w->bits_per_sample) {
+        return "the audio format changed";
+    }
+    error = luaflac_waveform_run(w,&w->cursor,buffer,w->position,count);
+    w->position += count;
+    return error;
+}
+
+LUAFLAC_PRIVATE
+const char *
+luaflac_waveform_finish(luaflac_waveform *w) {
+    const char *error = NULL;
+    unsigned int i = 0;
+
+    for(i=0;i<w->num_levels;i++) {
+        if(w->cursor.cur[i].count == 0) continue;
+        if( (error = luaflac_waveform_write(w,i,&w->cursor.cur[i])) != NULL) return error;
+        w->cursor.cur[i].count = 0;
+    }
+    return NULL;
+}
+
+struct luaflac_waveform_region_s {
+    luaflac_waveform *w;
+    const char *path;
+    FILE *f; /* used instead of path when set */
+    FLAC__uint64 start;
+    FLAC__uint64 end;
+    luaflac_waveform_cursor cursor;
+    const char *error;
+
+    luaflac_thread thread;
+    int started;
+};
+
+typedef struct luaflac_waveform_region_s luaflac_waveform_region;
+
+static void
+luaflac_waveform_region_run(void *arg) {
+    luaflac_waveform_region *g = (luaflac_waveform_region *)arg;
+    luaflac_frame_reader r;
+    luaflac_frame_decoder d;
+    luaflac_frame frame;
+    const FLAC__int32 *pcm[FLAC__MAX_CHANNELS];
+    FILE *f = g->f;
+    unsigned int c = 0;
+    int res = 0;
+
+    memset(&r,0,sizeof(r));
+    memset(&d,0,sizeof(d));
+    d.keep = 1;
+    g->cursor.keep_head = 1;
+    if(f == NULL) f = fopen(g->path,"rb");
+    if(f == NULL) {
+        g->error = "error opening file";
+        return;
+    }
+
+    if(!luaflac_frame_reader_init(&r,f) || !luaflac_frame_reader_seek(&r,g->start)) {
+        g->error = "error reading metadata";
+        goto luaflac_waveform_region_done;
+    }
+    if(!luaflac_frame_decoder_init(&d,&r.streaminfo)) {
+        g->error = "error creating decoder";
+        goto luaflac_waveform_region_done;
+    }
+
+    while( (res = luaflac_frame_reader_next(&r,&frame)) == 1) {
+        if(frame.offset >= g->end) break;
+        if(!luaflac_frame_decoder_run(&d,frame.data,frame.size)) {
+            g->error = d.error;
+            break;
+        }
+        if(frame.header.channels != g->w->channels ||
+           (frame.header.bits_per_sample != 0 && frame.header.bits_per_sample != g->w->bits_per_sample)) {
+            g->error = "the audio format changed";
+            break;
+        }
+        for(c=0;c<frame.header.channels;c++) {
+            pcm[c] = d.pcm[c];
+        }
+        g->error = luaflac_waveform_run(g->w,&g->cursor,pcm,frame.sample,d.samples);
+        if(g->error != NULL) break;
+    }
+    if(res < 0 && g->error == NULL) {
+        g->error = "error reading frames";
+    }
+
+    luaflac_waveform_region_done:
+    luaflac_frame_decoder_free(&d);
+    luaflac_frame_reader_free(&r);
+    if(g->f == NULL) fclose(f);
+}
+
+/* writes out the buckets held back at the edges of each region, putting
+ * together the ones two regions share */
+static const char *
+luaflac_waveform_stitch(luaflac_waveform *w, luaflac_waveform_region *regions, size_t n) {
+    luaflac_waveform_stats pending;
+    const luaflac_waveform_stats *edges[2];
+    const char *error = NULL;
+    unsigned int i = 0;
+    size_t j = 0;
+    size_t e = 0;
+
+    for(i=0;i<w->num_levels;i++) {
+        pending.count = 0;
+        for(j=0;j<n;j++) {
+            edges[0] = &regions[j].cursor.head[i];
+            edges[1] = &regions[j].cursor.cur[i];
+            for(e=0;e<2;e++) {
+                if(edges[e]->count == 0) continue;
+                if(pending.count && pending.bucket == edges[e]->bucket) {
+                    luaflac_waveform_combine(&pending,edges[e],w->channels);
+                    continue;
+                }
+                if(pending.count && (error = luaflac_waveform_write(w,i,&pending)) != NULL) return error;
+                pending = *edges[e];
+            }
+        }
+        if(pending.count && (error = luaflac_waveform_write(w,i,&pending)) != NULL) return error;
+    }
+    return NULL;
+}
+
+typedef struct luaflac_waveform_userdata_s {
+    luaflac_waveform w;
+} luaflac_waveform_userdata;
+
+LUAFLAC_PRIVATE
+luaflac_waveform *
+luaflac_waveform_test(lua_State *L, int idx) {
+    luaflac_waveform_userdata *u = luaL_testudata(L,idx,luaflac_waveform_mt);
+    return u == NULL ? NULL : &u->w;
+}
+
+/* reads a level's buckets or samples_per_bucket from the table at idx */
+static void
+luaflac_waveform_level_option(lua_State *L, int idx, luaflac_waveform_level *v) {
+    lua_Integer buckets = 0;
+    lua_Integer samples = 0;
+
+    lua_getfield(L,idx,"buckets");
+    buckets = luaL_optinteger(L,-1,0);
+    lua_getfield(L,idx,"samples_per_bucket");
+    samples = luaL_optinteger(L,-1,0);
+    lua_pop(L,2);
+
+    if((buckets > 0) == (samples > 0)) {
+        luaL_error(L,"a level needs either buckets or samples_per_bucket");
+        return;
+    }
+    if(buckets > LUAFLAC_WAVEFORM_BUCKETS_MAX) {
+        luaL_error(L,"too many buckets");
+        return;
+    }
+    memset(v,0,sizeof(luaflac_waveform_level));
+    v->requested = (FLAC__uint64)buckets;
+    v->samples_per_bucket = (FLAC__uint64)samples;
+}
+
+static void
+luaflac_waveform_options(lua_State *L, int idx, luaflac_waveform *w) {
+    const char *format = NULL;
+    unsigned int i = 0;
+
+    luaL_checktype(L,idx,LUA_TTABLE);
+    memset(w,0,sizeof(luaflac_waveform));
+
+    lua_getfield(L,idx,"format");
+    format = luaL_optstring(L,-1,"int16");
+    if(strcmp(format,"int8") == 0) {
+        w->bytes = 1;
+    } else if(strcmp(format,"int16") == 0) {
+        w->bytes = 2;
+    } else {
+        luaL_error(L,"unknown format '%s'",format);
+        return;
+    }
+    lua_pop(L,1);
+
+    lua_getfield(L,idx,"rms");
+    w->rms = lua_isnil(L,-1) ? 1 : lua_toboolean(L,-1);
+    lua_pop(L,1);
+
+    lua_getfield(L,idx,"levels");
+    if(lua_isnil(L,-1)) {
+        w->num_levels = 1;
+        luaflac_waveform_level_option(L,idx,&w->levels[0]);
+    } else {
+        luaL_checktype(L,-1,LUA_TTABLE);
+        w->num_levels = (unsigned int)lua_rawlen(L,-1);
+        if(w->num_levels == 0 || w->num_levels > LUAFLAC_WAVEFORM_LEVELS) {
+            luaL_error(L,"between 1 and %d levels are needed",LUAFLAC_WAVEFORM_LEVELS);
+            return;
+        }
+        for(i=0;i<w->num_levels;i++) {
+            lua_rawgeti(L,-1,i+1);
+            luaL_checktype(L,-1,LUA_TTABLE);
+            luaflac_waveform_level_option(L,lua_gettop(L),&w->levels[i]);
+            lua_pop(L,1);
+        }
+    }
+    lua_pop(L,1);
+}
+
+/* pushes a new waveform set up by the options at idx */
+static luaflac_waveform *
+luaflac_waveform_push(lua_State *L, int idx) {
+    luaflac_waveform_userdata *u = NULL;
+    luaflac_waveform w;
+
+    /* read before the userdata goes on the stack, idx may be relative */
+    luaflac_waveform_options(L,idx,&w);
+    u = (luaflac_waveform_userdata *)lua_newuserdata(L,sizeof(luaflac_waveform_userdata));
+    u->w = w;
+    luaL_setmetatable(L,luaflac_waveform_mt);
+    return &u->w;
+}
+
+static int
+luaflac_waveform_new(lua_State *L) {
+    luaflac_waveform_push(L,1);
+    return 1;
+}
+
+static int
+luaflac_waveform_gc(lua_State *L) {
+    luaflac_waveform_userdata *u = (luaflac_waveform_userdata *)luaL_checkudata(L,1,luaflac_waveform_mt);
+    luaflac_waveform_free(&u->w);
+    return 0;
+}
+
+static int
+luaflac_waveform_result(lua_State *L) {
+    luaflac_waveform_userdata *u = (luaflac_waveform_userdata *)luaL_checkudata(L,1,luaflac_waveform_mt);
+    luaflac_waveform *w = &u->w;
+    luaflac_waveform_level *v = NULL;
+    unsigned int i = 0;
+
+    lua_createtable(L,w->num_levels,0);
+    for(i=0;i<w->num_levels;i++) {
+        v = &w->levels[i];
+        lua_createtable(L,0,4);
+        lua_pushlstring(L,v->data != NULL ? (const char *)v->data : "",
+          w->channels ? (size_t)v->buckets * luaflac_waveform_bucket_size(w) : 0);
+        lua_setfield(L,-2,"data");
+        lua_pushinteger(L,(lua_Integer)(w->channels ? v->buckets : 0));
+        lua_setfield(L,-2,"buckets");
+        lua_pushinteger(L,w->channels);
+        lua_setfield(L,-2,"channels");
+        if(v->samples_per_bucket) {
+            lua_pushinteger(L,(lua_Integer)v->samples_per_bucket);
+        } else if(w->channels && v->buckets) {
+            /* on average */
+            lua_pushnumber(L,(double)w->length / (double)v->buckets);
+        } else {
+            lua_pushnil(L);
+        }
+        lua_setfield(L,-2,"samples_per_bucket");
+        lua_rawseti(L,-2,i+1);
+    }
+    return 1;
+}
+
+static int
+luaflac_waveform_file(lua_State *L) {
+    luaflac_waveform *w = NULL;
+    luaflac_waveform_region *regions = NULL;
+    luaflac_frame_reader r;
+    luaflac_frame last;
+    FLAC__uint64 size = 0;
+    FLAC__uint64 audio = 0;
+    FLAC__uint64 length = 0;
+    lua_Integer threads = luaflac_thread_cpus();
+    const char *path = NULL;
+    const char *error = NULL;
+    FILE *f = NULL;
+    int owned = 0;
+    int n = 0;
+    size_t i = 0;
+
+    lua_settop(L,2);
+    w = luaflac_waveform_push(L,2);
+    lua_getfield(L,2,"threads");
+    threads = luaL_optinteger(L,-1,threads);
+    lua_pop(L,1);
+
+    f = luaflac_checkfile(L,1,"rb",&owned);
+    if(f == NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L,"error opening %s",lua_tostring(L,1));
+        return 2;
+    }
+
+    /* threads open their own handles, a Lua file handle is read in one go */
+    if(owned) {
+        path = lua_tostring(L,1);
+    } else {
+        threads = 1;
+    }
+
+    memset(&r,0,sizeof(r));
+    if(!luaflac_frame_reader_init(&r,f) || luaflac_fsize(f,&size) != 0) {
+        error = "error reading metadata";
+    } else {
+        audio = r.audio_offset;
+        length = r.streaminfo.total_samples;
+        /* buckets are spread over the whole stream, so it has to be measured */
+        if(length == 0) {
+            if(luaflac_frame_reader_last(&r,&last) == 1) {
+                length = last.sample + last.header.blocksize;
+            } else {
+                error = "error reading frames";
+            }
+        }
+        if(error == NULL) {
+            luaflac_waveform_set_buckets(w,length);
+            error = luaflac_waveform_begin(w,length,r.streaminfo.channels,
+              r.streaminfo.bits_per_sample,0);
+        }
+    }
+    luaflac_frame_reader_free(&r);
+    if(owned) {
+        fclose(f);
+        f = NULL;
+    }
+    if(error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,error);
+        return 2;
+    }
+
+    n = luaflac_frame_regions(audio,size,threads);
+
+    regions = calloc(n,sizeof(luaflac_waveform_region));
+    if(regions == NULL) {
+        return luaL_error(L,"out of memory");
+    }
+
+    for(i=0;i<(size_t)n;i++) {
+        regions[i].w = w;
+        regions[i].path = path;
+        regions[i].f = f;
+        luaflac_frame_region(audio,size,n,(int)i,&regions[i].start,&regions[i].end);
+    }
+
+    /* the last region runs on this thread, as do any that fail to start */
+    for(i=0;i+1<(size_t)n;i++) {
+        regions[i].started = luaflac_thread_create(&regions[i].thread,luaflac_waveform_region_run,&regions[i]) == 0;
+    }
+    for(i=0;i<(size_t)n;i++) {
+        if(!regions[i].started) luaflac_waveform_region_run(&regions[i]);
+    }
+    for(i=0;i<(size_t)n;i++) {
+        if(regions[i].started) luaflac_thread_join(&regions[i].thread);
+    }
+
+    for(i=0;i<(size_t)n && error == NULL;i++) {
+        error = regions[i].error;
+    }
+    if(error == NULL) {
+        error = luaflac_waveform_stitch(w,regions,n);
+    }
+    free(regions);
+
+    if(error != NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L,error);
+        return 2;
+    }
+    lua_settop(L,3);
+    return 1;
+}
+
+static const struct luaL_Reg luaflac_waveform_functions[] = {
+    { "waveform", luaflac_waveform_new },
+    { "waveform_file", luaflac_waveform_file },
+    { NULL, NULL },
+};
+
+static const struct luaL_Reg luaflac_waveform_methods[] = {
+    { "result", luaflac_waveform_result },
+    { NULL, NULL },
+};
+
+LUAFLAC_PUBLIC
+int luaopen_luaflac_waveform(lua_State *L) {
+    lua_newtable(L);
+
+    luaL_setfuncs(L,luaflac_waveform_functions,0);
+
+    luaL_newmetatable(L,luaflac_waveform_mt);
+    lua_pushcclosure(L,luaflac_waveform_gc,0);
+    lua_setfield(L,-2,"__gc");
+    lua_newtable(L); /* __index */
+    luaL_setfuncs(L,luaflac_waveform_methods,0);
+    lua_setfield(L,-2,"__index");
+    lua_pop(L,1);
+
+    return 1;
+}
@@ -0,0 +1,103 @@
+-- LuaJIT FFI access to luaflac's sample buffers, so JIT-compiled loops
+-- can work on PCM without a Lua API call per sample
+local ffi = require'ffi'
+local flac = require'luaflac'
+
+local ABI_VERSION = 1
+
+ffi.cdef[[
+unsigned int luaflac_ffi_abi_version(void);
+unsigned int luaflac_ffi_pcm_channels(const void *buffer);
+size_t luaflac_ffi_pcm_frames(const void *buffer);
+int luaflac_ffi_pcm_format(const void *buffer);
+unsigned int luaflac_ffi_pcm_bits_per_sample(const void *buffer);
+void **luaflac_ffi_pcm_planar(void *buffer);
+int luaflac_ffi_encoder_process(void *encoder, int32_t *const buffer[], unsigned int samples);
+int luaflac_ffi_encoder_process_interleaved(void *encoder, const int32_t buffer[], unsigned int samples);
+]]
+
+-- the module is loaded with local symbols, so open it again by name.
+-- Fall back to the executable for a statically linked luaflac
+local C
+do
+  local path = package.searchpath and package.searchpath('luaflac', package.cpath)
+  local ok, lib = false, nil
+  if path then
+    ok, lib = pcall(ffi.load, path)
+  end
+  C = ok and lib or ffi.C
+end
+
+if C.luaflac_ffi_abi_version() ~= ABI_VERSION then
+  error('luaflac.ffi doesn\'t match the luaflac library')
+end
+
+local registry = debug.getregistry()
+
+local function check(value, mt, what)
+  if type(value) ~= 'userdata' or getmetatable(value) ~= registry[mt] then
+    error(what .. ' expected', 3)
+  end
+end
+
+local int32_pp = ffi.typeof('int32_t **')
+local float_pp = ffi.typeof('float **')
+local planar_t = ffi.typeof('int32_t *[?]')
+local samples_t = ffi.typeof('int32_t[?]')
+
+local M = {
+  _ABI_VERSION = ABI_VERSION,
+}
+
+-- returns the buffer's channels as int32_t ** (or float ** for float32
+-- buffers), its frames and its channels. Indexes are 0-based, and the
+-- pointers are only good while the buffer is alive and the same size
+function M.planar(buffer)
+  check(buffer, 'luaflac_pcm_buffer', 'pcm_buffer')
+  local planar = C.luaflac_ffi_pcm_planar(buffer)
+  local frames = tonumber(C.luaflac_ffi_pcm_frames(buffer))
+  local channels = C.luaflac_ffi_pcm_channels(buffer)
+  if C.luaflac_ffi_pcm_format(buffer) == 1 then
+    return ffi.cast(float_pp, planar), frames, channels
+  end
+  return ffi.cast(int32_pp, planar), frames, channels
+end
+
+-- allocates channels * frames samples, returns the int32_t *[channels]
+-- to pass to process and the storage behind it, which has to be kept
+function M.new_planar(channels, frames)
+  local storage = samples_t(channels * frames)
+  local planar = planar_t(channels)
+  for c = 0, channels - 1 do
+    planar[c] = storage + c * frames
+  end
+  return planar, storage
+end
+
+function M.process(encoder, planar, samples)
+  check(encoder, 'FLAC__StreamEncoder', 'encoder')
+  return C.luaflac_ffi_encoder_process(encoder, planar, samples) ~= 0
+end
+
+function M.process_interleaved(encoder, samples, count)
+  check(encoder, 'FLAC__StreamEncoder', 'encoder')
+  return C.luaflac_ffi_encoder_process_interleaved(encoder, samples, count) ~= 0
+end
+
+-- wraps fn(userdata, frame, planar, frames, channels) as a decoder write
+-- callback, for use with decoder:set_write_format('buffer')
+function M.write(fn)
+  return function(userdata, frame, buffer)
+    return fn(userdata, frame, M.planar(buffer))
+  end
+end
+
+-- wraps fn(planar, frames, channels) as a decode_range sink, for use with
+-- decoder:set_write_format('buffer')
+function M.sink(fn)
+  return function(buffer)
+    return fn(M.planar(buffer))
+  end
+end
+
+return M
@@ -0,0 +1,62 @@
+-- damages the headers of two frames in an encoded file and checks that
+-- verify_crc and scan_frames blame those frames and nothing else, with one
+-- thread and with the file split into ranges
+local flac = require'luaflac'
+
+local path = arg[1] or 'verify_crc_test.flac'
+local blocksize = 4096
+local num_frames = 2600 -- a bit over 20MiB of noise, enough for 3 ranges
+local damaged = { 20, 60, 1300 }
+
+local encoder = flac.FLAC__stream_encoder_new()
+assert(encoder:set_channels(2))
+assert(encoder:set_bits_per_sample(16))
+assert(encoder:set_sample_rate(44100))
+assert(encoder:set_blocksize(blocksize))
+assert(encoder:init_file({ filename = path }))
+
+-- noise doesn't compress, so frames come out about the same size
+math.randomseed(1)
+local samples = {}
+for _=1,num_frames do
+  for i=1,blocksize * 2 do
+    samples[i] = math.random(-32768,32767)
+  end
+  assert(encoder:process_interleaved(samples))
+end
+assert(encoder:finish())
+
+local stats = assert(flac.scan_frames(path))
+assert(stats.frames == num_frames)
+assert(stats.numbering_breaks == 0)
+
+-- flipping the low bit of the frame number breaks the header's CRC-8
+local f = assert(io.open(path,'r+b'))
+local offsets = {}
+for i,n in ipairs(damaged) do
+  offsets[i] = tostring(stats.index:get(n + 1))
+  f:seek('set',tonumber(offsets[i]) + 4)
+  local b = f:read(1):byte()
+  f:seek('set',tonumber(offsets[i]) + 4)
+  f:write(string.char(b % 2 == 0 and b + 1 or b - 1))
+end
+f:close()
+
+for _,threads in ipairs({ 1, 3 }) do
+  local result = assert(flac.verify_crc(path, { threads = threads }))
+  assert(not result.ok)
+  assert(result.frames == num_frames - #damaged)
+  assert(#result.bad == #damaged, 'threads=' .. threads .. ': ' .. #result.bad .. ' bad offsets')
+  for i=1,#damaged do
+    assert(tostring(result.bad[i]) == offsets[i],
+      'threads=' .. threads .. ': blamed ' .. tostring(result.bad[i]) .. ', not ' .. offsets[i])
+  end
+end
+
+stats = assert(flac.scan_frames(path, { crc = true }))
+assert(stats.frames == num_frames - #damaged)
+assert(stats.crc_errors == 0)
+assert(stats.numbering_breaks == #damaged)
+
+os.remove(path)
+print('ok')